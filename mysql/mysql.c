@@ -24,18 +24,24 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <zlib.h>
+#include <openssl/evp.h>
+
 #include <git2.h>
 #include <git2/oid.h>
 #include <git2/odb_backend.h>
@@ -46,6 +52,7 @@
 #include <git2/errors.h>
 #include <git2/types.h>
 #include <git2/indexer.h>
+#include <git2/object.h>
 
 /* MySQL C Api docs:
  *   http://dev.mysql.com/doc/refman/5.1/en/c-api-function-overview.html
@@ -59,16 +66,161 @@
 #define GIT2_ODB_STORAGE_ENGINE "InnoDB"
 #define GIT2_REFDB_TABLE_NAME "git2_refdb"
 #define GIT2_REFDB_STORAGE_ENGINE "InnoDB"
-
+#define GIT2_ODB_CHUNK_TABLE_NAME "git2_odb_chunks"
+#define GIT2_ODB_PACK_TABLE_NAME "git2_odb_packs"
+#define GIT2_ODB_HEADER_TABLE_NAME "git2_odb_headers"
+#define GIT2_REFDB_GENERATION_TABLE_NAME "git2_refdb_generation"
+
+/* Objects bigger than this are stored as a series of rows of at most
+ * GIT2_ODB_CHUNK_SIZE bytes in the chunk table, rather than in one row of the
+ * odb table. Their odb table row keeps the type and size, with empty data. */
+#define GIT2_ODB_CHUNK_THRESHOLD (16 * 1024 * 1024)
+#define GIT2_ODB_CHUNK_SIZE (1024 * 1024)
+
+/* Initial bucket count of the refdb lookup cache; doubles as it fills */
+#define MYSQL_REFDB_CACHE_BUCKETS 64
+
+/* How long, in milliseconds, the refdb lookup cache is trusted after a
+ * generation check by default. Long enough to serve a burst of lookups
+ * with one check, short enough that other processes' changes show soon. */
+#define MYSQL_REFDB_CACHE_TTL_MS 100
+
+/* Number of oids looked up per existence query when filtering packs */
+#define MYSQL_ODB_EXISTS_BATCH 256
+
+/* Returned internally by mysql_odb__fetch_object for chunked objects */
+#define MYSQL_ODB_CHUNKED 1
+
+/* Values of the `kind` column of the pack table. A pack is only complete once
+ * its MYSQL_ODB_PACK_DONE row, which has no data, has been written. */
+#define MYSQL_ODB_PACK_DATA 0
+#define MYSQL_ODB_PACK_INDEX 1
+#define MYSQL_ODB_PACK_DONE 2
+
+/* Values of the `location` column of the header table */
+#define MYSQL_ODB_LOCATION_INLINE 0
+#define MYSQL_ODB_LOCATION_CHUNKED 1
+
+/* One server connection of the odb backend along with its prepared
+ * statements. Replicas only get the read statements prepared. */
 typedef struct {
-  git_odb_backend parent;
   MYSQL *db;
   MYSQL_STMT *st_read;
   MYSQL_STMT *st_write;
   MYSQL_STMT *st_read_header;
   MYSQL_STMT *st_read_prefix;
+  MYSQL_STMT *st_read_chunk;
+  MYSQL_STMT *st_write_chunk;
+  MYSQL_STMT *st_rename_chunks;
+  MYSQL_STMT *st_delete_chunks;
+  MYSQL_STMT *st_exists_batch;
+  MYSQL_STMT *st_write_header;
+  /* Result metadata of the read statements; libmysql keeps the max_length
+   * of each column up to date in here after mysql_stmt_store_result */
+  MYSQL_RES *meta_read;
+  MYSQL_RES *meta_read_prefix;
+  MYSQL_RES *meta_read_chunk;
+} mysql_odb_conn;
+
+#ifdef GIT2_MYSQL_ASYNC
+/* Called once an asynchronous read or write completes. For reads, `data`
+ * is the object's contents, which the callback must free(); it's NULL for
+ * writes and whenever `error` is set. */
+typedef void (*git_odb_backend_mysql_async_cb)(int error, const git_oid *oid,
+        void *data, size_t len, git_otype type, void *payload);
+
+typedef struct mysql_odb_async_req {
+  struct mysql_odb_async_req *next;
+  int write;
+  git_oid oid;
+  git_otype type;
+  size_t size;
+  unsigned long long size_ll; /* Bound for writes */
+  unsigned char location;
+  const void *data; /* Writes only; owned by the caller */
+  git_odb_backend_mysql_async_cb cb;
+  void *payload;
+} mysql_odb_async_req;
+
+#define MYSQL_ODB_ASYNC_EXECUTE 0
+#define MYSQL_ODB_ASYNC_STORE 1
+#define MYSQL_ODB_ASYNC_HEADER 2
+
+typedef struct {
+  mysql_odb_conn conn;
+  mysql_odb_async_req *req; /* NULL when idle */
+  MYSQL_STMT *stmt; /* Statement the request is running */
+  MYSQL_BIND bind[4];
+  int stage;
+  int status; /* MYSQL_WAIT_* flags the client library is waiting on */
+} mysql_odb_async_conn;
+#endif
+
+typedef struct {
+  git_odb_backend parent;
+  mysql_odb_conn primary;
+  /* Read replicas, used round-robin for object reads. Objects are immutable
+   * and content addressed, so anything a replica returns is valid; misses
+   * fall back to the primary as the replica may simply be lagging. */
+  mysql_odb_conn *replicas;
+  size_t replica_count;
+  size_t next_replica;
+  /* Shards: route[] maps the first byte of an oid to the server in shards[]
+   * that holds the object. shards[0] is the primary, which holds everything
+   * git_odb_backend_mysql_add_shard hasn't handed to another server. */
+  mysql_odb_conn **shards;
+  size_t shard_count;
+  unsigned char route[256];
+  /* Set when the database has a chunk table; without one every object is
+   * stored inline, as older versions of this backend did */
+  int chunked_storage;
+  /* Set when the database has a header table, holding just the oid, type,
+   * size and location of every object. Header reads and existence checks
+   * then never touch the odb table and its blobs. */
+  int header_table;
+  /* Scratch buffer the compressed object data is fetched into. Grown as
+   * needed and reused for every read through this backend */
+  unsigned char *scratch;
+  unsigned long scratch_size;
+  /* Pack storage: incoming packs are stored whole in the pack table and
+   * read through libgit2's own pack backend, from copies kept in the cache
+   * directory. NULL unless git_odb_backend_mysql_set_pack_storage was
+   * called. */
+  git_odb *packs;
+  char *pack_cache_dir;
+  git_oid *pack_ids;
+  size_t pack_count;
+  MYSQL_STMT *st_read_pack_chunk;
+  MYSQL_STMT *st_write_pack_chunk;
+  MYSQL_RES *meta_read_pack_chunk;
+  /* Where writepack stages received packs: in memory until they grow past
+   * staging_limit bytes, then on disk under staging_spill_dir. Packs that
+   * stay in memory are written out to staging_memory_dir, meant to be a
+   * tmpfs, once complete. Without a staging_memory_dir everything goes
+   * straight to disk. */
+  char *staging_memory_dir;
+  char *staging_spill_dir;
+  size_t staging_limit;
+#ifdef GIT2_MYSQL_ASYNC
+  mysql_odb_async_conn *async_conns;
+  struct pollfd *async_fds;
+  size_t async_count;
+  mysql_odb_async_req *async_queue;
+  mysql_odb_async_req *async_queue_tail;
+  size_t async_pending; /* Queued or in flight */
+#endif
 } mysql_odb_backend;
 
+/* A cached lookup result. type is GIT_REF_INVALID for refs known not to
+ * exist. */
+typedef struct mysql_refdb_cache_entry {
+  struct mysql_refdb_cache_entry *next;
+  char *name;
+  unsigned char type;
+  git_oid oid;
+  char *symref;
+} mysql_refdb_cache_entry;
+
 typedef struct {
   git_refdb_backend parent;
   MYSQL *db;
@@ -76,6 +228,19 @@ typedef struct {
   MYSQL_STMT *st_iterate;
   MYSQL_STMT *st_write;
   MYSQL_STMT *st_delete;
+  MYSQL_STMT *st_generation;
+  MYSQL_STMT *st_bump;
+  int generation_table;
+  /* Lookup cache. Its contents are good for as long as the generation row,
+   * which every write and delete bumps, still holds cache_generation. */
+  mysql_refdb_cache_entry **cache;
+  size_t cache_buckets;
+  size_t cache_count;
+  int cache_enabled;
+  int cache_valid;
+  unsigned long long cache_generation;
+  unsigned int cache_ttl_ms;
+  long long cache_checked_ms;
 } mysql_refdb_backend;
 
 typedef struct {
@@ -89,24 +254,86 @@ typedef struct {
   unsigned long cur_pos;
 } mysql_refdb_iterator;
 
-#define MYSQL_ODB_STREAM_DIR_PATH_LEN 20
+typedef struct {
+  git_odb_stream parent;
+  mysql_odb_conn *conn; /* Read streams only */
+  git_oid oid; /* For chunked write streams, a temporary id for the chunks */
+  git_otype type;
+  size_t size;
+  size_t done; /* Bytes read from or written to the stream so far */
+  unsigned int seq; /* Next chunk to read or write */
+  int chunked;
+  int finalized;
+  unsigned char *buffer;
+  size_t buffer_size;
+  size_t buffer_len;
+  size_t buffer_pos;
+  EVP_MD_CTX *sha;
+} mysql_odb_stream;
+
+/* Multi-row insert into a shard's temporary table, built up while the
+ * previous one runs */
+typedef struct {
+  char *sql;
+  size_t len;
+  size_t alloc;
+  size_t rows;
+  int in_flight;
+} mysql_odb_insert_batch;
+
+/* Pending inserts are sent once they reach this size */
+#define MYSQL_ODB_INSERT_BATCH_BYTES (1024 * 1024)
+
 typedef struct {
   git_odb_writepack parent;
-  char dir_path[MYSQL_ODB_STREAM_DIR_PATH_LEN];
+  char dir_path[PATH_MAX]; /* Empty until the indexer is started */
   git_indexer_stream *indexer;
+  git_transfer_progress_callback progress_cb;
+  void *progress_payload;
+  /* Pack data held in memory while it fits the staging limit */
+  unsigned char *staged;
+  size_t staged_len;
+  size_t staged_alloc;
   git_odb *odb; /* Only valid during commit */
+  /* Likewise: per shard, whether it has a temporary table and the insert
+   * into it in the making */
+  unsigned char *temp_tables;
+  mysql_odb_insert_batch *batches;
+  unsigned char *zbuf; /* Compressed object being added to a batch */
+  size_t zbuf_size;
+  /* Ids of the objects in the pack, sorted, and whether the database has
+   * each of them already */
+  git_oid *oids;
+  unsigned char *present;
+  size_t oid_count;
+  size_t oid_alloc;
 } mysql_odb_writepack;
 
-static int mysql_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+static int init_statement(MYSQL *db, MYSQL_STMT **stmt, const char *sql)
+{
+  my_bool truth = 1;
+
+  *stmt = mysql_stmt_init(db);
+  if (*stmt == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(*stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(*stmt, sql, strlen(sql)) != 0)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+static int mysql_odb__read_header(mysql_odb_conn *conn, size_t *len_p, git_otype *type_p, const git_oid *oid)
 {
-  mysql_odb_backend *backend;
   int error;
   MYSQL_BIND bind_buffers[1];
   MYSQL_BIND result_buffers[2];
 
-  assert(len_p && type_p && _backend && oid);
+  assert(len_p && type_p && conn && oid);
 
-  backend = (mysql_odb_backend *)_backend;
   error = GIT_ERROR;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
@@ -117,19 +344,19 @@ static int mysql_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
+  if (mysql_stmt_bind_param(conn->st_read_header, bind_buffers) != 0)
     return GIT_ERROR;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read_header) != 0)
+  if (mysql_stmt_execute(conn->st_read_header) != 0)
     return GIT_ERROR;
 
-  if (mysql_stmt_store_result(backend->st_read_header) != 0)
+  if (mysql_stmt_store_result(conn->st_read_header) != 0)
     return GIT_ERROR;
 
   // this should either be 0 or 1
   // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
+  if (mysql_stmt_num_rows(conn->st_read_header) == 1) {
     result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
     result_buffers[0].buffer = type_p;
     result_buffers[0].buffer_length = sizeof(type_p);
@@ -140,11 +367,11 @@ static int mysql_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_
     result_buffers[1].buffer_length = sizeof(len_p);
     memset(len_p, 0, sizeof(*len_p));
 
-    if(mysql_stmt_bind_result(backend->st_read_header, result_buffers) != 0)
+    if(mysql_stmt_bind_result(conn->st_read_header, result_buffers) != 0)
       return GIT_ERROR;
 
     // this should populate the buffers at *type_p and *len_p
-    if(mysql_stmt_fetch(backend->st_read_header) != 0)
+    if(mysql_stmt_fetch(conn->st_read_header) != 0)
       return GIT_ERROR;
 
     error = GIT_OK;
@@ -153,28 +380,249 @@ static int mysql_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
+  if (mysql_stmt_reset(conn->st_read_header) != 0)
     return GIT_ERROR;
 
   return error;
 }
 
-static int mysql_odb_backend__read_prefix(git_oid *output_oid, void **out_buf,
-        size_t *out_len, git_otype *out_type, git_odb_backend *_backend,
-        const git_oid *partial_oid, size_t oidlen)
+/* MySQL's COMPRESS() turns an empty string into an empty string, and
+ * anything else into a four byte little-endian length followed by a zlib
+ * stream (and possibly a trailing '.', which zlib ignores). */
+static size_t mysql_odb__uncompressed_len(const unsigned char *in,
+        unsigned long in_len)
 {
-  MYSQL_BIND result_buffers[3];
-  MYSQL_BIND bind_buffers[1];
-  mysql_odb_backend *backend;
+  if (in_len <= 4)
+    return 0;
+
+  return (size_t)in[0] | ((size_t)in[1] << 8) | ((size_t)in[2] << 16) |
+         ((size_t)(in[3] & 0x3F) << 24);
+}
+
+static int mysql_odb__uncompress(void *out, size_t out_len,
+        const unsigned char *in, unsigned long in_len)
+{
+  uLongf dest_len;
+
+  if (in_len == 0)
+    return (out_len == 0) ? GIT_OK : GIT_ERROR;
+
+  if (in_len <= 4)
+    return GIT_ERROR;
+
+  dest_len = out_len;
+  if (uncompress(out, &dest_len, in + 4, in_len - 4) != Z_OK)
+    return GIT_ERROR;
+
+  if (dest_len != out_len)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+static int mysql_odb__reserve_scratch(mysql_odb_backend *backend,
+        unsigned long len)
+{
+  unsigned char *scratch;
+
+  if (len <= backend->scratch_size)
+    return GIT_OK;
+
+  scratch = realloc(backend->scratch, len);
+  if (scratch == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  backend->scratch = scratch;
+  backend->scratch_size = len;
+  return GIT_OK;
+}
+
+/* Fetch the single stored row of a read statement, whose columns are
+ * (`oid`,) `type`, `size`, `data`. The compressed data is fetched into the
+ * scratch buffer in one go -- sized from the max_length libmysql computed
+ * during mysql_stmt_store_result -- then inflated straight into a malloc()ed
+ * buffer of the stored `size`, which libgit2 frees. Chunked objects only get
+ * their type and size filled in, and MYSQL_ODB_CHUNKED is returned. */
+static int mysql_odb__fetch_object(mysql_odb_backend *backend,
+        MYSQL_STMT *stmt, MYSQL_RES *meta, git_oid *oid_out, void **data_p,
+        size_t *len_p, git_otype *type_p)
+{
+  MYSQL_BIND result_buffers[4];
+  MYSQL_BIND *res;
+  unsigned long data_len = 0;
+  unsigned int data_col;
+  int error;
+
+  memset(result_buffers, 0, sizeof(result_buffers));
+  res = result_buffers;
+  data_col = (oid_out) ? 3 : 2;
+
+  error = mysql_odb__reserve_scratch(backend,
+            mysql_fetch_field_direct(meta, data_col)->max_length);
+  if (error != GIT_OK)
+    return error;
+
+  if (oid_out) {
+    res->buffer_type = MYSQL_TYPE_BLOB;
+    res->buffer = oid_out->id;
+    res->buffer_length = GIT_OID_RAWSZ;
+    memset(oid_out, 0, sizeof(*oid_out));
+    res++;
+  }
+
+  res[0].buffer_type = MYSQL_TYPE_TINY;
+  res[0].buffer = type_p;
+  res[0].buffer_length = sizeof(*type_p);
+  memset(type_p, 0, sizeof(*type_p));
+
+  res[1].buffer_type = MYSQL_TYPE_LONGLONG;
+  res[1].buffer = len_p;
+  res[1].buffer_length = sizeof(*len_p);
+  memset(len_p, 0, sizeof(*len_p));
+
+  res[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
+  res[2].buffer = backend->scratch;
+  res[2].buffer_length = backend->scratch_size;
+  res[2].length = &data_len;
+
+  if (mysql_stmt_bind_result(stmt, result_buffers) != 0)
+    return GIT_ERROR;
+
+  // a truncation here means max_length lied to us; don't trust the data
+  if (mysql_stmt_fetch(stmt) != 0)
+    return GIT_ERROR;
+
+  // no data for a non-empty object: it lives in the chunk table
+  if (data_len == 0 && *len_p > 0)
+    return MYSQL_ODB_CHUNKED;
+
+  *data_p = malloc(*len_p + 1);
+  if (*data_p == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  if (mysql_odb__uncompress(*data_p, *len_p, backend->scratch, data_len) != GIT_OK) {
+    giterr_set_str(GITERR_ODB, "MySQL odb contains a corrupt object");
+    free(*data_p);
+    *data_p = NULL;
+    return GIT_ERROR;
+  }
+
+  ((unsigned char *)*data_p)[*len_p] = '\0';
+  return GIT_OK;
+}
+
+/* Fetch the still-compressed data of one chunk into the scratch buffer */
+static int mysql_odb__fetch_chunk(mysql_odb_backend *backend,
+        mysql_odb_conn *conn, const git_oid *oid, unsigned int seq,
+        unsigned long *data_len)
+{
+  MYSQL_BIND bind_buffers[2];
+  MYSQL_BIND result_buffers[1];
+  int error;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+  bind_buffers[1].buffer = &seq;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_LONG;
+  bind_buffers[1].is_unsigned = 1;
+
+  if (mysql_stmt_bind_param(conn->st_read_chunk, bind_buffers) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_execute(conn->st_read_chunk) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_store_result(conn->st_read_chunk) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_num_rows(conn->st_read_chunk) == 1) {
+    error = mysql_odb__reserve_scratch(backend,
+              mysql_fetch_field_direct(conn->meta_read_chunk, 0)->max_length);
+    if (error != GIT_OK)
+      goto out;
+
+    result_buffers[0].buffer_type = MYSQL_TYPE_LONG_BLOB;
+    result_buffers[0].buffer = backend->scratch;
+    result_buffers[0].buffer_length = backend->scratch_size;
+    result_buffers[0].length = data_len;
+
+    if (mysql_stmt_bind_result(conn->st_read_chunk, result_buffers) != 0 ||
+        mysql_stmt_fetch(conn->st_read_chunk) != 0)
+      error = GIT_ERROR;
+  } else {
+    giterr_set_str(GITERR_ODB, "MySQL odb is missing a chunk of an object");
+    error = GIT_ERROR;
+  }
+
+out:
+  // reset the statement for further use
+  if (mysql_stmt_reset(conn->st_read_chunk) != 0)
+    return GIT_ERROR;
+
+  return error;
+}
+
+/* Read all the chunks of an object into a freshly allocated buffer. One
+ * query per chunk, so the connection is never tied up for long. */
+static int mysql_odb__read_chunks(mysql_odb_backend *backend,
+        mysql_odb_conn *conn, const git_oid *oid, void **data_p, size_t len)
+{
+  unsigned char *data;
   unsigned long data_len;
+  unsigned int seq;
+  size_t offset, chunk_len;
+  int error;
+
+  data = malloc(len + 1);
+  if (data == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  for (offset = 0, seq = 0; offset < len; offset += chunk_len, seq++) {
+    error = mysql_odb__fetch_chunk(backend, conn, oid, seq, &data_len);
+    if (error != GIT_OK)
+      goto bad;
+
+    chunk_len = mysql_odb__uncompressed_len(backend->scratch, data_len);
+    if (chunk_len == 0 || chunk_len > len - offset ||
+        mysql_odb__uncompress(data + offset, chunk_len, backend->scratch, data_len) != GIT_OK) {
+      giterr_set_str(GITERR_ODB, "MySQL odb contains a corrupt object chunk");
+      error = GIT_ERROR;
+      goto bad;
+    }
+  }
+
+  data[len] = '\0';
+  *data_p = data;
+  return GIT_OK;
+
+bad:
+  free(data);
+  return error;
+}
+
+static int mysql_odb__read_prefix(mysql_odb_backend *backend,
+        mysql_odb_conn *conn, git_oid *output_oid, void **out_buf,
+        size_t *out_len, git_otype *out_type, const git_oid *partial_oid,
+        size_t oidlen)
+{
+  MYSQL_BIND bind_buffers[1];
   int error = GIT_ERROR;
 
-  assert(output_oid && out_buf && out_len && out_type && backend && partial_oid
+  assert(output_oid && out_buf && out_len && out_type && conn && partial_oid
           && oidlen != 0);
 
-  backend = (mysql_odb_backend *)_backend;
-
-  memset(result_buffers, 0, sizeof(result_buffers));
   memset(bind_buffers, 0, sizeof(bind_buffers));
 
   // Incoming OID length is specified in _hex_ digits, not bytes. Decrease to
@@ -188,157 +636,91 @@ static int mysql_odb_backend__read_prefix(git_oid *output_oid, void **out_buf,
   bind_buffers[0].buffer_length = oidlen;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_prefix, bind_buffers) != 0)
+  if (mysql_stmt_bind_param(conn->st_read_prefix, bind_buffers) != 0)
     return error;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read_prefix) != 0)
+  if (mysql_stmt_execute(conn->st_read_prefix) != 0)
     return error;
 
-  if (mysql_stmt_store_result(backend->st_read_prefix) != 0)
+  if (mysql_stmt_store_result(conn->st_read_prefix) != 0)
     return error;
 
   // This could be 0, 1, or many: it's a prefix search.
-  if (mysql_stmt_num_rows(backend->st_read_prefix) == 0) {
+  if (mysql_stmt_num_rows(conn->st_read_prefix) == 0) {
     error = GIT_ENOTFOUND;
-  } else if (mysql_stmt_num_rows(backend->st_read_prefix) > 1) {
+  } else if (mysql_stmt_num_rows(conn->st_read_prefix) > 1) {
     error = GIT_EAMBIGUOUS;
   } else {
-    assert(mysql_stmt_num_rows(backend->st_read_prefix) == 1);
-
-    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-    result_buffers[0].buffer = out_type;
-    result_buffers[0].buffer_length = sizeof(*out_type);
-    memset(out_type, 0, sizeof(*out_type));
-
-    result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
-    result_buffers[1].buffer = out_len;
-    result_buffers[1].buffer_length = sizeof(out_len);
-    memset(out_len, 0, sizeof(*out_len));
-
-    result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
-    result_buffers[2].buffer = 0;
-    result_buffers[2].buffer_length = 0;
-    result_buffers[2].length = &data_len;
-
-    if(mysql_stmt_bind_result(backend->st_read_prefix, result_buffers) != 0)
-      return GIT_ERROR;
-
-    // Fetch row, binding output data values, except data column
-    error = mysql_stmt_fetch(backend->st_read_prefix);
-
-    if (data_len > 0) {
-      *out_buf = malloc(data_len);
-      result_buffers[2].buffer = *out_buf;
-      result_buffers[2].buffer_length = data_len;
+    assert(mysql_stmt_num_rows(conn->st_read_prefix) == 1);
 
-      if (mysql_stmt_fetch_column(backend->st_read_prefix, &result_buffers[2], 2, 0) != 0)
-        return GIT_ERROR;
-    }
-
-    error = GIT_OK;
+    error = mysql_odb__fetch_object(backend, conn->st_read_prefix,
+              conn->meta_read_prefix, output_oid, out_buf, out_len, out_type);
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_prefix) != 0)
+  if (mysql_stmt_reset(conn->st_read_prefix) != 0)
     return GIT_ERROR;
 
+  if (error == MYSQL_ODB_CHUNKED)
+    error = mysql_odb__read_chunks(backend, conn, output_oid, out_buf, *out_len);
+
   return error;
 }
 
-static int mysql_odb_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+static int mysql_odb__read(mysql_odb_backend *backend, mysql_odb_conn *conn,
+        void **data_p, size_t *len_p, git_otype *type_p, const git_oid *oid)
 {
-  mysql_odb_backend *backend;
   int error;
   MYSQL_BIND bind_buffers[1];
-  MYSQL_BIND result_buffers[3];
-  unsigned long data_len;
 
-  assert(len_p && type_p && _backend && oid);
+  assert(len_p && type_p && conn && oid);
 
-  backend = (mysql_odb_backend *)_backend;
   error = GIT_ERROR;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
-  memset(result_buffers, 0, sizeof(result_buffers));
 
   // bind the oid passed to the statement
   bind_buffers[0].buffer = (void*)oid->id;
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read, bind_buffers) != 0)
+  if (mysql_stmt_bind_param(conn->st_read, bind_buffers) != 0)
     return GIT_ERROR;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read) != 0)
+  if (mysql_stmt_execute(conn->st_read) != 0)
     return GIT_ERROR;
 
-  if (mysql_stmt_store_result(backend->st_read) != 0)
+  if (mysql_stmt_store_result(conn->st_read) != 0)
     return GIT_ERROR;
 
   // this should either be 0 or 1
   // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read) == 1) {
-    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-    result_buffers[0].buffer = type_p;
-    result_buffers[0].buffer_length = sizeof(type_p);
-    memset(type_p, 0, sizeof(*type_p));
-
-    result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
-    result_buffers[1].buffer = len_p;
-    result_buffers[1].buffer_length = sizeof(len_p);
-    memset(len_p, 0, sizeof(*len_p));
-
-    // by setting buffer and buffer_length to 0, this tells libmysql
-    // we want it to set data_len to the *actual* length of that field
-    // this way we can malloc exactly as much memory as we need for the buffer
-    //
-    // come to think of it, we can probably just use the length set in *len_p
-    // once we fetch the result?
-    result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
-    result_buffers[2].buffer = 0;
-    result_buffers[2].buffer_length = 0;
-    result_buffers[2].length = &data_len;
-
-    if(mysql_stmt_bind_result(backend->st_read, result_buffers) != 0)
-      return GIT_ERROR;
-
-    // this should populate the buffers at *type_p, *len_p and &data_len
-    error = mysql_stmt_fetch(backend->st_read);
-    // if(error != 0 || error != MYSQL_DATA_TRUNCATED)
-    //   return GIT_ERROR;
-
-    if (data_len > 0) {
-      *data_p = malloc(data_len);
-      result_buffers[2].buffer = *data_p;
-      result_buffers[2].buffer_length = data_len;
-
-      if (mysql_stmt_fetch_column(backend->st_read, &result_buffers[2], 2, 0) != 0)
-        return GIT_ERROR;
-    }
-
-    error = GIT_OK;
+  if (mysql_stmt_num_rows(conn->st_read) == 1) {
+    error = mysql_odb__fetch_object(backend, conn->st_read,
+              conn->meta_read, NULL, data_p, len_p, type_p);
   } else {
     error = GIT_ENOTFOUND;
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read) != 0)
+  if (mysql_stmt_reset(conn->st_read) != 0)
     return GIT_ERROR;
 
+  if (error == MYSQL_ODB_CHUNKED)
+    error = mysql_odb__read_chunks(backend, conn, oid, data_p, *len_p);
+
   return error;
 }
 
-static int mysql_odb_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+static int mysql_odb__exists(mysql_odb_conn *conn, const git_oid *oid)
 {
-  mysql_odb_backend *backend;
   int found;
   MYSQL_BIND bind_buffers[1];
 
-  assert(_backend && oid);
+  assert(conn && oid);
 
-  backend = (mysql_odb_backend *)_backend;
   found = 0;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
@@ -348,1258 +730,4612 @@ static int mysql_odb_backend__exists(git_odb_backend *_backend, const git_oid *o
   bind_buffers[0].buffer_length = 20;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-  if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0)
+  if (mysql_stmt_bind_param(conn->st_read_header, bind_buffers) != 0)
     return GIT_ERROR;
 
   // execute the statement
-  if (mysql_stmt_execute(backend->st_read_header) != 0)
+  if (mysql_stmt_execute(conn->st_read_header) != 0)
     return GIT_ERROR;
 
-  if (mysql_stmt_store_result(backend->st_read_header) != 0)
+  if (mysql_stmt_store_result(conn->st_read_header) != 0)
     return GIT_ERROR;
 
   // now lets see if any rows matched our query
   // this should either be 0 or 1
   // if it's > 1 MySQL's unique index failed and we should all fear for our lives
-  if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
+  if (mysql_stmt_num_rows(conn->st_read_header) == 1) {
     found = 1;
   }
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
+  if (mysql_stmt_reset(conn->st_read_header) != 0)
     return GIT_ERROR;
 
   return found;
 }
 
-static int mysql_odb_backend__write(git_oid *oid, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+static int mysql_odb__pack_path(char *out, size_t out_len,
+        const char *dir, const git_oid *pack_id, const char *ext)
 {
-  int error;
-  mysql_odb_backend *backend;
-  MYSQL_BIND bind_buffers[4];
-  my_ulonglong affected_rows;
+  char hex[GIT_OID_HEXSZ + 1];
 
-  assert(oid && _backend && data);
+  git_oid_fmt(hex, pack_id);
+  hex[GIT_OID_HEXSZ] = '\0'; /* fmt does not set a terminator */
 
-  backend = (mysql_odb_backend *)_backend;
+  if ((size_t)snprintf(out, out_len, "%s/pack-%s.%s", dir, hex, ext) >= out_len) {
+    giterr_set_str(GITERR_ODB, "MySQL odb pack cache path is too long");
+    return GIT_ERROR;
+  }
 
-  if ((error = git_odb_hash(oid, data, len, type)) < 0)
-    return error;
+  return GIT_OK;
+}
+
+static int mysql_odb__write_pack_row(mysql_odb_backend *backend,
+        const git_oid *pack_id, unsigned char kind, unsigned int seq,
+        const void *data, size_t data_len)
+{
+  MYSQL_BIND bind_buffers[4];
+  MYSQL_STMT *stmt = backend->st_write_pack_chunk;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
 
-  // bind the oid
-  bind_buffers[0].buffer = (void*)oid->id;
-  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].buffer = (void*)pack_id->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
   bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-  // bind the type
-  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer = &kind;
   bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  bind_buffers[1].is_unsigned = 1;
 
-  // bind the size of the data
-  bind_buffers[2].buffer = &len;
+  bind_buffers[2].buffer = &seq;
   bind_buffers[2].buffer_type = MYSQL_TYPE_LONG;
+  bind_buffers[2].is_unsigned = 1;
 
-  // bind the data
+  /* Pack data is zlib compressed already; don't bother compressing again */
   bind_buffers[3].buffer = (void*)data;
-  bind_buffers[3].buffer_length = len;
+  bind_buffers[3].buffer_length = data_len;
   bind_buffers[3].length = &bind_buffers[3].buffer_length;
   bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
 
-  if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0)
-    return GIT_ERROR;
-
-  // TODO: use the streaming backend API so this actually makes sense to use :P
-  // once we want to use this we should comment out 
-  // if (mysql_stmt_send_long_data(backend->st_write, 2, data, len) != 0)
-  //   return GIT_ERROR;
-
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_write) != 0)
+  if (mysql_stmt_bind_param(stmt, bind_buffers) != 0)
     return GIT_ERROR;
 
-  // now lets see if the insert worked
-  affected_rows = mysql_stmt_affected_rows(backend->st_write);
-  if (affected_rows != 1)
+  if (mysql_stmt_execute(stmt) != 0)
     return GIT_ERROR;
 
   // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_read_header) != 0)
+  if (mysql_stmt_reset(stmt) != 0)
     return GIT_ERROR;
 
   return GIT_OK;
 }
 
-static int mysql_odb_backend__pack_add(git_odb_writepack *_wp,
-	const void *data, size_t size, git_transfer_progress *stats)
+/* Store one of the files of a pack, in rows of at most GIT2_ODB_CHUNK_SIZE */
+static int mysql_odb__upload_pack_file(mysql_odb_backend *backend,
+        const git_oid *pack_id, unsigned char kind, const char *path)
 {
-  mysql_odb_writepack *wp;
+  unsigned char *buffer;
+  unsigned int seq;
+  size_t len;
+  FILE *fp;
+  int error = GIT_OK;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    giterr_set_str(GITERR_OS, "MySQL odb failed to open received pack");
+    return GIT_ERROR;
+  }
 
-  wp = (mysql_odb_writepack*)_wp;
+  buffer = malloc(GIT2_ODB_CHUNK_SIZE);
+  if (buffer == NULL) {
+    giterr_set_oom();
+    fclose(fp);
+    return GIT_ERROR;
+  }
 
-  return git_indexer_stream_add(wp->indexer, data, size, stats);
+  for (seq = 0; ; seq++) {
+    len = fread(buffer, 1, GIT2_ODB_CHUNK_SIZE, fp);
+    if (len == 0 && seq > 0)
+      break;
+
+    error = mysql_odb__write_pack_row(backend, pack_id, kind, seq, buffer, len);
+    if (error != GIT_OK || len < GIT2_ODB_CHUNK_SIZE)
+      break;
+  }
+
+  if (error == GIT_OK && ferror(fp)) {
+    giterr_set_str(GITERR_OS, "MySQL odb failed to read received pack");
+    error = GIT_ERROR;
+  }
+
+  free(buffer);
+  fclose(fp);
+  return error;
 }
 
-static int add_each_packfile_obj(const git_oid *id, void *payload)
+/* Write out one of the files of a stored pack, via a temporary file so a
+ * half written file is never mistaken for a cached copy */
+static int mysql_odb__download_pack_file(mysql_odb_backend *backend,
+        const git_oid *pack_id, unsigned char kind, const char *path)
 {
-  static const char *sql_tmp_write = "INSERT IGNORE INTO `xyzzy` VALUES (?, ?, ?, COMPRESS(?));";
-  MYSQL_BIND bind_buffers[4];
-  MYSQL_STMT *tmp_write = NULL;
-  mysql_odb_writepack *wp;
-  mysql_odb_backend *backend;
-  git_odb_object *object = NULL;
-  const void *data;
-  size_t size;
-  int error = GIT_ERROR;
-  git_otype obj_type;
-  my_bool truth = 1;
-
-  wp = (mysql_odb_writepack*)payload;
-  backend = (mysql_odb_backend *)wp->parent.backend;
-  memset(bind_buffers, 0, sizeof(bind_buffers));
+  MYSQL_STMT *stmt = backend->st_read_pack_chunk;
+  MYSQL_BIND bind_buffers[3];
+  MYSQL_BIND result_buffers[1];
+  char tmp_path[PATH_MAX];
+  unsigned long data_len;
+  unsigned int seq;
+  FILE *fp;
+  int error = GIT_OK;
 
-  /* Suckage: we need to read all of an object in, and then use a special
-   * prepared statement to insert things into the temporary table. This because
-   * we can't currently parameterise the table name. Some code replication
-   * occurs as a result; for now, just eat it. */
-  /* Oh, and as we can't name the temporary table in preprared statements, it
-   * has to be manually constructed. Hurrah. */
+  if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path))
+    return GIT_ERROR;
 
-  error = git_odb_read(&object, wp->odb, id);
-  if (error != GIT_OK)
-    return error;
-
-  data = git_odb_object_data(object);
-  size = git_odb_object_size(object);
-  obj_type = git_odb_object_type(object);
-
-
-  /* Rather than attempting to escape the given buffer, make that the mysql
-   * libraries problem by creating a prepared statement and binding into it.
-   * This isn't super efficient, but avoids manual buffer mangling. */
+  fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    giterr_set_str(GITERR_OS, "MySQL odb failed to create pack cache file");
+    return GIT_ERROR;
+  }
 
-  tmp_write = mysql_stmt_init(backend->db);
-  if (tmp_write == NULL)
-    goto bad;
+  for (seq = 0; error == GIT_OK; seq++) {
+    memset(bind_buffers, 0, sizeof(bind_buffers));
+    memset(result_buffers, 0, sizeof(result_buffers));
 
-  if (mysql_stmt_attr_set(tmp_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    goto bad;
+    bind_buffers[0].buffer = (void*)pack_id->id;
+    bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+    bind_buffers[0].length = &bind_buffers[0].buffer_length;
+    bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-  if (mysql_stmt_prepare(tmp_write, sql_tmp_write, strlen(sql_tmp_write)) != 0)
-    goto bad;
+    bind_buffers[1].buffer = &kind;
+    bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+    bind_buffers[1].is_unsigned = 1;
 
-  /* id->id is const, cast that away. This is safe because we're binding params
-   * rather than binding result buffers */
-  bind_buffers[0].buffer = (void*)id->id;
-  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+    bind_buffers[2].buffer = &seq;
+    bind_buffers[2].buffer_type = MYSQL_TYPE_LONG;
+    bind_buffers[2].is_unsigned = 1;
 
-  bind_buffers[1].buffer = &obj_type;
-  bind_buffers[1].buffer_length = sizeof(obj_type);
-  bind_buffers[1].length = &bind_buffers[1].buffer_length;
-  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+    if (mysql_stmt_bind_param(stmt, bind_buffers) != 0 ||
+        mysql_stmt_execute(stmt) != 0 ||
+        mysql_stmt_store_result(stmt) != 0) {
+      error = GIT_ERROR;
+      break;
+    }
 
-  bind_buffers[2].buffer = &size;
-  bind_buffers[2].buffer_length = sizeof(size);
-  bind_buffers[2].length = &bind_buffers[2].buffer_length;
-  bind_buffers[2].buffer_type = MYSQL_TYPE_LONG;
+    if (mysql_stmt_num_rows(stmt) != 1) {
+      // ran past the last row
+      mysql_stmt_reset(stmt);
+      break;
+    }
 
-  /* Another case of casting away const */
-  bind_buffers[3].buffer = (void*)data;
-  bind_buffers[3].buffer_length = size;
-  bind_buffers[3].length = &bind_buffers[3].buffer_length;
-  bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+    error = mysql_odb__reserve_scratch(backend,
+              mysql_fetch_field_direct(backend->meta_read_pack_chunk, 0)->max_length);
+    if (error == GIT_OK) {
+      result_buffers[0].buffer_type = MYSQL_TYPE_LONG_BLOB;
+      result_buffers[0].buffer = backend->scratch;
+      result_buffers[0].buffer_length = backend->scratch_size;
+      result_buffers[0].length = &data_len;
+
+      if (mysql_stmt_bind_result(stmt, result_buffers) != 0 ||
+          mysql_stmt_fetch(stmt) != 0 ||
+          fwrite(backend->scratch, 1, data_len, fp) != data_len)
+        error = GIT_ERROR;
+    }
 
-  if (mysql_stmt_bind_param(tmp_write, bind_buffers) != 0)
-    goto bad;
+    // reset the statement for further use
+    if (mysql_stmt_reset(stmt) != 0)
+      error = GIT_ERROR;
+  }
 
-  if (mysql_stmt_execute(tmp_write) != 0)
-    goto bad;
+  if (fclose(fp) != 0)
+    error = GIT_ERROR;
 
-  /* NB: not called with NDEBUG */
-  assert(mysql_stmt_num_rows(tmp_write) == 1);
+  if (error == GIT_OK && seq == 0) {
+    giterr_set_str(GITERR_ODB, "MySQL odb is missing part of a stored pack");
+    error = GIT_ERROR;
+  }
 
-  /* Success! Free some things. */
+  if (error == GIT_OK && rename(tmp_path, path) != 0)
+    error = GIT_ERROR;
 
-  mysql_stmt_reset(tmp_write);
-  mysql_stmt_close(tmp_write);
-  git_odb_object_free(object);
-  return GIT_OK;
+  if (error != GIT_OK)
+    unlink(tmp_path);
 
-bad:
-  if (tmp_write)
-    mysql_stmt_close(tmp_write);
-  if (object)
-    git_odb_object_free(object);
   return error;
 }
 
-static int mysql_odb_backend__pack_commit(git_odb_writepack *_wp,
-	git_transfer_progress *stats)
+/* Make a stored pack available for reads: fetch it into the cache directory
+ * unless it's there already, and hand it to libgit2's pack backend, which
+ * gives us the pack index lookups and the delta base cache. */
+static int mysql_odb__add_pack(mysql_odb_backend *backend, const git_oid *pack_id)
 {
-  /* Existing path + "pack-" + oid + ".idx" or ".pack" broadly */
-  char idx_path_buffer[MYSQL_ODB_STREAM_DIR_PATH_LEN + GIT_OID_HEXSZ + 16];
-  char idx_oid_buffer[GIT_OID_HEXSZ + 1];
-  mysql_odb_writepack *wp;
-  mysql_odb_backend *backend;
-  const git_oid *packfile_oid_ptr = NULL;
-  git_odb_backend *pack_backend = NULL;
-  git_odb *pack_odb = NULL;
-  int error = GIT_ERROR;
-  int free_backend = 1, must_drop_temp_table = 0;
-
-  wp = (mysql_odb_writepack*)_wp;
-  backend = (mysql_odb_backend *)wp->parent.backend;
+  char pack_path[PATH_MAX], idx_path[PATH_MAX];
+  git_odb_backend *pack_backend;
+  git_oid *pack_ids;
+  size_t i;
+  int error;
 
-  /* The procedure for this function:
-   *  1) Finalize indexer stream
-   *  2) Open it as an odb
-   *  3) Create a temporary mysql table
-   *  4) Insert all objects from packfile odb into temp table *  5) Insert the temp table into the database (which will be atomic)
-   *       XXX -- this may _legitimately_ have duplicate oids, given that the
-   *       sent packfile can contain tree's of unchanged material.
-   *       XXX -- in the case of something like "git gc" though, we might
-   *       get delta-ified objects being written back. Just drop them for now.
-   *  6) Clean up
-   *
-   * Crucially, the merging of the temporary table into the main table will be
-   * one atomic mysql statement, which will either succeed or fail. */
+  for (i = 0; i < backend->pack_count; i++) {
+    if (git_oid_cmp(&backend->pack_ids[i], pack_id) == 0)
+      return GIT_OK;
+  }
 
-  /* 1: Finish index. */
-  error = git_indexer_stream_finalize(wp->indexer, stats);
-  if (error != GIT_OK)
-    return error;
+  if (mysql_odb__pack_path(pack_path, sizeof(pack_path),
+        backend->pack_cache_dir, pack_id, "pack") != GIT_OK ||
+      mysql_odb__pack_path(idx_path, sizeof(idx_path),
+        backend->pack_cache_dir, pack_id, "idx") != GIT_OK)
+    return GIT_ERROR;
 
-  /* We need to know where the indexed packfile is, to open it */
-  packfile_oid_ptr = git_indexer_stream_hash(wp->indexer);
+  if (access(pack_path, R_OK) != 0) {
+    error = mysql_odb__download_pack_file(backend, pack_id, MYSQL_ODB_PACK_DATA, pack_path);
+    if (error != GIT_OK)
+      return error;
+  }
 
-  /* 2: Open the ODB */
-  git_oid_fmt(idx_oid_buffer, packfile_oid_ptr);
-  idx_oid_buffer[GIT_OID_HEXSZ] = '\0'; /* fmt does not set a terminator */
-  sprintf(idx_path_buffer, "%s/pack-%s.idx", wp->dir_path, idx_oid_buffer);
-  error = git_odb_backend_one_pack(&pack_backend, idx_path_buffer);
-  if (error != GIT_OK)
-    goto bad;
+  if (access(idx_path, R_OK) != 0) {
+    error = mysql_odb__download_pack_file(backend, pack_id, MYSQL_ODB_PACK_INDEX, idx_path);
+    if (error != GIT_OK)
+      return error;
+  }
 
-  error = git_odb_new(&pack_odb);
-  if (error != GIT_OK)
-    goto bad;
+  pack_ids = realloc(backend->pack_ids, sizeof(git_oid) * (backend->pack_count + 1));
+  if (pack_ids == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+  backend->pack_ids = pack_ids;
 
-  error = git_odb_add_backend(pack_odb, pack_backend, 1);
+  error = git_odb_backend_one_pack(&pack_backend, idx_path);
   if (error != GIT_OK)
-    goto bad;
+    return error;
 
-  /* Backend will now be freed by deconstruction of odb */
-  free_backend = 0;
-  wp->odb = pack_odb;
+  error = git_odb_add_backend(backend->packs, pack_backend, 1);
+  if (error != GIT_OK) {
+    pack_backend->free(pack_backend);
+    return error;
+  }
 
-  /* 3: Create temporary table */
+  git_oid_cpy(&backend->pack_ids[backend->pack_count++], pack_id);
+  return GIT_OK;
+}
 
-  /* Global name is not required, apparently temporary tables are limited to
-   * the scope of our current connection. */
-  if (mysql_query(backend->db, "CREATE TEMPORARY TABLE `xyzzy` LIKE `" GIT2_ODB_TABLE_NAME "`;")) {
-    fprintf(stderr, "mysql_odb_backend__pack_commit: failed to create temp "
-		    "table\n");
-    error = GIT_ERROR;
-    goto bad;
-  }
+/* Pick up every complete pack in the pack table we don't know about yet */
+static int mysql_odb__load_packs(mysql_odb_backend *backend)
+{
+  char sql_list_packs[128];
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid pack_id;
+  int error = GIT_OK;
 
-  must_drop_temp_table = 1;
+  snprintf(sql_list_packs, sizeof(sql_list_packs),
+    "SELECT `id` FROM `" GIT2_ODB_PACK_TABLE_NAME "` WHERE `kind` = %d;",
+    MYSQL_ODB_PACK_DONE);
 
-  /* 4: Load temporary table */
-  /* Do this by iterating over all odb contents */
-  error = git_odb_foreach(pack_odb, add_each_packfile_obj, wp);
-  if (error != GIT_OK)
-    goto bad;
+  if (mysql_real_query(backend->primary.db, sql_list_packs, strlen(sql_list_packs)) != 0)
+    return GIT_ERROR;
 
-  /* 5: Merge temp table into db */
-  if (mysql_query(backend->db, "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME "` (SELECT * FROM `xyzzy`);")) {
-    fprintf(stderr, "mysql_odb_backend__pack_commit: failed to merge temp table "
-		    "table\n");
-    error = GIT_ERROR;
-    goto bad;
-  }
+  res = mysql_store_result(backend->primary.db);
+  if (res == NULL)
+    return GIT_ERROR;
 
-  /* 6: Clean up */
-  mysql_query(backend->db, "DROP TABLE `xyzzy`;");
-  git_odb_free(pack_odb); /* Frees backend too */
+  while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    if (lengths[0] != GIT_OID_RAWSZ)
+      continue;
 
-  return GIT_OK;
+    git_oid_fromraw(&pack_id, (const unsigned char *)row[0]);
+    error = mysql_odb__add_pack(backend, &pack_id);
+  }
 
-bad:
-  if (must_drop_temp_table)
-    mysql_query(backend->db, "DROP TABLE `xyzzy`;");
-  if (pack_odb)
-    git_odb_free(pack_odb);
-  if (pack_backend && free_backend)
-    pack_backend->free(pack_backend);
+  mysql_free_result(res);
   return error;
 }
 
-static void mysql_odb_backend__pack_free(git_odb_writepack *_wp)
+/* Store a received pack whole, then move it into the cache directory so
+ * this backend can serve it without fetching it back */
+static int mysql_odb__store_pack(mysql_odb_backend *backend,
+        const char *dir_path, const git_oid *pack_id)
 {
-  char idx_path_buffer[MYSQL_ODB_STREAM_DIR_PATH_LEN + GIT_OID_HEXSZ + 16];
-  char idx_oid_buffer[GIT_OID_HEXSZ + 1];
-  const git_oid *packfile_oid_ptr = NULL;
-  mysql_odb_writepack *wp;
-
-  wp = (mysql_odb_writepack*)_wp;
+  char pack_path[PATH_MAX], idx_path[PATH_MAX];
+  char cache_path[PATH_MAX];
+  int error;
 
-  /* We need to:
-   *   Free the indexer
-   *   Unlink the files we've created
-   * Potentially after a transfer has aborted */
+  if (mysql_odb__pack_path(pack_path, sizeof(pack_path), dir_path, pack_id, "pack") != GIT_OK ||
+      mysql_odb__pack_path(idx_path, sizeof(idx_path), dir_path, pack_id, "idx") != GIT_OK)
+    return GIT_ERROR;
 
-  packfile_oid_ptr = git_indexer_stream_hash(wp->indexer);
-  git_oid_fmt(idx_oid_buffer, packfile_oid_ptr);
-  idx_oid_buffer[GIT_OID_HEXSZ] = '\0'; /* fmt does not set a terminator */
-  sprintf(idx_path_buffer, "%s/pack-%s.pack", wp->dir_path, idx_oid_buffer);
-  unlink(idx_path_buffer);
-  sprintf(idx_path_buffer, "%s/pack-%s.idx", wp->dir_path, idx_oid_buffer);
-  unlink(idx_path_buffer);
+  error = mysql_odb__upload_pack_file(backend, pack_id, MYSQL_ODB_PACK_DATA, pack_path);
+  if (error != GIT_OK)
+    return error;
 
-  /* Also need to unlink the containing dir */
-  unlink(wp->dir_path);
+  error = mysql_odb__upload_pack_file(backend, pack_id, MYSQL_ODB_PACK_INDEX, idx_path);
+  if (error != GIT_OK)
+    return error;
 
-  git_indexer_stream_free(wp->indexer);
+  /* Only now is the pack visible to anyone else */
+  error = mysql_odb__write_pack_row(backend, pack_id, MYSQL_ODB_PACK_DONE, 0, "", 0);
+  if (error != GIT_OK)
+    return error;
 
-  free(wp);
-  return;
+  /* Failing to move the files is harmless, they get downloaded instead.
+   * The cache may well be on another filesystem, in which case it's
+   * cheaper to do just that than to copy. */
+  if (mysql_odb__pack_path(cache_path, sizeof(cache_path),
+        backend->pack_cache_dir, pack_id, "pack") == GIT_OK)
+    rename(pack_path, cache_path);
+  if (mysql_odb__pack_path(cache_path, sizeof(cache_path),
+        backend->pack_cache_dir, pack_id, "idx") == GIT_OK)
+    rename(idx_path, cache_path);
+
+  return mysql_odb__add_pack(backend, pack_id);
 }
 
-static int mysql_odb_backend__writepack(git_odb_writepack **_wp,
-	git_odb_backend *backend, git_transfer_progress_callback progress_cb,
-	void *progress_payload)
+/* Read an object out of the stored packs, into a malloc()ed buffer as the
+ * odb expects */
+static int mysql_odb__read_packed(mysql_odb_backend *backend, git_oid *oid_out,
+        void **data_p, size_t *len_p, git_otype *type_p,
+        const git_oid *oid, size_t oidlen)
 {
-  char dir_path[MYSQL_ODB_STREAM_DIR_PATH_LEN] = "/tmp/tmp.XXXXXXX";
-  mysql_odb_writepack *wp = NULL;
-  git_indexer_stream *indexer;
-  char *tmppath = NULL;
-  int error = GIT_ERROR;
+  git_odb_object *object;
+  int error;
 
-  wp = calloc(1, sizeof(mysql_odb_writepack));
-  if (!wp) {
-    giterr_set_oom();
-    return GIT_ERROR;
-  }
+  if (oidlen == GIT_OID_HEXSZ)
+    error = git_odb_read(&object, backend->packs, oid);
+  else
+    error = git_odb_read_prefix(&object, backend->packs, oid, oidlen);
+  if (error != GIT_OK)
+    return error;
 
-  /* Prepare to read a packfile. Seeing how facilities for interpreting
-   * packfiles are not exported by libgit2, and copy+pasting them would be
-   * bad, instead read the packfile to a temporary directory. Then open it
-   * using the existing ODB api, then suck objects out of it and into the
-   * database. */
+  *len_p = git_odb_object_size(object);
+  *type_p = git_odb_object_type(object);
 
-  if ((tmppath = mkdtemp(dir_path)) == NULL) {
-    perror("mysql_odb_backend");
-    goto bad;
+  *data_p = malloc(*len_p + 1);
+  if (*data_p == NULL) {
+    git_odb_object_free(object);
+    giterr_set_oom();
+    return GIT_ERROR;
   }
 
-  error = git_indexer_stream_new(&indexer, tmppath, progress_cb,
-	  progress_payload);
-  if (error != GIT_OK)
-    goto bad;
+  memcpy(*data_p, git_odb_object_data(object), *len_p);
+  ((unsigned char *)*data_p)[*len_p] = '\0';
 
-  /* Now prepare to receive data */
-  wp->indexer = indexer;
-  /* Perhaps we should use org.sun.pstrcpyatEx2W_safe */
-  strcpy(wp->dir_path, dir_path);
+  if (oid_out)
+    git_oid_cpy(oid_out, git_odb_object_id(object));
 
-  wp->parent.backend = backend;
-  wp->parent.add = mysql_odb_backend__pack_add;
-  wp->parent.commit = mysql_odb_backend__pack_commit;
-  wp->parent.free = mysql_odb_backend__pack_free;
-  *_wp = &wp->parent;
+  git_odb_object_free(object);
   return GIT_OK;
-
-bad:
-  if (tmppath)
-    unlink(tmppath);
-  if (wp)
-    free(wp);
-  return error;
 }
 
-static void mysql_odb_backend__free(git_odb_backend *_backend)
+static int mysql_odb_backend__refresh(git_odb_backend *_backend)
 {
   mysql_odb_backend *backend;
+
   assert(_backend);
+
   backend = (mysql_odb_backend *)_backend;
 
-  if (backend->st_read)
-    mysql_stmt_close(backend->st_read);
-  if (backend->st_read_header)
-    mysql_stmt_close(backend->st_read_header);
-  if (backend->st_write)
-    mysql_stmt_close(backend->st_write);
-  if (backend->st_read_prefix)
-    mysql_stmt_close(backend->st_read_prefix);
+  if (backend->packs == NULL)
+    return GIT_OK;
 
-  mysql_close(backend->db);
+  return mysql_odb__load_packs(backend);
+}
 
-  free(backend);
+static mysql_odb_conn *mysql_odb__shard(mysql_odb_backend *backend,
+        const git_oid *oid)
+{
+  return backend->shards[backend->route[oid->id[0]]];
 }
 
-static int mysql_refdb_backend__lookup(git_reference **out,
-        git_refdb_backend *_backend, const char *ref_name)
+/* Replicas are only ever replicas of the primary */
+static mysql_odb_conn *mysql_odb__pick_replica(mysql_odb_backend *backend,
+        mysql_odb_conn *conn)
 {
-  mysql_refdb_backend *backend;
-  char *refname_buffer = NULL;
-  int error;
-  MYSQL_BIND bind_buffers[1];
-  MYSQL_BIND result_buffers[3];
-  unsigned char reftype;
+  if (backend->replica_count == 0 || conn != &backend->primary)
+    return NULL;
 
-  assert(out && _backend && ref_name && oid);
+  return &backend->replicas[backend->next_replica++ % backend->replica_count];
+}
 
-  backend = (mysql_refdb_backend *)_backend;
-  error = GIT_ERROR;
+static int mysql_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_odb_backend *backend;
+  mysql_odb_conn *conn, *replica;
 
-  memset(bind_buffers, 0, sizeof(bind_buffers));
-  memset(result_buffers, 0, sizeof(result_buffers));
+  assert(_backend);
 
-  // bind the oid passed to the statement
-  bind_buffers[0].buffer = (void*)ref_name;
-  bind_buffers[0].buffer_length = strlen(ref_name);
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
-  if (mysql_stmt_bind_param(backend->st_lookup, bind_buffers) != 0)
-    return GIT_ERROR;
+  backend = (mysql_odb_backend *)_backend;
 
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_lookup) != 0)
-    return GIT_ERROR;
+  if (backend->packs && git_odb_read_header(len_p, type_p, backend->packs, oid) == GIT_OK)
+    return GIT_OK;
 
-  if (mysql_stmt_store_result(backend->st_lookup) != 0)
-    return GIT_ERROR;
+  conn = mysql_odb__shard(backend, oid);
+  replica = mysql_odb__pick_replica(backend, conn);
+  if (replica && mysql_odb__read_header(replica, len_p, type_p, oid) == GIT_OK)
+    return GIT_OK;
 
-  if (mysql_stmt_num_rows(backend->st_lookup) == 0) {
-    error = GIT_ENOTFOUND;
-  } else if (mysql_stmt_num_rows(backend->st_lookup) != 1) {
-    /* Duplicate refname has occurred. Everything is broken. */
-    error = GIT_ERROR;
-  } else {
-    unsigned char odb_buffer[GIT_OID_RAWSZ];
-    git_oid oid;
-    size_t symref_len;
+  return mysql_odb__read_header(conn, len_p, type_p, oid);
+}
 
-    assert(mysql_stmt_num_rows(backend->st_lookup) == 1);
-    memset(odb_buffer, 0, sizeof(odb_buffer));
+static int mysql_odb_backend__read_prefix(git_oid *output_oid, void **out_buf,
+        size_t *out_len, git_otype *out_type, git_odb_backend *_backend,
+        const git_oid *partial_oid, size_t oidlen)
+{
+  mysql_odb_backend *backend;
+  mysql_odb_conn *conn;
+  git_oid packed_oid;
+  void *packed_buf = NULL;
+  size_t packed_len = 0;
+  git_otype packed_type = GIT_OBJ_BAD;
+  int found_packed = 0, error;
 
-    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-    result_buffers[0].buffer = &reftype;
-    result_buffers[0].buffer_length = sizeof(reftype);
-    result_buffers[0].length = &result_buffers[0].buffer_length;
+  assert(_backend);
 
-    result_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
-    result_buffers[1].buffer = odb_buffer;
-    result_buffers[1].buffer_length = sizeof(odb_buffer);
-    result_buffers[1].length = &result_buffers[1].buffer_length;
-
-    symref_len = 0;
-    result_buffers[2].buffer_type = MYSQL_TYPE_STRING;
-    result_buffers[2].buffer = NULL;
-    result_buffers[2].buffer_length = 0;
-    result_buffers[2].length = &symref_len;
-
-    if(mysql_stmt_bind_result(backend->st_lookup, result_buffers) != 0)
-      return GIT_ERROR;
-
-    error = mysql_stmt_fetch(backend->st_lookup); /* Might return truncated */
+  backend = (mysql_odb_backend *)_backend;
 
-    /* If there's symbolic reference name data, load it manually */
-    if (symref_len > 0) {
-      refname_buffer = malloc(symref_len + 1UL);
-      if (refname_buffer == NULL) {
-        giterr_set_oom();
-        error = GIT_ERROR;
-	goto out;
-      }
+  /* A unique match in one place proves nothing while another place may
+   * hold a second one, so the stored packs and the primary are both asked,
+   * and the answers combined. Replicas aren't: a lagging one can't tell a
+   * unique prefix from one the primary has since made ambiguous. Prefixes
+   * are always long enough to pick the shard. */
+  if (backend->packs) {
+    error = mysql_odb__read_packed(backend, &packed_oid, &packed_buf,
+              &packed_len, &packed_type, partial_oid, oidlen);
+    if (error != GIT_OK && error != GIT_ENOTFOUND)
+      return error;
+    found_packed = (error == GIT_OK);
+  }
 
-      result_buffers[2].buffer = refname_buffer;
-      result_buffers[2].buffer_length = symref_len;
+  conn = (oidlen >= 2) ? mysql_odb__shard(backend, partial_oid) : &backend->primary;
+  error = mysql_odb__read_prefix(backend, conn, output_oid,
+            out_buf, out_len, out_type, partial_oid, oidlen);
 
-      /* XXX memory leak */
-      if (mysql_stmt_fetch_column(backend->st_lookup, &result_buffers[2], 2, 0) != 0)
-        return GIT_ERROR;
+  if (!found_packed)
+    return error;
 
-      refname_buffer[symref_len] = '\0';
+  if (error == GIT_OK) {
+    free(*out_buf);
+    if (git_oid_cmp(output_oid, &packed_oid) != 0) {
+      free(packed_buf);
+      giterr_set_str(GITERR_ODB, "MySQL odb found an ambiguous object id prefix");
+      return GIT_EAMBIGUOUS;
     }
+  } else if (error != GIT_ENOTFOUND) {
+    free(packed_buf);
+    return error;
+  }
 
-    /* Having read the relevant oid, create an oid, then a reference */
-    git_oid_fromraw(&oid, odb_buffer);
+  git_oid_cpy(output_oid, &packed_oid);
+  *out_buf = packed_buf;
+  *out_len = packed_len;
+  *out_type = packed_type;
+  return GIT_OK;
+}
 
-    assert(reftype == GIT_REF_OID || reftype == GIT_REF_SYMBOLIC);
-    if (reftype == GIT_REF_OID) {
-      *out = git_reference__alloc(ref_name, &oid, NULL);
-    } else {
-      *out = git_reference__alloc_symbolic(ref_name, refname_buffer);
-    }
+static int mysql_odb_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_odb_backend *backend;
+  mysql_odb_conn *conn, *replica;
 
-    if (refname_buffer != NULL)
-      free(refname_buffer);
+  assert(_backend);
 
-    if (*out == NULL)
-      error = GIT_ERROR;
-    else
-      error = GIT_OK;
-  }
+  backend = (mysql_odb_backend *)_backend;
 
-out:
-  // reset the statement for further use
-  if (mysql_stmt_reset(backend->st_lookup) != 0)
-    return GIT_ERROR;
+  if (backend->packs && mysql_odb__read_packed(backend, NULL, data_p, len_p,
+        type_p, oid, GIT_OID_HEXSZ) == GIT_OK)
+    return GIT_OK;
 
-  return error;
+  conn = mysql_odb__shard(backend, oid);
+  replica = mysql_odb__pick_replica(backend, conn);
+  if (replica && mysql_odb__read(backend, replica, data_p, len_p, type_p, oid) == GIT_OK)
+    return GIT_OK;
+
+  return mysql_odb__read(backend, conn, data_p, len_p, type_p, oid);
 }
 
-static int mysql_refdb_backend__exists(int *exists, git_refdb_backend *_backend,
-         const char *ref_name)
+static int mysql_odb_backend__exists(git_odb_backend *_backend, const git_oid *oid)
 {
-  git_reference *ref = NULL;
-  int error;
+  mysql_odb_backend *backend;
+  mysql_odb_conn *conn, *replica;
 
-  error = mysql_refdb_backend__lookup(&ref, _backend, ref_name);
+  assert(_backend);
 
-  if (error == GIT_ENOTFOUND) {
-    *exists = 0;
-    return GIT_OK;
-  } else if (error != GIT_OK) {
-    return error;
-  }
+  backend = (mysql_odb_backend *)_backend;
 
-  /* Otherwise, the reference was found */
-  git_reference_free(ref);
-  *exists = 1;
-  return GIT_OK;
+  if (backend->packs && git_odb_exists(backend->packs, oid))
+    return 1;
+
+  conn = mysql_odb__shard(backend, oid);
+  replica = mysql_odb__pick_replica(backend, conn);
+  if (replica && mysql_odb__exists(replica, oid) == 1)
+    return 1;
+
+  return mysql_odb__exists(conn, oid);
 }
 
-static int mysql_refdb_iterator_next(git_reference **ref,
-        git_reference_iterator *iter)
+static int mysql_odb_backend__foreach(git_odb_backend *_backend,
+        git_odb_foreach_cb cb, void *payload)
 {
-  mysql_refdb_iterator *myit = (mysql_refdb_iterator*)iter;
+  mysql_odb_backend *backend;
+  unsigned char sent[256];
+  MYSQL_RES *results[256];
+  const char *sql;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid oid;
+  size_t i;
+  int error = GIT_OK;
 
-  if (myit->cur_pos == myit->numrows)
-    return GIT_ITEROVER;
+  assert(_backend && cb);
 
-  git_ref_t t = myit->types[myit->cur_pos];
-  assert(t == GIT_REF_OID || t == GIT_REF_SYMBOLIC);
-  if (t == GIT_REF_OID) {
-    *ref = git_reference__alloc(myit->refnames[myit->cur_pos],
-                  &myit->oids[myit->cur_pos], NULL);
-  } else {
-    *ref = git_reference__alloc_symbolic(myit->refnames[myit->cur_pos],
-                  myit->symnames[myit->cur_pos]);
-  }
+  backend = (mysql_odb_backend *)_backend;
 
-  if (*ref == NULL) {
-    giterr_set_oom();
-    return GIT_ERROR;
+  if (backend->packs) {
+    error = git_odb_foreach(backend->packs, cb, payload);
+    if (error != GIT_OK)
+      return error;
   }
 
-  myit->cur_pos++;
-  return GIT_OK;
-}
+  sql = backend->header_table ?
+    "SELECT `oid` FROM `" GIT2_ODB_HEADER_TABLE_NAME "`;" :
+    "SELECT `oid` FROM `" GIT2_ODB_TABLE_NAME "`;";
 
-static int mysql_refdb_iterator_next_name(const char **ref_name,
-        git_reference_iterator *iter)
-{
-  mysql_refdb_iterator *myit = (mysql_refdb_iterator*)iter;
+  /* Have every shard start on its list before reading any of them */
+  for (i = 0; i < backend->shard_count; i++) {
+    sent[i] = (mysql_send_query(backend->shards[i]->db, sql, strlen(sql)) == 0);
+    if (!sent[i])
+      error = GIT_ERROR;
+  }
 
-  if (myit->cur_pos == myit->numrows)
-    return GIT_ITEROVER;
+  /* Every list is read in full before the callback sees any of it, as the
+   * callback may well use the odb, and so the shard connections */
+  for (i = 0; i < backend->shard_count; i++) {
+    results[i] = NULL;
+    if (!sent[i])
+      continue;
 
-  *ref_name = myit->refnames[myit->cur_pos++];
-  return GIT_OK;
-}
+    if (mysql_read_query_result(backend->shards[i]->db) != 0 ||
+        (results[i] = mysql_store_result(backend->shards[i]->db)) == NULL)
+      error = GIT_ERROR;
+  }
 
-static void mysql_refdb_iterator_free(git_reference_iterator *iter)
-{
-  mysql_refdb_iterator *myit = (mysql_refdb_iterator*)iter;
+  for (i = 0; i < backend->shard_count; i++) {
+    res = results[i];
+    if (res == NULL)
+      continue;
 
-  if (myit->refnames) {
-    unsigned int i;
+    while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+      lengths = mysql_fetch_lengths(res);
+      if (lengths[0] != GIT_OID_RAWSZ)
+        continue;
 
-    /* Free any allocated refnames */
-    for (i = 0; i < myit->numrows; i++)
-      if (myit->refnames[i])
-        free(myit->refnames[i]);
+      git_oid_fromraw(&oid, (const unsigned char *)row[0]);
 
-    free(myit->refnames);
-  }
+      // leftovers from before the shard map changed
+      if (backend->route[oid.id[0]] != i)
+        continue;
 
-  if (myit->types)
-    free(myit->types);
+      // listed with the packs already
+      if (backend->packs && git_odb_exists(backend->packs, &oid))
+        continue;
 
-  if (myit->oids)
-    free(myit->oids);
+      if (cb(&oid, payload) != 0)
+        error = GIT_EUSER;
+    }
 
-  if (myit->symnames) {
-    unsigned int i;
+    mysql_free_result(res);
+  }
 
-    for (i = 0; i < myit->numrows; i++)
-      if (myit->symnames[i])
-        free(myit->symnames[i]);
+  return error;
+}
 
-    free(myit->symnames);
+/* Write "X'<hex>',X'<hex>',..." for n oids into out, which needs room for
+ * MYSQL_ODB_HEX_ITEM_LEN bytes per oid */
+#define MYSQL_ODB_HEX_ITEM_LEN (GIT_OID_HEXSZ + 4)
+static size_t mysql_odb__hex_list(char *out, const git_oid *oids, size_t n)
+{
+  size_t i, len = 0;
+
+  for (i = 0; i < n; i++) {
+    out[len++] = 'X';
+    out[len++] = '\'';
+    git_oid_fmt(out + len, &oids[i]);
+    len += GIT_OID_HEXSZ;
+    out[len++] = '\'';
+    out[len++] = ',';
   }
 
-  free(myit);
+  out[len - 1] = '\0';
+  return len - 1;
 }
 
-static int mysql_refdb_backend__iterator(git_reference_iterator **iter,
-        struct git_refdb_backend *backend, const char *glob)
+/* Bump the `created` time of objects found already stored, as git freshens
+ * an object it's asked to write again: something about to refer to them
+ * mustn't see them pruned as old and unreachable. oids are sorted. */
+static int mysql_odb__freshen(mysql_odb_backend *backend,
+        const git_oid *oids, size_t count)
 {
-  MYSQL_BIND bind_buffers[1];
-  mysql_refdb_iterator *myit = NULL;
-  int error = GIT_ERROR;
+  static const char sql_head[] =
+    "UPDATE `" GIT2_ODB_HEADER_TABLE_NAME "` SET `created` = CURRENT_TIMESTAMP WHERE `oid` IN (";
+  mysql_odb_conn *conn;
+  char *sql;
+  size_t start, n, len;
+  int error = GIT_OK;
+
+  if (!backend->header_table || count == 0)
+    return GIT_OK;
 
-  /* Reject any glob with either '%' or '?' in it. These aren't allowed by the
-   * reference definitions of git anyway, but there's a risk they'll muck up
-   * the query we're making, in a way that upsets the user */
-  if (strchr(glob, '%') != NULL)
-    return GIT_EINVALIDSPEC;
+  sql = malloc(sizeof(sql_head) + MYSQL_ODB_EXISTS_BATCH * MYSQL_ODB_HEX_ITEM_LEN + 2);
+  if (sql == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
 
-  if (strchr(glob, '?') != NULL)
-    return GIT_EINVALIDSPEC;
+  for (start = 0; start < count && error == GIT_OK; start += n) {
+    conn = mysql_odb__shard(backend, &oids[start]);
 
-  *iter = NULL;
+    for (n = 1; n < MYSQL_ODB_EXISTS_BATCH && start + n < count; n++) {
+      if (backend->route[oids[start + n].id[0]] != backend->route[oids[start].id[0]])
+        break;
+    }
 
-  myit = calloc(1, sizeof(mysql_refdb_iterator));
-  if (!myit)
-    goto oom;
+    len = sizeof(sql_head) - 1;
+    memcpy(sql, sql_head, len);
+    len += mysql_odb__hex_list(sql + len, &oids[start], n);
+    sql[len++] = ')';
+    sql[len++] = ';';
 
-  myit->parent.next = mysql_refdb_iterator_next;
-  myit->parent.next_name = mysql_refdb_iterator_next_name;
-  myit->parent.free = mysql_refdb_iterator_free;
-  myit->backend = (mysql_refdb_backend*)backend;
+    if (mysql_real_query(conn->db, sql, len) != 0) {
+      giterr_set_str(GITERR_ODB, mysql_error(conn->db));
+      error = GIT_ERROR;
+    }
+  }
+
+  free(sql);
+  return error;
+}
+
+static int mysql_odb__write_header(mysql_odb_backend *backend,
+        const git_oid *oid, git_otype type, size_t size, unsigned char location)
+{
+  MYSQL_BIND bind_buffers[4];
+  MYSQL_STMT *stmt = mysql_odb__shard(backend, oid)->st_write_header;
+  unsigned long long size_ll = size;
 
   memset(bind_buffers, 0, sizeof(bind_buffers));
 
-  bind_buffers[0].buffer = (void*)glob;
-  bind_buffers[0].buffer_length = strlen(glob);
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
-  if (mysql_stmt_bind_param(myit->backend->st_iterate, bind_buffers) != 0)
-   goto error;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-  // execute the statement
-  if (mysql_stmt_execute(myit->backend->st_iterate) != 0)
-    goto error;
+  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
 
-  if (mysql_stmt_store_result(myit->backend->st_iterate) != 0)
-    return GIT_ERROR;
+  bind_buffers[2].buffer = &size_ll;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+  bind_buffers[2].is_unsigned = 1;
 
-  if (mysql_stmt_num_rows(myit->backend->st_iterate) == 0) {
-    /* Now rows -- indicated by iterator being over immediately (?) */
-    myit->cur_pos = 0;
-    myit->numrows = 0;
-  } else {
-    MYSQL_BIND result_buffers[4];
-    unsigned long refname_len, i;
+  bind_buffers[3].buffer = &location;
+  bind_buffers[3].buffer_type = MYSQL_TYPE_TINY;
+  bind_buffers[3].is_unsigned = 1;
 
-    /* Allocate and initialize fields in myit to store the result rows from the
-     * query */
-    myit->cur_pos = 0;
-    myit->numrows = mysql_stmt_num_rows(myit->backend->st_iterate);
-    if (myit->numrows >= (ULONG_MAX / sizeof(char*)) ||
-        myit->numrows >= (ULONG_MAX / GIT_OID_RAWSZ))
-      /* Nope */
-      goto error;
+  if (mysql_stmt_bind_param(stmt, bind_buffers) != 0)
+    return GIT_ERROR;
 
-    myit->refnames = calloc(1, sizeof(char *) * myit->numrows);
-    if (!myit->refnames)
-      goto oom;
+  // a duplicate just gets its `created` time bumped: it's the same object
+  if (mysql_stmt_execute(stmt) != 0)
+    return GIT_ERROR;
 
-    myit->types = malloc(sizeof(unsigned char) * myit->numrows);
-    if (!myit->types)
-      goto oom;
+  if (mysql_stmt_reset(stmt) != 0)
+    return GIT_ERROR;
 
-    myit->oids = malloc(sizeof(git_oid) * myit->numrows);
-    if (!myit->oids)
-      goto oom;
+  return GIT_OK;
+}
 
-    myit->symnames = calloc(1, sizeof(char *) * myit->numrows);
-    if (!myit->symnames)
-      goto oom;
+/* Insert the odb table row of an object, and its header table row if there
+ * is a header table. For chunked objects the data is empty, and `size` is
+ * the size of the full object. */
+static int mysql_odb__write_row(mysql_odb_backend *backend, const git_oid *oid,
+        git_otype type, size_t size, const void *data, size_t data_len)
+{
+  MYSQL_BIND bind_buffers[4];
+  MYSQL_STMT *stmt = mysql_odb__shard(backend, oid)->st_write;
+  unsigned long long size_ll = size;
 
-    /* Now proceed to iterate through each row, fetching data into the
-     * allocated buffers. Unpleasent as the refname can be an arbitary
-     * length string */
+  memset(bind_buffers, 0, sizeof(bind_buffers));
 
-    memset(result_buffers, 0, sizeof(result_buffers));
+  // bind the oid
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = 20;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-    for (i = 0; i < myit->numrows; i++) {
-      size_t sym_len;
+  // bind the type
+  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
 
-      refname_len = 0;
-      result_buffers[0].buffer_type = MYSQL_TYPE_STRING;
-      result_buffers[0].buffer = NULL;
-      result_buffers[0].buffer_length = 0;
-      result_buffers[0].length = &refname_len;
+  // bind the size of the data, which may be over 4GiB for chunked objects
+  bind_buffers[2].buffer = &size_ll;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+  bind_buffers[2].is_unsigned = 1;
 
-      result_buffers[1].buffer_type = MYSQL_TYPE_TINY;
-      result_buffers[1].buffer = &myit->types[i];
-      result_buffers[1].buffer_length = 1;
-      result_buffers[1].length = &result_buffers[1].buffer_length;
-
-      result_buffers[2].buffer_type = MYSQL_TYPE_BLOB;
-      result_buffers[2].buffer = &myit->oids[i];
-      result_buffers[2].buffer_length = GIT_OID_RAWSZ;
-      memset(result_buffers[2].buffer, 0, GIT_OID_RAWSZ);
-
-      /* Request len */
-      sym_len = 0;
-      result_buffers[3].buffer_type = MYSQL_TYPE_STRING;
-      result_buffers[3].buffer = NULL;
-      result_buffers[3].buffer_length = 0;
-      result_buffers[3].length = &sym_len;
-
-      if (mysql_stmt_bind_result(myit->backend->st_iterate, result_buffers) != 0)
-        goto error;
+  // bind the data
+  bind_buffers[3].buffer = (void*)data;
+  bind_buffers[3].buffer_length = data_len;
+  bind_buffers[3].length = &bind_buffers[3].buffer_length;
+  bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
 
-      /* May legitimately return 'truncated' */
-      mysql_stmt_fetch(myit->backend->st_iterate);
+  if (mysql_stmt_bind_param(stmt, bind_buffers) != 0)
+    return GIT_ERROR;
 
-      /* Allocate an actual buffer for the refname, the size of which has now
-       * been specified by mysql */
-      if (refname_len >= ULONG_MAX - 1UL || refname_len == 0)
-        goto error;
+  /* INSERT IGNORE: an odb row that is there already, maybe without its
+   * header row (after a crash between the two), is left alone, and the
+   * header row is written regardless, so the object doesn't stay invisible
+   * for good */
+  if (mysql_stmt_execute(stmt) != 0)
+    return GIT_ERROR;
 
-      myit->refnames[i] = malloc(refname_len + 1UL);
-      if (!myit->refnames[i])
-        goto oom;
+  // reset the statement for further use
+  if (mysql_stmt_reset(stmt) != 0)
+    return GIT_ERROR;
 
-      result_buffers[0].buffer = myit->refnames[i];
-      result_buffers[0].buffer_length = refname_len;
+  /* The header row goes in last: whoever finds it can read the object */
+  if (backend->header_table)
+    return mysql_odb__write_header(backend, oid, type, size,
+             (data_len == 0 && size > 0) ? MYSQL_ODB_LOCATION_CHUNKED : MYSQL_ODB_LOCATION_INLINE);
 
-      if (mysql_stmt_fetch_column(myit->backend->st_iterate, &result_buffers[0], 0, 0) != 0)
-        goto error;
+  return GIT_OK;
+}
 
-      myit->refnames[i][refname_len] = '\0';
+/* Write data as chunks of an object, numbered from first_seq on */
+static int mysql_odb__write_chunks(mysql_odb_backend *backend,
+        const git_oid *oid, unsigned int first_seq, const void *data,
+        size_t len)
+{
+  MYSQL_BIND bind_buffers[3];
+  MYSQL_STMT *stmt = mysql_odb__shard(backend, oid)->st_write_chunk;
+  unsigned int seq;
+  size_t offset;
+  int error = GIT_OK;
 
-      /* If there's data in the symbolic refname, fetch it too; otherwise loop
-       * around again */
-      if (sym_len == 0)
-        continue;
+  memset(bind_buffers, 0, sizeof(bind_buffers));
 
-      if (sym_len >= ULONG_MAX - 1UL)
-        goto error;
+  bind_buffers[0].buffer = (void*)oid->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-      myit->symnames[i] = malloc(sym_len + 1UL);
-      if (!myit->symnames[i])
-        goto oom;
+  bind_buffers[1].buffer = &seq;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_LONG;
+  bind_buffers[1].is_unsigned = 1;
 
-      myit->symnames[i][sym_len] = '\0';
+  bind_buffers[2].length = &bind_buffers[2].buffer_length;
+  bind_buffers[2].buffer_type = MYSQL_TYPE_BLOB;
 
-      result_buffers[3].buffer = myit->symnames[i];
-      result_buffers[3].buffer_length = sym_len;
+  for (offset = 0, seq = first_seq; offset < len; offset += GIT2_ODB_CHUNK_SIZE, seq++) {
+    bind_buffers[2].buffer = (unsigned char *)data + offset;
+    bind_buffers[2].buffer_length = len - offset;
+    if (bind_buffers[2].buffer_length > GIT2_ODB_CHUNK_SIZE)
+      bind_buffers[2].buffer_length = GIT2_ODB_CHUNK_SIZE;
 
-      if (mysql_stmt_fetch_column(myit->backend->st_iterate, &result_buffers[3], 3, 0) != 0)
-        goto error;
+    if (mysql_stmt_bind_param(stmt, bind_buffers) != 0 ||
+        mysql_stmt_execute(stmt) != 0) {
+      error = GIT_ERROR;
+      break;
     }
   }
 
-  *iter = &myit->parent;
-
-  return GIT_OK;
-
-oom:
-  giterr_set_oom();
-
-error:
-  if (myit)
-    myit->parent.free(&myit->parent);
+  // the statement is shared, so it's reset even after a failure
+  if (mysql_stmt_reset(stmt) != 0)
+    error = GIT_ERROR;
 
   return error;
 }
 
-static int mysql_refdb_backend__delete(git_refdb_backend *_backend,
-        const char *ref_name)
+/* Run one of the chunk statements taking a list of oids as parameters */
+static int mysql_odb__chunks_stmt(MYSQL_STMT *stmt, const git_oid *first,
+        const git_oid *second)
 {
-  MYSQL_BIND bind_buffers[1];
-  mysql_refdb_backend *backend;
+  MYSQL_BIND bind_buffers[2];
   int error;
 
-  assert(_backend && ref_name);
-
-  backend = (mysql_refdb_backend*)_backend;
-
   memset(bind_buffers, 0, sizeof(bind_buffers));
 
-  /* Pretty straightforward procedure: bind reference name to delete query,
-   * and execute. Return an error if the reference did not exist. */
-  bind_buffers[0].buffer = (void*)ref_name;
-  bind_buffers[0].buffer_length = strlen(ref_name);
+  bind_buffers[0].buffer = (void*)first->id;
+  bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
   bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
-  if (mysql_stmt_bind_param(backend->st_delete, bind_buffers) != 0)
-    return GIT_ERROR;
-
-  /* execute the statement */
-  if (mysql_stmt_execute(backend->st_delete) != 0)
-    return GIT_ERROR;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
 
-  if (mysql_affected_rows(backend->db) == 0) {
-    error = GIT_ENOTFOUND;
-  } else {
-    /* XXX -- diagnostic if an unexpected number of rows are delete would be
-     * nice */
-    error = GIT_OK;
+  if (second) {
+    bind_buffers[1].buffer = (void*)second->id;
+    bind_buffers[1].buffer_length = GIT_OID_RAWSZ;
+    bind_buffers[1].length = &bind_buffers[1].buffer_length;
+    bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
   }
 
-  /* reset the statement for further use */
-  if (mysql_stmt_reset(backend->st_delete) != 0)
-    return GIT_ERROR;
+  error = GIT_OK;
+  if (mysql_stmt_bind_param(stmt, bind_buffers) != 0 ||
+      mysql_stmt_execute(stmt) != 0)
+    error = GIT_ERROR;
+
+  if (mysql_stmt_reset(stmt) != 0)
+    error = GIT_ERROR;
 
   return error;
 }
 
-static int mysql_refdb_backend__write(git_refdb_backend *_backend,
-        const git_reference *ref, int force)
+/* Store an object whose oid is already known, chunking it if need be. The
+ * chunks go in before the odb row, so that anyone who can see the row can
+ * also see all of its data. */
+static int mysql_odb__write_object(mysql_odb_backend *backend,
+        const git_oid *oid, const void *data, size_t len, git_otype type)
 {
-  mysql_refdb_backend *backend;
   int error;
-  int does_it_exist = 0;
-  MYSQL_BIND bind_buffers[4];
-  const char *refname, *symname;
-  const git_oid *oid;
-  unsigned char type;
-
-  assert(_backend && ref);
-
-  backend = (mysql_refdb_backend *)_backend;
-  error = GIT_ERROR;
-  refname = git_reference_name(ref);
-  oid = git_reference_target(ref);
-  type = git_reference_type(ref);
-  symname = git_reference_symbolic_target(ref);
 
-  /* Procedure: we have a reference to write, which may or may not already exist
-   * in the database. Look it up to determine if it does. If it does, only
-   * overwrite if the force flag is given (by deleting it first). Finally, to
-   * actually write, bind and execute a query. */
+  if (!backend->chunked_storage || len <= GIT2_ODB_CHUNK_THRESHOLD)
+    return mysql_odb__write_row(backend, oid, type, len, data, len);
 
-  /* First: does it already exist? */
-  error = mysql_refdb_backend__exists(&does_it_exist, _backend, refname);
+  error = mysql_odb__write_chunks(backend, oid, 0, data, len);
   if (error != GIT_OK)
     return error;
 
-  if (does_it_exist) {
-    if (force == 0) {
-      return GIT_EEXISTS;
-    }
-
-    /* The reference exists, but we're force writing it. Delete it first. */
-    error = mysql_refdb_backend__delete(_backend, refname);
-    if (error != GIT_OK)
-      return error;
-  }
+  return mysql_odb__write_row(backend, oid, type, len, "", 0);
+}
 
-  /* Now proceed to actually writing to the desired reference */
+static int mysql_odb_backend__write(git_oid *oid, git_odb_backend *_backend, const void *data, size_t len, git_otype type)
+{
+  int error;
+  mysql_odb_backend *backend;
 
-  memset(bind_buffers, 0, sizeof(bind_buffers));
+  assert(oid && _backend && data);
 
-  /* bind the refname passed to the statement */
-  bind_buffers[0].buffer = (void*)refname;
-  bind_buffers[0].buffer_length = strlen(refname);
-  bind_buffers[0].length = &bind_buffers[0].buffer_length;
-  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+  backend = (mysql_odb_backend *)_backend;
 
-  /* Reference type */
-  bind_buffers[1].buffer = &type;
-  bind_buffers[1].buffer_length = 1;
-  bind_buffers[1].length = &bind_buffers[1].buffer_length;
-  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+  if ((error = git_odb_hash(oid, data, len, type)) < 0)
+    return error;
 
-  /* Bind the target OID in too, if it exists */
-  bind_buffers[2].buffer = (oid) ? (void*)oid->id : NULL;
-  bind_buffers[2].buffer_length = GIT_OID_RAWSZ ;
-  bind_buffers[2].length = &bind_buffers[2].buffer_length;
-  bind_buffers[2].buffer_type = (oid) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_NULL;
+  return mysql_odb__write_object(backend, oid, data, len, type);
+}
 
-  /* And possibly the symbolic name too */
-  bind_buffers[3].buffer = (void *)symname;
-  bind_buffers[3].buffer_length = GIT_OID_RAWSZ ;
-  bind_buffers[3].length = &bind_buffers[3].buffer_length;
-  bind_buffers[3].buffer_type = (symname) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_NULL;
+static int mysql_odb_stream__read(git_odb_stream *_stream, char *buffer,
+        size_t len)
+{
+  mysql_odb_stream *stream;
+  mysql_odb_backend *backend;
+  unsigned long data_len;
+  size_t chunk_len;
+  int error;
 
-  if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0)
-    return GIT_ERROR;
+  stream = (mysql_odb_stream *)_stream;
+  backend = (mysql_odb_backend *)stream->parent.backend;
 
-  // execute the statement
-  if (mysql_stmt_execute(backend->st_write) != 0)
-    return GIT_ERROR;
+  if (stream->buffer_pos == stream->buffer_len) {
+    if (!stream->chunked || stream->done == stream->size)
+      return 0;
 
-  if (mysql_affected_rows(backend->db) != 1) {
-    /* Something bad happened. Error reporting (to stderr) would be nice,
-     * however not now XXX */
-    error = GIT_ERROR;
-  } else {
-    error = GIT_OK;
-  }
+    /* Refill the buffer with the next chunk */
+    error = mysql_odb__fetch_chunk(backend, stream->conn, &stream->oid,
+              stream->seq++, &data_len);
+    if (error != GIT_OK)
+      return error;
 
-  /* reset the statement for further use */
-  if (mysql_stmt_reset(backend->st_write) != 0)
-    return GIT_ERROR;
+    chunk_len = mysql_odb__uncompressed_len(backend->scratch, data_len);
+    if (chunk_len == 0 || chunk_len > stream->size - stream->done) {
+      giterr_set_str(GITERR_ODB, "MySQL odb contains a corrupt object chunk");
+      return GIT_ERROR;
+    }
 
-  return error;
-}
+    if (chunk_len > stream->buffer_size) {
+      unsigned char *buf = realloc(stream->buffer, chunk_len);
+      if (buf == NULL) {
+        giterr_set_oom();
+        return GIT_ERROR;
+      }
 
-static void mysql_refdb_backend__free(git_refdb_backend *_backend)
-{
-  mysql_refdb_backend *backend;
+      stream->buffer = buf;
+      stream->buffer_size = chunk_len;
+    }
 
-  assert(_backend);
+    if (mysql_odb__uncompress(stream->buffer, chunk_len, backend->scratch, data_len) != GIT_OK) {
+      giterr_set_str(GITERR_ODB, "MySQL odb contains a corrupt object chunk");
+      return GIT_ERROR;
+    }
 
-  backend = (mysql_refdb_backend *)_backend;
+    stream->buffer_len = chunk_len;
+    stream->buffer_pos = 0;
+  }
 
-  if (backend->st_lookup)
-    mysql_stmt_close(backend->st_lookup);
-  if (backend->st_write)
-    mysql_stmt_close(backend->st_write);
-  if (backend->st_delete)
-    mysql_stmt_close(backend->st_delete);
-  if (backend->st_iterate)
-    mysql_stmt_close(backend->st_iterate);
+  if (len > stream->buffer_len - stream->buffer_pos)
+    len = stream->buffer_len - stream->buffer_pos;
 
-  mysql_close(backend->db);
+  memcpy(buffer, stream->buffer + stream->buffer_pos, len);
+  stream->buffer_pos += len;
+  stream->done += len;
 
-  free(backend);
+  return (int)len;
 }
 
-static int create_table(MYSQL *db)
+static int mysql_odb_stream__write(git_odb_stream *_stream, const char *data,
+        size_t len)
 {
-  static const char *sql_create_odb =
-    "CREATE TABLE `" GIT2_ODB_TABLE_NAME "` ("
-    "  `oid` binary(20) NOT NULL DEFAULT '',"
-    "  `type` tinyint(1) unsigned NOT NULL,"
-    "  `size` bigint(20) unsigned NOT NULL,"
-    "  `data` longblob NOT NULL,"
-    "  PRIMARY KEY (`oid`),"
-    "  KEY `type` (`type`),"
-    "  KEY `size` (`size`)"
-    ") ENGINE=" GIT2_ODB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
-  static const char *sql_create_refdb =
-    "CREATE TABLE `" GIT2_REFDB_TABLE_NAME "` ("
-    "  `refname` text COLLATE utf8_bin NOT NULL, "
-    "  `type` tinyint(1) unsigned NOT NULL,"
-    "  `oid` binary(20), "
-    "  `symref` TEXT COLLATE utf8_bin, "
-    "  KEY `name` (`refname`(32)) "
-    ") ENGINE=" GIT2_REFDB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  mysql_odb_stream *stream;
+  mysql_odb_backend *backend;
+  size_t n;
+  int error;
 
-  if (mysql_real_query(db, sql_create_odb, strlen(sql_create_odb)) != 0)
+  stream = (mysql_odb_stream *)_stream;
+  backend = (mysql_odb_backend *)stream->parent.backend;
+
+  if (len > stream->size - stream->done) {
+    giterr_set_str(GITERR_ODB, "MySQL odb stream written past its declared size");
     return GIT_ERROR;
+  }
 
-  if (mysql_real_query(db, sql_create_refdb, strlen(sql_create_refdb)) != 0)
+  if (EVP_DigestUpdate(stream->sha, data, len) != 1) {
+    giterr_set_str(GITERR_ODB, "MySQL odb failed to hash a streamed object");
     return GIT_ERROR;
+  }
+  stream->done += len;
+
+  while (len > 0) {
+    n = stream->buffer_size - stream->buffer_len;
+    if (n > len)
+      n = len;
+
+    memcpy(stream->buffer + stream->buffer_len, data, n);
+    stream->buffer_len += n;
+    data += n;
+    len -= n;
+
+    /* Ship every full chunk straight away, so we only ever hold one */
+    if (stream->chunked && stream->buffer_len == stream->buffer_size) {
+      error = mysql_odb__write_chunks(backend, &stream->oid, stream->seq++,
+                stream->buffer, stream->buffer_len);
+      if (error != GIT_OK)
+        return error;
+
+      stream->buffer_len = 0;
+    }
+  }
 
   return GIT_OK;
 }
 
-static int check_table_present(MYSQL *db, const char *query)
+/* Move the chunks of a write stream from its temporary id to its real one.
+ * That's a single UPDATE, unless the two ids belong to different shards, in
+ * which case the chunks are copied over one by one. */
+static int mysql_odb__move_chunks(mysql_odb_backend *backend,
+        mysql_odb_stream *stream, const git_oid *oid)
 {
-  MYSQL_RES *res;
-  int error;
-  my_ulonglong num_rows;
+  mysql_odb_conn *from, *to;
+  unsigned char *buffer;
+  unsigned long data_len;
+  unsigned int seq;
+  size_t chunk_len;
+  int error = GIT_OK;
 
-  if (mysql_real_query(db, query, strlen(query)) != 0)
-    return GIT_ERROR;
+  from = mysql_odb__shard(backend, &stream->oid);
+  to = mysql_odb__shard(backend, oid);
 
-  res = mysql_store_result(db);
-  if (res == NULL)
+  if (from == to)
+    return mysql_odb__chunks_stmt(to->st_rename_chunks, oid, &stream->oid);
+
+  buffer = malloc(GIT2_ODB_CHUNK_SIZE);
+  if (buffer == NULL) {
+    giterr_set_oom();
     return GIT_ERROR;
+  }
 
-  num_rows = mysql_num_rows(res);
-  if (num_rows == 0) {
-    /* the table was not found */
-    error = GIT_ENOTFOUND;
-  } else if (num_rows > 0) {
-    /* the table was found */
-    error = GIT_OK;
-  } else {
-    error = GIT_ERROR;
+  for (seq = 0; seq < stream->seq && error == GIT_OK; seq++) {
+    error = mysql_odb__fetch_chunk(backend, from, &stream->oid, seq, &data_len);
+    if (error != GIT_OK)
+      break;
+
+    chunk_len = mysql_odb__uncompressed_len(backend->scratch, data_len);
+    if (chunk_len == 0 || chunk_len > GIT2_ODB_CHUNK_SIZE ||
+        mysql_odb__uncompress(buffer, chunk_len, backend->scratch, data_len) != GIT_OK) {
+      giterr_set_str(GITERR_ODB, "MySQL odb contains a corrupt object chunk");
+      error = GIT_ERROR;
+      break;
+    }
+
+    error = mysql_odb__write_chunks(backend, oid, seq, buffer, chunk_len);
   }
 
-  mysql_free_result(res);
+  free(buffer);
+
+  if (error == GIT_OK)
+    error = mysql_odb__chunks_stmt(from->st_delete_chunks, &stream->oid, NULL);
+
   return error;
 }
 
-static int check_db_present(MYSQL *db)
+static int mysql_odb_stream__finalize_write(git_oid *oid_p,
+        git_odb_stream *_stream)
 {
-  static const char *sql_check_odb =
-    "SHOW TABLES LIKE '" GIT2_ODB_TABLE_NAME "';";
-  static const char *sql_check_refdb =
-    "SHOW TABLES LIKE '" GIT2_REFDB_TABLE_NAME "';";
+  mysql_odb_stream *stream;
+  mysql_odb_backend *backend;
   int error;
 
-  error = check_table_present(db, sql_check_odb);
+  stream = (mysql_odb_stream *)_stream;
+  backend = (mysql_odb_backend *)stream->parent.backend;
+
+  if (stream->done != stream->size) {
+    giterr_set_str(GITERR_ODB, "MySQL odb stream finalized before its declared size");
+    return GIT_ERROR;
+  }
+
+  if (EVP_DigestFinal_ex(stream->sha, oid_p->id, NULL) != 1) {
+    giterr_set_str(GITERR_ODB, "MySQL odb failed to hash a streamed object");
+    return GIT_ERROR;
+  }
+
+  /* Someone else may have stored the object in the meantime, in which case
+   * ours is surplus, bar freshening theirs; free() drops any temporary
+   * chunks */
+  if (mysql_odb__exists(mysql_odb__shard(backend, oid_p), oid_p) == 1)
+    return mysql_odb__freshen(backend, oid_p, 1);
+
+  if (!stream->chunked) {
+    error = mysql_odb__write_object(backend, oid_p, stream->buffer,
+              stream->size, stream->type);
+    if (error == GIT_OK)
+      stream->finalized = 1;
+    return error;
+  }
+
+  if (stream->buffer_len > 0) {
+    error = mysql_odb__write_chunks(backend, &stream->oid, stream->seq++,
+              stream->buffer, stream->buffer_len);
+    if (error != GIT_OK)
+      return error;
+
+    stream->buffer_len = 0;
+  }
+
+  /* The chunks were written under a temporary id, as the real one wasn't
+   * known yet. Move them over. */
+  error = mysql_odb__move_chunks(backend, stream, oid_p);
   if (error != GIT_OK)
     return error;
 
-  error = check_table_present(db, sql_check_refdb);
-  return error;
+  stream->finalized = 1;
+
+  return mysql_odb__write_row(backend, oid_p, stream->type, stream->size, "", 0);
 }
 
-static int init_odb_statements(mysql_odb_backend *backend)
+static void mysql_odb_stream__free(git_odb_stream *_stream)
 {
-  my_bool truth = 1;
+  mysql_odb_stream *stream;
+  mysql_odb_backend *backend;
 
-  static const char *sql_read =
-    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `" GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+  stream = (mysql_odb_stream *)_stream;
+  backend = (mysql_odb_backend *)stream->parent.backend;
 
-  static const char *sql_read_header =
-    "SELECT `type`, `size` FROM `" GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+  /* Drop the chunks of an abandoned (or redundant) chunked write */
+  if (stream->chunked && (stream->parent.mode & GIT_STREAM_WRONLY) &&
+      !stream->finalized)
+    mysql_odb__chunks_stmt(mysql_odb__shard(backend, &stream->oid)->st_delete_chunks,
+        &stream->oid, NULL);
 
-  static const char *sql_read_prefix =
-    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `" GIT2_ODB_TABLE_NAME "` WHERE oid LIKE CONCAT(?, '%');";
+  EVP_MD_CTX_free(stream->sha);
+  free(stream->buffer);
+  free(stream);
+}
 
-  static const char *sql_write =
-    "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME "` VALUES (?, ?, ?, COMPRESS(?));";
+static int mysql_odb_backend__readstream(git_odb_stream **stream_out,
+        git_odb_backend *_backend, const git_oid *oid)
+{
+  mysql_odb_backend *backend;
+  mysql_odb_stream *stream;
+  mysql_odb_conn *conn, *replica;
+  void *data = NULL;
+  int error;
+
+  assert(stream_out && _backend && oid);
+
+  backend = (mysql_odb_backend *)_backend;
+
+  stream = calloc(1, sizeof(mysql_odb_stream));
+  if (stream == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  /* Packed objects are read whole; libgit2 has to resolve their deltas in
+   * memory anyway */
+  if (backend->packs && mysql_odb__read_packed(backend, NULL, &data,
+        &stream->size, &stream->type, oid, GIT_OID_HEXSZ) == GIT_OK) {
+    conn = NULL;
+    stream->buffer = data;
+    stream->buffer_size = stream->buffer_len = stream->size;
+    goto ready;
+  }
+
+  /* An object read whole may come from a replica, falling back to the
+   * primary as read does. Chunked objects are streamed from the primary:
+   * chunks are stored before their odb row there, but a lagging replica can
+   * have the row without all of its chunks yet. */
+  conn = mysql_odb__shard(backend, oid);
+  replica = mysql_odb__pick_replica(backend, conn);
+  if (replica && mysql_odb__read_header(replica, &stream->size,
+                   &stream->type, oid) == GIT_OK &&
+      (!backend->chunked_storage || stream->size <= GIT2_ODB_CHUNK_THRESHOLD) &&
+      mysql_odb__read(backend, replica, &data, &stream->size,
+        &stream->type, oid) == GIT_OK) {
+    conn = replica;
+    stream->buffer = data;
+    stream->buffer_size = stream->buffer_len = stream->size;
+    goto ready;
+  }
+
+  error = mysql_odb__read_header(conn, &stream->size, &stream->type, oid);
+  if (error != GIT_OK)
+    goto bad;
+
+  if (!backend->chunked_storage || stream->size <= GIT2_ODB_CHUNK_THRESHOLD) {
+    /* Small enough to just read in one go and hand out piecemeal */
+    error = mysql_odb__read(backend, conn, &data, &stream->size,
+              &stream->type, oid);
+    if (error != GIT_OK)
+      goto bad;
 
+    stream->buffer = data;
+    stream->buffer_size = stream->buffer_len = stream->size;
+  } else {
+    stream->chunked = 1;
+  }
+
+ready:
+  git_oid_cpy(&stream->oid, oid);
+  stream->conn = conn;
+  stream->parent.backend = _backend;
+  stream->parent.mode = GIT_STREAM_RDONLY;
+  stream->parent.read = &mysql_odb_stream__read;
+  stream->parent.free = &mysql_odb_stream__free;
+
+  *stream_out = &stream->parent;
+  return GIT_OK;
+
+bad:
+  free(stream);
+  return error;
+}
+
+static int mysql_odb_backend__writestream(git_odb_stream **stream_out,
+        git_odb_backend *_backend, size_t size, git_otype type)
+{
+  mysql_odb_backend *backend;
+  mysql_odb_stream *stream;
+  char header[64];
+  int header_len, fd;
 
-  backend->st_read = mysql_stmt_init(backend->db);
-  if (backend->st_read == NULL)
+  assert(stream_out && _backend);
+
+  backend = (mysql_odb_backend *)_backend;
+
+  stream = calloc(1, sizeof(mysql_odb_stream));
+  if (stream == NULL) {
+    giterr_set_oom();
     return GIT_ERROR;
+  }
+
+  stream->type = type;
+  stream->size = size;
+  stream->chunked = backend->chunked_storage && size > GIT2_ODB_CHUNK_THRESHOLD;
+
+  /* Small objects are gathered up and written in one go at the end; big
+   * ones go out a chunk at a time under a random temporary id */
+  stream->buffer_size = (stream->chunked) ? GIT2_ODB_CHUNK_SIZE : size;
+  stream->buffer = malloc(stream->buffer_size + 1);
+  if (stream->buffer == NULL) {
+    giterr_set_oom();
+    goto bad;
+  }
+
+  if (stream->chunked) {
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, stream->oid.id, GIT_OID_RAWSZ) != GIT_OID_RAWSZ) {
+      giterr_set_str(GITERR_OS, "MySQL odb couldn't generate a temporary object id");
+      if (fd >= 0)
+        close(fd);
+      goto bad;
+    }
+    close(fd);
+  }
+
+  /* Objects are hashed along with a "<type> <size>\0" header */
+  header_len = snprintf(header, sizeof(header), "%s %lu",
+                 git_object_type2string(type), (unsigned long)size);
+  stream->sha = EVP_MD_CTX_new();
+  if (stream->sha == NULL ||
+      EVP_DigestInit_ex(stream->sha, EVP_sha1(), NULL) != 1 ||
+      EVP_DigestUpdate(stream->sha, header, header_len + 1) != 1) {
+    giterr_set_str(GITERR_ODB, "MySQL odb failed to start hashing a streamed object");
+    goto bad;
+  }
+
+  stream->parent.backend = _backend;
+  stream->parent.mode = GIT_STREAM_WRONLY;
+  stream->parent.write = &mysql_odb_stream__write;
+  stream->parent.finalize_write = &mysql_odb_stream__finalize_write;
+  stream->parent.free = &mysql_odb_stream__free;
+
+  *stream_out = &stream->parent;
+  return GIT_OK;
+
+bad:
+  EVP_MD_CTX_free(stream->sha);
+  free(stream->buffer);
+  free(stream);
+  return GIT_ERROR;
+}
+
+/* Start indexing the pack in a fresh directory under parent_dir, feeding
+ * the indexer whatever was held in memory so far */
+static int mysql_odb__writepack_start(mysql_odb_writepack *wp,
+        const char *parent_dir, git_transfer_progress *stats)
+{
+  int error;
+
+  if (parent_dir == NULL)
+    parent_dir = "/tmp";
 
-  if (mysql_stmt_attr_set(backend->st_read, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+  if ((size_t)snprintf(wp->dir_path, sizeof(wp->dir_path), "%s/tmp.XXXXXX",
+        parent_dir) >= sizeof(wp->dir_path) || mkdtemp(wp->dir_path) == NULL) {
+    giterr_set_str(GITERR_OS, "MySQL odb failed to create a pack staging directory");
+    wp->dir_path[0] = '\0';
     return GIT_ERROR;
+  }
+
+  error = git_indexer_stream_new(&wp->indexer, wp->dir_path, wp->progress_cb,
+            wp->progress_payload);
+  if (error != GIT_OK) {
+    wp->indexer = NULL;
+    rmdir(wp->dir_path);
+    wp->dir_path[0] = '\0';
+    return error;
+  }
+
+  if (wp->staged_len > 0)
+    error = git_indexer_stream_add(wp->indexer, wp->staged, wp->staged_len, stats);
+
+  free(wp->staged);
+  wp->staged = NULL;
+  wp->staged_len = 0;
+  wp->staged_alloc = 0;
+  return error;
+}
+
+static int mysql_odb_backend__pack_add(git_odb_writepack *_wp,
+	const void *data, size_t size, git_transfer_progress *stats)
+{
+  mysql_odb_writepack *wp;
+  mysql_odb_backend *backend;
+  unsigned char *staged;
+  int error;
+
+  wp = (mysql_odb_writepack*)_wp;
+  backend = (mysql_odb_backend *)wp->parent.backend;
+
+  if (wp->indexer)
+    return git_indexer_stream_add(wp->indexer, data, size, stats);
+
+  if (wp->staged_len + size <= backend->staging_limit) {
+    if (wp->staged_len + size > wp->staged_alloc) {
+      size_t new_alloc = (wp->staged_alloc) ? wp->staged_alloc * 2 : 64 * 1024;
+      while (new_alloc < wp->staged_len + size)
+        new_alloc *= 2;
+      if (new_alloc > backend->staging_limit)
+        new_alloc = backend->staging_limit;
+
+      staged = realloc(wp->staged, new_alloc);
+      if (staged == NULL) {
+        giterr_set_oom();
+        return GIT_ERROR;
+      }
+      wp->staged = staged;
+      wp->staged_alloc = new_alloc;
+    }
+
+    memcpy(wp->staged + wp->staged_len, data, size);
+    wp->staged_len += size;
+    return GIT_OK;
+  }
+
+  /* Too big to keep in memory: spill what we have to disk, and index
+   * the rest as it arrives */
+  error = mysql_odb__writepack_start(wp, backend->staging_spill_dir, stats);
+  if (error != GIT_OK)
+    return error;
+
+  return git_indexer_stream_add(wp->indexer, data, size, stats);
+}
+
+static int collect_packfile_oid(const git_oid *id, void *payload)
+{
+  mysql_odb_writepack *wp;
+
+  wp = (mysql_odb_writepack*)payload;
+
+  if (wp->oid_count == wp->oid_alloc) {
+    size_t new_alloc = (wp->oid_alloc) ? wp->oid_alloc * 2 : 1024;
+    git_oid *oids = realloc(wp->oids, new_alloc * sizeof(git_oid));
+    if (oids == NULL) {
+      giterr_set_oom();
+      return GIT_ERROR;
+    }
 
-  if (mysql_stmt_prepare(backend->st_read, sql_read, strlen(sql_read)) != 0)
+    wp->oids = oids;
+    wp->oid_alloc = new_alloc;
+  }
+
+  git_oid_cpy(&wp->oids[wp->oid_count++], id);
+  return GIT_OK;
+}
+
+static int oid_cmp(const void *a, const void *b)
+{
+  return git_oid_cmp((const git_oid *)a, (const git_oid *)b);
+}
+
+/* Work out which of the sorted oids the database already has, asking for
+ * MYSQL_ODB_EXISTS_BATCH of them per query. A short last batch is padded
+ * out by repeating its final oid, which IN () doesn't mind. Sorting keeps
+ * the oids of each shard together; a batch never spans two shards. */
+static int mysql_odb__mark_present(mysql_odb_backend *backend,
+        const git_oid *oids, size_t count, unsigned char *present)
+{
+  MYSQL_STMT *stmt;
+  MYSQL_BIND *bind_buffers;
+  MYSQL_BIND result_buffers[1];
+  git_oid found, *fresh;
+  const git_oid *match;
+  size_t start, n, i;
+  int error = GIT_OK;
+
+  bind_buffers = calloc(MYSQL_ODB_EXISTS_BATCH, sizeof(MYSQL_BIND));
+  if (bind_buffers == NULL) {
+    giterr_set_oom();
     return GIT_ERROR;
+  }
+
+  memset(result_buffers, 0, sizeof(result_buffers));
+  result_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+  result_buffers[0].buffer = found.id;
+  result_buffers[0].buffer_length = GIT_OID_RAWSZ;
+
+  for (start = 0; start < count && error == GIT_OK; start += n) {
+    stmt = mysql_odb__shard(backend, &oids[start])->st_exists_batch;
+
+    for (n = 1; n < MYSQL_ODB_EXISTS_BATCH && start + n < count; n++) {
+      if (backend->route[oids[start + n].id[0]] != backend->route[oids[start].id[0]])
+        break;
+    }
 
+    for (i = 0; i < MYSQL_ODB_EXISTS_BATCH; i++) {
+      const git_oid *oid = &oids[start + ((i < n) ? i : n - 1)];
 
-  backend->st_read_header = mysql_stmt_init(backend->db);
-  if (backend->st_read_header == NULL)
+      bind_buffers[i].buffer = (void*)oid->id;
+      bind_buffers[i].buffer_length = GIT_OID_RAWSZ;
+      bind_buffers[i].length = &bind_buffers[i].buffer_length;
+      bind_buffers[i].buffer_type = MYSQL_TYPE_BLOB;
+    }
+
+    if (mysql_stmt_bind_param(stmt, bind_buffers) != 0 ||
+        mysql_stmt_execute(stmt) != 0 ||
+        mysql_stmt_store_result(stmt) != 0 ||
+        mysql_stmt_bind_result(stmt, result_buffers) != 0) {
+      error = GIT_ERROR;
+      break;
+    }
+
+    while (mysql_stmt_fetch(stmt) == 0) {
+      match = bsearch(&found, &oids[start], n, sizeof(git_oid), oid_cmp);
+      if (match)
+        present[match - oids] = 1;
+    }
+
+    if (mysql_stmt_reset(stmt) != 0)
+      error = GIT_ERROR;
+  }
+
+  free(bind_buffers);
+
+  /* The pack is going to refer to whatever it didn't need to bring along */
+  if (error == GIT_OK && backend->header_table) {
+    fresh = malloc(count * sizeof(git_oid));
+    if (fresh == NULL) {
+      giterr_set_oom();
+      return GIT_ERROR;
+    }
+
+    for (i = 0, n = 0; i < count; i++) {
+      if (present[i])
+        git_oid_cpy(&fresh[n++], &oids[i]);
+    }
+
+    error = mysql_odb__freshen(backend, fresh, n);
+    free(fresh);
+  }
+
+  return error;
+}
+
+/* Wait for the insert in flight on a shard, if any, to finish */
+static int mysql_odb__batch_wait(mysql_odb_backend *backend,
+        mysql_odb_writepack *wp, size_t shard)
+{
+  MYSQL *db = backend->shards[shard]->db;
+
+  if (!wp->batches[shard].in_flight)
+    return GIT_OK;
+
+  wp->batches[shard].in_flight = 0;
+  if (mysql_read_query_result(db) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_error(db));
     return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+/* Send the rows pending for a shard. The server inserts them while the next
+ * batch is being extracted from the pack and compressed. */
+static int mysql_odb__batch_send(mysql_odb_backend *backend,
+        mysql_odb_writepack *wp, size_t shard)
+{
+  mysql_odb_insert_batch *batch = &wp->batches[shard];
+  MYSQL *db = backend->shards[shard]->db;
+  int error;
 
-  if (mysql_stmt_attr_set(backend->st_read_header, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+  if (batch->rows == 0)
+    return GIT_OK;
+
+  error = mysql_odb__batch_wait(backend, wp, shard);
+  if (error != GIT_OK)
+    return error;
+
+  if (mysql_send_query(db, batch->sql, batch->len) != 0) {
+    giterr_set_str(GITERR_ODB, mysql_error(db));
     return GIT_ERROR;
+  }
+
+  batch->in_flight = 1;
+  batch->len = 0;
+  batch->rows = 0;
+  return GIT_OK;
+}
+
+static int mysql_odb__batch_add(mysql_odb_backend *backend,
+        mysql_odb_writepack *wp, size_t shard, const git_oid *id,
+        git_otype type, const void *data, size_t size)
+{
+  static const char sql_head[] = "INSERT IGNORE INTO `xyzzy` VALUES ";
+  static const char hex_digits[] = "0123456789abcdef";
+  mysql_odb_insert_batch *batch = &wp->batches[shard];
+  char hex[GIT_OID_HEXSZ + 1];
+  unsigned char *zbuf;
+  uLongf zlen = 0, i;
+  size_t need;
+  char *sql;
+
+  /* Compress client side, in the format of MySQL's COMPRESS(): the length,
+   * four bytes little endian, then the zlib stream. Empty stays empty. */
+  if (size > 0) {
+    need = compressBound(size) + 4;
+    if (need > wp->zbuf_size) {
+      zbuf = realloc(wp->zbuf, need);
+      if (zbuf == NULL) {
+        giterr_set_oom();
+        return GIT_ERROR;
+      }
+      wp->zbuf = zbuf;
+      wp->zbuf_size = need;
+    }
+
+    zlen = wp->zbuf_size - 4;
+    if (compress(wp->zbuf + 4, &zlen, data, size) != Z_OK) {
+      giterr_set_str(GITERR_ZLIB, "MySQL odb failed to compress an object");
+      return GIT_ERROR;
+    }
+
+    wp->zbuf[0] = size & 0xff;
+    wp->zbuf[1] = (size >> 8) & 0xff;
+    wp->zbuf[2] = (size >> 16) & 0xff;
+    wp->zbuf[3] = (size >> 24) & 0x3f;
+    zlen += 4;
+  }
+
+  // the data goes in as a hex literal, twice its size
+  need = sizeof(sql_head) + GIT_OID_HEXSZ + 2 * zlen + 64;
+  if (batch->len + need > batch->alloc) {
+    sql = realloc(batch->sql, batch->len + need + batch->alloc);
+    if (sql == NULL) {
+      giterr_set_oom();
+      return GIT_ERROR;
+    }
+    batch->sql = sql;
+    batch->alloc += batch->len + need;
+  }
+
+  if (batch->rows == 0) {
+    memcpy(batch->sql, sql_head, sizeof(sql_head) - 1);
+    batch->len = sizeof(sql_head) - 1;
+  } else {
+    batch->sql[batch->len++] = ',';
+  }
+
+  git_oid_fmt(hex, id);
+  hex[GIT_OID_HEXSZ] = '\0'; /* fmt does not set a terminator */
+
+  /* A hex literal is binary whatever the connection's character set, and
+   * needs no escaping, so sql_mode can't change its meaning either */
+  batch->len += sprintf(batch->sql + batch->len, "(X'%s', %d, %lu, X'",
+                  hex, (int)type, (unsigned long)size);
+  for (i = 0; i < zlen; i++) {
+    batch->sql[batch->len++] = hex_digits[wp->zbuf[i] >> 4];
+    batch->sql[batch->len++] = hex_digits[wp->zbuf[i] & 0xf];
+  }
+  batch->sql[batch->len++] = '\'';
+  batch->sql[batch->len++] = ')';
+  batch->rows++;
+
+  if (batch->len >= MYSQL_ODB_INSERT_BATCH_BYTES)
+    return mysql_odb__batch_send(backend, wp, shard);
+
+  return GIT_OK;
+}
+
+static int add_each_packfile_obj(const git_oid *id, void *payload)
+{
+  mysql_odb_writepack *wp;
+  mysql_odb_backend *backend;
+  git_odb_object *object = NULL;
+  const void *data;
+  size_t size, shard;
+  int error = GIT_ERROR;
+  git_otype obj_type;
+
+  wp = (mysql_odb_writepack*)payload;
+  backend = (mysql_odb_backend *)wp->parent.backend;
+
+  error = git_odb_read(&object, wp->odb, id);
+  if (error != GIT_OK)
+    return error;
+
+  data = git_odb_object_data(object);
+  size = git_odb_object_size(object);
+  obj_type = git_odb_object_type(object);
+  shard = backend->route[id->id[0]];
+
+  /* Big objects can't go through the temporary table without blowing
+   * max_allowed_packet, so chunk them straight into place. That's outside
+   * the atomic merge below, but harmless: nothing refers to them yet. The
+   * connection has to be done with any insert first. */
+  if (backend->chunked_storage && size > GIT2_ODB_CHUNK_THRESHOLD) {
+    error = mysql_odb__batch_wait(backend, wp, shard);
+    if (error == GIT_OK && mysql_odb__exists(backend->shards[shard], id) != 1)
+      error = mysql_odb__write_object(backend, id, data, size, obj_type);
+
+    git_odb_object_free(object);
+    return error;
+  }
+
+  error = mysql_odb__batch_add(backend, wp, shard, id, obj_type, data, size);
+  git_odb_object_free(object);
+  return error;
+}
+
+/* Run a statement without a result set on each shard flagged in `which`,
+ * sending it to all of them before waiting on any */
+static int mysql_odb__shards_query(mysql_odb_backend *backend,
+        const unsigned char *which, const char *sql)
+{
+  unsigned char sent[256];
+  size_t i;
+  int error = GIT_OK;
+
+  for (i = 0; i < backend->shard_count; i++) {
+    sent[i] = 0;
+    if (!which[i])
+      continue;
+
+    if (mysql_send_query(backend->shards[i]->db, sql, strlen(sql)) == 0)
+      sent[i] = 1;
+    else
+      error = GIT_ERROR;
+  }
+
+  // always collect every answer, or the connections get out of step
+  for (i = 0; i < backend->shard_count; i++) {
+    if (sent[i] && mysql_read_query_result(backend->shards[i]->db) != 0)
+      error = GIT_ERROR;
+  }
+
+  return error;
+}
+
+static void mysql_odb__drop_temp_tables(mysql_odb_backend *backend,
+        mysql_odb_writepack *wp)
+{
+  size_t i;
+
+  if (wp->batches == NULL || wp->temp_tables == NULL)
+    return;
+
+  // collect the answer to any insert that went out before things failed
+  for (i = 0; i < backend->shard_count; i++)
+    mysql_odb__batch_wait(backend, wp, i);
+
+  mysql_odb__shards_query(backend, wp->temp_tables, "DROP TABLE IF EXISTS `xyzzy`;");
+}
+
+static int mysql_odb_backend__pack_commit(git_odb_writepack *_wp,
+	git_transfer_progress *stats)
+{
+  /* Existing path + "pack-" + oid + ".idx" or ".pack" broadly */
+  char idx_path_buffer[PATH_MAX + GIT_OID_HEXSZ + 16];
+  char idx_oid_buffer[GIT_OID_HEXSZ + 1];
+  mysql_odb_writepack *wp;
+  mysql_odb_backend *backend;
+  const git_oid *packfile_oid_ptr = NULL;
+  git_odb_backend *pack_backend = NULL;
+  git_odb *pack_odb = NULL;
+  size_t i, missing;
+  int error = GIT_ERROR;
+  int free_backend = 1, must_drop_temp_table = 0;
+
+  wp = (mysql_odb_writepack*)_wp;
+  backend = (mysql_odb_backend *)wp->parent.backend;
+
+  /* The procedure for this function:
+   *  1) Finalize indexer stream
+   *  2) Open it as an odb
+   *  3) Find out which of its objects the database lacks, in batches. Most
+   *     pushes mostly carry objects we already have, and there's no point
+   *     reading, sending and compressing those
+   *  4) Create a temporary mysql table, and insert the missing objects from
+   *     the packfile odb into it
+   *  5) Insert the temp table into the database (which will be atomic)
+   *       XXX -- this may _legitimately_ have duplicate oids, given that the
+   *       sent packfile can contain tree's of unchanged material.
+   *       XXX -- in the case of something like "git gc" though, we might
+   *       get delta-ified objects being written back. Just drop them for now.
+   *  6) Clean up
+   *
+   * In pack storage mode, all of that is skipped after step 1: the pack and
+   * its index are stored as they are, keeping their delta compression.
+   *
+   * Crucially, the merging of the temporary table into the main table will be
+   * one atomic mysql statement, which will either succeed or fail. */
+
+  /* 1: Finish index. A pack that's still in memory gets indexed now,
+   * in the memory backed staging directory. */
+  if (wp->indexer == NULL) {
+    error = mysql_odb__writepack_start(wp, backend->staging_memory_dir, stats);
+    if (error != GIT_OK)
+      return error;
+  }
+
+  error = git_indexer_stream_finalize(wp->indexer, stats);
+  if (error != GIT_OK)
+    return error;
+
+  /* We need to know where the indexed packfile is, to open it */
+  packfile_oid_ptr = git_indexer_stream_hash(wp->indexer);
+
+  if (backend->packs)
+    return mysql_odb__store_pack(backend, wp->dir_path, packfile_oid_ptr);
+
+  /* 2: Open the ODB */
+  git_oid_fmt(idx_oid_buffer, packfile_oid_ptr);
+  idx_oid_buffer[GIT_OID_HEXSZ] = '\0'; /* fmt does not set a terminator */
+  sprintf(idx_path_buffer, "%s/pack-%s.idx", wp->dir_path, idx_oid_buffer);
+  error = git_odb_backend_one_pack(&pack_backend, idx_path_buffer);
+  if (error != GIT_OK)
+    goto bad;
+
+  error = git_odb_new(&pack_odb);
+  if (error != GIT_OK)
+    goto bad;
+
+  error = git_odb_add_backend(pack_odb, pack_backend, 1);
+  if (error != GIT_OK)
+    goto bad;
+
+  /* Backend will now be freed by deconstruction of odb */
+  free_backend = 0;
+  wp->odb = pack_odb;
+
+  /* 3: Filter out what's already present */
+  error = git_odb_foreach(pack_odb, collect_packfile_oid, wp);
+  if (error != GIT_OK)
+    goto bad;
+
+  qsort(wp->oids, wp->oid_count, sizeof(git_oid), oid_cmp);
+
+  wp->present = calloc(1, wp->oid_count + 1);
+  if (wp->present == NULL) {
+    giterr_set_oom();
+    error = GIT_ERROR;
+    goto bad;
+  }
+
+  error = mysql_odb__mark_present(backend, wp->oids, wp->oid_count, wp->present);
+  if (error != GIT_OK)
+    goto bad;
+
+  for (i = 0, missing = 0; i < wp->oid_count; i++)
+    missing += !wp->present[i];
+
+  if (missing == 0) {
+    git_odb_free(pack_odb);
+    return GIT_OK;
+  }
+
+  /* 4: Create temporary table, on each shard that's missing something */
+  wp->batches = calloc(backend->shard_count, sizeof(mysql_odb_insert_batch));
+  wp->temp_tables = calloc(backend->shard_count, 1);
+  if (wp->batches == NULL || wp->temp_tables == NULL) {
+    giterr_set_oom();
+    error = GIT_ERROR;
+    goto bad;
+  }
+
+  for (i = 0; i < wp->oid_count; i++) {
+    if (!wp->present[i])
+      wp->temp_tables[backend->route[wp->oids[i].id[0]]] = 1;
+  }
+
+  /* Global name is not required, apparently temporary tables are limited to
+   * the scope of our current connection. The columns are spelled out rather
+   * than copied with LIKE, which would copy the odb table's partitioning
+   * too, and temporary tables can't be partitioned. */
+  must_drop_temp_table = 1;
+  if (mysql_odb__shards_query(backend, wp->temp_tables,
+        "CREATE TEMPORARY TABLE `xyzzy` ("
+        "  `oid` binary(20) NOT NULL DEFAULT '',"
+        "  `type` tinyint(1) unsigned NOT NULL,"
+        "  `size` bigint(20) unsigned NOT NULL,"
+        "  `data` longblob NOT NULL,"
+        "  PRIMARY KEY (`oid`)"
+        ") ENGINE=" GIT2_ODB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;")) {
+    fprintf(stderr, "mysql_odb_backend__pack_commit: failed to create temp "
+		    "table\n");
+    error = GIT_ERROR;
+    goto bad;
+  }
+
+  /* Load temporary table with whatever's missing. Rows go in as multi-row
+   * inserts, each sent without waiting for it to complete, so that reading
+   * objects out of the pack overlaps with the server storing them. */
+  for (i = 0; i < wp->oid_count; i++) {
+    if (wp->present[i])
+      continue;
+
+    error = add_each_packfile_obj(&wp->oids[i], wp);
+    if (error != GIT_OK)
+      goto bad;
+  }
+
+  for (i = 0; i < backend->shard_count; i++) {
+    if ((error = mysql_odb__batch_send(backend, wp, i)) != GIT_OK ||
+        (error = mysql_odb__batch_wait(backend, wp, i)) != GIT_OK)
+      goto bad;
+  }
+
+  /* 5: Merge temp tables into db, on all shards at once. On each shard the
+   * odb rows and their header rows go in as one transaction, so neither is
+   * ever left without the other. Across shards this is best effort: each
+   * shard commits on its own, so when a later one fails, the objects the
+   * earlier ones stored stay. They are complete objects nothing refers to
+   * yet, as refs are only updated once the whole pack is in; a retry skips
+   * them, and prune removes them if no retry comes. */
+  if (mysql_odb__shards_query(backend, wp->temp_tables, "START TRANSACTION;")) {
+    error = GIT_ERROR;
+    goto bad;
+  }
+
+  if (mysql_odb__shards_query(backend, wp->temp_tables,
+        "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME "` (SELECT * FROM `xyzzy`);")) {
+    fprintf(stderr, "mysql_odb_backend__pack_commit: failed to merge temp table "
+		    "table\n");
+    error = GIT_ERROR;
+    goto rollback;
+  }
+
+  /* Everything in the temp table is stored inline */
+  if (backend->header_table &&
+      mysql_odb__shards_query(backend, wp->temp_tables,
+        "INSERT IGNORE INTO `" GIT2_ODB_HEADER_TABLE_NAME "` (`oid`, `type`, `size`, `location`) "
+        "(SELECT `oid`, `type`, `size`, 0 FROM `xyzzy`);")) {
+    fprintf(stderr, "mysql_odb_backend__pack_commit: failed to merge temp table "
+		    "headers\n");
+    error = GIT_ERROR;
+    goto rollback;
+  }
+
+  if (mysql_odb__shards_query(backend, wp->temp_tables, "COMMIT;")) {
+    error = GIT_ERROR;
+    goto rollback;
+  }
+
+  /* 6: Clean up */
+  mysql_odb__drop_temp_tables(backend, wp);
+  git_odb_free(pack_odb); /* Frees backend too */
+
+  return GIT_OK;
+
+rollback:
+  mysql_odb__shards_query(backend, wp->temp_tables, "ROLLBACK;");
+bad:
+  if (must_drop_temp_table)
+    mysql_odb__drop_temp_tables(backend, wp);
+  if (pack_odb)
+    git_odb_free(pack_odb);
+  if (pack_backend && free_backend)
+    pack_backend->free(pack_backend);
+  return error;
+}
+
+static void mysql_odb_backend__pack_free(git_odb_writepack *_wp)
+{
+  char idx_path_buffer[PATH_MAX + GIT_OID_HEXSZ + 16];
+  char idx_oid_buffer[GIT_OID_HEXSZ + 1];
+  const git_oid *packfile_oid_ptr = NULL;
+  mysql_odb_writepack *wp;
+  mysql_odb_backend *backend;
+  size_t i;
+
+  wp = (mysql_odb_writepack*)_wp;
+  backend = (mysql_odb_backend *)wp->parent.backend;
+
+  /* We need to:
+   *   Free the indexer
+   *   Unlink the files we've created
+   * Potentially after a transfer has aborted, or before the indexer was
+   * ever started */
+
+  if (wp->indexer) {
+    packfile_oid_ptr = git_indexer_stream_hash(wp->indexer);
+    git_oid_fmt(idx_oid_buffer, packfile_oid_ptr);
+    idx_oid_buffer[GIT_OID_HEXSZ] = '\0'; /* fmt does not set a terminator */
+    sprintf(idx_path_buffer, "%s/pack-%s.pack", wp->dir_path, idx_oid_buffer);
+    unlink(idx_path_buffer);
+    sprintf(idx_path_buffer, "%s/pack-%s.idx", wp->dir_path, idx_oid_buffer);
+    unlink(idx_path_buffer);
+
+    git_indexer_stream_free(wp->indexer);
+  }
+
+  /* Also need to remove the containing dir; on tmpfs, leftovers eat memory */
+  if (wp->dir_path[0])
+    rmdir(wp->dir_path);
+
+  if (wp->batches) {
+    for (i = 0; i < backend->shard_count; i++)
+      free(wp->batches[i].sql);
+  }
+
+  free(wp->staged);
+  free(wp->zbuf);
+  free(wp->oids);
+  free(wp->present);
+  free(wp->batches);
+  free(wp->temp_tables);
+  free(wp);
+  return;
+}
+
+static int mysql_odb_backend__writepack(git_odb_writepack **_wp,
+	git_odb_backend *_backend, git_transfer_progress_callback progress_cb,
+	void *progress_payload)
+{
+  mysql_odb_backend *backend;
+  mysql_odb_writepack *wp = NULL;
+  git_transfer_progress stats;
+  int error;
+
+  backend = (mysql_odb_backend *)_backend;
+
+  wp = calloc(1, sizeof(mysql_odb_writepack));
+  if (!wp) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  /* Prepare to read a packfile. Seeing how facilities for interpreting
+   * packfiles are not exported by libgit2, and copy+pasting them would be
+   * bad, instead read the packfile to a temporary directory. Then open it
+   * using the existing ODB api, then suck objects out of it and into the
+   * database. With a memory staging directory configured, the pack is held
+   * in memory for as long as it fits, and only indexed at commit. */
+  wp->progress_cb = progress_cb;
+  wp->progress_payload = progress_payload;
+
+  if (backend->staging_memory_dir == NULL) {
+    memset(&stats, 0, sizeof(stats));
+    error = mysql_odb__writepack_start(wp, backend->staging_spill_dir, &stats);
+    if (error != GIT_OK) {
+      free(wp);
+      return error;
+    }
+  }
+
+  wp->parent.backend = _backend;
+  wp->parent.add = mysql_odb_backend__pack_add;
+  wp->parent.commit = mysql_odb_backend__pack_commit;
+  wp->parent.free = mysql_odb_backend__pack_free;
+  *_wp = &wp->parent;
+  return GIT_OK;
+}
+
+static void mysql_odb__conn_free(mysql_odb_conn *conn)
+{
+  if (conn->st_read)
+    mysql_stmt_close(conn->st_read);
+  if (conn->st_read_header)
+    mysql_stmt_close(conn->st_read_header);
+  if (conn->st_write)
+    mysql_stmt_close(conn->st_write);
+  if (conn->st_read_prefix)
+    mysql_stmt_close(conn->st_read_prefix);
+  if (conn->st_read_chunk)
+    mysql_stmt_close(conn->st_read_chunk);
+  if (conn->st_write_chunk)
+    mysql_stmt_close(conn->st_write_chunk);
+  if (conn->st_rename_chunks)
+    mysql_stmt_close(conn->st_rename_chunks);
+  if (conn->st_delete_chunks)
+    mysql_stmt_close(conn->st_delete_chunks);
+  if (conn->st_exists_batch)
+    mysql_stmt_close(conn->st_exists_batch);
+  if (conn->st_write_header)
+    mysql_stmt_close(conn->st_write_header);
+  if (conn->meta_read)
+    mysql_free_result(conn->meta_read);
+  if (conn->meta_read_prefix)
+    mysql_free_result(conn->meta_read_prefix);
+  if (conn->meta_read_chunk)
+    mysql_free_result(conn->meta_read_chunk);
+
+  mysql_close(conn->db);
+}
+
+#ifdef GIT2_MYSQL_ASYNC
+
+/* Asynchronous reads and writes, on connections of their own driven through
+ * the MariaDB non-blocking client API. Requests are queued and handed to
+ * whichever connection is idle; git_odb_backend_mysql_async_poll waits on all
+ * of the connections' sockets at once and runs the callback of each request
+ * as it completes. One thread can so keep a query in flight on every
+ * connection. */
+
+static void mysql_odb__async_bind_oid(MYSQL_BIND *bind, git_oid *oid)
+{
+  bind->buffer = oid->id;
+  bind->buffer_length = GIT_OID_RAWSZ;
+  bind->length = &bind->buffer_length;
+  bind->buffer_type = MYSQL_TYPE_BLOB;
+}
+
+static void mysql_odb__async_finish(mysql_odb_backend *backend,
+        mysql_odb_async_conn *ac, int error, void *data)
+{
+  mysql_odb_async_req *req = ac->req;
+
+  ac->req = NULL;
+  ac->stmt = NULL;
+  backend->async_pending--;
+
+  req->cb(error, &req->oid, data, req->size, req->type, req->payload);
+  free(req);
+}
+
+/* Once a read has its result stored, everything else is local, bar the
+ * rare chunked object, which is read synchronously */
+static void mysql_odb__async_read_done(mysql_odb_backend *backend,
+        mysql_odb_async_conn *ac)
+{
+  mysql_odb_async_req *req = ac->req;
+  void *data = NULL;
+  int error = GIT_ENOTFOUND;
+
+  if (mysql_stmt_num_rows(ac->stmt) == 1) {
+    error = mysql_odb__fetch_object(backend, ac->stmt, ac->conn.meta_read,
+              NULL, &data, &req->size, &req->type);
+    if (error == MYSQL_ODB_CHUNKED)
+      error = mysql_odb__read_chunks(backend, &ac->conn, &req->oid, &data, req->size);
+  }
+
+  // buffered results are freed client side, without a round trip
+  mysql_stmt_free_result(ac->stmt);
+
+  mysql_odb__async_finish(backend, ac, error, (error == GIT_OK) ? data : NULL);
+}
+
+/* Advance a connection's request for as long as the client library doesn't
+ * need to wait on the socket. `ret` is the result of the operation that just
+ * completed. */
+static void mysql_odb__async_step(mysql_odb_backend *backend,
+        mysql_odb_async_conn *ac, int ret)
+{
+  mysql_odb_async_req *req;
+
+  while (ac->req != NULL) {
+    req = ac->req;
+
+    if (ret != 0) {
+      giterr_set_str(GITERR_ODB, mysql_stmt_error(ac->stmt));
+      mysql_odb__async_finish(backend, ac, GIT_ERROR, NULL);
+      return;
+    }
+
+    switch (ac->stage) {
+    case MYSQL_ODB_ASYNC_EXECUTE:
+      if (!req->write) {
+        ac->stage = MYSQL_ODB_ASYNC_STORE;
+        ac->status = mysql_stmt_store_result_start(&ret, ac->stmt);
+        break;
+      }
+
+      /* A duplicate row is fine, but its header row may be what's missing,
+       * so that goes in either way */
+      if (!backend->header_table) {
+        mysql_odb__async_finish(backend, ac, GIT_OK, NULL);
+        return;
+      }
+
+      memset(ac->bind, 0, sizeof(ac->bind));
+      mysql_odb__async_bind_oid(&ac->bind[0], &req->oid);
+      ac->bind[1].buffer = &req->type;
+      ac->bind[1].buffer_type = MYSQL_TYPE_TINY;
+      ac->bind[2].buffer = &req->size_ll;
+      ac->bind[2].buffer_type = MYSQL_TYPE_LONGLONG;
+      ac->bind[2].is_unsigned = 1;
+      ac->bind[3].buffer = &req->location;
+      ac->bind[3].buffer_type = MYSQL_TYPE_TINY;
+      ac->bind[3].is_unsigned = 1;
+
+      ac->stmt = ac->conn.st_write_header;
+      ac->stage = MYSQL_ODB_ASYNC_HEADER;
+      if (mysql_stmt_bind_param(ac->stmt, ac->bind) != 0) {
+        ret = 1;
+        continue;
+      }
+      ac->status = mysql_stmt_execute_start(&ret, ac->stmt);
+      break;
+
+    case MYSQL_ODB_ASYNC_STORE:
+      mysql_odb__async_read_done(backend, ac);
+      return;
+
+    case MYSQL_ODB_ASYNC_HEADER:
+      mysql_odb__async_finish(backend, ac, GIT_OK, NULL);
+      return;
+    }
+
+    if (ac->status != 0)
+      return;
+  }
+}
+
+/* Hand queued requests to idle connections */
+static void mysql_odb__async_dispatch(mysql_odb_backend *backend)
+{
+  mysql_odb_async_conn *ac;
+  mysql_odb_async_req *req;
+  size_t i;
+  int ret = 0;
+
+  for (i = 0; i < backend->async_count && backend->async_queue; i++) {
+    ac = &backend->async_conns[i];
+    if (ac->req != NULL)
+      continue;
+
+    req = backend->async_queue;
+    backend->async_queue = req->next;
+    if (backend->async_queue == NULL)
+      backend->async_queue_tail = NULL;
+
+    ac->req = req;
+    ac->stage = MYSQL_ODB_ASYNC_EXECUTE;
+    memset(ac->bind, 0, sizeof(ac->bind));
+    mysql_odb__async_bind_oid(&ac->bind[0], &req->oid);
+
+    if (req->write) {
+      ac->stmt = ac->conn.st_write;
+      ac->bind[1].buffer = &req->type;
+      ac->bind[1].buffer_type = MYSQL_TYPE_TINY;
+      ac->bind[2].buffer = &req->size_ll;
+      ac->bind[2].buffer_type = MYSQL_TYPE_LONGLONG;
+      ac->bind[2].is_unsigned = 1;
+      ac->bind[3].buffer = (void *)req->data;
+      ac->bind[3].buffer_length = req->size;
+      ac->bind[3].length = &ac->bind[3].buffer_length;
+      ac->bind[3].buffer_type = MYSQL_TYPE_BLOB;
+    } else {
+      ac->stmt = ac->conn.st_read;
+    }
+
+    if (mysql_stmt_bind_param(ac->stmt, ac->bind) != 0) {
+      mysql_odb__async_step(backend, ac, 1);
+      continue;
+    }
+
+    ac->status = mysql_stmt_execute_start(&ret, ac->stmt);
+    if (ac->status == 0)
+      mysql_odb__async_step(backend, ac, ret);
+  }
+}
+
+static int mysql_odb__async_submit(mysql_odb_backend *backend,
+        mysql_odb_async_req *req)
+{
+  if (backend->async_count == 0) {
+    giterr_set_str(GITERR_ODB, "MySQL odb has no asynchronous connections");
+    free(req);
+    return GIT_ERROR;
+  }
+
+  if (backend->async_queue_tail)
+    backend->async_queue_tail->next = req;
+  else
+    backend->async_queue = req;
+  backend->async_queue_tail = req;
+  backend->async_pending++;
+
+  mysql_odb__async_dispatch(backend);
+  return GIT_OK;
+}
+
+static void mysql_odb__async_free(mysql_odb_backend *backend)
+{
+  mysql_odb_async_req *req;
+  size_t i;
+
+  /* Requests still in flight are abandoned along with their connection */
+  for (i = 0; i < backend->async_count; i++) {
+    free(backend->async_conns[i].req);
+    mysql_odb__conn_free(&backend->async_conns[i].conn);
+  }
+  free(backend->async_conns);
+
+  while ((req = backend->async_queue) != NULL) {
+    backend->async_queue = req->next;
+    free(req);
+  }
+}
+
+#endif
+
+static void mysql_odb_backend__free(git_odb_backend *_backend)
+{
+  mysql_odb_backend *backend;
+  size_t i;
+
+  assert(_backend);
+  backend = (mysql_odb_backend *)_backend;
+
+  mysql_odb__conn_free(&backend->primary);
+
+  for (i = 1; i < backend->shard_count; i++) {
+    mysql_odb__conn_free(backend->shards[i]);
+    free(backend->shards[i]);
+  }
+  free(backend->shards);
+
+  for (i = 0; i < backend->replica_count; i++)
+    mysql_odb__conn_free(&backend->replicas[i]);
+  free(backend->replicas);
+
+  free(backend->scratch);
+
+  if (backend->packs)
+    git_odb_free(backend->packs);
+  free(backend->pack_cache_dir);
+  free(backend->pack_ids);
+  free(backend->staging_memory_dir);
+  free(backend->staging_spill_dir);
+  if (backend->st_read_pack_chunk)
+    mysql_stmt_close(backend->st_read_pack_chunk);
+  if (backend->st_write_pack_chunk)
+    mysql_stmt_close(backend->st_write_pack_chunk);
+  if (backend->meta_read_pack_chunk)
+    mysql_free_result(backend->meta_read_pack_chunk);
+
+#ifdef GIT2_MYSQL_ASYNC
+  mysql_odb__async_free(backend);
+  free(backend->async_fds);
+#endif
+
+  free(backend);
+}
+
+static int mysql_refdb__query_ref(git_reference **out,
+        mysql_refdb_backend *backend, const char *ref_name)
+{
+  char *refname_buffer = NULL;
+  int error;
+  MYSQL_BIND bind_buffers[1];
+  MYSQL_BIND result_buffers[3];
+  unsigned char reftype;
+
+  assert(out && backend && ref_name);
+
+  error = GIT_ERROR;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+  memset(result_buffers, 0, sizeof(result_buffers));
+
+  // bind the oid passed to the statement
+  bind_buffers[0].buffer = (void*)ref_name;
+  bind_buffers[0].buffer_length = strlen(ref_name);
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+  if (mysql_stmt_bind_param(backend->st_lookup, bind_buffers) != 0)
+    return GIT_ERROR;
+
+  // execute the statement
+  if (mysql_stmt_execute(backend->st_lookup) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_store_result(backend->st_lookup) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_num_rows(backend->st_lookup) == 0) {
+    error = GIT_ENOTFOUND;
+  } else if (mysql_stmt_num_rows(backend->st_lookup) != 1) {
+    /* Duplicate refname has occurred. Everything is broken. */
+    error = GIT_ERROR;
+  } else {
+    unsigned char odb_buffer[GIT_OID_RAWSZ];
+    git_oid oid;
+    size_t symref_len;
+
+    assert(mysql_stmt_num_rows(backend->st_lookup) == 1);
+    memset(odb_buffer, 0, sizeof(odb_buffer));
+
+    result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+    result_buffers[0].buffer = &reftype;
+    result_buffers[0].buffer_length = sizeof(reftype);
+    result_buffers[0].length = &result_buffers[0].buffer_length;
+
+    result_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+    result_buffers[1].buffer = odb_buffer;
+    result_buffers[1].buffer_length = sizeof(odb_buffer);
+    result_buffers[1].length = &result_buffers[1].buffer_length;
+
+    symref_len = 0;
+    result_buffers[2].buffer_type = MYSQL_TYPE_STRING;
+    result_buffers[2].buffer = NULL;
+    result_buffers[2].buffer_length = 0;
+    result_buffers[2].length = &symref_len;
+
+    if(mysql_stmt_bind_result(backend->st_lookup, result_buffers) != 0)
+      return GIT_ERROR;
+
+    error = mysql_stmt_fetch(backend->st_lookup); /* Might return truncated */
+
+    /* If there's symbolic reference name data, load it manually */
+    if (symref_len > 0) {
+      refname_buffer = malloc(symref_len + 1UL);
+      if (refname_buffer == NULL) {
+        giterr_set_oom();
+        error = GIT_ERROR;
+	goto out;
+      }
+
+      result_buffers[2].buffer = refname_buffer;
+      result_buffers[2].buffer_length = symref_len;
+
+      /* XXX memory leak */
+      if (mysql_stmt_fetch_column(backend->st_lookup, &result_buffers[2], 2, 0) != 0)
+        return GIT_ERROR;
+
+      refname_buffer[symref_len] = '\0';
+    }
+
+    /* Having read the relevant oid, create an oid, then a reference */
+    git_oid_fromraw(&oid, odb_buffer);
+
+    assert(reftype == GIT_REF_OID || reftype == GIT_REF_SYMBOLIC);
+    if (reftype == GIT_REF_OID) {
+      *out = git_reference__alloc(ref_name, &oid, NULL);
+    } else {
+      *out = git_reference__alloc_symbolic(ref_name, refname_buffer);
+    }
+
+    if (refname_buffer != NULL)
+      free(refname_buffer);
+
+    if (*out == NULL)
+      error = GIT_ERROR;
+    else
+      error = GIT_OK;
+  }
+
+out:
+  // reset the statement for further use
+  if (mysql_stmt_reset(backend->st_lookup) != 0)
+    return GIT_ERROR;
+
+  return error;
+}
+
+static long long mysql_refdb__now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t mysql_refdb__cache_hash(const char *name)
+{
+  /* FNV-1a */
+  size_t hash = 2166136261u;
+
+  while (*name) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static void mysql_refdb__cache_clear(mysql_refdb_backend *backend)
+{
+  mysql_refdb_cache_entry *entry, *next;
+  size_t i;
+
+  for (i = 0; i < backend->cache_buckets; i++) {
+    for (entry = backend->cache[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      free(entry->name);
+      free(entry->symref);
+      free(entry);
+    }
+    backend->cache[i] = NULL;
+  }
+
+  backend->cache_count = 0;
+  backend->cache_valid = 0;
+}
+
+static mysql_refdb_cache_entry *mysql_refdb__cache_find(
+        mysql_refdb_backend *backend, const char *ref_name)
+{
+  mysql_refdb_cache_entry *entry;
+
+  if (backend->cache_buckets == 0)
+    return NULL;
+
+  entry = backend->cache[mysql_refdb__cache_hash(ref_name) % backend->cache_buckets];
+  while (entry != NULL && strcmp(entry->name, ref_name) != 0)
+    entry = entry->next;
+
+  return entry;
+}
+
+/* Remember the result of a lookup; ref is NULL for a missing ref. Failing
+ * to allocate just leaves the result uncached. */
+static void mysql_refdb__cache_add(mysql_refdb_backend *backend,
+        const char *ref_name, const git_reference *ref)
+{
+  mysql_refdb_cache_entry *entry, *next, **buckets;
+  size_t i, slot, count;
+
+  if (backend->cache_count >= backend->cache_buckets) {
+    count = backend->cache_buckets ? backend->cache_buckets * 2 : MYSQL_REFDB_CACHE_BUCKETS;
+    buckets = calloc(count, sizeof(mysql_refdb_cache_entry *));
+    if (buckets == NULL)
+      return;
+
+    for (i = 0; i < backend->cache_buckets; i++) {
+      for (entry = backend->cache[i]; entry != NULL; entry = next) {
+        next = entry->next;
+        slot = mysql_refdb__cache_hash(entry->name) % count;
+        entry->next = buckets[slot];
+        buckets[slot] = entry;
+      }
+    }
+
+    free(backend->cache);
+    backend->cache = buckets;
+    backend->cache_buckets = count;
+  }
+
+  entry = calloc(1, sizeof(mysql_refdb_cache_entry));
+  if (entry == NULL)
+    return;
+
+  entry->name = strdup(ref_name);
+  entry->type = ref ? git_reference_type(ref) : GIT_REF_INVALID;
+  if (entry->type == GIT_REF_OID)
+    git_oid_cpy(&entry->oid, git_reference_target(ref));
+  else if (entry->type == GIT_REF_SYMBOLIC)
+    entry->symref = strdup(git_reference_symbolic_target(ref));
+
+  if (entry->name == NULL ||
+      (entry->type == GIT_REF_SYMBOLIC && entry->symref == NULL)) {
+    free(entry->name);
+    free(entry->symref);
+    free(entry);
+    return;
+  }
+
+  slot = mysql_refdb__cache_hash(ref_name) % backend->cache_buckets;
+  entry->next = backend->cache[slot];
+  backend->cache[slot] = entry;
+  backend->cache_count++;
+}
+
+/* Make sure the cache reflects the database, by comparing the generation
+ * counter with the one the cache was filled at. Within the TTL of the last
+ * check, the cache is trusted as it is. */
+static int mysql_refdb__cache_validate(mysql_refdb_backend *backend)
+{
+  MYSQL_BIND result_buffers[1];
+  unsigned long long generation;
+  long long now;
+  int error;
+
+  now = mysql_refdb__now_ms();
+  if (backend->cache_valid && backend->cache_ttl_ms > 0 &&
+      now - backend->cache_checked_ms < (long long)backend->cache_ttl_ms)
+    return GIT_OK;
+
+  memset(result_buffers, 0, sizeof(result_buffers));
+  result_buffers[0].buffer_type = MYSQL_TYPE_LONGLONG;
+  result_buffers[0].buffer = &generation;
+  result_buffers[0].buffer_length = sizeof(generation);
+  result_buffers[0].is_unsigned = 1;
+
+  if (mysql_stmt_execute(backend->st_generation) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_store_result(backend->st_generation) != 0 ||
+      mysql_stmt_num_rows(backend->st_generation) != 1 ||
+      mysql_stmt_bind_result(backend->st_generation, result_buffers) != 0 ||
+      mysql_stmt_fetch(backend->st_generation) != 0) {
+    error = GIT_ERROR;
+  } else {
+    if (!backend->cache_valid || generation != backend->cache_generation) {
+      mysql_refdb__cache_clear(backend);
+      backend->cache_generation = generation;
+      backend->cache_valid = 1;
+    }
+    backend->cache_checked_ms = now;
+    error = GIT_OK;
+  }
+
+  if (mysql_stmt_reset(backend->st_generation) != 0)
+    return GIT_ERROR;
+
+  return error;
+}
+
+static int mysql_refdb_backend__lookup(git_reference **out,
+        git_refdb_backend *_backend, const char *ref_name)
+{
+  mysql_refdb_backend *backend;
+  mysql_refdb_cache_entry *entry;
+  int error;
+
+  assert(out && _backend && ref_name);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  if (!backend->cache_enabled)
+    return mysql_refdb__query_ref(out, backend, ref_name);
+
+  error = mysql_refdb__cache_validate(backend);
+  if (error != GIT_OK)
+    return error;
+
+  entry = mysql_refdb__cache_find(backend, ref_name);
+  if (entry != NULL) {
+    if (entry->type == GIT_REF_INVALID)
+      return GIT_ENOTFOUND;
+
+    if (entry->type == GIT_REF_OID)
+      *out = git_reference__alloc(ref_name, &entry->oid, NULL);
+    else
+      *out = git_reference__alloc_symbolic(ref_name, entry->symref);
+
+    return (*out == NULL) ? GIT_ERROR : GIT_OK;
+  }
+
+  error = mysql_refdb__query_ref(out, backend, ref_name);
+  if (error == GIT_OK)
+    mysql_refdb__cache_add(backend, ref_name, *out);
+  else if (error == GIT_ENOTFOUND)
+    mysql_refdb__cache_add(backend, ref_name, NULL);
+
+  return error;
+}
+
+static int mysql_refdb_backend__exists(int *exists, git_refdb_backend *_backend,
+         const char *ref_name)
+{
+  git_reference *ref = NULL;
+  int error;
+
+  error = mysql_refdb_backend__lookup(&ref, _backend, ref_name);
+
+  if (error == GIT_ENOTFOUND) {
+    *exists = 0;
+    return GIT_OK;
+  } else if (error != GIT_OK) {
+    return error;
+  }
+
+  /* Otherwise, the reference was found */
+  git_reference_free(ref);
+  *exists = 1;
+  return GIT_OK;
+}
+
+static int mysql_refdb_iterator_next(git_reference **ref,
+        git_reference_iterator *iter)
+{
+  mysql_refdb_iterator *myit = (mysql_refdb_iterator*)iter;
+
+  if (myit->cur_pos == myit->numrows)
+    return GIT_ITEROVER;
+
+  git_ref_t t = myit->types[myit->cur_pos];
+  assert(t == GIT_REF_OID || t == GIT_REF_SYMBOLIC);
+  if (t == GIT_REF_OID) {
+    *ref = git_reference__alloc(myit->refnames[myit->cur_pos],
+                  &myit->oids[myit->cur_pos], NULL);
+  } else {
+    *ref = git_reference__alloc_symbolic(myit->refnames[myit->cur_pos],
+                  myit->symnames[myit->cur_pos]);
+  }
+
+  if (*ref == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  myit->cur_pos++;
+  return GIT_OK;
+}
+
+static int mysql_refdb_iterator_next_name(const char **ref_name,
+        git_reference_iterator *iter)
+{
+  mysql_refdb_iterator *myit = (mysql_refdb_iterator*)iter;
+
+  if (myit->cur_pos == myit->numrows)
+    return GIT_ITEROVER;
+
+  *ref_name = myit->refnames[myit->cur_pos++];
+  return GIT_OK;
+}
+
+static void mysql_refdb_iterator_free(git_reference_iterator *iter)
+{
+  mysql_refdb_iterator *myit = (mysql_refdb_iterator*)iter;
+
+  if (myit->refnames) {
+    unsigned int i;
+
+    /* Free any allocated refnames */
+    for (i = 0; i < myit->numrows; i++)
+      if (myit->refnames[i])
+        free(myit->refnames[i]);
+
+    free(myit->refnames);
+  }
+
+  if (myit->types)
+    free(myit->types);
+
+  if (myit->oids)
+    free(myit->oids);
+
+  if (myit->symnames) {
+    unsigned int i;
+
+    for (i = 0; i < myit->numrows; i++)
+      if (myit->symnames[i])
+        free(myit->symnames[i]);
+
+    free(myit->symnames);
+  }
+
+  free(myit);
+}
+
+static int mysql_refdb_backend__iterator(git_reference_iterator **iter,
+        struct git_refdb_backend *backend, const char *glob)
+{
+  MYSQL_BIND bind_buffers[1];
+  mysql_refdb_iterator *myit = NULL;
+  int error = GIT_ERROR;
+
+  /* Reject any glob with either '%' or '?' in it. These aren't allowed by the
+   * reference definitions of git anyway, but there's a risk they'll muck up
+   * the query we're making, in a way that upsets the user */
+  if (strchr(glob, '%') != NULL)
+    return GIT_EINVALIDSPEC;
+
+  if (strchr(glob, '?') != NULL)
+    return GIT_EINVALIDSPEC;
+
+  *iter = NULL;
+
+  myit = calloc(1, sizeof(mysql_refdb_iterator));
+  if (!myit)
+    goto oom;
+
+  myit->parent.next = mysql_refdb_iterator_next;
+  myit->parent.next_name = mysql_refdb_iterator_next_name;
+  myit->parent.free = mysql_refdb_iterator_free;
+  myit->backend = (mysql_refdb_backend*)backend;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  bind_buffers[0].buffer = (void*)glob;
+  bind_buffers[0].buffer_length = strlen(glob);
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+  if (mysql_stmt_bind_param(myit->backend->st_iterate, bind_buffers) != 0)
+   goto error;
+
+  // execute the statement
+  if (mysql_stmt_execute(myit->backend->st_iterate) != 0)
+    goto error;
+
+  if (mysql_stmt_store_result(myit->backend->st_iterate) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_num_rows(myit->backend->st_iterate) == 0) {
+    /* Now rows -- indicated by iterator being over immediately (?) */
+    myit->cur_pos = 0;
+    myit->numrows = 0;
+  } else {
+    MYSQL_BIND result_buffers[4];
+    unsigned long refname_len, i;
+
+    /* Allocate and initialize fields in myit to store the result rows from the
+     * query */
+    myit->cur_pos = 0;
+    myit->numrows = mysql_stmt_num_rows(myit->backend->st_iterate);
+    if (myit->numrows >= (ULONG_MAX / sizeof(char*)) ||
+        myit->numrows >= (ULONG_MAX / GIT_OID_RAWSZ))
+      /* Nope */
+      goto error;
+
+    myit->refnames = calloc(1, sizeof(char *) * myit->numrows);
+    if (!myit->refnames)
+      goto oom;
+
+    myit->types = malloc(sizeof(unsigned char) * myit->numrows);
+    if (!myit->types)
+      goto oom;
+
+    myit->oids = malloc(sizeof(git_oid) * myit->numrows);
+    if (!myit->oids)
+      goto oom;
+
+    myit->symnames = calloc(1, sizeof(char *) * myit->numrows);
+    if (!myit->symnames)
+      goto oom;
+
+    /* Now proceed to iterate through each row, fetching data into the
+     * allocated buffers. Unpleasent as the refname can be an arbitary
+     * length string */
+
+    memset(result_buffers, 0, sizeof(result_buffers));
+
+    for (i = 0; i < myit->numrows; i++) {
+      size_t sym_len;
+
+      refname_len = 0;
+      result_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+      result_buffers[0].buffer = NULL;
+      result_buffers[0].buffer_length = 0;
+      result_buffers[0].length = &refname_len;
+
+      result_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+      result_buffers[1].buffer = &myit->types[i];
+      result_buffers[1].buffer_length = 1;
+      result_buffers[1].length = &result_buffers[1].buffer_length;
+
+      result_buffers[2].buffer_type = MYSQL_TYPE_BLOB;
+      result_buffers[2].buffer = &myit->oids[i];
+      result_buffers[2].buffer_length = GIT_OID_RAWSZ;
+      memset(result_buffers[2].buffer, 0, GIT_OID_RAWSZ);
+
+      /* Request len */
+      sym_len = 0;
+      result_buffers[3].buffer_type = MYSQL_TYPE_STRING;
+      result_buffers[3].buffer = NULL;
+      result_buffers[3].buffer_length = 0;
+      result_buffers[3].length = &sym_len;
+
+      if (mysql_stmt_bind_result(myit->backend->st_iterate, result_buffers) != 0)
+        goto error;
+
+      /* May legitimately return 'truncated' */
+      mysql_stmt_fetch(myit->backend->st_iterate);
+
+      /* Allocate an actual buffer for the refname, the size of which has now
+       * been specified by mysql */
+      if (refname_len >= ULONG_MAX - 1UL || refname_len == 0)
+        goto error;
+
+      myit->refnames[i] = malloc(refname_len + 1UL);
+      if (!myit->refnames[i])
+        goto oom;
+
+      result_buffers[0].buffer = myit->refnames[i];
+      result_buffers[0].buffer_length = refname_len;
+
+      if (mysql_stmt_fetch_column(myit->backend->st_iterate, &result_buffers[0], 0, 0) != 0)
+        goto error;
+
+      myit->refnames[i][refname_len] = '\0';
+
+      /* If there's data in the symbolic refname, fetch it too; otherwise loop
+       * around again */
+      if (sym_len == 0)
+        continue;
+
+      if (sym_len >= ULONG_MAX - 1UL)
+        goto error;
+
+      myit->symnames[i] = malloc(sym_len + 1UL);
+      if (!myit->symnames[i])
+        goto oom;
+
+      myit->symnames[i][sym_len] = '\0';
+
+      result_buffers[3].buffer = myit->symnames[i];
+      result_buffers[3].buffer_length = sym_len;
+
+      if (mysql_stmt_fetch_column(myit->backend->st_iterate, &result_buffers[3], 3, 0) != 0)
+        goto error;
+    }
+  }
+
+  *iter = &myit->parent;
+
+  return GIT_OK;
+
+oom:
+  giterr_set_oom();
+
+error:
+  if (myit)
+    myit->parent.free(&myit->parent);
+
+  return error;
+}
+
+/* Writes and deletes run in a transaction which also bumps the generation
+ * counter, so no reader sees the change without the new generation. */
+static int mysql_refdb__begin(mysql_refdb_backend *backend)
+{
+  static const char *sql_begin = "START TRANSACTION;";
+
+  if (mysql_real_query(backend->db, sql_begin, strlen(sql_begin)) != 0)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+static int mysql_refdb__finish(mysql_refdb_backend *backend, int error)
+{
+  /* A change other processes can't notice is no change at all */
+  if (error == GIT_OK && backend->generation_table) {
+    if (mysql_stmt_execute(backend->st_bump) != 0 ||
+        mysql_stmt_affected_rows(backend->st_bump) != 1) {
+      giterr_set_str(GITERR_REFERENCE, "MySQL refdb failed to bump the refdb generation");
+      error = GIT_ERROR;
+    }
+
+    mysql_stmt_reset(backend->st_bump);
+  }
+
+  if (error == GIT_OK) {
+    if (mysql_commit(backend->db) != 0)
+      error = GIT_ERROR;
+  } else {
+    mysql_rollback(backend->db);
+  }
+
+  /* Our own change needs a fresh look at the database either way */
+  if (backend->cache_buckets > 0)
+    mysql_refdb__cache_clear(backend);
+  backend->cache_valid = 0;
+
+  return error;
+}
+
+static int mysql_refdb__delete_row(mysql_refdb_backend *backend,
+        const char *ref_name)
+{
+  MYSQL_BIND bind_buffers[1];
+  int error;
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  /* Pretty straightforward procedure: bind reference name to delete query,
+   * and execute. Return an error if the reference did not exist. */
+  bind_buffers[0].buffer = (void*)ref_name;
+  bind_buffers[0].buffer_length = strlen(ref_name);
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+  if (mysql_stmt_bind_param(backend->st_delete, bind_buffers) != 0)
+    return GIT_ERROR;
+
+  /* execute the statement */
+  if (mysql_stmt_execute(backend->st_delete) != 0)
+    return GIT_ERROR;
+
+  if (mysql_affected_rows(backend->db) == 0) {
+    error = GIT_ENOTFOUND;
+  } else {
+    /* XXX -- diagnostic if an unexpected number of rows are delete would be
+     * nice */
+    error = GIT_OK;
+  }
+
+  /* reset the statement for further use */
+  if (mysql_stmt_reset(backend->st_delete) != 0)
+    return GIT_ERROR;
+
+  return error;
+}
+
+static int mysql_refdb_backend__delete(git_refdb_backend *_backend,
+        const char *ref_name)
+{
+  mysql_refdb_backend *backend;
+  int error;
+
+  assert(_backend && ref_name);
+
+  backend = (mysql_refdb_backend*)_backend;
+
+  error = mysql_refdb__begin(backend);
+  if (error != GIT_OK)
+    return error;
+
+  error = mysql_refdb__delete_row(backend, ref_name);
+  return mysql_refdb__finish(backend, error);
+}
+
+static int mysql_refdb__write_row(mysql_refdb_backend *backend,
+        const git_reference *ref, int force)
+{
+  git_reference *existing = NULL;
+  int error;
+  MYSQL_BIND bind_buffers[4];
+  const char *refname, *symname;
+  const git_oid *oid;
+  unsigned char type;
+
+  error = GIT_ERROR;
+  refname = git_reference_name(ref);
+  oid = git_reference_target(ref);
+  type = git_reference_type(ref);
+  symname = git_reference_symbolic_target(ref);
+
+  /* Procedure: we have a reference to write, which may or may not already exist
+   * in the database. Look it up to determine if it does. If it does, only
+   * overwrite if the force flag is given (by deleting it first). Finally, to
+   * actually write, bind and execute a query. */
+
+  /* First: does it already exist? Ask the database rather than the cache,
+   * within the transaction. */
+  error = mysql_refdb__query_ref(&existing, backend, refname);
+  if (error == GIT_OK) {
+    git_reference_free(existing);
+
+    if (force == 0) {
+      return GIT_EEXISTS;
+    }
+
+    /* The reference exists, but we're force writing it. Delete it first. */
+    error = mysql_refdb__delete_row(backend, refname);
+    if (error != GIT_OK)
+      return error;
+  } else if (error != GIT_ENOTFOUND) {
+    return error;
+  }
+
+  /* Now proceed to actually writing to the desired reference */
+
+  memset(bind_buffers, 0, sizeof(bind_buffers));
+
+  /* bind the refname passed to the statement */
+  bind_buffers[0].buffer = (void*)refname;
+  bind_buffers[0].buffer_length = strlen(refname);
+  bind_buffers[0].length = &bind_buffers[0].buffer_length;
+  bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+
+  /* Reference type */
+  bind_buffers[1].buffer = &type;
+  bind_buffers[1].buffer_length = 1;
+  bind_buffers[1].length = &bind_buffers[1].buffer_length;
+  bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+
+  /* Bind the target OID in too, if it exists */
+  bind_buffers[2].buffer = (oid) ? (void*)oid->id : NULL;
+  bind_buffers[2].buffer_length = GIT_OID_RAWSZ ;
+  bind_buffers[2].length = &bind_buffers[2].buffer_length;
+  bind_buffers[2].buffer_type = (oid) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_NULL;
+
+  /* And possibly the symbolic name too */
+  bind_buffers[3].buffer = (void *)symname;
+  bind_buffers[3].buffer_length = (symname) ? strlen(symname) : 0;
+  bind_buffers[3].length = &bind_buffers[3].buffer_length;
+  bind_buffers[3].buffer_type = (symname) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_NULL;
+
+  if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0)
+    return GIT_ERROR;
+
+  // execute the statement
+  if (mysql_stmt_execute(backend->st_write) != 0)
+    return GIT_ERROR;
+
+  if (mysql_affected_rows(backend->db) != 1) {
+    /* Something bad happened. Error reporting (to stderr) would be nice,
+     * however not now XXX */
+    error = GIT_ERROR;
+  } else {
+    error = GIT_OK;
+  }
+
+  /* reset the statement for further use */
+  if (mysql_stmt_reset(backend->st_write) != 0)
+    return GIT_ERROR;
+
+  return error;
+}
+
+static int mysql_refdb_backend__write(git_refdb_backend *_backend,
+        const git_reference *ref, int force)
+{
+  mysql_refdb_backend *backend;
+  int error;
+
+  assert(_backend && ref);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  error = mysql_refdb__begin(backend);
+  if (error != GIT_OK)
+    return error;
+
+  error = mysql_refdb__write_row(backend, ref, force);
+  return mysql_refdb__finish(backend, error);
+}
+
+static void mysql_refdb_backend__free(git_refdb_backend *_backend)
+{
+  mysql_refdb_backend *backend;
+
+  assert(_backend);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  if (backend->st_lookup)
+    mysql_stmt_close(backend->st_lookup);
+  if (backend->st_write)
+    mysql_stmt_close(backend->st_write);
+  if (backend->st_delete)
+    mysql_stmt_close(backend->st_delete);
+  if (backend->st_iterate)
+    mysql_stmt_close(backend->st_iterate);
+  if (backend->st_generation)
+    mysql_stmt_close(backend->st_generation);
+  if (backend->st_bump)
+    mysql_stmt_close(backend->st_bump);
+
+  if (backend->cache_buckets > 0)
+    mysql_refdb__cache_clear(backend);
+  free(backend->cache);
+
+  mysql_close(backend->db);
+
+  free(backend);
+}
+
+/* Pruning: everything reachable from the refdb's refs is collected in an
+ * in-memory oid set by walking commits, trees and tags, fetched in batches
+ * of MYSQL_ODB_EXISTS_BATCH per query. Whatever else the header table lists
+ * and is older than the grace period is then deleted, a bounded batch per
+ * statement, paging through the table by oid. */
+
+typedef struct {
+  git_oid *set; /* Open addressing, keyed on the oid's leading bytes */
+  unsigned char *used;
+  size_t set_size;
+  size_t set_count;
+  git_oid *queue; /* Commits, trees and tags still to be parsed */
+  size_t queue_len;
+  size_t queue_alloc;
+} mysql_odb_walk;
+
+static size_t mysql_odb__walk_slot(const mysql_odb_walk *walk, const git_oid *oid)
+{
+  size_t hash, i;
+
+  memcpy(&hash, oid->id, sizeof(hash));
+  for (i = hash & (walk->set_size - 1); walk->used[i];
+       i = (i + 1) & (walk->set_size - 1)) {
+    if (git_oid_cmp(&walk->set[i], oid) == 0)
+      break;
+  }
+
+  return i;
+}
+
+static int mysql_odb__walk_contains(const mysql_odb_walk *walk, const git_oid *oid)
+{
+  return walk->used[mysql_odb__walk_slot(walk, oid)];
+}
+
+static int mysql_odb__walk_grow(mysql_odb_walk *walk)
+{
+  git_oid *old_set = walk->set;
+  unsigned char *old_used = walk->used;
+  size_t old_size = walk->set_size, i, slot;
+
+  walk->set_size = old_size ? old_size * 2 : 1024;
+  walk->set = malloc(walk->set_size * sizeof(git_oid));
+  walk->used = calloc(walk->set_size, 1);
+  if (walk->set == NULL || walk->used == NULL) {
+    free(walk->set);
+    free(walk->used);
+    walk->set = old_set;
+    walk->used = old_used;
+    walk->set_size = old_size;
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  for (i = 0; i < old_size; i++) {
+    if (!old_used[i])
+      continue;
+
+    slot = mysql_odb__walk_slot(walk, &old_set[i]);
+    git_oid_cpy(&walk->set[slot], &old_set[i]);
+    walk->used[slot] = 1;
+  }
+
+  free(old_set);
+  free(old_used);
+  return GIT_OK;
+}
+
+/* Mark an object reachable, queueing it for parsing if it may have links
+ * of its own and wasn't seen before */
+static int mysql_odb__walk_add(mysql_odb_walk *walk, const git_oid *oid, int parse)
+{
+  git_oid *queue;
+  size_t slot;
+
+  if (walk->set_count * 2 >= walk->set_size && mysql_odb__walk_grow(walk) != GIT_OK)
+    return GIT_ERROR;
+
+  slot = mysql_odb__walk_slot(walk, oid);
+  if (walk->used[slot])
+    return GIT_OK;
+
+  git_oid_cpy(&walk->set[slot], oid);
+  walk->used[slot] = 1;
+  walk->set_count++;
+
+  if (!parse)
+    return GIT_OK;
+
+  if (walk->queue_len == walk->queue_alloc) {
+    queue = realloc(walk->queue, sizeof(git_oid) * (walk->queue_alloc * 2 + 256));
+    if (queue == NULL) {
+      giterr_set_oom();
+      return GIT_ERROR;
+    }
+    walk->queue = queue;
+    walk->queue_alloc = walk->queue_alloc * 2 + 256;
+  }
+
+  git_oid_cpy(&walk->queue[walk->queue_len++], oid);
+  return GIT_OK;
+}
+
+static void mysql_odb__walk_free(mysql_odb_walk *walk)
+{
+  free(walk->set);
+  free(walk->used);
+  free(walk->queue);
+}
+
+/* Queue the objects a commit, tree or tag links to. Gitlinks point into
+ * other repositories and are skipped. */
+static int mysql_odb__walk_parse(mysql_odb_walk *walk, git_otype type,
+        const unsigned char *data, size_t len)
+{
+  const unsigned char *p = data, *end = data + len, *nul;
+  unsigned long mode;
+  git_oid oid;
+  int error = GIT_OK;
+
+  if (type == GIT_OBJ_TREE) {
+    while (p < end && error == GIT_OK) {
+      mode = strtoul((const char *)p, NULL, 8);
+      nul = memchr(p, '\0', end - p);
+      if (nul == NULL || end - nul - 1 < GIT_OID_RAWSZ)
+        break;
+
+      git_oid_fromraw(&oid, nul + 1);
+      p = nul + 1 + GIT_OID_RAWSZ;
+
+      if (mode == 0040000)
+        error = mysql_odb__walk_add(walk, &oid, 1);
+      else if (mode != 0160000)
+        error = mysql_odb__walk_add(walk, &oid, 0);
+    }
+
+    return error;
+  }
+
+  if (type != GIT_OBJ_COMMIT && type != GIT_OBJ_TAG)
+    return GIT_OK;
+
+  /* The links come first in the header, one per line, up to the blank
+   * line before the message */
+  while (p < end && *p != '\n' && error == GIT_OK) {
+    if (end - p > 5 + GIT_OID_HEXSZ &&
+        (memcmp(p, "tree ", 5) == 0 || memcmp(p, "object ", 7) == 0 ||
+         memcmp(p, "parent ", 7) == 0)) {
+      p = memchr(p, ' ', end - p) + 1;
+      if (end - p >= GIT_OID_HEXSZ &&
+          git_oid_fromstrn(&oid, (const char *)p, GIT_OID_HEXSZ) == GIT_OK)
+        error = mysql_odb__walk_add(walk, &oid, 1);
+    }
+
+    p = memchr(p, '\n', end - p);
+    if (p == NULL)
+      break;
+    p++;
+  }
+
+  return error;
+}
+
+/* Fetch and parse a batch of queued objects living on one shard */
+static int mysql_odb__walk_fetch(mysql_odb_backend *backend, mysql_odb_conn *conn,
+        mysql_odb_walk *walk, const git_oid *oids, size_t n)
+{
+  static const char sql_head[] =
+    "SELECT `oid`, `type`, `size`, `data` FROM `" GIT2_ODB_TABLE_NAME "` WHERE `oid` IN (";
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid oid;
+  git_otype type;
+  size_t size;
+  void *data;
+  char *sql;
+  size_t len;
+  int error = GIT_OK;
+
+  sql = malloc(sizeof(sql_head) + n * MYSQL_ODB_HEX_ITEM_LEN + 2);
+  if (sql == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  memcpy(sql, sql_head, sizeof(sql_head) - 1);
+  len = sizeof(sql_head) - 1;
+  len += mysql_odb__hex_list(sql + len, oids, n);
+  sql[len++] = ')';
+  sql[len] = '\0';
+
+  if (mysql_real_query(conn->db, sql, len) != 0 ||
+      (res = mysql_store_result(conn->db)) == NULL) {
+    free(sql);
+    return GIT_ERROR;
+  }
+  free(sql);
+
+  while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    if (lengths[0] != GIT_OID_RAWSZ)
+      continue;
+
+    git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+    type = (git_otype)atoi(row[1]);
+    size = (size_t)strtoull(row[2], NULL, 10);
+
+    if (type == GIT_OBJ_BLOB)
+      continue;
+
+    if (lengths[3] == 0 && size > 0) {
+      // chunked; rare enough for a separate read
+      error = mysql_odb__read(backend, conn, &data, &size, &type, &oid);
+    } else {
+      data = malloc(size + 1);
+      if (data == NULL) {
+        giterr_set_oom();
+        error = GIT_ERROR;
+      } else if (mysql_odb__uncompress(data, size, (const unsigned char *)row[3], lengths[3]) != GIT_OK) {
+        giterr_set_str(GITERR_ODB, "MySQL odb contains a corrupt object");
+        free(data);
+        error = GIT_ERROR;
+      }
+    }
+
+    if (error == GIT_OK) {
+      error = mysql_odb__walk_parse(walk, type, data, size);
+      free(data);
+    }
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+/* Parse queued objects until there are none left. Objects in stored packs
+ * are read from there; the rest are fetched from their shard in batches. */
+static int mysql_odb__walk_run(mysql_odb_backend *backend, mysql_odb_walk *walk)
+{
+  git_oid batch[MYSQL_ODB_EXISTS_BATCH];
+  git_oid shard_batch[MYSQL_ODB_EXISTS_BATCH];
+  git_odb_object *object;
+  size_t n, i, s, shard_n;
+  int error = GIT_OK;
+
+  while (walk->queue_len > 0 && error == GIT_OK) {
+    n = 0;
+    while (walk->queue_len > 0 && n < MYSQL_ODB_EXISTS_BATCH) {
+      git_oid_cpy(&batch[n], &walk->queue[--walk->queue_len]);
+
+      if (backend->packs && git_odb_read(&object, backend->packs, &batch[n]) == GIT_OK) {
+        error = mysql_odb__walk_parse(walk, git_odb_object_type(object),
+                  git_odb_object_data(object), git_odb_object_size(object));
+        git_odb_object_free(object);
+        if (error != GIT_OK)
+          return error;
+        continue;
+      }
+
+      n++;
+    }
+
+    for (s = 0; s < backend->shard_count && error == GIT_OK; s++) {
+      for (i = 0, shard_n = 0; i < n; i++) {
+        if (backend->route[batch[i].id[0]] == s)
+          git_oid_cpy(&shard_batch[shard_n++], &batch[i]);
+      }
+
+      if (shard_n > 0)
+        error = mysql_odb__walk_fetch(backend, backend->shards[s], walk,
+                  shard_batch, shard_n);
+    }
+  }
+
+  return error;
+}
+
+/* Mark the targets of all direct refs reachable, and walk from them */
+static int mysql_odb__walk_refs(mysql_odb_backend *backend,
+        mysql_refdb_backend *refdb, mysql_odb_walk *walk)
+{
+  static const char *sql_roots =
+    "SELECT `oid` FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `type` = 1;";
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  git_oid oid;
+  int error = GIT_OK;
+
+  if (mysql_real_query(refdb->db, sql_roots, strlen(sql_roots)) != 0 ||
+      (res = mysql_store_result(refdb->db)) == NULL)
+    return GIT_ERROR;
+
+  while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+    lengths = mysql_fetch_lengths(res);
+    if (row[0] == NULL || lengths[0] != GIT_OID_RAWSZ)
+      continue;
+
+    git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+    error = mysql_odb__walk_add(walk, &oid, 1);
+  }
+
+  mysql_free_result(res);
+
+  if (error != GIT_OK)
+    return error;
+
+  return mysql_odb__walk_run(backend, walk);
+}
+
+/* Delete a batch of objects from one shard: the header rows first, so the
+ * objects stop being visible before their data goes */
+static int mysql_odb__prune_batch(mysql_odb_backend *backend,
+        mysql_odb_conn *conn, const git_oid *oids, size_t n)
+{
+  static const char *tables[] = {
+    GIT2_ODB_HEADER_TABLE_NAME, GIT2_ODB_TABLE_NAME, GIT2_ODB_CHUNK_TABLE_NAME
+  };
+  char *sql, *list;
+  size_t i, len;
+  int error = GIT_OK;
+
+  list = malloc(n * MYSQL_ODB_HEX_ITEM_LEN + 1);
+  sql = malloc(n * MYSQL_ODB_HEX_ITEM_LEN + 128);
+  if (list == NULL || sql == NULL) {
+    free(list);
+    free(sql);
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  mysql_odb__hex_list(list, oids, n);
+
+  for (i = 0; i < 3 && error == GIT_OK; i++) {
+    if (i == 2 && !backend->chunked_storage)
+      break;
+
+    len = sprintf(sql, "DELETE FROM `%s` WHERE `oid` IN (%s);", tables[i], list);
+    if (mysql_real_query(conn->db, sql, len) != 0)
+      error = GIT_ERROR;
+  }
+
+  free(list);
+  free(sql);
+  return error;
+}
+
+/* Page through the header table of one shard in oid order, deleting
+ * whatever old enough wasn't reached */
+static int mysql_odb__prune_shard(mysql_odb_backend *backend, size_t shard,
+        const mysql_odb_walk *walk, unsigned int grace_seconds,
+        unsigned int batch_size, size_t *pruned)
+{
+  mysql_odb_conn *conn = backend->shards[shard];
+  char sql[256], last_hex[GIT_OID_HEXSZ + 1];
+  git_oid last, oid, *doomed;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  unsigned long *lengths;
+  my_ulonglong rows;
+  size_t n;
+  int error = GIT_OK;
+
+  doomed = malloc(sizeof(git_oid) * batch_size);
+  if (doomed == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  memset(&last, 0, sizeof(last));
+
+  do {
+    git_oid_fmt(last_hex, &last);
+    last_hex[GIT_OID_HEXSZ] = '\0';
+
+    snprintf(sql, sizeof(sql),
+      "SELECT `oid` FROM `" GIT2_ODB_HEADER_TABLE_NAME "` WHERE `oid` > X'%s' "
+      "AND `created` < NOW() - INTERVAL %u SECOND ORDER BY `oid` LIMIT %u;",
+      last_hex, grace_seconds, batch_size);
+
+    if (mysql_real_query(conn->db, sql, strlen(sql)) != 0 ||
+        (res = mysql_store_result(conn->db)) == NULL) {
+      error = GIT_ERROR;
+      break;
+    }
+
+    rows = mysql_num_rows(res);
+    n = 0;
+    while ((row = mysql_fetch_row(res)) != NULL) {
+      lengths = mysql_fetch_lengths(res);
+      if (lengths[0] != GIT_OID_RAWSZ)
+        continue;
+
+      git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+      git_oid_cpy(&last, &oid);
+
+      // leave anything the shard map doesn't give this shard alone
+      if (backend->route[oid.id[0]] == shard && !mysql_odb__walk_contains(walk, &oid))
+        git_oid_cpy(&doomed[n++], &oid);
+    }
+
+    mysql_free_result(res);
+
+    if (n > 0) {
+      error = mysql_odb__prune_batch(backend, conn, doomed, n);
+      if (error == GIT_OK)
+        *pruned += n;
+    }
+  } while (error == GIT_OK && rows == batch_size);
+
+  free(doomed);
+  return error;
+}
+
+/* Run the CREATE TABLE statement of one of the odb's tables, all of which
+ * have the oid leading their primary key, adding a PARTITION BY KEY clause
+ * when asked for partitions */
+static int create_object_table(MYSQL *db, const char *sql, unsigned int partitions)
+{
+  char *query;
+  size_t len;
+  int error = GIT_OK;
+
+  if (partitions == 0)
+    return (mysql_real_query(db, sql, strlen(sql)) == 0) ? GIT_OK : GIT_ERROR;
+
+  len = strlen(sql) + 64;
+  query = malloc(len);
+  if (query == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  // drop the terminating ';' to tack the partitioning on
+  snprintf(query, len, "%.*s PARTITION BY KEY(`oid`) PARTITIONS %u;",
+    (int)strlen(sql) - 1, sql, partitions);
+
+  if (mysql_real_query(db, query, strlen(query)) != 0)
+    error = GIT_ERROR;
+
+  free(query);
+  return error;
+}
+
+/* The header table keeps the columns header reads and existence checks need
+ * apart from the bulky odb table, so that its primary key stays small enough
+ * to live in the buffer pool. The odb table just holds the data. */
+static int create_header_table(MYSQL *db, unsigned int partitions)
+{
+  static const char *sql_create_headers =
+    "CREATE TABLE IF NOT EXISTS `" GIT2_ODB_HEADER_TABLE_NAME "` ("
+    "  `oid` binary(20) NOT NULL DEFAULT '',"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `size` bigint(20) unsigned NOT NULL,"
+    "  `location` tinyint(1) unsigned NOT NULL,"
+    "  `created` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+    "  PRIMARY KEY (`oid`)"
+    ") ENGINE=" GIT2_ODB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+  return create_object_table(db, sql_create_headers, partitions);
+}
+
+/* One row holding the refdb's generation, bumped by every ref write and
+ * delete. Made on demand, so existing databases gain it on open. */
+static int ensure_generation_table(MYSQL *db)
+{
+  static const char *sql_create_generation =
+    "CREATE TABLE IF NOT EXISTS `" GIT2_REFDB_GENERATION_TABLE_NAME "` ("
+    "  `id` tinyint(1) unsigned NOT NULL,"
+    "  `generation` bigint(20) unsigned NOT NULL,"
+    "  PRIMARY KEY (`id`)"
+    ") ENGINE=" GIT2_REFDB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  static const char *sql_init_generation =
+    "INSERT IGNORE INTO `" GIT2_REFDB_GENERATION_TABLE_NAME "` VALUES (0, 0);";
+
+  if (mysql_real_query(db, sql_create_generation, strlen(sql_create_generation)) != 0)
+    return GIT_ERROR;
+
+  if (mysql_real_query(db, sql_init_generation, strlen(sql_init_generation)) != 0)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+static int create_table(MYSQL *db, unsigned int partitions)
+{
+  static const char *sql_create_odb =
+    "CREATE TABLE `" GIT2_ODB_TABLE_NAME "` ("
+    "  `oid` binary(20) NOT NULL DEFAULT '',"
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `size` bigint(20) unsigned NOT NULL,"
+    "  `data` longblob NOT NULL,"
+    "  PRIMARY KEY (`oid`)"
+    ") ENGINE=" GIT2_ODB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  static const char *sql_create_chunks =
+    "CREATE TABLE `" GIT2_ODB_CHUNK_TABLE_NAME "` ("
+    "  `oid` binary(20) NOT NULL DEFAULT '',"
+    "  `seq` int(10) unsigned NOT NULL,"
+    "  `data` longblob NOT NULL,"
+    "  PRIMARY KEY (`oid`, `seq`)"
+    ") ENGINE=" GIT2_ODB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  static const char *sql_create_packs =
+    "CREATE TABLE `" GIT2_ODB_PACK_TABLE_NAME "` ("
+    "  `id` binary(20) NOT NULL DEFAULT '',"
+    "  `kind` tinyint(1) unsigned NOT NULL,"
+    "  `seq` int(10) unsigned NOT NULL,"
+    "  `data` longblob NOT NULL,"
+    "  PRIMARY KEY (`id`, `kind`, `seq`)"
+    ") ENGINE=" GIT2_ODB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+  static const char *sql_create_refdb =
+    "CREATE TABLE `" GIT2_REFDB_TABLE_NAME "` ("
+    "  `refname` text COLLATE utf8_bin NOT NULL, "
+    "  `type` tinyint(1) unsigned NOT NULL,"
+    "  `oid` binary(20), "
+    "  `symref` TEXT COLLATE utf8_bin, "
+    "  KEY `name` (`refname`(32)) "
+    ") ENGINE=" GIT2_REFDB_STORAGE_ENGINE " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+  if (create_object_table(db, sql_create_odb, partitions) != GIT_OK)
+    return GIT_ERROR;
+
+  if (create_object_table(db, sql_create_chunks, partitions) != GIT_OK)
+    return GIT_ERROR;
+
+  if (mysql_real_query(db, sql_create_packs, strlen(sql_create_packs)) != 0)
+    return GIT_ERROR;
+
+  if (create_header_table(db, partitions) != GIT_OK)
+    return GIT_ERROR;
+
+  if (mysql_real_query(db, sql_create_refdb, strlen(sql_create_refdb)) != 0)
+    return GIT_ERROR;
+
+  if (ensure_generation_table(db) != GIT_OK)
+    return GIT_ERROR;
+
+  return GIT_OK;
+}
+
+static int check_table_present(MYSQL *db, const char *query)
+{
+  MYSQL_RES *res;
+  int error;
+  my_ulonglong num_rows;
+
+  if (mysql_real_query(db, query, strlen(query)) != 0)
+    return GIT_ERROR;
+
+  res = mysql_store_result(db);
+  if (res == NULL)
+    return GIT_ERROR;
+
+  num_rows = mysql_num_rows(res);
+  if (num_rows == 0) {
+    /* the table was not found */
+    error = GIT_ENOTFOUND;
+  } else if (num_rows > 0) {
+    /* the table was found */
+    error = GIT_OK;
+  } else {
+    error = GIT_ERROR;
+  }
+
+  mysql_free_result(res);
+  return error;
+}
+
+static int check_db_present(MYSQL *db)
+{
+  static const char *sql_check_odb =
+    "SHOW TABLES LIKE '" GIT2_ODB_TABLE_NAME "';";
+  static const char *sql_check_refdb =
+    "SHOW TABLES LIKE '" GIT2_REFDB_TABLE_NAME "';";
+  int error;
+
+  error = check_table_present(db, sql_check_odb);
+  if (error != GIT_OK)
+    return error;
+
+  error = check_table_present(db, sql_check_refdb);
+  return error;
+}
+
+static int init_exists_batch_statement(mysql_odb_conn *conn, const char *table)
+{
+  char sql_head[64];
+  char *sql;
+  size_t i, len;
+  int error;
+
+  snprintf(sql_head, sizeof(sql_head), "SELECT `oid` FROM `%s` WHERE `oid` IN (", table);
+
+  len = strlen(sql_head) + 1 + 2 * MYSQL_ODB_EXISTS_BATCH + 2;
+  sql = malloc(len);
+  if (sql == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  strcpy(sql, sql_head);
+  len = strlen(sql_head);
+  for (i = 0; i < MYSQL_ODB_EXISTS_BATCH; i++) {
+    sql[len++] = '?';
+    sql[len++] = ',';
+  }
+  sql[len - 1] = ')';
+  sql[len++] = ';';
+  sql[len] = '\0';
+
+  error = init_statement(conn->db, &conn->st_exists_batch, sql);
+  free(sql);
+  return error;
+}
+
+static int init_odb_statements(mysql_odb_conn *conn, int writable, int chunked,
+        int header_table)
+{
+  my_bool truth = 1;
+
+  /* Object data is fetched still compressed and inflated client side, which
+   * keeps the wire transfer small and the decompression off the server */
+  static const char *sql_read =
+    "SELECT `type`, `size`, `data` FROM `" GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+
+  static const char *sql_read_header =
+    "SELECT `type`, `size` FROM `" GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+
+  static const char *sql_read_header_split =
+    "SELECT `type`, `size` FROM `" GIT2_ODB_HEADER_TABLE_NAME "` WHERE `oid` = ?;";
+
+  static const char *sql_write_header =
+    "INSERT INTO `" GIT2_ODB_HEADER_TABLE_NAME "` (`oid`, `type`, `size`, `location`) VALUES (?, ?, ?, ?) "
+    "ON DUPLICATE KEY UPDATE `created` = CURRENT_TIMESTAMP;";
+
+  static const char *sql_read_prefix =
+    "SELECT `oid`, `type`, `size`, `data` FROM `" GIT2_ODB_TABLE_NAME "` WHERE oid LIKE CONCAT(?, '%');";
+
+  static const char *sql_write =
+    "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME "` VALUES (?, ?, ?, COMPRESS(?));";
+
+  static const char *sql_read_chunk =
+    "SELECT `data` FROM `" GIT2_ODB_CHUNK_TABLE_NAME "` WHERE `oid` = ? AND `seq` = ?;";
+
+  static const char *sql_write_chunk =
+    "INSERT IGNORE INTO `" GIT2_ODB_CHUNK_TABLE_NAME "` VALUES (?, ?, COMPRESS(?));";
+
+  static const char *sql_rename_chunks =
+    "UPDATE `" GIT2_ODB_CHUNK_TABLE_NAME "` SET `oid` = ? WHERE `oid` = ?;";
+
+  static const char *sql_delete_chunks =
+    "DELETE FROM `" GIT2_ODB_CHUNK_TABLE_NAME "` WHERE `oid` = ?;";
+
+
+  conn->st_read = mysql_stmt_init(conn->db);
+  if (conn->st_read == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(conn->st_read, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(conn->st_read, sql_read, strlen(sql_read)) != 0)
+    return GIT_ERROR;
+
+  conn->meta_read = mysql_stmt_result_metadata(conn->st_read);
+  if (conn->meta_read == NULL)
+    return GIT_ERROR;
+
+
+  conn->st_read_header = mysql_stmt_init(conn->db);
+  if (conn->st_read_header == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(conn->st_read_header, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (header_table)
+    sql_read_header = sql_read_header_split;
+
+  if (mysql_stmt_prepare(conn->st_read_header, sql_read_header, strlen(sql_read_header)) != 0)
+    return GIT_ERROR;
+
+
+  conn->st_read_prefix = mysql_stmt_init(conn->db);
+  if (conn->st_read_prefix == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(conn->st_read_prefix, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(conn->st_read_prefix, sql_read_prefix, strlen(sql_read_prefix)) != 0)
+    return GIT_ERROR;
+
+  conn->meta_read_prefix = mysql_stmt_result_metadata(conn->st_read_prefix);
+  if (conn->meta_read_prefix == NULL)
+    return GIT_ERROR;
+
+  if (chunked) {
+    if (init_statement(conn->db, &conn->st_read_chunk, sql_read_chunk) != GIT_OK)
+      return GIT_ERROR;
+
+    conn->meta_read_chunk = mysql_stmt_result_metadata(conn->st_read_chunk);
+    if (conn->meta_read_chunk == NULL)
+      return GIT_ERROR;
+  }
+
+  /* Replicas are read only, and their user may well lack INSERT privileges */
+  if (!writable)
+    return GIT_OK;
+
+  conn->st_write = mysql_stmt_init(conn->db);
+  if (conn->st_write == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(conn->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(conn->st_write, sql_write, strlen(sql_write)) != 0)
+    return GIT_ERROR;
+
+  if (init_exists_batch_statement(conn, header_table ?
+        GIT2_ODB_HEADER_TABLE_NAME : GIT2_ODB_TABLE_NAME) != GIT_OK)
+    return GIT_ERROR;
+
+  if (header_table &&
+      init_statement(conn->db, &conn->st_write_header, sql_write_header) != GIT_OK)
+    return GIT_ERROR;
+
+  if (chunked) {
+    if (init_statement(conn->db, &conn->st_write_chunk, sql_write_chunk) != GIT_OK ||
+        init_statement(conn->db, &conn->st_rename_chunks, sql_rename_chunks) != GIT_OK ||
+        init_statement(conn->db, &conn->st_delete_chunks, sql_delete_chunks) != GIT_OK)
+      return GIT_ERROR;
+  }
+
+  return GIT_OK;
+}
+
+static int init_refdb_statements(mysql_refdb_backend *backend)
+{
+  my_bool truth = 1;
+
+  static const char *sql_lookup =
+    "SELECT `type`, `oid`, `symref` FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `refname` = ?;";
+
+  static const char *sql_write =
+    "INSERT INTO `" GIT2_REFDB_TABLE_NAME "` VALUES (?, ?, ?, ?);";
+
+  static const char *sql_delete =
+    "DELETE FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `refname` = ?;";
+
+  static const char *sql_iterate =
+    "SELECT `refname`, `type`, `oid`, `symref` FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `refname` LIKE REPLACE(REPLACE(?, '?', '_'), '*', '%');";
+
+  static const char *sql_generation =
+    "SELECT `generation` FROM `" GIT2_REFDB_GENERATION_TABLE_NAME "` WHERE `id` = 0;";
+
+  static const char *sql_bump =
+    "UPDATE `" GIT2_REFDB_GENERATION_TABLE_NAME "` SET `generation` = `generation` + 1 WHERE `id` = 0;";
+
+  backend->st_lookup = mysql_stmt_init(backend->db);
+  if (backend->st_lookup == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(backend->st_lookup, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(backend->st_lookup, sql_lookup, strlen(sql_lookup)) != 0)
+    return GIT_ERROR;
+
+
+  backend->st_write = mysql_stmt_init(backend->db);
+  if (backend->st_write == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_write)) != 0)
+    return GIT_ERROR;
+
+
+  backend->st_delete = mysql_stmt_init(backend->db);
+  if (backend->st_delete == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(backend->st_delete, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(backend->st_delete, sql_delete, strlen(sql_delete)) != 0)
+    return GIT_ERROR;
+
+
+  backend->st_iterate = mysql_stmt_init(backend->db);
+  if (backend->st_iterate == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_attr_set(backend->st_iterate, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(backend->st_iterate, sql_iterate, strlen(sql_iterate)) != 0)
+    return GIT_ERROR;
+
+
+  if (!backend->generation_table)
+    return GIT_OK;
+
+  backend->st_generation = mysql_stmt_init(backend->db);
+  if (backend->st_generation == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(backend->st_generation, sql_generation, strlen(sql_generation)) != 0)
+    return GIT_ERROR;
+
+
+  backend->st_bump = mysql_stmt_init(backend->db);
+  if (backend->st_bump == NULL)
+    return GIT_ERROR;
+
+  if (mysql_stmt_prepare(backend->st_bump, sql_bump, strlen(sql_bump)) != 0)
+    return GIT_ERROR;
+
+
+  return GIT_OK;
+}
+
+static MYSQL *connect_to_server(const char *mysql_host, const char *mysql_user,
+        const char *mysql_passwd, const char *mysql_db, unsigned int mysql_port,
+        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  my_bool reconnect;
+
+  MYSQL *db = mysql_init(NULL);
+
+  reconnect = 1;
+  // allow libmysql to reconnect gracefully
+  if (mysql_options(db, MYSQL_OPT_RECONNECT, &reconnect) != 0)
+    goto cleanup;
+
+  // make the connection
+  if (mysql_real_connect(db, mysql_host, mysql_user, mysql_passwd, mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag) != db)
+    goto cleanup;
+
+  return db;
+
+cleanup:
+  mysql_close(db);
+  return NULL;
+}
+
+int git_odb_backend_mysql_open(git_odb_backend **odb_out, git_refdb_backend **refdb_out,
+        const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  mysql_odb_backend *odb_backend;
+  mysql_refdb_backend *refdb_backend;
+  int error = GIT_ERROR;
+
+  odb_backend = calloc(1, sizeof(mysql_odb_backend));
+  if (odb_backend == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  refdb_backend = calloc(1, sizeof(mysql_refdb_backend));
+  if (refdb_backend == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  /* Until told otherwise, the primary holds every object */
+  odb_backend->shards = malloc(sizeof(mysql_odb_conn *));
+  if (odb_backend->shards == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
+  odb_backend->shards[0] = &odb_backend->primary;
+  odb_backend->shard_count = 1;
+
+  /* Create two connections, one for odb access, the other for refdb. This
+   * simplifies situations where, perhaps, a refdb_backend is freed but the
+   * odb_backend continues elsewhere. */
+  odb_backend->primary.db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
+                       mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
+  refdb_backend->db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
+                       mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
+
+  if (!odb_backend->primary.db || !refdb_backend->db)
+    goto cleanup;
+
+  // check for existence of db
+  error = check_db_present(odb_backend->primary.db);
+  if (error < 0)
+    goto cleanup;
+
+  /* Databases created before chunked storage existed just keep storing
+   * every object inline */
+  odb_backend->chunked_storage = (check_table_present(odb_backend->primary.db,
+        "SHOW TABLES LIKE '" GIT2_ODB_CHUNK_TABLE_NAME "';") == GIT_OK);
+
+  odb_backend->header_table = (check_table_present(odb_backend->primary.db,
+        "SHOW TABLES LIKE '" GIT2_ODB_HEADER_TABLE_NAME "';") == GIT_OK);
+
+  error = init_odb_statements(&odb_backend->primary, 1,
+            odb_backend->chunked_storage, odb_backend->header_table);
+  if (error < 0)
+    goto cleanup;
+
+  /* Without a generation table (say, for a user that may not create one)
+   * the refdb works uncached. Whether there is one is checked apart from
+   * trying to make it: a user that may not create it must still bump it
+   * when it's there, or other processes would keep serving stale refs. */
+  ensure_generation_table(refdb_backend->db);
+  refdb_backend->generation_table = (check_table_present(refdb_backend->db,
+        "SHOW TABLES LIKE '" GIT2_REFDB_GENERATION_TABLE_NAME "';") == GIT_OK);
+  refdb_backend->cache_enabled = refdb_backend->generation_table;
+  refdb_backend->cache_ttl_ms = MYSQL_REFDB_CACHE_TTL_MS;
+
+  error = init_refdb_statements(refdb_backend);
+  if (error < 0)
+    goto cleanup;
+
+  odb_backend->parent.version = GIT_ODB_BACKEND_VERSION;
+  odb_backend->parent.odb = NULL;
+  odb_backend->parent.read = &mysql_odb_backend__read;
+  odb_backend->parent.read_header = &mysql_odb_backend__read_header;
+  odb_backend->parent.read_prefix = &mysql_odb_backend__read_prefix;
+  odb_backend->parent.write = &mysql_odb_backend__write;
+  odb_backend->parent.exists = &mysql_odb_backend__exists;
+  odb_backend->parent.free = &mysql_odb_backend__free;
+  odb_backend->parent.writepack = &mysql_odb_backend__writepack;
+  odb_backend->parent.readstream = &mysql_odb_backend__readstream;
+  odb_backend->parent.writestream = &mysql_odb_backend__writestream;
+  odb_backend->parent.refresh = &mysql_odb_backend__refresh;
+  odb_backend->parent.foreach = &mysql_odb_backend__foreach;
+
+  refdb_backend->parent.version = GIT_ODB_BACKEND_VERSION ;
+  refdb_backend->parent.exists = &mysql_refdb_backend__exists;
+  refdb_backend->parent.lookup = &mysql_refdb_backend__lookup;
+  refdb_backend->parent.iterator = &mysql_refdb_backend__iterator;
+  refdb_backend->parent.write = &mysql_refdb_backend__write;
+  refdb_backend->parent.delete = &mysql_refdb_backend__delete;
+  refdb_backend->parent.free = &mysql_refdb_backend__free;
+
+  *odb_out = (git_odb_backend *)odb_backend;
+  *refdb_out = &refdb_backend->parent;
+  return GIT_OK;
+
+cleanup:
+  mysql_odb_backend__free((git_odb_backend *)odb_backend);
+  mysql_refdb_backend__free(&refdb_backend->parent);
+  return error;
+}
+
+int git_odb_backend_mysql_create_partitioned(const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket,
+        unsigned long mysql_client_flag, unsigned int partitions)
+{
+  /* Like git_odb_backend_mysql_create, but with the object tables split
+   * into `partitions` partitions by oid (none if 0). Also used to set up
+   * the servers given to git_odb_backend_mysql_add_shard. */
+  MYSQL *db;
+  int error = GIT_ERROR;
+
+  db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
+               mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
+
+  if (!db)
+    goto cleanup;
+
+  error = create_table(db, partitions);
+  if (error != GIT_OK)
+    return error;
+
+  /* Everything breaks if we don't have a HEAD ref */
+
+  /* XXX, 2 is hardcoded. Could stringify if this were a macro */
+  if (mysql_query(db, "INSERT INTO `" GIT2_REFDB_TABLE_NAME "` VALUES ('HEAD', 2, NULL, 'refs/heads/master');") != 0)
+    error = GIT_ERROR;
+  else
+    error = GIT_OK;
+
+cleanup:
+  if (db)
+    mysql_close(db);
+
+  return error;
+}
+
+int git_odb_backend_mysql_create(const char *mysql_host, const char *mysql_user,
+        const char *mysql_passwd, const char *mysql_db, unsigned int mysql_port,
+        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  return git_odb_backend_mysql_create_partitioned(mysql_host, mysql_user,
+           mysql_passwd, mysql_db, mysql_port, mysql_unix_socket,
+           mysql_client_flag, 0);
+}
+
+int git_odb_backend_mysql_add_replica(git_odb_backend *_backend,
+        const char *mysql_host, const char *mysql_user, const char *mysql_passwd,
+        const char *mysql_db, unsigned int mysql_port,
+        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  /* Add a read replica of the database given to git_odb_backend_mysql_open.
+   * Object reads are spread over the replicas, falling back to the primary
+   * whenever a replica doesn't have the object (yet). Writes, and everything
+   * the refdb does, stay on the primary. Objects held by shards are always
+   * read from their shard. */
+  mysql_odb_backend *backend;
+  mysql_odb_conn *replicas;
+  mysql_odb_conn conn;
+  int error;
+
+  assert(_backend);
+
+  backend = (mysql_odb_backend *)_backend;
+  memset(&conn, 0, sizeof(conn));
+
+  conn.db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
+              mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
+  if (!conn.db) {
+    giterr_set_str(GITERR_ODB, "MySQL odb couldn't connect to replica");
+    return GIT_ERROR;
+  }
+
+  error = init_odb_statements(&conn, 0, backend->chunked_storage,
+            backend->header_table);
+  if (error < 0)
+    goto cleanup;
+
+  replicas = realloc(backend->replicas,
+               sizeof(mysql_odb_conn) * (backend->replica_count + 1));
+  if (replicas == NULL) {
+    giterr_set_oom();
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+
+  replicas[backend->replica_count++] = conn;
+  backend->replicas = replicas;
+  return GIT_OK;
+
+cleanup:
+  mysql_odb__conn_free(&conn);
+  return error;
+}
+
+int git_odb_backend_mysql_add_shard(git_odb_backend *_backend,
+        unsigned char first, unsigned char last,
+        const char *mysql_host, const char *mysql_user, const char *mysql_passwd,
+        const char *mysql_db, unsigned int mysql_port,
+        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  /* Hand the objects whose oids start with a byte from first to last
+   * (inclusive) to another server, set up like the primary. Every user of
+   * the database has to add the same shards, before touching any objects:
+   * nothing is moved between servers. The refdb, stored packs and read
+   * replicas stay with the primary. */
+  mysql_odb_backend *backend;
+  mysql_odb_conn **shards;
+  mysql_odb_conn *conn;
+  unsigned int i;
+  int error = GIT_ERROR;
+
+  assert(_backend);
+
+  backend = (mysql_odb_backend *)_backend;
+
+  if (first > last || backend->shard_count > 255) {
+    giterr_set_str(GITERR_INVALID, "MySQL odb shard range is invalid");
+    return GIT_ERROR;
+  }
+
+#ifdef GIT2_MYSQL_ASYNC
+  if (backend->async_count > 0) {
+    giterr_set_str(GITERR_ODB, "MySQL odb can't add shards once it has asynchronous connections");
+    return GIT_ERROR;
+  }
+#endif
+
+  conn = calloc(1, sizeof(mysql_odb_conn));
+  if (conn == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  conn->db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
+               mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
+  if (!conn->db) {
+    giterr_set_str(GITERR_ODB, "MySQL odb couldn't connect to shard");
+    goto cleanup;
+  }
+
+  error = check_table_present(conn->db, "SHOW TABLES LIKE '" GIT2_ODB_TABLE_NAME "';");
+  if (error < 0)
+    goto cleanup;
+
+  error = init_odb_statements(conn, 1, backend->chunked_storage,
+            backend->header_table);
+  if (error < 0)
+    goto cleanup;
+
+  shards = realloc(backend->shards,
+             sizeof(mysql_odb_conn *) * (backend->shard_count + 1));
+  if (shards == NULL) {
+    giterr_set_oom();
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+  backend->shards = shards;
+
+  for (i = first; i <= last; i++)
+    backend->route[i] = (unsigned char)backend->shard_count;
+
+  backend->shards[backend->shard_count++] = conn;
+  return GIT_OK;
 
-  if (mysql_stmt_prepare(backend->st_read_header, sql_read_header, strlen(sql_read_header)) != 0)
-    return GIT_ERROR;
+cleanup:
+  mysql_odb__conn_free(conn);
+  free(conn);
+  return error;
+}
 
+int git_odb_backend_mysql_prune(size_t *pruned_out,
+        git_odb_backend *_backend, git_refdb_backend *_refdb,
+        unsigned int grace_seconds, unsigned int batch_size)
+{
+  /* Delete every object not reachable from the refs in the given refdb and
+   * stored more than grace_seconds ago. The grace period protects objects
+   * that are on their way to being referenced, e.g. by a push in progress;
+   * it should comfortably exceed the time any write takes. Each delete
+   * statement covers at most batch_size objects (1000 if 0), keeping
+   * transactions and replication events small. Needs the header table,
+   * which records when objects were stored. Objects in stored packs are
+   * never pruned. */
+  mysql_odb_backend *backend;
+  mysql_refdb_backend *refdb;
+  mysql_odb_walk walk;
+  size_t s;
+  int error;
 
-  backend->st_read_prefix = mysql_stmt_init(backend->db);
-  if (backend->st_read_prefix == NULL)
-    return GIT_ERROR;
+  assert(pruned_out && _backend && _refdb);
 
-  if (mysql_stmt_attr_set(backend->st_read_prefix, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  backend = (mysql_odb_backend *)_backend;
+  refdb = (mysql_refdb_backend *)_refdb;
+  *pruned_out = 0;
 
-  if (mysql_stmt_prepare(backend->st_read_prefix, sql_read_prefix, strlen(sql_read_prefix)) != 0)
+  if (!backend->header_table) {
+    giterr_set_str(GITERR_ODB, "MySQL odb can only prune with a header table");
     return GIT_ERROR;
+  }
 
+  if (batch_size == 0)
+    batch_size = 1000;
 
-  backend->st_write = mysql_stmt_init(backend->db);
-  if (backend->st_write == NULL)
+  memset(&walk, 0, sizeof(walk));
+  if (mysql_odb__walk_grow(&walk) != GIT_OK)
     return GIT_ERROR;
 
-  if (mysql_stmt_attr_set(backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  error = mysql_odb__walk_refs(backend, refdb, &walk);
 
-  if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_write)) != 0)
-    return GIT_ERROR;
+  /* Refs may have moved during the walk, to objects that were stored long
+   * ago and already unreachable when it started. Go over the refs once more;
+   * this time round only what's new gets walked. */
+  if (error == GIT_OK)
+    error = mysql_odb__walk_refs(backend, refdb, &walk);
 
+  for (s = 0; s < backend->shard_count && error == GIT_OK; s++)
+    error = mysql_odb__prune_shard(backend, s, &walk, grace_seconds,
+              batch_size, pruned_out);
 
-  return GIT_OK;
+  mysql_odb__walk_free(&walk);
+  return error;
 }
 
-static int init_refdb_statements(mysql_refdb_backend *backend)
+int git_odb_backend_mysql_set_staging(git_odb_backend *_backend,
+        const char *memory_dir, size_t memory_limit, const char *spill_dir)
 {
-  my_bool truth = 1;
-
-  static const char *sql_lookup =
-    "SELECT `type`, `oid`, `symref` FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `refname` = ?;";
-
-  static const char *sql_write =
-    "INSERT INTO `" GIT2_REFDB_TABLE_NAME "` VALUES (?, ?, ?, ?);";
-
-  static const char *sql_delete =
-    "DELETE FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `refname` = ?;";
-
-  static const char *sql_iterate =
-    "SELECT `refname`, `type`, `oid`, `symref` FROM `" GIT2_REFDB_TABLE_NAME "` WHERE `refname` LIKE REPLACE(REPLACE(?, '?', '_'), '*', '%');";
+  /* Choose where writepack stages the packs it receives. With a memory_dir
+   * (a tmpfs mount such as /dev/shm), packs are held in memory while they're
+   * at most memory_limit bytes, and written to memory_dir to be indexed once
+   * complete; bigger ones spill to spill_dir as they arrive. Without one,
+   * packs go to spill_dir directly. A NULL spill_dir means /tmp. */
+  mysql_odb_backend *backend;
+  char *memory_copy = NULL, *spill_copy = NULL;
 
-  backend->st_lookup = mysql_stmt_init(backend->db);
-  if (backend->st_lookup == NULL)
-    return GIT_ERROR;
+  assert(_backend);
 
-  if (mysql_stmt_attr_set(backend->st_lookup, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  backend = (mysql_odb_backend *)_backend;
 
-  if (mysql_stmt_prepare(backend->st_lookup, sql_lookup, strlen(sql_lookup)) != 0)
+  if ((memory_dir && (memory_copy = strdup(memory_dir)) == NULL) ||
+      (spill_dir && (spill_copy = strdup(spill_dir)) == NULL)) {
+    free(memory_copy);
+    giterr_set_oom();
     return GIT_ERROR;
+  }
 
+  free(backend->staging_memory_dir);
+  free(backend->staging_spill_dir);
+  backend->staging_memory_dir = memory_copy;
+  backend->staging_spill_dir = spill_copy;
+  backend->staging_limit = memory_dir ? memory_limit : 0;
+  return GIT_OK;
+}
 
-  backend->st_write = mysql_stmt_init(backend->db);
-  if (backend->st_write == NULL)
-    return GIT_ERROR;
-
-  if (mysql_stmt_attr_set(backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+int git_odb_backend_mysql_set_pack_storage(git_odb_backend *_backend,
+        const char *cache_dir)
+{
+  /* Keep packs received through writepack whole, rather than storing each
+   * of their objects in full. The packs live in the pack table; cache_dir
+   * is a local directory the backend keeps copies of them in to read from.
+   * Objects written one by one still go to the odb table. */
+  static const char *sql_read_pack_chunk =
+    "SELECT `data` FROM `" GIT2_ODB_PACK_TABLE_NAME "` WHERE `id` = ? AND `kind` = ? AND `seq` = ?;";
+  static const char *sql_write_pack_chunk =
+    "INSERT IGNORE INTO `" GIT2_ODB_PACK_TABLE_NAME "` VALUES (?, ?, ?, ?);";
+  mysql_odb_backend *backend;
+  int error;
 
-  if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_write)) != 0)
-    return GIT_ERROR;
+  assert(_backend && cache_dir);
 
+  backend = (mysql_odb_backend *)_backend;
 
-  backend->st_delete = mysql_stmt_init(backend->db);
-  if (backend->st_delete == NULL)
-    return GIT_ERROR;
+  if (backend->packs)
+    return GIT_OK;
 
-  if (mysql_stmt_attr_set(backend->st_delete, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-    return GIT_ERROR;
+  error = check_table_present(backend->primary.db,
+            "SHOW TABLES LIKE '" GIT2_ODB_PACK_TABLE_NAME "';");
+  if (error != GIT_OK) {
+    giterr_set_str(GITERR_ODB, "MySQL odb has no pack table");
+    return error;
+  }
 
-  if (mysql_stmt_prepare(backend->st_delete, sql_delete, strlen(sql_delete)) != 0)
+  if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+    giterr_set_str(GITERR_OS, "MySQL odb failed to create pack cache directory");
     return GIT_ERROR;
+  }
 
-
-  backend->st_iterate = mysql_stmt_init(backend->db);
-  if (backend->st_iterate == NULL)
+  if (init_statement(backend->primary.db, &backend->st_read_pack_chunk, sql_read_pack_chunk) != GIT_OK ||
+      init_statement(backend->primary.db, &backend->st_write_pack_chunk, sql_write_pack_chunk) != GIT_OK)
     return GIT_ERROR;
 
-  if (mysql_stmt_attr_set(backend->st_iterate, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
+  backend->meta_read_pack_chunk = mysql_stmt_result_metadata(backend->st_read_pack_chunk);
+  if (backend->meta_read_pack_chunk == NULL)
     return GIT_ERROR;
 
-  if (mysql_stmt_prepare(backend->st_iterate, sql_iterate, strlen(sql_iterate)) != 0)
+  backend->pack_cache_dir = strdup(cache_dir);
+  if (backend->pack_cache_dir == NULL) {
+    giterr_set_oom();
     return GIT_ERROR;
+  }
 
+  error = git_odb_new(&backend->packs);
+  if (error != GIT_OK)
+    return error;
 
-  return GIT_OK;
+  return mysql_odb__load_packs(backend);
 }
 
-static MYSQL *connect_to_server(const char *mysql_host, const char *mysql_user,
-        const char *mysql_passwd, const char *mysql_db, unsigned int mysql_port,
-        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+int git_odb_backend_mysql_migrate_headers(const char *mysql_host,
+        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
+        unsigned int mysql_port, const char *mysql_unix_socket,
+        unsigned long mysql_client_flag)
 {
-  my_bool reconnect;
+  /* Bring a database created before the header table existed up to date:
+   * create the header table, fill it in from the odb table, and drop the odb
+   * table's type and size indexes, which nothing reads. Objects stored by
+   * backends opened before the header table existed are missed, so stop
+   * writers while this runs; running it again is harmless. Header tables
+   * predating the `created` column get it, with existing rows counting as
+   * created now. */
+  static const char *sql_add_created =
+    "ALTER TABLE `" GIT2_ODB_HEADER_TABLE_NAME "` "
+    "ADD COLUMN `created` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP;";
+  static const char *sql_fill_headers =
+    "INSERT IGNORE INTO `" GIT2_ODB_HEADER_TABLE_NAME "` (`oid`, `type`, `size`, `location`) "
+    "(SELECT `oid`, `type`, `size`, IF(LENGTH(`data`) = 0 AND `size` > 0, 1, 0) "
+    "FROM `" GIT2_ODB_TABLE_NAME "`);";
+  static const char *keys[] = { "type", "size" };
+  char sql[128];
+  MYSQL *db;
+  size_t i;
+  int error = GIT_ERROR;
 
-  MYSQL *db = mysql_init(NULL);
+  db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
+               mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
 
-  reconnect = 1;
-  // allow libmysql to reconnect gracefully
-  if (mysql_options(db, MYSQL_OPT_RECONNECT, &reconnect) != 0)
+  if (!db)
     goto cleanup;
 
-  // make the connection
-  if (mysql_real_connect(db, mysql_host, mysql_user, mysql_passwd, mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag) != db)
+  error = create_header_table(db, 0);
+  if (error != GIT_OK)
     goto cleanup;
 
-  return db;
+  if (check_table_present(db, "SHOW COLUMNS FROM `" GIT2_ODB_HEADER_TABLE_NAME "` LIKE 'created';") == GIT_ENOTFOUND &&
+      mysql_real_query(db, sql_add_created, strlen(sql_add_created)) != 0) {
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+
+  if (mysql_real_query(db, sql_fill_headers, strlen(sql_fill_headers)) != 0) {
+    error = GIT_ERROR;
+    goto cleanup;
+  }
+
+  for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    snprintf(sql, sizeof(sql), "SHOW INDEX FROM `" GIT2_ODB_TABLE_NAME "` WHERE `Key_name` = '%s';", keys[i]);
+    if (check_table_present(db, sql) != GIT_OK)
+      continue;
+
+    snprintf(sql, sizeof(sql), "ALTER TABLE `" GIT2_ODB_TABLE_NAME "` DROP KEY `%s`;", keys[i]);
+    if (mysql_real_query(db, sql, strlen(sql)) != 0) {
+      error = GIT_ERROR;
+      goto cleanup;
+    }
+  }
+
+  error = GIT_OK;
 
 cleanup:
-  mysql_close(db);
-  return NULL;
+  if (db)
+    mysql_close(db);
+
+  return error;
 }
 
-int git_odb_backend_mysql_open(git_odb_backend **odb_out, git_refdb_backend **refdb_out,
-        const char *mysql_host,
-        const char *mysql_user, const char *mysql_passwd, const char *mysql_db,
-        unsigned int mysql_port, const char *mysql_unix_socket, unsigned long mysql_client_flag)
+#ifdef GIT2_MYSQL_ASYNC
+
+int git_odb_backend_mysql_add_async_connection(git_odb_backend *_backend,
+        const char *mysql_host, const char *mysql_user, const char *mysql_passwd,
+        const char *mysql_db, unsigned int mysql_port,
+        const char *mysql_unix_socket, unsigned long mysql_client_flag)
 {
-  mysql_odb_backend *odb_backend;
-  mysql_refdb_backend *refdb_backend;
+  /* Open one more connection for asynchronous reads and writes. Each one
+   * can have a single query in flight, so add as many as the number of
+   * requests that should be outstanding at once. They should all go to the
+   * primary, or writes will end up on a replica. Not available with
+   * shards. */
+  mysql_odb_backend *backend;
+  mysql_odb_async_conn *conns;
+  struct pollfd *fds;
+  mysql_odb_async_conn ac;
+  my_bool reconnect = 1;
   int error = GIT_ERROR;
 
-  odb_backend = calloc(1, sizeof(mysql_odb_backend));
-  if (odb_backend == NULL) {
-    giterr_set_oom();
+  assert(_backend);
+
+  backend = (mysql_odb_backend *)_backend;
+  memset(&ac, 0, sizeof(ac));
+
+  if (backend->shard_count > 1) {
+    giterr_set_str(GITERR_ODB, "MySQL odb can't run asynchronous requests across shards");
     return GIT_ERROR;
   }
 
-  refdb_backend = calloc(1, sizeof(mysql_refdb_backend));
-  if (refdb_backend == NULL) {
+  ac.conn.db = mysql_init(NULL);
+  if (ac.conn.db == NULL) {
     giterr_set_oom();
     return GIT_ERROR;
   }
 
-  /* Create two connections, one for odb access, the other for refdb. This
-   * simplifies situations where, perhaps, a refdb_backend is freed but the
-   * odb_backend continues elsewhere. */
-  odb_backend->db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
-                       mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
-  refdb_backend->db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
-                       mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
-
-  if (!odb_backend->db || !refdb_backend->db)
+  if (mysql_options(ac.conn.db, MYSQL_OPT_NONBLOCK, 0) != 0 ||
+      mysql_options(ac.conn.db, MYSQL_OPT_RECONNECT, &reconnect) != 0)
     goto cleanup;
 
-  // check for existence of db
-  error = check_db_present(odb_backend->db);
-  if (error < 0)
+  /* Connecting is done synchronously; only queries are worth overlapping */
+  if (mysql_real_connect(ac.conn.db, mysql_host, mysql_user, mysql_passwd,
+        mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag) != ac.conn.db) {
+    giterr_set_str(GITERR_ODB, "MySQL odb couldn't connect to server");
     goto cleanup;
+  }
 
-  error = init_odb_statements(odb_backend);
+  error = init_odb_statements(&ac.conn, 1, backend->chunked_storage,
+            backend->header_table);
   if (error < 0)
     goto cleanup;
 
-  error = init_refdb_statements(refdb_backend);
-  if (error < 0)
+  error = GIT_ERROR;
+
+  fds = realloc(backend->async_fds,
+          sizeof(struct pollfd) * (backend->async_count + 1));
+  if (fds == NULL) {
+    giterr_set_oom();
     goto cleanup;
+  }
+  backend->async_fds = fds;
 
-  odb_backend->parent.version = GIT_ODB_BACKEND_VERSION;
-  odb_backend->parent.odb = NULL;
-  odb_backend->parent.read = &mysql_odb_backend__read;
-  odb_backend->parent.read_header = &mysql_odb_backend__read_header;
-  odb_backend->parent.read_prefix = &mysql_odb_backend__read_prefix;
-  odb_backend->parent.write = &mysql_odb_backend__write;
-  odb_backend->parent.exists = &mysql_odb_backend__exists;
-  odb_backend->parent.free = &mysql_odb_backend__free;
-  odb_backend->parent.writepack = &mysql_odb_backend__writepack;
+  conns = realloc(backend->async_conns,
+            sizeof(mysql_odb_async_conn) * (backend->async_count + 1));
+  if (conns == NULL) {
+    giterr_set_oom();
+    goto cleanup;
+  }
 
-  refdb_backend->parent.version = GIT_ODB_BACKEND_VERSION ;
-  refdb_backend->parent.exists = &mysql_refdb_backend__exists;
-  refdb_backend->parent.lookup = &mysql_refdb_backend__lookup;
-  refdb_backend->parent.iterator = &mysql_refdb_backend__iterator;
-  refdb_backend->parent.write = &mysql_refdb_backend__write;
-  refdb_backend->parent.delete = &mysql_refdb_backend__delete;
-  refdb_backend->parent.free = &mysql_refdb_backend__free;
+  conns[backend->async_count++] = ac;
+  backend->async_conns = conns;
 
-  *odb_out = (git_odb_backend *)odb_backend;
-  *refdb_out = &refdb_backend->parent;
+  /* Pick up anything submitted before there was a connection to run it */
+  mysql_odb__async_dispatch(backend);
   return GIT_OK;
 
 cleanup:
-  mysql_odb_backend__free((git_odb_backend *)odb_backend);
-  mysql_refdb_backend__free(&refdb_backend->parent);
+  mysql_odb__conn_free(&ac.conn);
   return error;
 }
 
-int git_odb_backend_mysql_create(const char *mysql_host, const char *mysql_user,
-        const char *mysql_passwd, const char *mysql_db, unsigned int mysql_port,
-        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+int git_odb_backend_mysql_async_read(git_odb_backend *_backend,
+        const git_oid *oid, git_odb_backend_mysql_async_cb cb, void *payload)
 {
-  MYSQL *db;
-  int error = GIT_ERROR;
+  /* Queue a read of an object; `cb` is called from
+   * git_odb_backend_mysql_async_poll once it completes. Objects in stored
+   * packs are read on the spot, and the callback runs before this returns. */
+  mysql_odb_backend *backend;
+  mysql_odb_async_req *req;
+  void *data;
+  size_t len;
+  git_otype type;
 
-  db = connect_to_server(mysql_host, mysql_user, mysql_passwd,
-               mysql_db, mysql_port, mysql_unix_socket, mysql_client_flag);
+  assert(_backend && oid && cb);
 
-  if (!db)
-    goto cleanup;
+  backend = (mysql_odb_backend *)_backend;
 
-  error = create_table(db);
-  if (error != GIT_OK)
+  if (backend->packs && mysql_odb__read_packed(backend, NULL, &data, &len,
+        &type, oid, GIT_OID_HEXSZ) == GIT_OK) {
+    cb(GIT_OK, oid, data, len, type, payload);
+    return GIT_OK;
+  }
+
+  req = calloc(1, sizeof(mysql_odb_async_req));
+  if (req == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
+
+  git_oid_cpy(&req->oid, oid);
+  req->cb = cb;
+  req->payload = payload;
+
+  return mysql_odb__async_submit(backend, req);
+}
+
+int git_odb_backend_mysql_async_write(git_oid *oid_out,
+        git_odb_backend *_backend, const void *data, size_t len,
+        git_otype type, git_odb_backend_mysql_async_cb cb, void *payload)
+{
+  /* Queue a write of an object, whose id is returned right away. `data` has
+   * to stay around until `cb` is called. Objects big enough to be chunked
+   * are written on the spot, and the callback runs before this returns. */
+  mysql_odb_backend *backend;
+  mysql_odb_async_req *req;
+  int error;
+
+  assert(oid_out && _backend && data && cb);
+
+  backend = (mysql_odb_backend *)_backend;
+
+  if ((error = git_odb_hash(oid_out, data, len, type)) < 0)
     return error;
 
-  /* Everything breaks if we don't have a HEAD ref */
+  if (backend->chunked_storage && len > GIT2_ODB_CHUNK_THRESHOLD) {
+    error = mysql_odb__write_object(backend, oid_out, data, len, type);
+    cb(error, oid_out, NULL, len, type, payload);
+    return GIT_OK;
+  }
 
-  /* XXX, 2 is hardcoded. Could stringify if this were a macro */
-  if (mysql_query(db, "INSERT INTO `" GIT2_REFDB_TABLE_NAME "` VALUES ('HEAD', 2, NULL, 'refs/heads/master');") != 0)
-    error = GIT_ERROR;
-  else
-    error = GIT_OK;
+  req = calloc(1, sizeof(mysql_odb_async_req));
+  if (req == NULL) {
+    giterr_set_oom();
+    return GIT_ERROR;
+  }
 
-cleanup:
-  if (db)
-    mysql_close(db);
+  git_oid_cpy(&req->oid, oid_out);
+  req->write = 1;
+  req->type = type;
+  req->size = len;
+  req->size_ll = len;
+  req->location = MYSQL_ODB_LOCATION_INLINE;
+  req->data = data;
+  req->cb = cb;
+  req->payload = payload;
+
+  return mysql_odb__async_submit(backend, req);
+}
 
-  return error;
+int git_odb_backend_mysql_async_poll(git_odb_backend *_backend, int timeout_ms)
+{
+  /* Wait up to timeout_ms (forever if negative) for any of the requests in
+   * flight to make progress, and run the callbacks of those that complete.
+   * Returns the number of requests still queued or in flight. */
+  mysql_odb_backend *backend;
+  mysql_odb_async_conn *ac;
+  struct pollfd *fd;
+  unsigned int conn_timeout;
+  int wait_ms = timeout_ms;
+  int ready, status, ret;
+  size_t i;
+
+  assert(_backend);
+
+  backend = (mysql_odb_backend *)_backend;
+
+  for (i = 0; i < backend->async_count; i++) {
+    ac = &backend->async_conns[i];
+    fd = &backend->async_fds[i];
+
+    fd->fd = -1; // idle connections are skipped by poll()
+    fd->events = fd->revents = 0;
+    if (ac->req == NULL)
+      continue;
+
+    fd->fd = mysql_get_socket(ac->conn.db);
+    if (ac->status & MYSQL_WAIT_READ)
+      fd->events |= POLLIN;
+    if (ac->status & MYSQL_WAIT_WRITE)
+      fd->events |= POLLOUT;
+    if (ac->status & MYSQL_WAIT_EXCEPT)
+      fd->events |= POLLPRI;
+
+    if (ac->status & MYSQL_WAIT_TIMEOUT) {
+      conn_timeout = mysql_get_timeout_value_ms(ac->conn.db);
+      if (wait_ms < 0 || conn_timeout < (unsigned int)wait_ms)
+        wait_ms = conn_timeout;
+    }
+  }
+
+  if (backend->async_pending == 0)
+    return 0;
+
+  ready = poll(backend->async_fds, backend->async_count, wait_ms);
+  if (ready < 0) {
+    if (errno == EINTR)
+      return (int)backend->async_pending;
+
+    giterr_set_str(GITERR_OS, "MySQL odb failed to poll connections");
+    return GIT_ERROR;
+  }
+
+  for (i = 0; i < backend->async_count; i++) {
+    ac = &backend->async_conns[i];
+    fd = &backend->async_fds[i];
+
+    if (ac->req == NULL || fd->fd < 0)
+      continue;
+
+    status = 0;
+    if (fd->revents & (POLLIN | POLLHUP | POLLERR))
+      status |= MYSQL_WAIT_READ;
+    if (fd->revents & POLLOUT)
+      status |= MYSQL_WAIT_WRITE;
+    if (fd->revents & POLLPRI)
+      status |= MYSQL_WAIT_EXCEPT;
+    if (status == 0 && ready == 0 && (ac->status & MYSQL_WAIT_TIMEOUT))
+      status = MYSQL_WAIT_TIMEOUT;
+    if (status == 0)
+      continue;
+
+    if (ac->stage == MYSQL_ODB_ASYNC_STORE)
+      ac->status = mysql_stmt_store_result_cont(&ret, ac->stmt, status);
+    else
+      ac->status = mysql_stmt_execute_cont(&ret, ac->stmt, status);
+
+    if (ac->status == 0)
+      mysql_odb__async_step(backend, ac, ret);
+  }
+
+  mysql_odb__async_dispatch(backend);
+  return (int)backend->async_pending;
+}
+
+#else
+
+int git_odb_backend_mysql_add_async_connection(git_odb_backend *_backend,
+        const char *mysql_host, const char *mysql_user, const char *mysql_passwd,
+        const char *mysql_db, unsigned int mysql_port,
+        const char *mysql_unix_socket, unsigned long mysql_client_flag)
+{
+  /* Asynchronous requests need the MariaDB client's non-blocking API */
+  giterr_set_str(GITERR_ODB, "MySQL odb was built without asynchronous query support");
+  return GIT_ERROR;
 }
 
+#endif
+
 void git_odb_backend_mysql_free(git_odb_backend *backend)
 {
   /* Function for disposing of an unwanted backend -- necessary if for some
@@ -1609,6 +5345,34 @@ void git_odb_backend_mysql_free(git_odb_backend *backend)
   return;
 }
 
+int git_refdb_backend_mysql_set_cache(git_refdb_backend *_backend,
+        int enabled, unsigned int ttl_ms)
+{
+  /* Turn the ref lookup cache on or off. Lookups within ttl_ms of the last
+   * generation check trust the cache without asking the database, and so
+   * may miss the latest changes made by other processes; a ttl_ms of 0
+   * checks on every lookup. Our own changes always show at once. The
+   * cache is on by default, with a ttl_ms of MYSQL_REFDB_CACHE_TTL_MS. */
+  mysql_refdb_backend *backend;
+
+  assert(_backend);
+
+  backend = (mysql_refdb_backend *)_backend;
+
+  if (enabled && !backend->generation_table) {
+    giterr_set_str(GITERR_REFERENCE, "MySQL refdb has no generation table to validate its cache");
+    return GIT_ERROR;
+  }
+
+  if (backend->cache_buckets > 0)
+    mysql_refdb__cache_clear(backend);
+
+  backend->cache_enabled = enabled;
+  backend->cache_valid = 0;
+  backend->cache_ttl_ms = ttl_ms;
+  return GIT_OK;
+}
+
 void git_refdb_backend_mysql_free(git_refdb_backend *backend)
 {
   /* Same as odb...free, but for refdb */
@@ -0,0 +1,87 @@
+/*
+ * Objects over the chunk threshold are stored as chunk rows: write one,
+ * read it back whole, through its header and through a read stream, and
+ * write another through a write stream.
+ */
+
+#include "../mysql.c"
+#include "test.h"
+
+#define TEST_OBJECT_SIZE (GIT2_ODB_CHUNK_THRESHOLD + GIT2_ODB_CHUNK_SIZE / 2)
+
+static void check_read(git_odb_backend *odb, const git_oid *oid,
+        const unsigned char *data, size_t len)
+{
+  git_odb_stream *stream;
+  unsigned char *streamed;
+  void *read_data;
+  size_t read_len, done = 0;
+  git_otype type;
+  int n;
+
+  CHECK(odb->read_header(&read_len, &type, odb, oid) == GIT_OK);
+  CHECK(read_len == len && type == GIT_OBJ_BLOB);
+
+  CHECK(odb->read(&read_data, &read_len, &type, odb, oid) == GIT_OK);
+  CHECK(read_len == len && type == GIT_OBJ_BLOB);
+  CHECK(memcmp(read_data, data, len) == 0);
+  free(read_data);
+
+  streamed = malloc(len);
+  CHECK(streamed != NULL);
+  CHECK(odb->readstream(&stream, odb, oid) == GIT_OK);
+  while ((n = stream->read(stream, (char *)streamed + done, len - done)) > 0)
+    done += n;
+  CHECK(n == 0 && done == len);
+  CHECK(memcmp(streamed, data, len) == 0);
+  stream->free(stream);
+  free(streamed);
+}
+
+int main(void)
+{
+  test_server server;
+  git_odb_backend *odb;
+  git_refdb_backend *refdb;
+  git_odb_stream *stream;
+  unsigned char *data;
+  git_oid oid, expected;
+  size_t done, n;
+
+  if (!test_server_get(&server, "GIT2_MYSQL_TEST_DB"))
+    return 0;
+
+  git_threads_init();
+  CHECK(test_open(&odb, &refdb, &server) == GIT_OK);
+
+  data = malloc(TEST_OBJECT_SIZE);
+  CHECK(data != NULL);
+
+  test_fill(data, TEST_OBJECT_SIZE, 1);
+  CHECK(git_odb_hash(&expected, data, TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+  CHECK(odb->write(&oid, odb, data, TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+  CHECK(git_oid_cmp(&oid, &expected) == 0);
+  CHECK(odb->exists(odb, &oid) == 1);
+  check_read(odb, &oid, data, TEST_OBJECT_SIZE);
+
+  /* A write stream doesn't know the id until it's finalized, and may be
+   * fed in pieces that don't line up with the chunks */
+  test_fill(data, TEST_OBJECT_SIZE, 2);
+  CHECK(git_odb_hash(&expected, data, TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+  CHECK(odb->writestream(&stream, odb, TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+  for (done = 0; done < TEST_OBJECT_SIZE; done += n) {
+    n = TEST_OBJECT_SIZE - done < 100000 ? TEST_OBJECT_SIZE - done : 100000;
+    CHECK(stream->write(stream, (const char *)data + done, n) == GIT_OK);
+  }
+  CHECK(stream->finalize_write(&oid, stream) == GIT_OK);
+  stream->free(stream);
+  CHECK(git_oid_cmp(&oid, &expected) == 0);
+  check_read(odb, &oid, data, TEST_OBJECT_SIZE);
+
+  free(data);
+  odb->free(odb);
+  refdb->free(refdb);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Prune deletes what no ref reaches, once past the grace period: store a
+ * commit with a tree and a blob under a ref, and a blob nothing refers to,
+ * and check that only the latter goes.
+ */
+
+#include "../mysql.c"
+#include "test.h"
+
+#define TEST_REF "refs/heads/prune-test"
+
+int main(void)
+{
+  test_server server;
+  git_odb_backend *odb;
+  git_refdb_backend *refdb;
+  git_reference *ref;
+  unsigned char kept[32], dropped[32], tree[64];
+  char commit[256], tree_hex[GIT_OID_HEXSZ + 1];
+  git_oid kept_oid, dropped_oid, tree_oid, commit_oid;
+  size_t tree_len, pruned;
+
+  if (!test_server_get(&server, "GIT2_MYSQL_TEST_DB"))
+    return 0;
+
+  git_threads_init();
+  CHECK(test_open(&odb, &refdb, &server) == GIT_OK);
+
+  test_fill(kept, sizeof(kept), 1);
+  test_fill(dropped, sizeof(dropped), 2);
+  CHECK(odb->write(&kept_oid, odb, kept, sizeof(kept), GIT_OBJ_BLOB) == GIT_OK);
+  CHECK(odb->write(&dropped_oid, odb, dropped, sizeof(dropped), GIT_OBJ_BLOB) == GIT_OK);
+
+  tree_len = sprintf((char *)tree, "100644 kept") + 1;
+  memcpy(tree + tree_len, kept_oid.id, GIT_OID_RAWSZ);
+  tree_len += GIT_OID_RAWSZ;
+  CHECK(odb->write(&tree_oid, odb, tree, tree_len, GIT_OBJ_TREE) == GIT_OK);
+
+  git_oid_tostr(tree_hex, sizeof(tree_hex), &tree_oid);
+  sprintf(commit, "tree %s\nauthor A U Thor <author@example.com> 0 +0000\n"
+      "committer A U Thor <author@example.com> 0 +0000\n\nprune test\n", tree_hex);
+  CHECK(odb->write(&commit_oid, odb, commit, strlen(commit), GIT_OBJ_COMMIT) == GIT_OK);
+
+  ref = git_reference__alloc(TEST_REF, &commit_oid, NULL);
+  CHECK(ref != NULL);
+  CHECK(refdb->write(refdb, ref, 1) == GIT_OK);
+  git_reference_free(ref);
+
+  /* Nothing is past a grace period of an hour yet */
+  CHECK(git_odb_backend_mysql_prune(&pruned, odb, refdb, 3600, 0) == GIT_OK);
+  CHECK(odb->exists(odb, &dropped_oid) == 1);
+
+  /* Stored times have a resolution of a second */
+  sleep(2);
+  CHECK(git_odb_backend_mysql_prune(&pruned, odb, refdb, 0, 1) == GIT_OK);
+  CHECK(pruned >= 1);
+
+  CHECK(odb->exists(odb, &dropped_oid) == 0);
+  CHECK(odb->exists(odb, &kept_oid) == 1);
+  CHECK(odb->exists(odb, &tree_oid) == 1);
+  CHECK(odb->exists(odb, &commit_oid) == 1);
+
+  CHECK(refdb->delete(refdb, TEST_REF) == GIT_OK);
+
+  odb->free(odb);
+  refdb->free(refdb);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * The ref cache: a backend's own changes show at once, another process's
+ * once the ttl has passed, or at once with a ttl of 0.
+ */
+
+#include "../mysql.c"
+#include "test.h"
+
+#define TEST_REF "refs/heads/refcache-test"
+
+static void write_ref(git_refdb_backend *refdb, const git_oid *oid)
+{
+  git_reference *ref;
+
+  ref = git_reference__alloc(TEST_REF, oid, NULL);
+  CHECK(ref != NULL);
+  CHECK(refdb->write(refdb, ref, 1) == GIT_OK);
+  git_reference_free(ref);
+}
+
+static void check_ref(git_refdb_backend *refdb, const git_oid *oid)
+{
+  git_reference *ref;
+
+  CHECK(refdb->lookup(&ref, refdb, TEST_REF) == GIT_OK);
+  CHECK(git_oid_cmp(git_reference_target(ref), oid) == 0);
+  git_reference_free(ref);
+}
+
+int main(void)
+{
+  test_server server;
+  git_odb_backend *odb, *other_odb;
+  git_refdb_backend *refdb, *other;
+  git_reference *ref;
+  git_oid oids[4];
+  int i;
+
+  if (!test_server_get(&server, "GIT2_MYSQL_TEST_DB"))
+    return 0;
+
+  git_threads_init();
+  CHECK(test_open(&odb, &refdb, &server) == GIT_OK);
+  CHECK(test_open(&other_odb, &other, &server) == GIT_OK);
+
+  for (i = 0; i < 4; i++)
+    test_fill(oids[i].id, GIT_OID_RAWSZ, i);
+
+  write_ref(refdb, &oids[0]);
+  check_ref(refdb, &oids[0]);
+  write_ref(refdb, &oids[1]);
+  check_ref(refdb, &oids[1]);
+
+  write_ref(other, &oids[2]);
+  usleep(2 * MYSQL_REFDB_CACHE_TTL_MS * 1000);
+  check_ref(refdb, &oids[2]);
+
+  CHECK(git_refdb_backend_mysql_set_cache(refdb, 1, 0) == GIT_OK);
+  check_ref(refdb, &oids[2]);
+  write_ref(other, &oids[3]);
+  check_ref(refdb, &oids[3]);
+
+  CHECK(other->delete(other, TEST_REF) == GIT_OK);
+  CHECK(refdb->lookup(&ref, refdb, TEST_REF) == GIT_ENOTFOUND);
+  CHECK(refdb->exists(&i, refdb, TEST_REF) == GIT_OK && i == 0);
+
+  odb->free(odb);
+  refdb->free(refdb);
+  other_odb->free(other_odb);
+  other->free(other);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Objects are routed to shards by the first byte of their oid: write a few,
+ * and check that each is read back, stored on the right server and listed
+ * once by foreach. Needs a second scratch database, GIT2_MYSQL_TEST_SHARD_DB,
+ * on the same server.
+ */
+
+#include "../mysql.c"
+#include "test.h"
+
+#define TEST_OBJECTS 16
+#define TEST_OBJECT_SIZE 64
+
+typedef struct {
+  git_oid oids[TEST_OBJECTS];
+  int seen[TEST_OBJECTS];
+} foreach_data;
+
+static int foreach_cb(const git_oid *oid, void *payload)
+{
+  foreach_data *data = payload;
+  int i;
+
+  for (i = 0; i < TEST_OBJECTS; i++)
+    if (git_oid_cmp(oid, &data->oids[i]) == 0)
+      data->seen[i]++;
+
+  return 0;
+}
+
+int main(void)
+{
+  test_server server, shard;
+  git_odb_backend *odb, *shard_odb;
+  git_refdb_backend *refdb, *shard_refdb;
+  unsigned char data[TEST_OBJECT_SIZE];
+  foreach_data listed;
+  void *read_data;
+  size_t read_len;
+  git_otype type;
+  int i;
+
+  if (!test_server_get(&server, "GIT2_MYSQL_TEST_DB") ||
+      !test_server_get(&shard, "GIT2_MYSQL_TEST_SHARD_DB"))
+    return 0;
+
+  git_threads_init();
+  CHECK(test_open(&odb, &refdb, &server) == GIT_OK);
+  CHECK(git_odb_backend_mysql_add_shard(odb, 0x80, 0xff, shard.host,
+        shard.user, shard.passwd, shard.db, shard.port, NULL, 0) == GIT_OK);
+
+  /* The shard on its own, to see what it holds */
+  CHECK(test_open(&shard_odb, &shard_refdb, &shard) == GIT_OK);
+
+  memset(&listed, 0, sizeof(listed));
+  for (i = 0; i < TEST_OBJECTS; i++) {
+    test_fill(data, sizeof(data), i);
+    CHECK(odb->write(&listed.oids[i], odb, data, sizeof(data), GIT_OBJ_BLOB) == GIT_OK);
+
+    CHECK(odb->read(&read_data, &read_len, &type, odb, &listed.oids[i]) == GIT_OK);
+    CHECK(read_len == sizeof(data) && memcmp(read_data, data, sizeof(data)) == 0);
+    free(read_data);
+
+    CHECK(shard_odb->exists(shard_odb, &listed.oids[i]) ==
+          (listed.oids[i].id[0] >= 0x80));
+  }
+
+  CHECK(odb->foreach(odb, foreach_cb, &listed) == GIT_OK);
+  for (i = 0; i < TEST_OBJECTS; i++)
+    CHECK(listed.seen[i] == 1);
+
+  shard_odb->free(shard_odb);
+  shard_refdb->free(shard_refdb);
+  odb->free(odb);
+  refdb->free(refdb);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Helpers for the MySQL backend's smoke tests. Each test is built with the
+ * backend's source included, so it can reach its internals too.
+ *
+ * The tests need a scratch database, set up with git_odb_backend_mysql_create
+ * or left empty for the tests to set up, given by GIT2_MYSQL_TEST_HOST,
+ * GIT2_MYSQL_TEST_USER, GIT2_MYSQL_TEST_PASSWD, GIT2_MYSQL_TEST_DB and
+ * GIT2_MYSQL_TEST_PORT. They write objects and refs there, and prune may
+ * delete whatever else it holds. Without GIT2_MYSQL_TEST_DB they are skipped.
+ */
+
+#ifndef GIT2_MYSQL_TEST_H
+#define GIT2_MYSQL_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <git2.h>
+
+#define CHECK(expr) do { \
+    if (!(expr)) { \
+      const git_error *e = giterr_last(); \
+      fprintf(stderr, "%s:%d: check failed: %s (%s)\n", __FILE__, __LINE__, \
+          #expr, (e) ? e->message : "no error"); \
+      exit(1); \
+    } \
+  } while (0)
+
+typedef struct {
+  const char *host;
+  const char *user;
+  const char *passwd;
+  const char *db;
+  unsigned int port;
+} test_server;
+
+static const char *test_env(const char *name, const char *fallback)
+{
+  const char *value = getenv(name);
+  return (value && *value) ? value : fallback;
+}
+
+/* Fill in the server from the environment, with `db_var` naming its
+ * database. Returns 0 if that isn't set, and the test should be skipped. */
+static int test_server_get(test_server *server, const char *db_var)
+{
+  server->host = test_env("GIT2_MYSQL_TEST_HOST", "localhost");
+  server->user = test_env("GIT2_MYSQL_TEST_USER", "root");
+  server->passwd = test_env("GIT2_MYSQL_TEST_PASSWD", NULL);
+  server->db = test_env(db_var, NULL);
+  server->port = atoi(test_env("GIT2_MYSQL_TEST_PORT", "3306"));
+
+  if (server->db == NULL) {
+    printf("skipped: %s is not set\n", db_var);
+    return 0;
+  }
+
+  /* Fails harmlessly when the tables are there already */
+  git_odb_backend_mysql_create(server->host, server->user, server->passwd,
+      server->db, server->port, NULL, 0);
+  return 1;
+}
+
+static int test_open(git_odb_backend **odb, git_refdb_backend **refdb,
+        const test_server *server)
+{
+  return git_odb_backend_mysql_open(odb, refdb, server->host, server->user,
+           server->passwd, server->db, server->port, NULL, 0);
+}
+
+/* Fill a buffer with data unique to this run, so each run stores new
+ * objects */
+static void test_fill(unsigned char *data, size_t len, unsigned int seed)
+{
+  size_t i;
+
+  seed ^= (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+  for (i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (unsigned char)(seed >> 16);
+  }
+}
+
+#endif
@@ -24,556 +24,4937 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <git2.h>
 #include <git2/sys/odb_backend.h>
 #include <git2/sys/refdb_backend.h>
+#include <git2/sys/reflog.h>
 #include <git2/sys/refs.h>
 #include <hiredis/hiredis.h>
+#include <zlib.h>
+
+/* Number of commands sent before their replies are read back, when
+ * operating on many objects at once */
+#define HIREDIS_ODB_PIPELINE_DEPTH 256
+
+/* What a batch asks about each object */
+#define HIREDIS_ODB_BATCH_EXISTS 0
+#define HIREDIS_ODB_BATCH_HEADER 1
+#define HIREDIS_ODB_BATCH_READ 2
+
+/* Connections per pool, for pools the constructors make themselves */
+#define HIREDIS_POOL_DEFAULT_SIZE 8
+
+/* Redis Cluster hashes keys to this many slots */
+#define HIREDIS_CLUSTER_SLOTS 16384
+
+/* MOVED or ASK redirects followed for one command before giving up */
+#define HIREDIS_CLUSTER_REDIRECTS 5
+
+/* Compact layout: each object is a single string under its raw oid, holding
+ * a fixed header (a byte with the type, and the codec in its high nibble,
+ * then the size as 8 big endian bytes) followed by the data */
+#define HIREDIS_ODB_HEADER_LEN 9
+
+/* How an object's data is stored. The size kept with it is always that of
+ * the object itself, so headers are read without inflating anything. */
+#define HIREDIS_ODB_CODEC_NONE 0
+#define HIREDIS_ODB_CODEC_ZLIB 1
+#define HIREDIS_ODB_CODEC_CHUNKED 2
+
+/* A chunked object keeps its data in keys of its own,
+ * prefix:repo_path:chunk:<token>:<n>, and in their place the size of its
+ * chunks (4 big endian bytes) then the token, 40 hex digits */
+#define HIREDIS_ODB_CHUNKS_LEN (4 + GIT_OID_HEXSZ)
+
+/* Objects larger than this are chunked by default, so that no one command
+ * carries a whole large object, holding up the server and the connection */
+#define HIREDIS_ODB_CHUNK_THRESHOLD (8 * 1024 * 1024)
+#define HIREDIS_ODB_CHUNK_SIZE (1024 * 1024)
+
+/* Chunks sent or fetched per round trip */
+#define HIREDIS_ODB_CHUNK_WINDOW 8
+
+/* Refnames a refdb iterator reads from the index at a time */
+#define HIREDIS_REFDB_PAGE_SIZE 256
+
+/* Entries a reflog keeps, by default; older ones are trimmed away */
+#define HIREDIS_REFDB_REFLOG_MAXLEN 1024
+
+/* Keys SCAN is asked to look at per call, when rebuilding the ref index */
+#define HIREDIS_REFDB_SCAN_COUNT 1000
+
+/* Refs a refdb cache holds before starting over, and its hash buckets */
+#define HIREDIS_REFDB_CACHE_MAX 65536
+#define HIREDIS_REFDB_CACHE_BUCKETS 4096
+
+/* Seconds between attempts to reopen a refdb cache's invalidation connection */
+#define HIREDIS_REFDB_CACHE_RETRY 1
+
+/* Keys SCAN is asked to look at per call, and ids read from the index of
+ * object ids at a time, when listing objects */
+#define HIREDIS_ODB_SCAN_COUNT 10000
+
+/* Bytes of object data a writepack sends before waiting for the replies */
+#define HIREDIS_ODB_WRITEPACK_INFLIGHT (8 * 1024 * 1024)
+
+/* A pool of connections to one Redis endpoint. Backend methods check a
+ * connection out for the duration of their commands, so backends sharing a
+ * pool may be used from several threads at once. A cluster pool instead
+ * holds a pool per cluster node, and sends each command to the node serving
+ * its key's slot. */
+typedef struct git_hiredis_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+
+	char *host;
+	int port;
+	char *unix_socket;
+	char *password;
+	struct timeval connect_timeout;
+	struct timeval command_timeout;
+
+	size_t size;
+	size_t open;
+	redisContext **idle;
+	size_t idle_count;
+
+	/* Guarded by hiredis_pools_lock, as is the registry itself */
+	unsigned int refcount;
+	int shared;
+	struct git_hiredis_pool *next;
+
+	/* Cluster pools only. Node pools live as long as the cluster's. */
+	int cluster;
+	pthread_rwlock_t slots_lock;
+	struct git_hiredis_pool **nodes;
+	size_t node_count;
+	struct git_hiredis_pool **slots;
+} git_hiredis_pool;
+
+/* A connection checked out for a pipeline */
+typedef struct {
+	git_hiredis_pool *node;
+	redisContext *db;
+} hiredis_pool_conn;
+
+/* A Lua script, run by its SHA1 once the server has been given it */
+typedef struct {
+	const char *source;
+	char sha[41];
+	int loaded;
+} hiredis_script;
 
 typedef struct {
 	git_odb_backend parent;
 
 	char *prefix;
 	char *repo_path;
-	redisContext *db;
+	git_hiredis_pool *pool;
+	int compact;
+	size_t compress_threshold;
+	int oid_index;
+	int foreach_rehash;
+	int writepack_multi;
+	size_t writepack_inflight;
+	size_t chunk_threshold;
+	size_t chunk_size;
 } hiredis_odb_backend;
 
+/* An object read or written a piece at a time. One that isn't chunked is
+ * read, or gathered for writing, whole; a chunked one passes through a
+ * chunk at a time. Writes chunk under a random token, as the object's id
+ * isn't known until the end. */
 typedef struct {
-	git_refdb_backend parent;
+	git_odb_stream parent;
 
-	char *prefix;
-	char *repo_path;
+	git_otype type;
+	size_t size;
+	size_t done;
+
+	int chunked;
+	int finalized;
+	size_t chunk_size;
+	char token[GIT_OID_HEXSZ + 1];
+	unsigned int seq;
+
+	char *buffer;
+	size_t buffer_size;
+	size_t buffer_len;
+	size_t buffer_pos;
+} hiredis_odb_stream;
+
+typedef struct {
+	git_odb_writepack parent;
+
+	git_indexer *indexer;
+	char dir_path[PATH_MAX];
+} hiredis_odb_writepack;
+
+/* A cached ref, or the knowledge that there is none (type 0) */
+typedef struct hiredis_refdb_cached {
+	struct hiredis_refdb_cached *next;
+	git_ref_t type;
+	char *name;
+	char *target;
+} hiredis_refdb_cached;
+
+/* Refs a refdb backend has read, kept until the server says they changed.
+ * A connection of its own has the server track every key under
+ * key_prefix:refdb: (CLIENT TRACKING in broadcasting mode, redirected to
+ * itself) and is read by a thread, which drops refs as invalidations come
+ * in. While that connection is down, nothing is served from the cache. */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	hiredis_refdb_cached **buckets;
+	size_t count;
+
+	/* Bumped by every invalidation, so a ref read from the server while
+	 * one came in isn't cached */
+	unsigned long generation;
+	int live;
+
+	git_hiredis_pool *pool;
+	const char *key_prefix;
+	char *tracked;
 	redisContext *db;
+	pthread_t thread;
+	int stop;
+} hiredis_refdb_cache;
+
+typedef struct {
+	git_refdb_backend parent;
+
+	/* prefix:repo_path, as a hash tag in a cluster */
+	char *key_prefix;
+	git_hiredis_pool *pool;
+	unsigned int reflog_maxlen;
+	hiredis_refdb_cache *cache;
 } hiredis_refdb_backend;
 
+/* libgit2 gives backends no way to build a reflog other than filling in
+ * its own structures, whose layout (as of 0.22) is mirrored here */
+typedef struct {
+	size_t alloc_size;
+	int (*cmp)(const void *, const void *);
+	void **contents;
+	size_t length;
+	uint32_t flags;
+} hiredis_reflog_vector;
+
+typedef struct {
+	git_oid oid_old;
+	git_oid oid_cur;
+	git_signature *committer;
+	char *msg;
+} hiredis_reflog_entry;
+
+typedef struct {
+	git_refdb *db;
+	char *ref_name;
+	hiredis_reflog_vector entries;
+} hiredis_reflog;
+
+/* The reflog entry a ref update appends, as script arguments */
+typedef struct {
+	const char *mode;
+	const char *name;
+	const char *email;
+	char time[32];
+	char offset[16];
+	const char *message;
+	const char *has_message;
+} hiredis_reflog_args;
+
+/* Refs are listed from a sorted set of their names, kept beside them under
+ * key_prefix:refnames, a page at a time. Only the names from the glob's
+ * literal prefix on are read, and those not matching it are dropped. */
 typedef struct {
 	git_reference_iterator parent;
 
+	char *glob;
+	char *min;
+	char *max;
+	int done;
+
+	/* The current page, and its names matching the glob. Values are read
+	 * for the whole page, on the first call to next. */
+	redisReply *page;
+	const char **names;
+	redisReply **values;
+	size_t count;
 	size_t current;
-	redisReply *keys;
 
 	hiredis_refdb_backend *backend;
 } hiredis_refdb_iterator;
 
-static redisContext *sharedConnection = NULL;
+/* Pools the constructors made, shared by all backends for one endpoint */
+static pthread_mutex_t hiredis_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static git_hiredis_pool *hiredis_pools = NULL;
 
-/* Odb methods */
+/* Guards the SHA1s of the scripts, which are shared by every pool */
+static pthread_mutex_t hiredis_scripts_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int hiredis_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+/* Connection pool */
+
+static void hiredis_pool__timeval(struct timeval *tv, int timeout_ms)
+{
+	tv->tv_sec = timeout_ms / 1000;
+	tv->tv_usec = (timeout_ms % 1000) * 1000;
+}
+
+static int hiredis_pool__prepare(git_hiredis_pool *pool, redisContext *db)
 {
-	hiredis_odb_backend *backend;
-	int error;
 	redisReply *reply;
-	char *str_id = calloc(GIT_OID_HEXSZ + 1, sizeof(char));
+	int error = GIT_OK;
 
-	assert(len_p && type_p && _backend && oid);
+	if (pool->command_timeout.tv_sec || pool->command_timeout.tv_usec)
+		redisSetTimeout(db, pool->command_timeout);
 
-	backend = (hiredis_odb_backend *) _backend;
-	error = GIT_ERROR;
+	if (pool->password != NULL) {
+		reply = redisCommand(db, "AUTH %s", pool->password);
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			giterr_set_str(GITERR_NET, "Redis authentication with redis server failed");
+			error = GIT_ERROR;
+		}
+		freeReplyObject(reply);
+	}
 
-	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+	return error;
+}
+
+static redisContext *hiredis_pool__connect(git_hiredis_pool *pool)
+{
+	redisContext *db;
+	int timed = (pool->connect_timeout.tv_sec || pool->connect_timeout.tv_usec);
+
+	if (pool->unix_socket != NULL)
+		db = timed ? redisConnectUnixWithTimeout(pool->unix_socket, pool->connect_timeout) :
+			redisConnectUnix(pool->unix_socket);
+	else
+		db = timed ? redisConnectWithTimeout(pool->host, pool->port, pool->connect_timeout) :
+			redisConnect(pool->host, pool->port);
+
+	if (db == NULL || db->err) {
+		giterr_set_str(GITERR_NET, "Redis storage couldn't connect to redis server");
+		redisFree(db);
+		return NULL;
+	}
 
-	reply = redisCommand(backend->db, "HMGET %s:%s:odb:%s %s %s", backend->prefix, backend->repo_path, str_id, "type", "size");
+	if (hiredis_pool__prepare(pool, db) != GIT_OK) {
+		redisFree(db);
+		return NULL;
+	}
 
-	if (reply && reply->type == REDIS_REPLY_ARRAY) {
-		if (reply->element[0]->type != REDIS_REPLY_NIL &&
-				reply->element[0]->type != REDIS_REPLY_NIL) {
-			*type_p = (git_otype) atoi(reply->element[0]->str);
-			*len_p = (size_t) atoi(reply->element[1]->str);
-			error = GIT_OK;
-		} else {
-			giterr_set_str(GITERR_ODB, "Redis odb storage corrupted");
-			error = GIT_ENOTFOUND;
+	return db;
+}
+
+/* Give up a connection's place in the pool */
+static void hiredis_pool__discard(git_hiredis_pool *pool, redisContext *db)
+{
+	redisFree(db);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->open--;
+	pthread_cond_signal(&pool->available);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static redisContext *hiredis_pool__checkout(git_hiredis_pool *pool)
+{
+	redisContext *db = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->idle_count == 0 && pool->open >= pool->size)
+		pthread_cond_wait(&pool->available, &pool->lock);
+
+	if (pool->idle_count > 0)
+		db = pool->idle[--pool->idle_count];
+	else
+		pool->open++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (db == NULL) {
+		db = hiredis_pool__connect(pool);
+		if (db == NULL) {
+			pthread_mutex_lock(&pool->lock);
+			pool->open--;
+			pthread_cond_signal(&pool->available);
+			pthread_mutex_unlock(&pool->lock);
 		}
-	} else {
-		giterr_set_str(GITERR_ODB, "Redis odb storage error");
-		error = GIT_ERROR;
+		return db;
 	}
 
-	free(str_id);
-	freeReplyObject(reply);
-	return error;
+	/* A connection that failed last time it was used gets another go,
+	 * which needs authenticating again */
+	if (db->err) {
+		if (redisReconnect(db) != REDIS_OK) {
+			giterr_set_str(GITERR_NET, "Redis storage couldn't reconnect to redis server");
+			hiredis_pool__discard(pool, db);
+			return NULL;
+		}
+
+		if (hiredis_pool__prepare(pool, db) != GIT_OK) {
+			hiredis_pool__discard(pool, db);
+			return NULL;
+		}
+	}
+
+	return db;
 }
 
-int hiredis_odb_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+static void hiredis_pool__checkin(git_hiredis_pool *pool, redisContext *db)
 {
-	hiredis_odb_backend *backend;
-	int error;
-	redisReply *reply;
-	char *str_id = calloc(GIT_OID_HEXSZ + 1, sizeof(char));
+	pthread_mutex_lock(&pool->lock);
+	pool->idle[pool->idle_count++] = db;
+	pthread_cond_signal(&pool->available);
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	assert(data_p && len_p && type_p && _backend && oid);
+int git_hiredis_pool_new(git_hiredis_pool **out, const char *host, int port, const char *unix_socket,
+	const char *password, size_t size, int connect_timeout_ms, int command_timeout_ms)
+{
+	/* Create a pool of up to size connections to a Redis server, at host and
+	 * port or, when unix_socket is given, at that socket. Connections are
+	 * opened as they're needed, authenticated with password if there is one,
+	 * and reopened after failing. Timeouts of zero mean none. Backends made
+	 * with it keep their own references; free the pool once done making
+	 * them. */
+	git_hiredis_pool *pool;
+
+	assert(out && (host || unix_socket) && size > 0);
+
+	pool = calloc(1, sizeof(git_hiredis_pool));
+	if (pool == NULL)
+		return GITERR_NOMEMORY;
 
-	backend = (hiredis_odb_backend *) _backend;
-	error = GIT_ERROR;
+	pool->idle = calloc(size, sizeof(redisContext *));
+	pool->host = host ? strdup(host) : NULL;
+	pool->unix_socket = unix_socket ? strdup(unix_socket) : NULL;
+	pool->password = password ? strdup(password) : NULL;
+	if (pool->idle == NULL || (host && pool->host == NULL) ||
+			(unix_socket && pool->unix_socket == NULL) || (password && pool->password == NULL)) {
+		free(pool->idle);
+		free(pool->host);
+		free(pool->unix_socket);
+		free(pool->password);
+		free(pool);
+		return GITERR_NOMEMORY;
+	}
 
-	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->available, NULL);
 
-	reply = redisCommand(backend->db, "HMGET %s:%s:odb:%s %s %s %s", backend->prefix, backend->repo_path, str_id,
-			"type", "size", "data");
+	pool->port = port;
+	pool->size = size;
+	pool->refcount = 1;
+	hiredis_pool__timeval(&pool->connect_timeout, connect_timeout_ms);
+	hiredis_pool__timeval(&pool->command_timeout, command_timeout_ms);
 
-	if (reply && reply->type == REDIS_REPLY_ARRAY) {
-		if (reply->element[0]->type != REDIS_REPLY_NIL &&
-				reply->element[1]->type != REDIS_REPLY_NIL &&
-				reply->element[2]->type != REDIS_REPLY_NIL) {
-			*type_p = (git_otype) atoi(reply->element[0]->str);
-			*len_p = (size_t) atoi(reply->element[1]->str);
-			*data_p = malloc(*len_p);
-			if (*data_p == NULL) {
-				error = GITERR_NOMEMORY;
-			} else {
-				memcpy(*data_p, reply->element[2]->str, *len_p);
-				error = GIT_OK;
+	*out = pool;
+	return GIT_OK;
+}
+
+void git_hiredis_pool_free(git_hiredis_pool *pool)
+{
+	/* Drop a reference to the pool; the last one closes its connections */
+	git_hiredis_pool **p;
+	size_t i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&hiredis_pools_lock);
+	if (--pool->refcount > 0) {
+		pthread_mutex_unlock(&hiredis_pools_lock);
+		return;
+	}
+
+	if (pool->shared) {
+		for (p = &hiredis_pools; *p != NULL; p = &(*p)->next) {
+			if (*p == pool) {
+				*p = pool->next;
+				break;
 			}
-		} else {
-			giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
-			error = GIT_ENOTFOUND;
 		}
-	} else {
-		giterr_set_str(GITERR_ODB, "Redis odb storage error");
-		error = GIT_ERROR;
 	}
+	pthread_mutex_unlock(&hiredis_pools_lock);
 
-	free(str_id);
-	freeReplyObject(reply);
-	return error;
+	for (i = 0; i < pool->idle_count; i++)
+		redisFree(pool->idle[i]);
+
+	if (pool->cluster) {
+		for (i = 0; i < pool->node_count; i++)
+			git_hiredis_pool_free(pool->nodes[i]);
+
+		free(pool->nodes);
+		free(pool->slots);
+		pthread_rwlock_destroy(&pool->slots_lock);
+	}
+
+	pthread_cond_destroy(&pool->available);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->idle);
+	free(pool->host);
+	free(pool->unix_socket);
+	free(pool->password);
+	free(pool);
 }
 
-int hiredis_odb_backend__read_prefix(git_oid *out_oid,
-		void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend,
-		const git_oid *short_oid, size_t len)
+static void hiredis_pool__ref(git_hiredis_pool *pool)
 {
-	if (len >= GIT_OID_HEXSZ) {
-		/* Just match the full identifier */
-		int error = hiredis_odb_backend__read(data_p, len_p, type_p, _backend, short_oid);
-		if (error == GIT_OK)
-			git_oid_cpy(out_oid, short_oid);
+	pthread_mutex_lock(&hiredis_pools_lock);
+	pool->refcount++;
+	pthread_mutex_unlock(&hiredis_pools_lock);
+}
 
-		return error;
+/* Find or make the shared pool for an endpoint, taking a reference on it */
+static git_hiredis_pool *hiredis_pool__shared(const char *host, int port, const char *password)
+{
+	git_hiredis_pool *pool;
+
+	pthread_mutex_lock(&hiredis_pools_lock);
+
+	for (pool = hiredis_pools; pool != NULL; pool = pool->next) {
+		if (strcmp(pool->host, host) == 0 && pool->port == port &&
+				(pool->password == NULL) == (password == NULL) &&
+				(password == NULL || strcmp(pool->password, password) == 0)) {
+			pool->refcount++;
+			break;
+		}
+	}
+
+	if (pool == NULL && git_hiredis_pool_new(&pool, host, port, NULL, password,
+			HIREDIS_POOL_DEFAULT_SIZE, 0, 0) == GIT_OK) {
+		pool->shared = 1;
+		pool->next = hiredis_pools;
+		hiredis_pools = pool;
 	}
 
-	/* TODO prefix */
-	giterr_set_str(GITERR_ODB, "Redis odb doesn't not implement oid prefix lookup");
-	return GITERR_INVALID;
+	pthread_mutex_unlock(&hiredis_pools_lock);
+	return pool;
 }
 
-int hiredis_odb_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+/* Make sure the pool can reach its server, so constructors fail early */
+static int hiredis_pool__check(git_hiredis_pool *pool)
 {
-	hiredis_odb_backend *backend;
-	int found;
-	redisReply *reply;
-	char *str_id = calloc(GIT_OID_HEXSZ + 1, sizeof(char));
+	redisContext *db = hiredis_pool__checkout(pool);
 
-	assert(_backend && oid);
+	if (db == NULL)
+		return GIT_ERROR;
 
-	backend = (hiredis_odb_backend *) _backend;
-	found = 0;
+	hiredis_pool__checkin(pool, db);
+	return GIT_OK;
+}
 
-	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+/* Cluster routing */
 
-	reply = redisCommand(backend->db, "exists %s:%s:odb:%s", backend->prefix, backend->repo_path, str_id);
-	if (reply->type == REDIS_REPLY_INTEGER)
-		found = reply->integer;
+static unsigned int hiredis_cluster__slot(const char *key, size_t len)
+{
+	unsigned int crc = 0;
+	size_t start, end;
+	int bit;
+
+	/* Only the part of the key within the first {...}, if not empty, is
+	 * hashed; this is what keeps a repository's refs together */
+	for (start = 0; start < len && key[start] != '{'; start++)
+		;
+	if (start < len) {
+		for (end = start + 1; end < len && key[end] != '}'; end++)
+			;
+		if (end < len && end > start + 1) {
+			key += start + 1;
+			len = end - start - 1;
+		}
+	}
 
-	free(str_id);
-	freeReplyObject(reply);
-	return found;
+	/* CRC16, XMODEM variant */
+	while (len--) {
+		crc ^= (unsigned char) *key++ << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc & (HIREDIS_CLUSTER_SLOTS - 1);
 }
 
-int hiredis_odb_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+static int hiredis_cluster__next_arg(const char **arg, size_t *arg_len, const char *cmd, size_t len, size_t *pos)
 {
-	hiredis_odb_backend *backend;
+	size_t i = *pos, n = 0;
+
+	if (i >= len || cmd[i] != '$')
+		return -1;
+
+	for (i++; i < len && cmd[i] != '\r'; i++)
+		n = n * 10 + (cmd[i] - '0');
+	i += 2;
+
+	if (i + n + 2 > len)
+		return -1;
+
+	*arg = cmd + i;
+	*arg_len = n;
+	*pos = i + n + 2;
+	return 0;
+}
+
+/* Find the key of a formatted command: its first argument, or for scripts
+ * the first of their keys. Returns 0 if the command has none. */
+static int hiredis_cluster__command_key(const char **key, size_t *key_len, const char *cmd, size_t len)
+{
+	const char *arg;
+	size_t arg_len, pos;
+
+	for (pos = 0; pos < len && cmd[pos] != '\n'; pos++)
+		;
+	pos++;
+
+	if (hiredis_cluster__next_arg(&arg, &arg_len, cmd, len, &pos) < 0)
+		return 0;
+
+	if ((arg_len == 4 && strncasecmp(arg, "EVAL", 4) == 0) ||
+			(arg_len == 7 && strncasecmp(arg, "EVALSHA", 7) == 0)) {
+		if (hiredis_cluster__next_arg(&arg, &arg_len, cmd, len, &pos) < 0 ||
+				hiredis_cluster__next_arg(&arg, &arg_len, cmd, len, &pos) < 0 ||
+				(arg_len == 1 && arg[0] == '0'))
+			return 0;
+	}
+
+	return hiredis_cluster__next_arg(key, key_len, cmd, len, &pos) == 0;
+}
+
+/* The pool for a node, made if need be. Called with slots_lock held for
+ * writing. */
+static git_hiredis_pool *hiredis_cluster__node(git_hiredis_pool *cluster, const char *host, size_t host_len, int port)
+{
+	git_hiredis_pool *node, **nodes;
+	char *node_host;
+	size_t i;
 	int error;
-	redisReply *reply;
-	char *str_id = calloc(GIT_OID_HEXSZ + 1, sizeof(char));
 
-	assert(oid && _backend && data);
+	for (i = 0; i < cluster->node_count; i++) {
+		node = cluster->nodes[i];
+		if (node->port == port && strlen(node->host) == host_len && strncmp(node->host, host, host_len) == 0)
+			return node;
+	}
 
-	backend = (hiredis_odb_backend *) _backend;
-	error = GIT_ERROR;
+	nodes = realloc(cluster->nodes, (cluster->node_count + 1) * sizeof(git_hiredis_pool *));
+	if (nodes == NULL)
+		return NULL;
+	cluster->nodes = nodes;
 
-	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+	node_host = strndup(host, host_len);
+	if (node_host == NULL)
+		return NULL;
 
-	reply = redisCommand(backend->db, "HMSET %s:%s:odb:%s "
-			"type %d "
-			"size %d "
-			"data %b ", backend->prefix, backend->repo_path, str_id,
-			(int) type, len, data, len);
-	free(str_id);
+	error = git_hiredis_pool_new(&node, node_host, port, NULL, cluster->password, cluster->size,
+			cluster->connect_timeout.tv_sec * 1000 + cluster->connect_timeout.tv_usec / 1000,
+			cluster->command_timeout.tv_sec * 1000 + cluster->command_timeout.tv_usec / 1000);
+	free(node_host);
+	if (error != GIT_OK)
+		return NULL;
 
-	error = (reply == NULL || reply->type == REDIS_REPLY_ERROR) ? GIT_ERROR : GIT_OK;
+	cluster->nodes[cluster->node_count++] = node;
+	return node;
+}
+
+/* The node serving a key, or any node if the key is NULL */
+static git_hiredis_pool *hiredis_cluster__key_node(git_hiredis_pool *cluster, const char *key, size_t key_len)
+{
+	git_hiredis_pool *node = NULL;
+
+	pthread_rwlock_rdlock(&cluster->slots_lock);
+	if (key != NULL)
+		node = cluster->slots[hiredis_cluster__slot(key, key_len)];
+	if (node == NULL)
+		node = cluster->nodes[0];
+	pthread_rwlock_unlock(&cluster->slots_lock);
+
+	return node;
+}
+
+static git_hiredis_pool *hiredis_cluster__lookup(git_hiredis_pool *cluster, const char *cmd, size_t len)
+{
+	const char *key;
+	size_t key_len;
+
+	if (!hiredis_cluster__command_key(&key, &key_len, cmd, len))
+		key = NULL;
+
+	return hiredis_cluster__key_node(cluster, key, key_len);
+}
+
+static redisReply *hiredis_pool__execute(git_hiredis_pool *pool, const char *cmd, size_t len, int asking);
+
+/* Load the slot map from whichever node answers first. The nodes are asked
+ * without slots_lock held, as pipelines look commands up while holding
+ * connections; the lock is only taken to put the new map in place. */
+static int hiredis_cluster__refresh(git_hiredis_pool *cluster)
+{
+	static const char cmd_slots[] = "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n";
+	redisReply *reply = NULL, *range, *master;
+	git_hiredis_pool *node, *asked = NULL, **slots;
+	const char *host;
+	size_t i, host_len;
+	long long slot;
+	int error = GIT_OK;
+
+	/* Nodes are only ever added, so each one asked stays valid */
+	for (i = 0; reply == NULL; i++) {
+		pthread_rwlock_rdlock(&cluster->slots_lock);
+		asked = i < cluster->node_count ? cluster->nodes[i] : NULL;
+		pthread_rwlock_unlock(&cluster->slots_lock);
+		if (asked == NULL)
+			break;
+
+		reply = hiredis_pool__execute(asked, cmd_slots, sizeof(cmd_slots) - 1, 0);
+		if (reply != NULL && reply->type != REDIS_REPLY_ARRAY) {
+			freeReplyObject(reply);
+			reply = NULL;
+		}
+	}
 
+	if (reply == NULL) {
+		giterr_set_str(GITERR_NET, "Redis cluster slot map couldn't be read");
+		return GIT_ERROR;
+	}
+
+	slots = calloc(HIREDIS_CLUSTER_SLOTS, sizeof(git_hiredis_pool *));
+	if (slots == NULL) {
+		freeReplyObject(reply);
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	pthread_rwlock_wrlock(&cluster->slots_lock);
+
+	for (i = 0; i < reply->elements; i++) {
+		range = reply->element[i];
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3)
+			continue;
+
+		master = range->element[2];
+		if (master->type != REDIS_REPLY_ARRAY || master->elements < 2)
+			continue;
+
+		/* An empty host means the node we asked */
+		host = master->element[0]->str;
+		host_len = master->element[0]->len;
+		if (host_len == 0) {
+			host = asked->host;
+			host_len = strlen(host);
+		}
+
+		node = hiredis_cluster__node(cluster, host, host_len, (int) master->element[1]->integer);
+		if (node == NULL) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			error = GIT_ERROR;
+			break;
+		}
+
+		for (slot = range->element[0]->integer;
+				slot <= range->element[1]->integer && slot < HIREDIS_CLUSTER_SLOTS; slot++)
+			slots[slot] = node;
+	}
+
+	/* A map that couldn't be read in full leaves the old one in place */
+	if (error == GIT_OK) {
+		free(cluster->slots);
+		cluster->slots = slots;
+		slots = NULL;
+	}
+
+	pthread_rwlock_unlock(&cluster->slots_lock);
+	free(slots);
 	freeReplyObject(reply);
 	return error;
 }
 
-void hiredis_odb_backend__free(git_odb_backend *_backend)
+static int hiredis_cluster__is_redirect(const redisReply *reply)
 {
-	hiredis_odb_backend *backend;
+	return reply != NULL && reply->type == REDIS_REPLY_ERROR &&
+		(strncmp(reply->str, "MOVED ", 6) == 0 || strncmp(reply->str, "ASK ", 4) == 0);
+}
 
-	assert(_backend);
-	backend = (hiredis_odb_backend *) _backend;
+/* Where a MOVED or ASK error points. MOVED means the slot map changed, so
+ * it's loaded again; ASK only holds for this one command, which must be
+ * preceded by ASKING. */
+static git_hiredis_pool *hiredis_cluster__redirect(git_hiredis_pool *cluster, const redisReply *reply, int *asking)
+{
+	git_hiredis_pool *node;
+	const char *addr, *colon;
+
+	*asking = (strncmp(reply->str, "ASK ", 4) == 0);
+	if (!*asking)
+		hiredis_cluster__refresh(cluster);
+
+	/* "MOVED <slot> <host>:<port>" */
+	addr = strchr(reply->str, ' ');
+	addr = addr ? strchr(addr + 1, ' ') : NULL;
+	colon = addr ? strrchr(addr, ':') : NULL;
+	if (colon == NULL)
+		return NULL;
+	addr++;
+
+	pthread_rwlock_wrlock(&cluster->slots_lock);
+	node = hiredis_cluster__node(cluster, addr, colon - addr, atoi(colon + 1));
+	pthread_rwlock_unlock(&cluster->slots_lock);
+
+	return node;
+}
 
-	free(backend->repo_path);
-	free(backend->prefix);
+/* Commands */
 
-	redisFree(backend->db);
+/* Send a formatted command over one of the pool's connections and wait for
+ * the reply. With asking, ASKING goes first, for a slot being migrated. */
+static redisReply *hiredis_pool__execute(git_hiredis_pool *pool, const char *cmd, size_t len, int asking)
+{
+	redisContext *db;
+	redisReply *reply = NULL;
+	int error = REDIS_OK;
+
+	db = hiredis_pool__checkout(pool);
+	if (db == NULL)
+		return NULL;
+
+	if (asking)
+		error = redisAppendCommand(db, "ASKING");
+	if (error == REDIS_OK)
+		error = redisAppendFormattedCommand(db, cmd, len);
+	if (error == REDIS_OK && asking) {
+		error = redisGetReply(db, (void **) &reply);
+		freeReplyObject(reply);
+		reply = NULL;
+	}
+	if (error == REDIS_OK)
+		error = redisGetReply(db, (void **) &reply);
 
-	free(backend);
+	if (error != REDIS_OK) {
+		giterr_set_str(GITERR_NET, db->err ? db->errstr : "Redis storage error");
+		reply = NULL;
+	}
+
+	/* A broken connection reconnects on its next checkout */
+	hiredis_pool__checkin(pool, db);
+	return reply;
 }
 
-/* Refdb methods */
+static redisReply *hiredis_pool__route(git_hiredis_pool *pool, const char *cmd, size_t len)
+{
+	git_hiredis_pool *node;
+	redisReply *reply;
+	int redirects, asking = 0;
 
-int hiredis_refdb_backend__exists(int *exists, git_refdb_backend *_backend, const char *ref_name)
+	if (!pool->cluster)
+		return hiredis_pool__execute(pool, cmd, len, 0);
+
+	node = hiredis_cluster__lookup(pool, cmd, len);
+	for (redirects = 0; ; redirects++) {
+		reply = hiredis_pool__execute(node, cmd, len, asking);
+		if (!hiredis_cluster__is_redirect(reply) || redirects == HIREDIS_CLUSTER_REDIRECTS)
+			return reply;
+
+		node = hiredis_cluster__redirect(pool, reply, &asking);
+		if (node == NULL)
+			return reply;
+
+		freeReplyObject(reply);
+	}
+}
+
+/* Run a command, formatted as for redisCommand, on the right server. Gives
+ * NULL, with the error set, if the connection failed. */
+static redisReply *hiredis_pool__command(git_hiredis_pool *pool, const char *format, ...)
 {
-	hiredis_refdb_backend *backend;
-	int error = GIT_OK;
 	redisReply *reply;
+	va_list ap;
+	char *cmd;
+	int len;
 
-	assert(ref_name && _backend);
+	va_start(ap, format);
+	len = redisvFormatCommand(&cmd, format, ap);
+	va_end(ap);
 
-	backend = (hiredis_refdb_backend *) _backend;
+	if (len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return NULL;
+	}
+
+	reply = hiredis_pool__route(pool, cmd, (size_t) len);
+	redisFreeCommand(cmd);
+	return reply;
+}
+
+static int hiredis_pool_conn__cmp(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t) ((const hiredis_pool_conn *) a)->node;
+	uintptr_t y = (uintptr_t) ((const hiredis_pool_conn *) b)->node;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Run count formatted commands, sending them all before reading any reply;
+ * replies[i] gets the reply to cmds[i], or NULL if it couldn't be run. In a
+ * cluster the commands are spread over the nodes they belong to, and those
+ * that get redirected are run again on their own. */
+static int hiredis_pool__pipeline(git_hiredis_pool *pool, char **cmds, size_t *lens, size_t count,
+		redisReply **replies)
+{
+	hiredis_pool_conn *conns;
+	git_hiredis_pool **targets;
+	size_t *which;
+	size_t i, c, conn_count = 0;
+	int error = GIT_OK;
+
+	memset(replies, 0, count * sizeof(redisReply *));
+	if (count == 0)
+		return GIT_OK;
+
+	conns = calloc(count, sizeof(hiredis_pool_conn));
+	targets = calloc(count, sizeof(git_hiredis_pool *));
+	which = calloc(count, sizeof(size_t));
+	if (conns == NULL || targets == NULL || which == NULL) {
+		free(conns);
+		free(targets);
+		free(which);
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	/* Every command is routed before any connection is taken, and the
+	 * connections are taken in one order, by node, so that pipelines
+	 * waiting on full pools can't each hold what another waits for */
+	for (i = 0; i < count; i++) {
+		targets[i] = pool->cluster ? hiredis_cluster__lookup(pool, cmds[i], lens[i]) : pool;
+
+		for (c = 0; c < conn_count && conns[c].node != targets[i]; c++)
+			;
+		if (c == conn_count)
+			conns[conn_count++].node = targets[i];
+	}
+
+	qsort(conns, conn_count, sizeof(hiredis_pool_conn), hiredis_pool_conn__cmp);
+
+	for (c = 0; c < conn_count; c++) {
+		conns[c].db = hiredis_pool__checkout(conns[c].node);
+		if (conns[c].db == NULL) {
+			error = GIT_ERROR;
+			break;
+		}
+	}
+
+	for (i = 0; error == GIT_OK && i < count; i++) {
+		for (c = 0; conns[c].node != targets[i]; c++)
+			;
+
+		which[i] = c;
+		if (redisAppendFormattedCommand(conns[c].db, cmds[i], lens[i]) != REDIS_OK) {
+			giterr_set_str(GITERR_NET, conns[c].db->errstr);
+			error = GIT_ERROR;
+		}
+	}
+
+	for (i = 0; error == GIT_OK && i < count; i++) {
+		redisContext *db = conns[which[i]].db;
+
+		if (redisGetReply(db, (void **) &replies[i]) != REDIS_OK) {
+			giterr_set_str(GITERR_NET, db->err ? db->errstr : "Redis storage error");
+			replies[i] = NULL;
+			error = GIT_ERROR;
+		}
+	}
+
+	/* After a failure, unread replies may be left on any of the connections */
+	for (c = 0; c < conn_count && conns[c].db != NULL; c++) {
+		if (error == GIT_OK)
+			hiredis_pool__checkin(conns[c].node, conns[c].db);
+		else
+			hiredis_pool__discard(conns[c].node, conns[c].db);
+	}
+
+	free(conns);
+	free(targets);
+	free(which);
+
+	if (error != GIT_OK) {
+		for (i = 0; i < count; i++) {
+			freeReplyObject(replies[i]);
+			replies[i] = NULL;
+		}
+		return error;
+	}
+
+	/* Only once every connection is back, as this may reload the slot map */
+	for (i = 0; pool->cluster && i < count; i++) {
+		if (hiredis_cluster__is_redirect(replies[i])) {
+			freeReplyObject(replies[i]);
+			replies[i] = hiredis_pool__route(pool, cmds[i], lens[i]);
+		}
+	}
+
+	return GIT_OK;
+}
+
+/* Put EVAL or EVALSHA and the script in front of the script's formatted
+ * arguments, which start with the number of keys */
+static int hiredis_script__format(char **out, const char *verb, const char *script, const char *args, size_t args_len)
+{
+	const char *body;
+	char *cmd;
+	size_t verb_len = strlen(verb), script_len = strlen(script), head_len;
+	int argc;
+
+	body = memchr(args, '\n', args_len);
+	if (body == NULL)
+		return -1;
+	body++;
+	argc = atoi(args + 1) + 2;
+
+	cmd = malloc(args_len + verb_len + script_len + 64);
+	if (cmd == NULL)
+		return -1;
+
+	head_len = sprintf(cmd, "*%d\r\n$%u\r\n%s\r\n$%u\r\n", argc, (unsigned int) verb_len, verb,
+			(unsigned int) script_len);
+	memcpy(cmd + head_len, script, script_len);
+	head_len += script_len;
+	memcpy(cmd + head_len, "\r\n", 2);
+	head_len += 2;
+	memcpy(cmd + head_len, body, args_len - (body - args));
+
+	*out = cmd;
+	return (int) (head_len + args_len - (body - args));
+}
+
+/* Run a script with the given formatted arguments. The script is loaded on
+ * first use, then sent by its SHA1; a server that doesn't know it (having
+ * been flushed, or being another cluster node) is sent the source instead,
+ * which it keeps for next time. */
+static redisReply *hiredis_pool__script_formatted(git_hiredis_pool *pool, hiredis_script *script,
+		const char *args, size_t args_len)
+{
+	redisReply *reply = NULL;
+	char sha[41];
+	char *cmd;
+	int len, loaded;
+
+	pthread_mutex_lock(&hiredis_scripts_lock);
+	loaded = script->loaded;
+	memcpy(sha, script->sha, sizeof(sha));
+	pthread_mutex_unlock(&hiredis_scripts_lock);
+
+	if (!loaded) {
+		reply = hiredis_pool__command(pool, "SCRIPT LOAD %s", script->source);
+		if (reply != NULL && reply->type == REDIS_REPLY_STRING && reply->len == 40) {
+			memcpy(sha, reply->str, 40);
+			sha[40] = '\0';
+			loaded = 1;
+
+			pthread_mutex_lock(&hiredis_scripts_lock);
+			memcpy(script->sha, sha, sizeof(sha));
+			script->loaded = 1;
+			pthread_mutex_unlock(&hiredis_scripts_lock);
+		}
+		freeReplyObject(reply);
+		reply = NULL;
+	}
+
+	if (loaded) {
+		len = hiredis_script__format(&cmd, "EVALSHA", sha, args, args_len);
+		if (len < 0) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return NULL;
+		}
+
+		reply = hiredis_pool__route(pool, cmd, (size_t) len);
+		free(cmd);
+
+		if (reply == NULL || reply->type != REDIS_REPLY_ERROR || strncmp(reply->str, "NOSCRIPT", 8) != 0)
+			return reply;
+
+		freeReplyObject(reply);
+	}
+
+	len = hiredis_script__format(&cmd, "EVAL", script->source, args, args_len);
+	if (len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return NULL;
+	}
+
+	reply = hiredis_pool__route(pool, cmd, (size_t) len);
+	free(cmd);
+
+	return reply;
+}
+
+/* Run a script; the format gives the number of keys, the keys, then the
+ * other arguments, as for redisCommand */
+static redisReply *hiredis_pool__script(git_hiredis_pool *pool, hiredis_script *script, const char *format, ...)
+{
+	redisReply *reply;
+	va_list ap;
+	char *args;
+	int len;
+
+	va_start(ap, format);
+	len = redisvFormatCommand(&args, format, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return NULL;
+	}
+
+	reply = hiredis_pool__script_formatted(pool, script, args, (size_t) len);
+	redisFreeCommand(args);
+	return reply;
+}
+
+/* Copy a key prefix for a SCAN pattern, so it matches literally whatever
+ * glob characters it holds. out needs room for twice the input. */
+static char *hiredis_scan__escape(char *out, const char *in)
+{
+	for (; *in; in++) {
+		if (strchr("*?[]\\", *in))
+			*out++ = '\\';
+		*out++ = *in;
+	}
+
+	*out = '\0';
+	return out;
+}
+
+/* Odb methods */
+
+static void hiredis_odb_backend__format_header(unsigned char *header, git_otype type, int codec, size_t len)
+{
+	unsigned long long size = len;
+	int i;
+
+	header[0] = (unsigned char) (type | (codec << 4));
+	for (i = HIREDIS_ODB_HEADER_LEN - 1; i > 0; i--) {
+		header[i] = (unsigned char) (size & 0xff);
+		size >>= 8;
+	}
+}
+
+/* Chunks: a window of them is sent or fetched per pipeline. In a cluster,
+ * each goes to whichever node serves its key. */
+
+static void hiredis_odb_backend__format_chunks(unsigned char *out, size_t chunk_size, const char *token)
+{
+	out[0] = (unsigned char) ((chunk_size >> 24) & 0xff);
+	out[1] = (unsigned char) ((chunk_size >> 16) & 0xff);
+	out[2] = (unsigned char) ((chunk_size >> 8) & 0xff);
+	out[3] = (unsigned char) (chunk_size & 0xff);
+	memcpy(out + 4, token, GIT_OID_HEXSZ);
+}
+
+static int hiredis_odb_backend__parse_chunks(size_t *chunk_size, char *token, const char *in, size_t in_len)
+{
+	const unsigned char *p = (const unsigned char *) in;
+
+	if (in_len != HIREDIS_ODB_CHUNKS_LEN) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage corrupted (bad chunked object)");
+		return GIT_ERROR;
+	}
+
+	*chunk_size = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | (size_t) p[3];
+	if (*chunk_size == 0) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage corrupted (bad chunked object)");
+		return GIT_ERROR;
+	}
+
+	memcpy(token, in + 4, GIT_OID_HEXSZ);
+	token[GIT_OID_HEXSZ] = '\0';
+	return GIT_OK;
+}
+
+/* Store data as the chunks numbered from first on */
+static int hiredis_odb_backend__write_chunks(hiredis_odb_backend *backend, const char *token, size_t chunk_size,
+		unsigned int first, const char *data, size_t len)
+{
+	char *cmds[HIREDIS_ODB_CHUNK_WINDOW];
+	size_t lens[HIREDIS_ODB_CHUNK_WINDOW];
+	redisReply *replies[HIREDIS_ODB_CHUNK_WINDOW];
+	size_t count, n, i;
+	int cmd_len, error = GIT_OK;
+
+	while (error == GIT_OK && len > 0) {
+		for (count = 0; count < HIREDIS_ODB_CHUNK_WINDOW && len > 0; count++) {
+			n = len < chunk_size ? len : chunk_size;
+
+			cmd_len = redisFormatCommand(&cmds[count], "SET %s:%s:chunk:%s:%u %b", backend->prefix,
+					backend->repo_path, token, first++, data, n);
+			if (cmd_len < 0) {
+				for (i = 0; i < count; i++)
+					redisFreeCommand(cmds[i]);
+				giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+				return GIT_ERROR;
+			}
+			lens[count] = (size_t) cmd_len;
+
+			data += n;
+			len -= n;
+		}
+
+		error = hiredis_pool__pipeline(backend->pool, cmds, lens, count, replies);
+
+		for (i = 0; i < count; i++) {
+			if (error == GIT_OK && (replies[i] == NULL || replies[i]->type == REDIS_REPLY_ERROR)) {
+				giterr_set_str(GITERR_ODB, "Redis odb failed to store an object chunk");
+				error = GIT_ERROR;
+			}
+
+			redisFreeCommand(cmds[i]);
+			freeReplyObject(replies[i]);
+		}
+	}
+
+	return error;
+}
+
+/* Fill out with the chunks numbered from first on. Every chunk but an
+ * object's last is chunk_size long. */
+static int hiredis_odb_backend__read_chunks(hiredis_odb_backend *backend, const char *token, size_t chunk_size,
+		unsigned int first, char *out, size_t len)
+{
+	char *cmds[HIREDIS_ODB_CHUNK_WINDOW];
+	size_t lens[HIREDIS_ODB_CHUNK_WINDOW];
+	size_t want[HIREDIS_ODB_CHUNK_WINDOW];
+	redisReply *replies[HIREDIS_ODB_CHUNK_WINDOW];
+	size_t count, i;
+	int cmd_len, error = GIT_OK;
+
+	while (error == GIT_OK && len > 0) {
+		for (count = 0; count < HIREDIS_ODB_CHUNK_WINDOW && len > 0; count++) {
+			want[count] = len < chunk_size ? len : chunk_size;
+
+			cmd_len = redisFormatCommand(&cmds[count], "GET %s:%s:chunk:%s:%u", backend->prefix,
+					backend->repo_path, token, first++);
+			if (cmd_len < 0) {
+				for (i = 0; i < count; i++)
+					redisFreeCommand(cmds[i]);
+				giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+				return GIT_ERROR;
+			}
+			lens[count] = (size_t) cmd_len;
+
+			len -= want[count];
+		}
+
+		error = hiredis_pool__pipeline(backend->pool, cmds, lens, count, replies);
+
+		for (i = 0; i < count; i++) {
+			if (error == GIT_OK) {
+				if (replies[i] == NULL || replies[i]->type == REDIS_REPLY_ERROR) {
+					giterr_set_str(GITERR_ODB, "Redis odb storage error");
+					error = GIT_ERROR;
+				} else if (replies[i]->type != REDIS_REPLY_STRING || replies[i]->len != want[i]) {
+					giterr_set_str(GITERR_ODB, "Redis odb storage corrupted (missing object chunk)");
+					error = GIT_ERROR;
+				} else {
+					memcpy(out, replies[i]->str, want[i]);
+					out += want[i];
+				}
+			}
+
+			redisFreeCommand(cmds[i]);
+			freeReplyObject(replies[i]);
+		}
+	}
+
+	return error;
+}
+
+/* Drop the first count chunks under token. One DEL per chunk, as in a
+ * cluster they're in different slots. */
+static void hiredis_odb_backend__delete_chunks(hiredis_odb_backend *backend, const char *token, unsigned int count)
+{
+	char *cmds[HIREDIS_ODB_CHUNK_WINDOW];
+	size_t lens[HIREDIS_ODB_CHUNK_WINDOW];
+	redisReply *replies[HIREDIS_ODB_CHUNK_WINDOW];
+	unsigned int seq = 0;
+	size_t n, i;
+	int cmd_len = 0;
+
+	while (seq < count) {
+		for (n = 0; n < HIREDIS_ODB_CHUNK_WINDOW && seq < count; n++, seq++) {
+			cmd_len = redisFormatCommand(&cmds[n], "DEL %s:%s:chunk:%s:%u", backend->prefix,
+					backend->repo_path, token, seq);
+			if (cmd_len < 0)
+				break;
+			lens[n] = (size_t) cmd_len;
+		}
+
+		if (n > 0 && hiredis_pool__pipeline(backend->pool, cmds, lens, n, replies) == GIT_OK) {
+			for (i = 0; i < n; i++)
+				freeReplyObject(replies[i]);
+		}
+
+		for (i = 0; i < n; i++)
+			redisFreeCommand(cmds[i]);
+
+		if (cmd_len < 0)
+			break;
+	}
+}
+
+/* Copy, inflate or gather stored data into a buffer for libgit2 */
+static int hiredis_odb_backend__unpack(void **data_p, hiredis_odb_backend *backend, size_t len, int codec,
+		const char *in, size_t in_len)
+{
+	uLongf out_len = (uLongf) len;
+	char token[GIT_OID_HEXSZ + 1];
+	size_t chunk_size = 0;
+	char *data;
+	int error;
+
+	if (codec != HIREDIS_ODB_CODEC_NONE && codec != HIREDIS_ODB_CODEC_ZLIB &&
+			codec != HIREDIS_ODB_CODEC_CHUNKED) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage corrupted (unknown codec)");
+		return GIT_ERROR;
+	}
+
+	if (codec == HIREDIS_ODB_CODEC_NONE && in_len != len) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage corrupted");
+		return GIT_ERROR;
+	}
+
+	if (codec == HIREDIS_ODB_CODEC_CHUNKED &&
+			(error = hiredis_odb_backend__parse_chunks(&chunk_size, token, in, in_len)) != GIT_OK)
+		return error;
+
+	/* One more byte, so an empty object isn't taken for a failed allocation */
+	data = malloc(len + 1);
+	if (data == NULL)
+		return GITERR_NOMEMORY;
+
+	if (codec == HIREDIS_ODB_CODEC_NONE) {
+		memcpy(data, in, len);
+	} else if (codec == HIREDIS_ODB_CODEC_CHUNKED) {
+		error = hiredis_odb_backend__read_chunks(backend, token, chunk_size, 0, data, len);
+		if (error != GIT_OK) {
+			free(data);
+			return error;
+		}
+	} else if (uncompress((Bytef *) data, &out_len, (const Bytef *) in, (uLong) in_len) != Z_OK ||
+			out_len != len) {
+		free(data);
+		giterr_set_str(GITERR_ZLIB, "Redis odb failed to inflate an object");
+		return GIT_ERROR;
+	}
+
+	data[len] = '\0';
+	*data_p = data;
+	return GIT_OK;
+}
+
+/* Interpret a compact layout reply to GET (or to GETRANGE on the header,
+ * when data_p is NULL) */
+static int hiredis_odb_backend__parse_compact(void **data_p, size_t *len_p, git_otype *type_p,
+		hiredis_odb_backend *backend, const redisReply *reply)
+{
+	const unsigned char *header;
+	unsigned long long size = 0;
+	int i;
+
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage error");
+		return GIT_ERROR;
+	}
+
+	/* GET gives nil for missing keys, GETRANGE an empty string */
+	if (reply->type == REDIS_REPLY_NIL || (reply->type == REDIS_REPLY_STRING && reply->len == 0)) {
+		giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
+		return GIT_ENOTFOUND;
+	}
+
+	if (reply->type != REDIS_REPLY_STRING || reply->len < HIREDIS_ODB_HEADER_LEN) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage corrupted");
+		return GIT_ERROR;
+	}
+
+	header = (const unsigned char *) reply->str;
+	for (i = 1; i < HIREDIS_ODB_HEADER_LEN; i++)
+		size = (size << 8) | header[i];
+
+	*type_p = (git_otype) (header[0] & 0x0f);
+	*len_p = (size_t) size;
+
+	if (data_p == NULL)
+		return GIT_OK;
+
+	return hiredis_odb_backend__unpack(data_p, backend, *len_p, header[0] >> 4,
+			reply->str + HIREDIS_ODB_HEADER_LEN, reply->len - HIREDIS_ODB_HEADER_LEN);
+}
+
+/* Direct reads: rather than build a reply, then copy the object out of it,
+ * the connection's reader is given functions that parse the reply as it
+ * arrives, copying the object's data once, into a malloc()ed buffer that
+ * is handed on to libgit2 as is. Every reply object they make is the read
+ * itself. This relies on the reader's layout in hiredis 1.0 and later;
+ * older versions always take the ordinary path. */
+#if HIREDIS_MAJOR >= 1
+typedef struct {
+	hiredis_odb_backend *backend;
+	void *data;
+	size_t len;
+	git_otype type;
+	int codec;
+	int missing;
+	int error;
+
+	/* A chunked object's chunks, fetched once the connection is back in
+	 * the pool */
+	int chunked;
+	char chunks[HIREDIS_ODB_CHUNKS_LEN];
+	size_t chunks_len;
+
+	/* Set when the reply isn't what a read expects, such as a cluster
+	 * redirect; the read is then made again the ordinary way */
+	int unexpected;
+} hiredis_odb_read;
+
+static size_t hiredis_odb_read__number(const char *str, size_t len)
+{
+	size_t n = 0;
+
+	while (len-- && *str >= '0' && *str <= '9')
+		n = n * 10 + (*str++ - '0');
+
+	return n;
+}
+
+static void *hiredis_odb_read__data(hiredis_odb_read *read, const char *str, size_t len)
+{
+	if (read->codec == HIREDIS_ODB_CODEC_CHUNKED) {
+		read->chunked = 1;
+		read->chunks_len = len;
+		if (len <= sizeof(read->chunks))
+			memcpy(read->chunks, str, len);
+		return read;
+	}
+
+	read->error = hiredis_odb_backend__unpack(&read->data, read->backend, read->len, read->codec, str, len);
+
+	/* Failing to allocate is a reader error too; anything else fails only
+	 * the read */
+	return read->error == GITERR_NOMEMORY ? NULL : read;
+}
+
+static void *hiredis_odb_read__string(const redisReadTask *task, char *str, size_t len)
+{
+	hiredis_odb_read *read = (hiredis_odb_read *) task->privdata;
+	const unsigned char *header = (const unsigned char *) str;
+	unsigned long long size = 0;
+	int i;
+
+	if (task->type != REDIS_REPLY_STRING) {
+		read->unexpected = 1;
+		return read;
+	}
+
+	/* Compact: the value of a GET, a header then the data */
+	if (read->backend->compact) {
+		if (task->parent != NULL || len < HIREDIS_ODB_HEADER_LEN) {
+			read->unexpected = 1;
+			return read;
+		}
+
+		for (i = 1; i < HIREDIS_ODB_HEADER_LEN; i++)
+			size = (size << 8) | header[i];
+
+		read->type = (git_otype) (header[0] & 0x0f);
+		read->codec = header[0] >> 4;
+		read->len = (size_t) size;
+
+		return hiredis_odb_read__data(read, str + HIREDIS_ODB_HEADER_LEN, len - HIREDIS_ODB_HEADER_LEN);
+	}
+
+	/* Hex: the fields of HMGET type size codec data, in that order */
+	switch (task->parent != NULL ? task->idx : -1) {
+	case 0:
+		read->type = (git_otype) hiredis_odb_read__number(str, len);
+		return read;
+	case 1:
+		read->len = hiredis_odb_read__number(str, len);
+		return read;
+	case 2:
+		read->codec = (int) hiredis_odb_read__number(str, len);
+		return read;
+	case 3:
+		return hiredis_odb_read__data(read, str, len);
+	default:
+		read->unexpected = 1;
+		return read;
+	}
+}
+
+static void *hiredis_odb_read__array(const redisReadTask *task, size_t elements)
+{
+	hiredis_odb_read *read = (hiredis_odb_read *) task->privdata;
+
+	if (read->backend->compact || task->parent != NULL || elements != 4)
+		read->unexpected = 1;
+
+	return read;
+}
+
+static void *hiredis_odb_read__integer(const redisReadTask *task, long long value)
+{
+	hiredis_odb_read *read = (hiredis_odb_read *) task->privdata;
+
+	read->unexpected = 1;
+	return read;
+}
+
+static void *hiredis_odb_read__double(const redisReadTask *task, double value, char *str, size_t len)
+{
+	hiredis_odb_read *read = (hiredis_odb_read *) task->privdata;
+
+	read->unexpected = 1;
+	return read;
+}
+
+static void *hiredis_odb_read__nil(const redisReadTask *task)
+{
+	hiredis_odb_read *read = (hiredis_odb_read *) task->privdata;
+
+	/* Objects stored before there were codecs have none */
+	if (read->backend->compact || task->parent == NULL || task->idx != 2)
+		read->missing = 1;
+	return read;
+}
+
+static void *hiredis_odb_read__bool(const redisReadTask *task, int value)
+{
+	hiredis_odb_read *read = (hiredis_odb_read *) task->privdata;
+
+	read->unexpected = 1;
+	return read;
+}
+
+static void hiredis_odb_read__free(void *obj)
+{
+	/* Nothing was allocated but the data, which the read owns */
+}
+
+static redisReplyObjectFunctions hiredis_odb_read_functions = {
+	hiredis_odb_read__string,
+	hiredis_odb_read__array,
+	hiredis_odb_read__integer,
+	hiredis_odb_read__double,
+	hiredis_odb_read__nil,
+	hiredis_odb_read__bool,
+	hiredis_odb_read__free
+};
+
+/* Read an object straight into a buffer for libgit2. Gives GIT_PASSTHROUGH
+ * if the reply called for an ordinary read instead. */
+static int hiredis_odb_backend__read_direct(void **data_p, size_t *len_p, git_otype *type_p,
+		hiredis_odb_backend *backend, const git_oid *oid)
+{
+	hiredis_odb_read read;
+	git_hiredis_pool *node;
+	redisContext *db;
+	redisReplyObjectFunctions *fn;
+	void *privdata, *reply = NULL;
+	char str_id[GIT_OID_HEXSZ + 1];
+	char *cmd;
+	int len, status;
+
+	if (backend->compact) {
+		len = redisFormatCommand(&cmd, "GET %s:%s:obj:%b", backend->prefix, backend->repo_path,
+				oid->id, (size_t) GIT_OID_RAWSZ);
+	} else {
+		git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+		len = redisFormatCommand(&cmd, "HMGET %s:%s:odb:%s type size codec data", backend->prefix,
+				backend->repo_path, str_id);
+	}
+	if (len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	node = backend->pool->cluster ? hiredis_cluster__lookup(backend->pool, cmd, (size_t) len) : backend->pool;
+	db = hiredis_pool__checkout(node);
+	if (db == NULL) {
+		redisFreeCommand(cmd);
+		return GIT_ERROR;
+	}
+
+	memset(&read, 0, sizeof(read));
+	read.backend = backend;
+
+	/* The connection is ours until checked in, so its reader can be lent
+	 * other functions for the one reply */
+	fn = db->reader->fn;
+	privdata = db->reader->privdata;
+	db->reader->fn = &hiredis_odb_read_functions;
+	db->reader->privdata = &read;
+
+	status = redisAppendFormattedCommand(db, cmd, (size_t) len);
+	if (status == REDIS_OK)
+		status = redisGetReply(db, &reply);
+
+	db->reader->fn = fn;
+	db->reader->privdata = privdata;
+
+	if (status != REDIS_OK)
+		giterr_set_str(GITERR_NET, db->err ? db->errstr : "Redis storage error");
+
+	hiredis_pool__checkin(node, db);
+	redisFreeCommand(cmd);
+
+	if (status != REDIS_OK || read.unexpected || (read.missing && read.data != NULL)) {
+		free(read.data);
+		return status != REDIS_OK ? GIT_ERROR : GIT_PASSTHROUGH;
+	}
+
+	if (read.chunked && !read.missing && read.error == GIT_OK)
+		read.error = hiredis_odb_backend__unpack(&read.data, backend, read.len, read.codec,
+				read.chunks, read.chunks_len);
+
+	if (read.error != GIT_OK)
+		return read.error;
+
+	if (read.missing || read.data == NULL) {
+		free(read.data);
+		giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
+		return GIT_ENOTFOUND;
+	}
+
+	*data_p = read.data;
+	*len_p = read.len;
+	*type_p = read.type;
+	return GIT_OK;
+}
+#else
+static int hiredis_odb_backend__read_direct(void **data_p, size_t *len_p, git_otype *type_p,
+		hiredis_odb_backend *backend, const git_oid *oid)
+{
+	return GIT_PASSTHROUGH;
+}
+#endif
+
+int hiredis_odb_backend__read_header(size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	hiredis_odb_backend *backend;
+	int error;
+	redisReply *reply;
+	char str_id[GIT_OID_HEXSZ + 1];
+
+	assert(len_p && type_p && _backend && oid);
+
+	backend = (hiredis_odb_backend *) _backend;
+	error = GIT_ERROR;
+
+	if (backend->compact) {
+		reply = hiredis_pool__command(backend->pool, "GETRANGE %s:%s:obj:%b 0 %d", backend->prefix, backend->repo_path,
+				oid->id, (size_t) GIT_OID_RAWSZ, HIREDIS_ODB_HEADER_LEN - 1);
+		error = hiredis_odb_backend__parse_compact(NULL, len_p, type_p, backend, reply);
+		freeReplyObject(reply);
+		return error;
+	}
+
+	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+
+	reply = hiredis_pool__command(backend->pool, "HMGET %s:%s:odb:%s %s %s", backend->prefix, backend->repo_path, str_id, "type", "size");
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY) {
+		if (reply->element[0]->type != REDIS_REPLY_NIL &&
+				reply->element[1]->type != REDIS_REPLY_NIL) {
+			*type_p = (git_otype) atoi(reply->element[0]->str);
+			*len_p = (size_t) strtoull(reply->element[1]->str, NULL, 10);
+			error = GIT_OK;
+		} else {
+			giterr_set_str(GITERR_ODB, "Redis odb storage corrupted");
+			error = GIT_ENOTFOUND;
+		}
+	} else {
+		giterr_set_str(GITERR_ODB, "Redis odb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_odb_backend__read(void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend, const git_oid *oid)
+{
+	hiredis_odb_backend *backend;
+	int error;
+	redisReply *reply;
+	char str_id[GIT_OID_HEXSZ + 1];
+
+	assert(data_p && len_p && type_p && _backend && oid);
+
+	backend = (hiredis_odb_backend *) _backend;
+	error = GIT_ERROR;
+
+	error = hiredis_odb_backend__read_direct(data_p, len_p, type_p, backend, oid);
+	if (error != GIT_PASSTHROUGH)
+		return error;
+
+	if (backend->compact) {
+		reply = hiredis_pool__command(backend->pool, "GET %s:%s:obj:%b", backend->prefix, backend->repo_path,
+				oid->id, (size_t) GIT_OID_RAWSZ);
+		error = hiredis_odb_backend__parse_compact(data_p, len_p, type_p, backend, reply);
+		freeReplyObject(reply);
+		return error;
+	}
+
+	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+
+	reply = hiredis_pool__command(backend->pool, "HMGET %s:%s:odb:%s %s %s %s %s", backend->prefix, backend->repo_path, str_id,
+			"type", "size", "codec", "data");
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY) {
+		if (reply->element[0]->type != REDIS_REPLY_NIL &&
+				reply->element[1]->type != REDIS_REPLY_NIL &&
+				reply->element[3]->type != REDIS_REPLY_NIL) {
+			*type_p = (git_otype) atoi(reply->element[0]->str);
+			*len_p = (size_t) strtoull(reply->element[1]->str, NULL, 10);
+			error = hiredis_odb_backend__unpack(data_p, backend, *len_p,
+					reply->element[2]->type == REDIS_REPLY_NIL ? HIREDIS_ODB_CODEC_NONE : atoi(reply->element[2]->str),
+					reply->element[3]->str, reply->element[3]->len);
+		} else {
+			giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
+			error = GIT_ENOTFOUND;
+		}
+	} else {
+		giterr_set_str(GITERR_ODB, "Redis odb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+/* Resolve an abbreviated id through the index of object ids: one range
+ * query, asking for two ids, tells a unique prefix from an ambiguous one */
+static int hiredis_odb_backend__resolve_prefix(git_oid *out, hiredis_odb_backend *backend,
+		const git_oid *short_oid, size_t len)
+{
+	redisReply *reply;
+	char hex[GIT_OID_HEXSZ + 1];
+	int error = GIT_OK;
+
+	if (!backend->oid_index) {
+		giterr_set_str(GITERR_ODB, "Redis odb doesn't not implement oid prefix lookup");
+		return GITERR_INVALID;
+	}
+
+	git_oid_nfmt(hex, len, short_oid);
+	hex[len] = '\0';
+
+	reply = hiredis_pool__command(backend->pool, "ZRANGEBYLEX %s:%s:oids [%s (%s\xff LIMIT 0 2",
+			backend->prefix, backend->repo_path, hex, hex);
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage error");
+		error = GIT_ERROR;
+	} else if (reply->elements == 0) {
+		giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
+		error = GIT_ENOTFOUND;
+	} else if (reply->elements > 1) {
+		giterr_set_str(GITERR_ODB, "Redis odb found an ambiguous object id prefix");
+		error = GIT_EAMBIGUOUS;
+	} else if (git_oid_fromstr(out, reply->element[0]->str) < 0) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage corrupted (bad object id in index)");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_odb_backend__read_prefix(git_oid *out_oid,
+		void **data_p, size_t *len_p, git_otype *type_p, git_odb_backend *_backend,
+		const git_oid *short_oid, size_t len)
+{
+	int error;
+
+	if (len >= GIT_OID_HEXSZ) {
+		/* Just match the full identifier */
+		int error = hiredis_odb_backend__read(data_p, len_p, type_p, _backend, short_oid);
+		if (error == GIT_OK)
+			git_oid_cpy(out_oid, short_oid);
+
+		return error;
+	}
+
+	error = hiredis_odb_backend__resolve_prefix(out_oid, (hiredis_odb_backend *) _backend, short_oid, len);
+	if (error == GIT_OK)
+		error = hiredis_odb_backend__read(data_p, len_p, type_p, _backend, out_oid);
+
+	return error;
+}
+
+int hiredis_odb_backend__exists(git_odb_backend *_backend, const git_oid *oid)
+{
+	hiredis_odb_backend *backend;
+	int found;
+	redisReply *reply;
+	char str_id[GIT_OID_HEXSZ + 1];
+
+	assert(_backend && oid);
+
+	backend = (hiredis_odb_backend *) _backend;
+	found = 0;
+
+	if (backend->compact) {
+		reply = hiredis_pool__command(backend->pool, "EXISTS %s:%s:obj:%b", backend->prefix, backend->repo_path,
+				oid->id, (size_t) GIT_OID_RAWSZ);
+	} else {
+		git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+		reply = hiredis_pool__command(backend->pool, "exists %s:%s:odb:%s", backend->prefix, backend->repo_path, str_id);
+	}
+
+	if (reply && reply->type == REDIS_REPLY_INTEGER)
+		found = reply->integer;
+
+	freeReplyObject(reply);
+	return found;
+}
+
+int hiredis_odb_backend__exists_prefix(git_oid *out, git_odb_backend *_backend, const git_oid *short_oid, size_t len)
+{
+	assert(out && _backend && short_oid);
+
+	if (len >= GIT_OID_HEXSZ) {
+		if (!hiredis_odb_backend__exists(_backend, short_oid)) {
+			giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
+			return GIT_ENOTFOUND;
+		}
+
+		git_oid_cpy(out, short_oid);
+		return GIT_OK;
+	}
+
+	return hiredis_odb_backend__resolve_prefix(out, (hiredis_odb_backend *) _backend, short_oid, len);
+}
+
+/* Format the command storing an object of len bytes as stored_len bytes of
+ * stored data, in the given codec */
+static int hiredis_odb_backend__format_stored(hiredis_odb_backend *backend, char **cmd, const git_oid *oid,
+		git_otype type, size_t len, int codec, const void *stored, size_t stored_len)
+{
+	char str_id[GIT_OID_HEXSZ + 1], full_id[GIT_OID_HEXSZ + 1];
+	unsigned char header[HIREDIS_ODB_HEADER_LEN];
+
+	if (backend->compact) {
+		/* Adjacent %b make up a single argument, sparing a copy of the data */
+		hiredis_odb_backend__format_header(header, type, codec, len);
+		return redisFormatCommand(cmd, "SET %s:%s:obj:%b %b%b", backend->prefix, backend->repo_path,
+				oid->id, (size_t) GIT_OID_RAWSZ, header, sizeof(header), stored, stored_len);
+	}
+
+	/* The key holds only 39 digits of the id, so the whole id is stored
+	 * along, for foreach */
+	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+	git_oid_tostr(full_id, sizeof(full_id), oid);
+
+	return redisFormatCommand(cmd, "HMSET %s:%s:odb:%s "
+			"type %d "
+			"size %llu "
+			"codec %d "
+			"id %s "
+			"data %b ", backend->prefix, backend->repo_path, str_id,
+			(int) type, (unsigned long long) len, codec, full_id, stored, stored_len);
+}
+
+/* Format the command storing an object, for running now or in a pipeline */
+static int hiredis_odb_backend__format_write(hiredis_odb_backend *backend, char **cmd, const git_oid *oid,
+		const void *data, size_t len, git_otype type)
+{
+	const void *stored = data;
+	size_t stored_len = len;
+	Bytef *packed = NULL;
+	uLongf packed_len;
+	int codec = HIREDIS_ODB_CODEC_NONE;
+	int result;
+
+	/* Deflated data is kept only if it saves something */
+	if (backend->compress_threshold && len >= backend->compress_threshold) {
+		packed_len = compressBound((uLong) len);
+		packed = malloc(packed_len);
+		if (packed != NULL && compress2(packed, &packed_len, (const Bytef *) data, (uLong) len,
+					Z_BEST_SPEED) == Z_OK && packed_len < len) {
+			stored = packed;
+			stored_len = packed_len;
+			codec = HIREDIS_ODB_CODEC_ZLIB;
+		}
+	}
+
+	result = hiredis_odb_backend__format_stored(backend, cmd, oid, type, len, codec, stored, stored_len);
+
+	free(packed);
+	return result;
+}
+
+/* Format the command adding oids to the index of object ids, which lists
+ * them by their hex form so abbreviated ids can be looked up by range */
+static int hiredis_odb_backend__format_index(hiredis_odb_backend *backend, char **cmd,
+		const git_oid **oids, size_t count)
+{
+	const char **argv;
+	size_t *argv_len;
+	char *strs;
+	size_t i, argc;
+	int len;
+
+	argv = malloc((count * 2 + 2) * sizeof(const char *));
+	argv_len = malloc((count * 2 + 2) * sizeof(size_t));
+	strs = malloc(strlen(backend->prefix) + strlen(backend->repo_path) + sizeof("::oids") +
+			count * (GIT_OID_HEXSZ + 1));
+	if (argv == NULL || argv_len == NULL || strs == NULL) {
+		free(argv);
+		free(argv_len);
+		free(strs);
+		return -1;
+	}
+
+	argv[0] = "ZADD";
+	argv_len[0] = 4;
+	argv[1] = strs;
+	argv_len[1] = sprintf(strs, "%s:%s:oids", backend->prefix, backend->repo_path);
+	argc = 2;
+
+	for (i = 0; i < count; i++) {
+		char *str = strs + argv_len[1] + 1 + i * (GIT_OID_HEXSZ + 1);
+
+		argv[argc] = "0";
+		argv_len[argc++] = 1;
+		argv[argc] = git_oid_tostr(str, GIT_OID_HEXSZ + 1, oids[i]);
+		argv_len[argc++] = GIT_OID_HEXSZ;
+	}
+
+	len = redisFormatCommandArgv(cmd, (int) argc, argv, argv_len);
+
+	free(argv);
+	free(argv_len);
+	free(strs);
+	return len;
+}
+
+/* Store an object and add it to the index in one pipeline. The index is a
+ * key of its own, so in a cluster it needn't be on the object's node. */
+static int hiredis_odb_backend__write_indexed(hiredis_odb_backend *backend, char *cmd, size_t cmd_len,
+		const git_oid *oid)
+{
+	char *cmds[2];
+	size_t lens[2];
+	redisReply *replies[2];
+	int len, error;
+
+	cmds[0] = cmd;
+	lens[0] = cmd_len;
+
+	len = hiredis_odb_backend__format_index(backend, &cmds[1], &oid, 1);
+	if (len < 0) {
+		redisFreeCommand(cmd);
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+	lens[1] = (size_t) len;
+
+	error = hiredis_pool__pipeline(backend->pool, cmds, lens, 2, replies);
+	redisFreeCommand(cmds[0]);
+	redisFreeCommand(cmds[1]);
+	if (error != GIT_OK)
+		return error;
+
+	if (replies[0] == NULL || replies[0]->type == REDIS_REPLY_ERROR ||
+			replies[1] == NULL || replies[1]->type == REDIS_REPLY_ERROR)
+		error = GIT_ERROR;
+
+	freeReplyObject(replies[0]);
+	freeReplyObject(replies[1]);
+	return error;
+}
+
+/* Run a formatted command storing oid, adding it to the index of object ids
+ * if there is one */
+static int hiredis_odb_backend__write_command(hiredis_odb_backend *backend, char *cmd, size_t cmd_len,
+		const git_oid *oid)
+{
+	redisReply *reply;
+	int error;
+
+	if (backend->oid_index)
+		return hiredis_odb_backend__write_indexed(backend, cmd, cmd_len, oid);
+
+	reply = hiredis_pool__route(backend->pool, cmd, cmd_len);
+	redisFreeCommand(cmd);
+
+	error = (reply == NULL || reply->type == REDIS_REPLY_ERROR) ? GIT_ERROR : GIT_OK;
+
+	freeReplyObject(reply);
+	return error;
+}
+
+/* Store the key of a chunked object, whose chunks are all stored already.
+ * Until then the object doesn't exist, so it's never seen half written. */
+static int hiredis_odb_backend__write_chunked_key(hiredis_odb_backend *backend, const git_oid *oid,
+		git_otype type, size_t len, const char *token, size_t chunk_size)
+{
+	unsigned char chunks[HIREDIS_ODB_CHUNKS_LEN];
+	char *cmd;
+	int cmd_len;
+
+	hiredis_odb_backend__format_chunks(chunks, chunk_size, token);
+
+	cmd_len = hiredis_odb_backend__format_stored(backend, &cmd, oid, type, len, HIREDIS_ODB_CODEC_CHUNKED,
+			chunks, sizeof(chunks));
+	if (cmd_len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	return hiredis_odb_backend__write_command(backend, cmd, (size_t) cmd_len, oid);
+}
+
+/* Store a large object in chunks. They're named after the object's id, so
+ * writing it again only writes them over. */
+static int hiredis_odb_backend__write_chunked(hiredis_odb_backend *backend, const git_oid *oid,
+		const void *data, size_t len, git_otype type)
+{
+	char token[GIT_OID_HEXSZ + 1];
+	int error;
+
+	git_oid_tostr(token, sizeof(token), oid);
+
+	error = hiredis_odb_backend__write_chunks(backend, token, backend->chunk_size, 0, data, len);
+	if (error == GIT_OK)
+		error = hiredis_odb_backend__write_chunked_key(backend, oid, type, len, token, backend->chunk_size);
+
+	return error;
+}
+
+int hiredis_odb_backend__write(git_odb_backend *_backend, const git_oid *oid, const void *data, size_t len, git_otype type)
+{
+	hiredis_odb_backend *backend;
+	char *cmd;
+	int cmd_len;
+
+	assert(oid && _backend && data);
+
+	backend = (hiredis_odb_backend *) _backend;
+
+	if (backend->chunk_threshold && len > backend->chunk_threshold)
+		return hiredis_odb_backend__write_chunked(backend, oid, data, len, type);
+
+	cmd_len = hiredis_odb_backend__format_write(backend, &cmd, oid, data, len, type);
+	if (cmd_len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	return hiredis_odb_backend__write_command(backend, cmd, (size_t) cmd_len, oid);
+}
+
+/* Streams */
+
+/* Read an object's header and, if it is chunked, the size and token of its
+ * chunks, without reading the data of one that isn't. Gives GIT_PASSTHROUGH
+ * for an object that isn't chunked. */
+static int hiredis_odb_backend__read_chunked(char *token, size_t *chunk_size, size_t *len_p, git_otype *type_p,
+		hiredis_odb_backend *backend, const git_oid *oid)
+{
+	redisReply *reply, *data;
+	char str_id[GIT_OID_HEXSZ + 1];
+	int error;
+
+	if (backend->compact) {
+		reply = hiredis_pool__command(backend->pool, "GETRANGE %s:%s:obj:%b 0 %d", backend->prefix,
+				backend->repo_path, oid->id, (size_t) GIT_OID_RAWSZ,
+				HIREDIS_ODB_HEADER_LEN + HIREDIS_ODB_CHUNKS_LEN - 1);
+		error = hiredis_odb_backend__parse_compact(NULL, len_p, type_p, backend, reply);
+		if (error == GIT_OK) {
+			if ((((const unsigned char *) reply->str)[0] >> 4) != HIREDIS_ODB_CODEC_CHUNKED)
+				error = GIT_PASSTHROUGH;
+			else
+				error = hiredis_odb_backend__parse_chunks(chunk_size, token,
+						reply->str + HIREDIS_ODB_HEADER_LEN, reply->len - HIREDIS_ODB_HEADER_LEN);
+		}
+
+		freeReplyObject(reply);
+		return error;
+	}
+
+	git_oid_tostr(str_id, GIT_OID_HEXSZ, oid);
+
+	reply = hiredis_pool__command(backend->pool, "HMGET %s:%s:odb:%s %s %s %s", backend->prefix,
+			backend->repo_path, str_id, "type", "size", "codec");
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 3) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage error");
+		error = GIT_ERROR;
+	} else if (reply->element[0]->type == REDIS_REPLY_NIL || reply->element[1]->type == REDIS_REPLY_NIL) {
+		giterr_set_str(GITERR_ODB, "Redis odb couldn't find object");
+		error = GIT_ENOTFOUND;
+	} else {
+		*type_p = (git_otype) atoi(reply->element[0]->str);
+		*len_p = (size_t) strtoull(reply->element[1]->str, NULL, 10);
+		error = GIT_PASSTHROUGH;
+
+		if (reply->element[2]->type == REDIS_REPLY_STRING &&
+				atoi(reply->element[2]->str) == HIREDIS_ODB_CODEC_CHUNKED) {
+			data = hiredis_pool__command(backend->pool, "HGET %s:%s:odb:%s data", backend->prefix,
+					backend->repo_path, str_id);
+			if (data == NULL || data->type != REDIS_REPLY_STRING) {
+				giterr_set_str(GITERR_ODB, "Redis odb storage error");
+				error = GIT_ERROR;
+			} else {
+				error = hiredis_odb_backend__parse_chunks(chunk_size, token, data->str, data->len);
+			}
+			freeReplyObject(data);
+		}
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+static int hiredis_odb_stream__read(git_odb_stream *_stream, char *buffer, size_t len)
+{
+	hiredis_odb_stream *stream;
+	hiredis_odb_backend *backend;
+	size_t chunk_len;
+	int error;
+
+	stream = (hiredis_odb_stream *) _stream;
+	backend = (hiredis_odb_backend *) stream->parent.backend;
+
+	if (stream->buffer_pos == stream->buffer_len) {
+		if (!stream->chunked || stream->done == stream->size)
+			return 0;
+
+		/* Refill the buffer with the next chunk */
+		chunk_len = stream->size - stream->done;
+		if (chunk_len > stream->chunk_size)
+			chunk_len = stream->chunk_size;
+
+		error = hiredis_odb_backend__read_chunks(backend, stream->token, stream->chunk_size,
+				stream->seq++, stream->buffer, chunk_len);
+		if (error != GIT_OK)
+			return error;
+
+		stream->buffer_len = chunk_len;
+		stream->buffer_pos = 0;
+	}
+
+	if (len > stream->buffer_len - stream->buffer_pos)
+		len = stream->buffer_len - stream->buffer_pos;
+
+	memcpy(buffer, stream->buffer + stream->buffer_pos, len);
+	stream->buffer_pos += len;
+	stream->done += len;
+
+	return (int) len;
+}
+
+static int hiredis_odb_stream__write(git_odb_stream *_stream, const char *data, size_t len)
+{
+	hiredis_odb_stream *stream;
+	hiredis_odb_backend *backend;
+	size_t n;
+	int error;
+
+	stream = (hiredis_odb_stream *) _stream;
+	backend = (hiredis_odb_backend *) stream->parent.backend;
+
+	if (len > stream->size - stream->done) {
+		giterr_set_str(GITERR_ODB, "Redis odb stream written past its declared size");
+		return GIT_ERROR;
+	}
+
+	stream->done += len;
+
+	while (len > 0) {
+		n = stream->buffer_size - stream->buffer_len;
+		if (n > len)
+			n = len;
+
+		memcpy(stream->buffer + stream->buffer_len, data, n);
+		stream->buffer_len += n;
+		data += n;
+		len -= n;
+
+		/* Ship every full chunk straight away, so only one is ever held */
+		if (stream->chunked && stream->buffer_len == stream->buffer_size) {
+			error = hiredis_odb_backend__write_chunks(backend, stream->token, stream->chunk_size,
+					stream->seq++, stream->buffer, stream->buffer_len);
+			if (error != GIT_OK)
+				return error;
+
+			stream->buffer_len = 0;
+		}
+	}
+
+	return GIT_OK;
+}
+
+static int hiredis_odb_stream__finalize_write(git_odb_stream *_stream, const git_oid *oid)
+{
+	hiredis_odb_stream *stream;
+	hiredis_odb_backend *backend;
+	int error;
+
+	stream = (hiredis_odb_stream *) _stream;
+	backend = (hiredis_odb_backend *) stream->parent.backend;
+
+	if (stream->done != stream->size) {
+		giterr_set_str(GITERR_ODB, "Redis odb stream finalized before its declared size");
+		return GIT_ERROR;
+	}
+
+	if (!stream->chunked)
+		return hiredis_odb_backend__write(&backend->parent, oid, stream->buffer, stream->size, stream->type);
+
+	/* Someone else may have stored the object in the meantime, in which
+	 * case ours is surplus; free() drops its chunks */
+	if (hiredis_odb_backend__exists(&backend->parent, oid) == 1)
+		return GIT_OK;
+
+	if (stream->buffer_len > 0) {
+		error = hiredis_odb_backend__write_chunks(backend, stream->token, stream->chunk_size,
+				stream->seq++, stream->buffer, stream->buffer_len);
+		if (error != GIT_OK)
+			return error;
+
+		stream->buffer_len = 0;
+	}
+
+	error = hiredis_odb_backend__write_chunked_key(backend, oid, stream->type, stream->size,
+			stream->token, stream->chunk_size);
+	if (error == GIT_OK)
+		stream->finalized = 1;
+
+	return error;
+}
+
+static void hiredis_odb_stream__free(git_odb_stream *_stream)
+{
+	hiredis_odb_stream *stream;
+	hiredis_odb_backend *backend;
+
+	stream = (hiredis_odb_stream *) _stream;
+	backend = (hiredis_odb_backend *) stream->parent.backend;
+
+	/* Drop the chunks of an abandoned (or redundant) write */
+	if (stream->chunked && (stream->parent.mode & GIT_STREAM_WRONLY) && !stream->finalized)
+		hiredis_odb_backend__delete_chunks(backend, stream->token, stream->seq);
+
+	free(stream->buffer);
+	free(stream);
+}
+
+int hiredis_odb_backend__readstream(git_odb_stream **stream_out, git_odb_backend *_backend, const git_oid *oid)
+{
+	hiredis_odb_backend *backend;
+	hiredis_odb_stream *stream;
+	void *data = NULL;
+	int error;
+
+	assert(stream_out && _backend && oid);
+
+	backend = (hiredis_odb_backend *) _backend;
+
+	stream = calloc(1, sizeof(hiredis_odb_stream));
+	if (stream == NULL)
+		return GITERR_NOMEMORY;
+
+	error = hiredis_odb_backend__read_chunked(stream->token, &stream->chunk_size, &stream->size,
+			&stream->type, backend, oid);
+
+	if (error == GIT_PASSTHROUGH) {
+		/* Not chunked, so small enough to read in one go and hand out
+		 * piecemeal */
+		error = hiredis_odb_backend__read(&data, &stream->size, &stream->type, _backend, oid);
+		stream->buffer = data;
+		stream->buffer_size = stream->buffer_len = stream->size;
+	} else if (error == GIT_OK) {
+		stream->chunked = 1;
+		stream->buffer_size = stream->chunk_size;
+		stream->buffer = malloc(stream->buffer_size);
+		if (stream->buffer == NULL)
+			error = GITERR_NOMEMORY;
+	}
+
+	if (error != GIT_OK) {
+		free(stream->buffer);
+		free(stream);
+		return error;
+	}
+
+	stream->parent.backend = _backend;
+	stream->parent.mode = GIT_STREAM_RDONLY;
+	stream->parent.read = &hiredis_odb_stream__read;
+	stream->parent.free = &hiredis_odb_stream__free;
+
+	*stream_out = &stream->parent;
+	return GIT_OK;
+}
+
+int hiredis_odb_backend__writestream(git_odb_stream **stream_out, git_odb_backend *_backend, git_off_t size,
+		git_otype type)
+{
+	hiredis_odb_backend *backend;
+	hiredis_odb_stream *stream;
+	unsigned char random[GIT_OID_RAWSZ];
+	git_oid token;
+	FILE *urandom;
+	int ok;
+
+	assert(stream_out && _backend);
+
+	backend = (hiredis_odb_backend *) _backend;
+
+	stream = calloc(1, sizeof(hiredis_odb_stream));
+	if (stream == NULL)
+		return GITERR_NOMEMORY;
+
+	stream->type = type;
+	stream->size = (size_t) size;
+	stream->chunked = backend->chunk_threshold && stream->size > backend->chunk_threshold;
+	stream->chunk_size = backend->chunk_size;
+
+	/* Small objects are gathered up and written in one go at the end; big
+	 * ones go out a chunk at a time under a random token */
+	stream->buffer_size = stream->chunked ? stream->chunk_size : stream->size;
+	stream->buffer = malloc(stream->buffer_size + 1);
+	if (stream->buffer == NULL) {
+		free(stream);
+		return GITERR_NOMEMORY;
+	}
+
+	if (stream->chunked) {
+		urandom = fopen("/dev/urandom", "rb");
+		ok = urandom != NULL && fread(random, 1, sizeof(random), urandom) == sizeof(random);
+		if (urandom != NULL)
+			fclose(urandom);
+
+		if (!ok) {
+			free(stream->buffer);
+			free(stream);
+			giterr_set_str(GITERR_OS, "Redis odb couldn't make a token for an object's chunks");
+			return GIT_ERROR;
+		}
+
+		git_oid_fromraw(&token, random);
+		git_oid_tostr(stream->token, sizeof(stream->token), &token);
+	}
+
+	stream->parent.backend = _backend;
+	stream->parent.mode = GIT_STREAM_WRONLY;
+	stream->parent.write = &hiredis_odb_stream__write;
+	stream->parent.finalize_write = &hiredis_odb_stream__finalize_write;
+	stream->parent.free = &hiredis_odb_stream__free;
+
+	*stream_out = &stream->parent;
+	return GIT_OK;
+}
+
+void hiredis_odb_backend__free(git_odb_backend *_backend)
+{
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
+	backend = (hiredis_odb_backend *) _backend;
+
+	free(backend->repo_path);
+	free(backend->prefix);
+
+	git_hiredis_pool_free(backend->pool);
+
+	free(backend);
+}
+
+/* Refdb methods */
+
+/* Every change to the refs is made by a script, which checks the ref's
+ * current value against the caller's expectation, then updates it and the
+ * index of refnames, all in one atomic step. Every key a script touches is
+ * passed in KEYS; in a cluster they share a hash tag. Expectations fail
+ * with EEXISTS, EMODIFIED or ENOTFOUND errors. */
+
+/* Reflogs are streams, one per ref, trimmed to about maxlen entries. The
+ * scripts updating a ref append to its log, given a mode of '1' to log
+ * regardless, '0' to log only if the ref has a log already, or '' not to.
+ * The entry's arguments are those of hiredis_reflog_args, after the mode:
+ * committer name, email, time, offset, message and whether there's one. */
+#define HIREDIS_REFDB_LUA_LOG \
+	"local zero = string.rep('0', 40)\n" \
+	"local function log(key, maxlen, old, new, a)\n" \
+	"  if a[1] == '' or (a[1] == '0' and redis.call('EXISTS', key) == 0) then return end\n" \
+	"  local entry = {'old', old, 'new', new, 'name', a[2], 'email', a[3], 'time', a[4], 'offset', a[5]}\n" \
+	"  if a[7] == '1' then\n" \
+	"    entry[#entry + 1] = 'message'\n" \
+	"    entry[#entry + 1] = a[6]\n" \
+	"  end\n" \
+	"  redis.call('XADD', key, 'MAXLEN', '~', maxlen, '*', unpack(entry))\n" \
+	"end\n"
+
+/* KEYS: ref, index, log, and the ref a symbolic ref points to (else the
+ * ref again). ARGV: type, target, name, force, the expected type and
+ * target (or empty strings if any will do), maxlen, then the log entry. */
+static hiredis_script hiredis_refdb_script_write = {
+	HIREDIS_REFDB_LUA_LOG
+	"local cur = redis.call('HMGET', KEYS[1], 'type', 'target')\n"
+	"if ARGV[4] == '0' and cur[1] then return redis.error_reply('EEXISTS') end\n"
+	"if ARGV[5] ~= '' then\n"
+	"  if not cur[1] then return redis.error_reply('ENOTFOUND') end\n"
+	"  if cur[1] ~= ARGV[5] or cur[2] ~= ARGV[6] then return redis.error_reply('EMODIFIED') end\n"
+	"end\n"
+	"redis.call('HMSET', KEYS[1], 'type', ARGV[1], 'target', ARGV[2])\n"
+	"redis.call('ZADD', KEYS[2], 0, ARGV[3])\n"
+	"local old = cur[1] == '1' and cur[2] or zero\n"
+	"local new = ARGV[2]\n"
+	"if ARGV[1] ~= '1' then\n"
+	"  local to = redis.call('HMGET', KEYS[4], 'type', 'target')\n"
+	"  new = to[1] == '1' and to[2] or zero\n"
+	"end\n"
+	"log(KEYS[3], ARGV[7], old, new, {unpack(ARGV, 8, 14)})\n"
+	"return 1\n"
+};
+
+/* KEYS: old ref, new ref, index, old log, new log. ARGV: old name, new
+ * name, force, maxlen, then the log entry. Gives the renamed ref's type
+ * and target. */
+static hiredis_script hiredis_refdb_script_rename = {
+	HIREDIS_REFDB_LUA_LOG
+	"if redis.call('EXISTS', KEYS[1]) == 0 then return redis.error_reply('ENOTFOUND') end\n"
+	"if ARGV[3] == '0' and redis.call('EXISTS', KEYS[2]) == 1 then return redis.error_reply('EEXISTS') end\n"
+	"redis.call('RENAME', KEYS[1], KEYS[2])\n"
+	"redis.call('ZREM', KEYS[3], ARGV[1])\n"
+	"redis.call('ZADD', KEYS[3], 0, ARGV[2])\n"
+	"if redis.call('EXISTS', KEYS[4]) == 1 then\n"
+	"  redis.call('RENAME', KEYS[4], KEYS[5])\n"
+	"else\n"
+	"  redis.call('DEL', KEYS[5])\n"
+	"end\n"
+	"local cur = redis.call('HMGET', KEYS[2], 'type', 'target')\n"
+	"local id = cur[1] == '1' and cur[2] or zero\n"
+	"log(KEYS[5], ARGV[4], id, id, {unpack(ARGV, 5, 11)})\n"
+	"return cur\n"
+};
+
+/* KEYS: ref, index, log. ARGV: name, then the expected type and target. */
+static hiredis_script hiredis_refdb_script_del = {
+	"local cur = redis.call('HMGET', KEYS[1], 'type', 'target')\n"
+	"if not cur[1] then return redis.error_reply('ENOTFOUND') end\n"
+	"if ARGV[2] ~= '' and (cur[1] ~= ARGV[2] or cur[2] ~= ARGV[3]) then\n"
+	"  return redis.error_reply('EMODIFIED')\n"
+	"end\n"
+	"redis.call('DEL', KEYS[1], KEYS[3])\n"
+	"redis.call('ZREM', KEYS[2], ARGV[1])\n"
+	"return 1\n"
+};
+
+/* KEYS: log. Makes an empty log, unless there is one already. */
+static hiredis_script hiredis_refdb_script_ensure_log = {
+	"if redis.call('EXISTS', KEYS[1]) == 0 then\n"
+	"  redis.call('XADD', KEYS[1], 'MAXLEN', '0', '*', 'old', '')\n"
+	"end\n"
+	"return 1\n"
+};
+
+/* KEYS: log. ARGV: maxlen, then for each entry its old and new ids,
+ * committer name, email, time and offset, message and whether there's
+ * one. Replaces the log's entries with these. */
+static hiredis_script hiredis_refdb_script_reflog_write = {
+	"redis.call('DEL', KEYS[1])\n"
+	"redis.call('XADD', KEYS[1], 'MAXLEN', '0', '*', 'old', '')\n"
+	"for i = 2, #ARGV, 8 do\n"
+	"  local entry = {'old', ARGV[i], 'new', ARGV[i + 1], 'name', ARGV[i + 2], 'email', ARGV[i + 3],\n"
+	"    'time', ARGV[i + 4], 'offset', ARGV[i + 5]}\n"
+	"  if ARGV[i + 7] == '1' then\n"
+	"    entry[#entry + 1] = 'message'\n"
+	"    entry[#entry + 1] = ARGV[i + 6]\n"
+	"  end\n"
+	"  redis.call('XADD', KEYS[1], 'MAXLEN', '~', ARGV[1], '*', unpack(entry))\n"
+	"end\n"
+	"return 1\n"
+};
+
+/* Whether updates to a ref are logged even if it has no log yet, as git
+ * does by default for branches and HEAD */
+static int hiredis_refdb_backend__should_log(const char *name)
+{
+	return strcmp(name, "HEAD") == 0 ||
+		strncmp(name, "refs/heads/", 11) == 0 ||
+		strncmp(name, "refs/remotes/", 13) == 0 ||
+		strncmp(name, "refs/notes/", 11) == 0;
+}
+
+static void hiredis_refdb_backend__log_args(hiredis_reflog_args *args, const char *name,
+		const git_signature *who, const char *message)
+{
+	memset(args, 0, sizeof(*args));
+
+	args->mode = who == NULL ? "" : hiredis_refdb_backend__should_log(name) ? "1" : "0";
+	args->name = who ? who->name : "";
+	args->email = who ? who->email : "";
+	if (who) {
+		sprintf(args->time, "%lld", (long long) who->when.time);
+		sprintf(args->offset, "%d", who->when.offset);
+	}
+	args->message = message ? message : "";
+	args->has_message = message ? "1" : "0";
+}
+
+/* KEYS: index, then a ref and its log per update. ARGV: maxlen and the
+ * log entry bar its mode, then for each update its name, its new oid
+ * (empty to delete it), its expected oid (empty if any will do, all zeros
+ * if it mustn't exist) and its log mode. Nothing changes unless every
+ * update's expectation holds; a deleted ref loses its log, as with del. */
+static hiredis_script hiredis_refdb_script_update = {
+	HIREDIS_REFDB_LUA_LOG
+	"local n = (#KEYS - 1) / 2\n"
+	"local cur = {}\n"
+	"for i = 1, n do\n"
+	"  local b = 4 * i + 4\n"
+	"  local expect = ARGV[b + 2]\n"
+	"  cur[i] = redis.call('HMGET', KEYS[2 * i], 'type', 'target')\n"
+	"  if expect ~= '' then\n"
+	"    if expect == zero then\n"
+	"      if cur[i][1] then return redis.error_reply('EMODIFIED ' .. ARGV[b]) end\n"
+	"    elseif cur[i][1] ~= '1' or cur[i][2] ~= expect then\n"
+	"      return redis.error_reply('EMODIFIED ' .. ARGV[b])\n"
+	"    end\n"
+	"  end\n"
+	"end\n"
+	"for i = 1, n do\n"
+	"  local b = 4 * i + 4\n"
+	"  if ARGV[b + 1] == '' then\n"
+	"    redis.call('DEL', KEYS[2 * i], KEYS[2 * i + 1])\n"
+	"    redis.call('ZREM', KEYS[1], ARGV[b])\n"
+	"  else\n"
+	"    redis.call('HMSET', KEYS[2 * i], 'type', '1', 'target', ARGV[b + 1])\n"
+	"    redis.call('ZADD', KEYS[1], 0, ARGV[b])\n"
+	"    local old = cur[i][1] == '1' and cur[i][2] or zero\n"
+	"    log(KEYS[2 * i + 1], ARGV[1], old, ARGV[b + 1], {ARGV[b + 3], unpack(ARGV, 2, 7)})\n"
+	"  end\n"
+	"end\n"
+	"return n\n"
+};
+
+/* Map a script's reply to an error code */
+static int hiredis_refdb_backend__script_error(const redisReply *reply)
+{
+	if (reply != NULL && reply->type != REDIS_REPLY_ERROR)
+		return GIT_OK;
+
+	if (reply != NULL && strncmp(reply->str, "EEXISTS", 7) == 0) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb ref already exists");
+		return GIT_EEXISTS;
+	}
+
+	if (reply != NULL && strncmp(reply->str, "EMODIFIED", 9) == 0) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb ref doesn't have the expected value");
+		return GIT_EMODIFIED;
+	}
+
+	if (reply != NULL && strncmp(reply->str, "ENOTFOUND", 9) == 0) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb couldn't find ref");
+		return GIT_ENOTFOUND;
+	}
+
+	giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+	return GIT_ERROR;
+}
+
+/* Ref cache */
+
+static size_t hiredis_refdb_cache__bucket(const char *name)
+{
+	/* FNV-1a */
+	unsigned long hash = 2166136261UL;
+
+	while (*name)
+		hash = (hash ^ (unsigned char) *name++) * 16777619UL;
+
+	return (size_t) (hash % HIREDIS_REFDB_CACHE_BUCKETS);
+}
+
+/* The caller holds the cache's lock, in these */
+
+static void hiredis_refdb_cache__clear(hiredis_refdb_cache *cache)
+{
+	hiredis_refdb_cached *cached, *next;
+	size_t i;
+
+	for (i = 0; i < HIREDIS_REFDB_CACHE_BUCKETS; i++) {
+		for (cached = cache->buckets[i]; cached != NULL; cached = next) {
+			next = cached->next;
+			free(cached);
+		}
+		cache->buckets[i] = NULL;
+	}
+
+	cache->count = 0;
+	cache->generation++;
+}
+
+static void hiredis_refdb_cache__remove(hiredis_refdb_cache *cache, const char *name, size_t name_len)
+{
+	hiredis_refdb_cached **p, *cached;
+	char *key;
+
+	key = malloc(name_len + 1);
+	if (key == NULL) {
+		hiredis_refdb_cache__clear(cache);
+		return;
+	}
+	memcpy(key, name, name_len);
+	key[name_len] = '\0';
+
+	for (p = &cache->buckets[hiredis_refdb_cache__bucket(key)]; *p != NULL; p = &(*p)->next) {
+		if (strcmp((*p)->name, key) == 0) {
+			cached = *p;
+			*p = cached->next;
+			free(cached);
+			cache->count--;
+			break;
+		}
+	}
+
+	cache->generation++;
+	free(key);
+}
+
+/* Serve a lookup (or, with out NULL, an exists) from the cache. Gives
+ * GIT_PASSTHROUGH if the server must be asked, along with the generation
+ * to hand hiredis_refdb_cache__put. */
+static int hiredis_refdb_cache__get(git_reference **out, hiredis_refdb_cache *cache, const char *name,
+		unsigned long *generation)
+{
+	hiredis_refdb_cached *cached = NULL;
+	git_oid oid;
+	int error = GIT_PASSTHROUGH;
+
+	pthread_mutex_lock(&cache->lock);
+
+	*generation = cache->generation;
+	if (cache->live) {
+		for (cached = cache->buckets[hiredis_refdb_cache__bucket(name)]; cached != NULL; cached = cached->next) {
+			if (strcmp(cached->name, name) == 0)
+				break;
+		}
+	}
+
+	if (cached == NULL) {
+		error = GIT_PASSTHROUGH;
+	} else if (cached->type == 0) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb couldn't find ref");
+		error = GIT_ENOTFOUND;
+	} else if (out == NULL) {
+		error = GIT_OK;
+	} else if (cached->type == GIT_REF_OID) {
+		git_oid_fromstr(&oid, cached->target);
+		*out = git_reference__alloc(name, &oid, NULL);
+		error = *out ? GIT_OK : GITERR_NOMEMORY;
+	} else {
+		*out = git_reference__alloc_symbolic(name, cached->target);
+		error = *out ? GIT_OK : GITERR_NOMEMORY;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return error;
+}
+
+/* Cache the reply to HMGET type target for a ref, unless it may have
+ * changed since the generation hiredis_refdb_cache__get gave */
+static void hiredis_refdb_cache__put(hiredis_refdb_cache *cache, const char *name, const redisReply *reply,
+		unsigned long generation)
+{
+	hiredis_refdb_cached *cached, **p;
+	git_ref_t type = 0;
+	const char *target = "";
+	size_t name_len, target_len, bucket;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+		return;
+
+	if (reply->element[0]->type == REDIS_REPLY_STRING && reply->element[1]->type == REDIS_REPLY_STRING) {
+		type = (git_ref_t) atoi(reply->element[0]->str);
+		target = reply->element[1]->str;
+		if (type != GIT_REF_OID && type != GIT_REF_SYMBOLIC)
+			return;
+	}
+
+	name_len = strlen(name);
+	target_len = strlen(target);
+
+	cached = malloc(sizeof(hiredis_refdb_cached) + name_len + target_len + 2);
+	if (cached == NULL)
+		return;
+
+	cached->type = type;
+	cached->name = (char *) (cached + 1);
+	memcpy(cached->name, name, name_len + 1);
+	cached->target = cached->name + name_len + 1;
+	memcpy(cached->target, target, target_len + 1);
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (!cache->live || cache->generation != generation) {
+		pthread_mutex_unlock(&cache->lock);
+		free(cached);
+		return;
+	}
+
+	/* Starting over is crude, but refs are cheap to read again */
+	if (cache->count >= HIREDIS_REFDB_CACHE_MAX)
+		hiredis_refdb_cache__clear(cache);
+
+	bucket = hiredis_refdb_cache__bucket(name);
+	for (p = &cache->buckets[bucket]; *p != NULL; p = &(*p)->next) {
+		if (strcmp((*p)->name, name) == 0) {
+			cached->next = (*p)->next;
+			free(*p);
+			*p = cached;
+			pthread_mutex_unlock(&cache->lock);
+			return;
+		}
+	}
+
+	cached->next = cache->buckets[bucket];
+	cache->buckets[bucket] = cached;
+	cache->count++;
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Forget a ref this process changed, rather than wait to hear of it */
+static void hiredis_refdb_cache__invalidate(hiredis_refdb_cache *cache, const char *name)
+{
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	hiredis_refdb_cache__remove(cache, name, strlen(name));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Open the invalidation connection and have the server track the refs */
+static redisContext *hiredis_refdb_cache__connect(hiredis_refdb_cache *cache)
+{
+	git_hiredis_pool *node;
+	redisContext *db;
+	redisReply *reply;
+	struct timeval none = { 0, 0 };
+	long long id;
+
+	/* In a cluster the refs are all on the node serving their hash tag */
+	node = cache->pool->cluster ?
+		hiredis_cluster__key_node(cache->pool, cache->key_prefix, strlen(cache->key_prefix)) : cache->pool;
+	if (node == NULL)
+		return NULL;
+
+	db = hiredis_pool__connect(node);
+	if (db == NULL)
+		return NULL;
+
+	/* Invalidations come whenever they come; a read must wait for them */
+	redisSetTimeout(db, none);
+
+	reply = redisCommand(db, "CLIENT ID");
+	if (reply == NULL || reply->type != REDIS_REPLY_INTEGER)
+		goto fail;
+	id = reply->integer;
+	freeReplyObject(reply);
+
+	reply = redisCommand(db, "CLIENT TRACKING on REDIRECT %lld BCAST PREFIX %s", id, cache->tracked);
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR)
+		goto fail;
+	freeReplyObject(reply);
+
+	reply = redisCommand(db, "SUBSCRIBE __redis__:invalidate");
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY)
+		goto fail;
+	freeReplyObject(reply);
+
+	return db;
+
+fail:
+	giterr_set_str(GITERR_REFERENCE, "Redis refdb couldn't track refs (CLIENT TRACKING needs Redis 6)");
+	freeReplyObject(reply);
+	redisFree(db);
+	return NULL;
+}
+
+/* Drop the refs named in an invalidation message; a nil list means the
+ * server dropped everything */
+static void hiredis_refdb_cache__invalidated(hiredis_refdb_cache *cache, const redisReply *reply)
+{
+	const redisReply *keys;
+	size_t i, tracked_len = strlen(cache->tracked);
+
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+			reply->element[0]->type != REDIS_REPLY_STRING || strcmp(reply->element[0]->str, "message") != 0)
+		return;
+
+	keys = reply->element[2];
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (keys->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i < keys->elements; i++) {
+			if (keys->element[i]->type == REDIS_REPLY_STRING && keys->element[i]->len > tracked_len &&
+					memcmp(keys->element[i]->str, cache->tracked, tracked_len) == 0)
+				hiredis_refdb_cache__remove(cache, keys->element[i]->str + tracked_len,
+						keys->element[i]->len - tracked_len);
+		}
+	} else {
+		hiredis_refdb_cache__clear(cache);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void *hiredis_refdb_cache__listen(void *payload)
+{
+	hiredis_refdb_cache *cache = (hiredis_refdb_cache *) payload;
+	redisContext *db;
+	redisReply *reply;
+	struct timeval now;
+	struct timespec until;
+
+	pthread_mutex_lock(&cache->lock);
+
+	while (!cache->stop) {
+		if (cache->db == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			db = hiredis_refdb_cache__connect(cache);
+			pthread_mutex_lock(&cache->lock);
+
+			if (db != NULL && cache->stop) {
+				redisFree(db);
+				break;
+			}
+
+			if (db == NULL) {
+				gettimeofday(&now, NULL);
+				until.tv_sec = now.tv_sec + HIREDIS_REFDB_CACHE_RETRY;
+				until.tv_nsec = now.tv_usec * 1000;
+				pthread_cond_timedwait(&cache->wake, &cache->lock, &until);
+				continue;
+			}
+
+			/* A lookup that began while nothing was tracking may have
+			 * read a ref changed since, unnoticed; it mustn't cache it */
+			cache->db = db;
+			cache->generation++;
+			cache->live = 1;
+		}
+
+		db = cache->db;
+		pthread_mutex_unlock(&cache->lock);
+
+		if (redisGetReply(db, (void **) &reply) == REDIS_OK) {
+			hiredis_refdb_cache__invalidated(cache, reply);
+			freeReplyObject(reply);
+			pthread_mutex_lock(&cache->lock);
+			continue;
+		}
+
+		/* Invalidations may have been missed, so nothing cached can be
+		 * trusted any more */
+		pthread_mutex_lock(&cache->lock);
+		cache->live = 0;
+		cache->db = NULL;
+		hiredis_refdb_cache__clear(cache);
+		redisFree(db);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+static void hiredis_refdb_cache__free(hiredis_refdb_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	/* Shutting the socket down wakes the thread from its read */
+	pthread_mutex_lock(&cache->lock);
+	cache->stop = 1;
+	if (cache->db != NULL)
+		shutdown(cache->db->fd, SHUT_RDWR);
+	pthread_cond_signal(&cache->wake);
+	pthread_mutex_unlock(&cache->lock);
+
+	pthread_join(cache->thread, NULL);
+
+	hiredis_refdb_cache__clear(cache);
+	pthread_cond_destroy(&cache->wake);
+	pthread_mutex_destroy(&cache->lock);
+
+	free(cache->buckets);
+	free(cache->tracked);
+	free(cache);
+}
+
+/* Make a cache for a refdb backend, its invalidation connection open */
+static int hiredis_refdb_cache__new(hiredis_refdb_cache **out, git_hiredis_pool *pool, const char *key_prefix)
+{
+	hiredis_refdb_cache *cache;
+
+	cache = calloc(1, sizeof(hiredis_refdb_cache));
+	if (cache == NULL)
+		return GITERR_NOMEMORY;
+
+	cache->buckets = calloc(HIREDIS_REFDB_CACHE_BUCKETS, sizeof(hiredis_refdb_cached *));
+	cache->tracked = malloc(strlen(key_prefix) + sizeof(":refdb:"));
+	if (cache->buckets == NULL || cache->tracked == NULL) {
+		free(cache->buckets);
+		free(cache->tracked);
+		free(cache);
+		return GITERR_NOMEMORY;
+	}
+	sprintf(cache->tracked, "%s:refdb:", key_prefix);
+
+	cache->pool = pool;
+	cache->key_prefix = key_prefix;
+
+	/* The first connection is made here, so a server without tracking
+	 * fails now rather than leaving a cache that never serves anything */
+	cache->db = hiredis_refdb_cache__connect(cache);
+	if (cache->db == NULL) {
+		free(cache->buckets);
+		free(cache->tracked);
+		free(cache);
+		return GIT_ERROR;
+	}
+	cache->live = 1;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->wake, NULL);
+
+	if (pthread_create(&cache->thread, NULL, &hiredis_refdb_cache__listen, cache) != 0) {
+		pthread_cond_destroy(&cache->wake);
+		pthread_mutex_destroy(&cache->lock);
+		redisFree(cache->db);
+		free(cache->buckets);
+		free(cache->tracked);
+		free(cache);
+		giterr_set_str(GITERR_OS, "Redis refdb couldn't start its cache's thread");
+		return GIT_ERROR;
+	}
+
+	*out = cache;
+	return GIT_OK;
+}
+
+int hiredis_refdb_backend__exists(int *exists, git_refdb_backend *_backend, const char *ref_name)
+{
+	hiredis_refdb_backend *backend;
+	int error = GIT_OK;
+	redisReply *reply;
+	unsigned long generation;
+
+	assert(ref_name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	if (backend->cache != NULL) {
+		error = hiredis_refdb_cache__get(NULL, backend->cache, ref_name, &generation);
+		if (error != GIT_PASSTHROUGH) {
+			*exists = (error == GIT_OK);
+			return GIT_OK;
+		}
+		error = GIT_OK;
+	}
+
+	reply = hiredis_pool__command(backend->pool, "EXISTS %s:refdb:%s", backend->key_prefix, ref_name);
+	if (reply && reply->type == REDIS_REPLY_INTEGER) {
+		*exists = reply->integer;
+	} else {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+/* Make a reference out of the reply to HMGET type target */
+static int hiredis_refdb_backend__parse_ref(git_reference **out, const char *ref_name, const redisReply *reply)
+{
+	git_ref_t type;
+	git_oid oid;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+		return GIT_ERROR;
+	}
+
+	if (reply->element[0]->type == REDIS_REPLY_NIL || reply->element[1]->type == REDIS_REPLY_NIL) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb couldn't find ref");
+		return GIT_ENOTFOUND;
+	}
+
+	type = (git_ref_t) atoi(reply->element[0]->str);
+
+	if (type == GIT_REF_OID) {
+		git_oid_fromstr(&oid, reply->element[1]->str);
+		*out = git_reference__alloc(ref_name, &oid, NULL);
+	} else if (type == GIT_REF_SYMBOLIC) {
+		*out = git_reference__alloc_symbolic(ref_name, reply->element[1]->str);
+	} else {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage corrupted (unknown ref type returned)");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int hiredis_refdb_backend__lookup(git_reference **out, git_refdb_backend *_backend, const char *ref_name)
+{
+	hiredis_refdb_backend *backend;
+	int error;
+	redisReply *reply;
+	unsigned long generation = 0;
+
+	assert(ref_name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	if (backend->cache != NULL) {
+		error = hiredis_refdb_cache__get(out, backend->cache, ref_name, &generation);
+		if (error != GIT_PASSTHROUGH)
+			return error;
+	}
+
+	reply = hiredis_pool__command(backend->pool, "HMGET %s:refdb:%s type target", backend->key_prefix, ref_name);
+	error = hiredis_refdb_backend__parse_ref(out, ref_name, reply);
+
+	if (backend->cache != NULL && (error == GIT_OK || error == GIT_ENOTFOUND))
+		hiredis_refdb_cache__put(backend->cache, ref_name, reply, generation);
+
+	freeReplyObject(reply);
+	return error;
+}
+
+static void hiredis_refdb_iterator__clear(hiredis_refdb_iterator *iter)
+{
+	size_t i;
+
+	if (iter->values != NULL) {
+		for (i = 0; i < iter->count; i++)
+			freeReplyObject(iter->values[i]);
+		free(iter->values);
+		iter->values = NULL;
+	}
+
+	free(iter->names);
+	iter->names = NULL;
+
+	freeReplyObject(iter->page);
+	iter->page = NULL;
+
+	iter->count = 0;
+	iter->current = 0;
+}
+
+/* Read the next page of names from the index, until one has a match */
+static int hiredis_refdb_iterator__load(hiredis_refdb_iterator *iter)
+{
+	hiredis_refdb_backend *backend = iter->backend;
+	redisReply *last;
+	size_t i;
+
+	while (iter->current == iter->count) {
+		hiredis_refdb_iterator__clear(iter);
+		if (iter->done)
+			return GIT_ITEROVER;
+
+		iter->page = hiredis_pool__command(backend->pool, "ZRANGEBYLEX %s:refnames %s %s LIMIT 0 %d",
+				backend->key_prefix, iter->min, iter->max, HIREDIS_REFDB_PAGE_SIZE);
+		if (iter->page == NULL || iter->page->type != REDIS_REPLY_ARRAY) {
+			giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+			return GIT_ERROR;
+		}
+
+		if (iter->page->elements < HIREDIS_REFDB_PAGE_SIZE)
+			iter->done = 1;
+		if (iter->page->elements == 0)
+			continue;
+
+		iter->names = calloc(iter->page->elements, sizeof(const char *));
+		if (iter->names == NULL) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+
+		for (i = 0; i < iter->page->elements; i++) {
+			if (fnmatch(iter->glob, iter->page->element[i]->str, 0) == 0)
+				iter->names[iter->count++] = iter->page->element[i]->str;
+		}
+
+		/* The next page starts right after this one's last name */
+		last = iter->page->element[iter->page->elements - 1];
+		free(iter->min);
+		iter->min = malloc(last->len + 2);
+		if (iter->min == NULL) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+		iter->min[0] = '(';
+		memcpy(iter->min + 1, last->str, last->len + 1);
+	}
+
+	return GIT_OK;
+}
+
+/* Read the values of the current page's refs, in a single pipeline */
+static int hiredis_refdb_iterator__values(hiredis_refdb_iterator *iter)
+{
+	hiredis_refdb_backend *backend = iter->backend;
+	char **cmds;
+	size_t *lens;
+	size_t i;
+	int len, error = GIT_OK;
+
+	iter->values = calloc(iter->count, sizeof(redisReply *));
+	cmds = calloc(iter->count, sizeof(char *));
+	lens = calloc(iter->count, sizeof(size_t));
+	if (iter->values == NULL || cmds == NULL || lens == NULL) {
+		free(cmds);
+		free(lens);
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < iter->count; i++) {
+		len = redisFormatCommand(&cmds[i], "HMGET %s:refdb:%s type target", backend->key_prefix, iter->names[i]);
+		if (len < 0) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			error = GIT_ERROR;
+			break;
+		}
+		lens[i] = (size_t) len;
+	}
+
+	if (error == GIT_OK)
+		error = hiredis_pool__pipeline(backend->pool, cmds, lens, iter->count, iter->values);
+
+	for (; i > 0; i--)
+		redisFreeCommand(cmds[i - 1]);
+	free(cmds);
+	free(lens);
+
+	return error;
+}
+
+int hiredis_refdb_backend__iterator_next(git_reference **ref, git_reference_iterator *_iter) {
+	hiredis_refdb_iterator *iter;
+	const char *ref_name;
+	int error;
+
+	assert(_iter);
+	iter = (hiredis_refdb_iterator *) _iter;
+
+	do {
+		if ((error = hiredis_refdb_iterator__load(iter)) != GIT_OK)
+			return error;
+
+		if (iter->values == NULL && (error = hiredis_refdb_iterator__values(iter)) != GIT_OK)
+			return error;
+
+		ref_name = iter->names[iter->current];
+		error = hiredis_refdb_backend__parse_ref(ref, ref_name, iter->values[iter->current]);
+		iter->current++;
+
+		/* A ref deleted since its page was read is skipped */
+	} while (error == GIT_ENOTFOUND);
+
+	return error;
+}
+
+int hiredis_refdb_backend__iterator_next_name(const char **ref_name, git_reference_iterator *_iter) {
+	hiredis_refdb_iterator *iter;
+	int error;
+
+	assert(_iter);
+	iter = (hiredis_refdb_iterator *) _iter;
+
+	if ((error = hiredis_refdb_iterator__load(iter)) != GIT_OK)
+		return error;
+
+	/* Valid until the iterator moves on to its next page */
+	*ref_name = iter->names[iter->current++];
+
+	return GIT_OK;
+}
+
+void hiredis_refdb_backend__iterator_free(git_reference_iterator *_iter) {
+	hiredis_refdb_iterator *iter;
+
+	assert(_iter);
+	iter = (hiredis_refdb_iterator *) _iter;
+
+	hiredis_refdb_iterator__clear(iter);
+
+	free(iter->glob);
+	free(iter->min);
+	free(iter->max);
+
+	free(iter);
+}
+
+int hiredis_refdb_backend__iterator(git_reference_iterator **_iter, struct git_refdb_backend *_backend, const char *glob)
+{
+	hiredis_refdb_backend *backend;
+	hiredis_refdb_iterator *iterator;
+	size_t prefix_len;
+
+	assert(_backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	if (glob == NULL)
+		glob = "refs/*";
+
+	iterator = calloc(1, sizeof(hiredis_refdb_iterator));
+	if (iterator == NULL)
+		return GITERR_NOMEMORY;
+
+	/* Names matching the glob all lie between its literal prefix and that
+	 * prefix followed by 0xff, which no UTF-8 name contains */
+	prefix_len = strcspn(glob, "*?[\\");
+
+	iterator->glob = strdup(glob);
+	iterator->min = malloc(prefix_len + 2);
+	iterator->max = malloc(prefix_len + 3);
+	if (iterator->glob == NULL || iterator->min == NULL || iterator->max == NULL) {
+		free(iterator->glob);
+		free(iterator->min);
+		free(iterator->max);
+		free(iterator);
+		return GITERR_NOMEMORY;
+	}
+
+	sprintf(iterator->min, "[%.*s", (int) prefix_len, glob);
+	sprintf(iterator->max, "(%.*s\xff", (int) prefix_len, glob);
+
+	iterator->backend = backend;
+
+	iterator->parent.next = &hiredis_refdb_backend__iterator_next;
+	iterator->parent.next_name = &hiredis_refdb_backend__iterator_next_name;
+	iterator->parent.free = &hiredis_refdb_backend__iterator_free;
+
+	*_iter = (git_reference_iterator *) iterator;
+
+	return GIT_OK;
+}
+
+int hiredis_refdb_backend__write(git_refdb_backend *_backend, const git_reference *ref, int force, const git_signature *who,
+	const char *message, const git_oid *old, const char *old_target)
+{
+	hiredis_refdb_backend *backend;
+	int error = GIT_OK;
+	redisReply *reply;
+
+	const char *name = git_reference_name(ref);
+	const git_oid *target;
+	const char *symbolic_target;
+	char oid_str[GIT_OID_HEXSZ + 1];
+	char old_str[GIT_OID_HEXSZ + 1];
+	const char *old_type = "", *old_value = "";
+	hiredis_reflog_args log;
+	git_ref_t type;
+
+	assert(ref && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	target = git_reference_target(ref);
+	symbolic_target = git_reference_symbolic_target(ref);
+
+	if (target) {
+		git_oid_nfmt(oid_str, sizeof(oid_str), target);
+		symbolic_target = oid_str;
+		type = GIT_REF_OID;
+	} else {
+		type = GIT_REF_SYMBOLIC;
+	}
+
+	/* Types are stored as their numbers, GIT_REF_OID being 1 */
+	if (old) {
+		git_oid_nfmt(old_str, sizeof(old_str), old);
+		old_type = "1";
+		old_value = old_str;
+	} else if (old_target) {
+		old_type = "2";
+		old_value = old_target;
+	}
+
+	/* The ref's log entry goes in the same script */
+	hiredis_refdb_backend__log_args(&log, name, who, message);
+
+	reply = hiredis_pool__script(backend->pool, &hiredis_refdb_script_write,
+			"4 %s:refdb:%s %s:refnames %s:reflog:%s %s:refdb:%s %d %s %s %d %s %s %u %s %s %s %s %s %s %s",
+			backend->key_prefix, name, backend->key_prefix, backend->key_prefix, name,
+			backend->key_prefix, type == GIT_REF_OID ? name : symbolic_target,
+			(int) type, symbolic_target, name, force ? 1 : 0, old_type, old_value, backend->reflog_maxlen,
+			log.mode, log.name, log.email, log.time, log.offset, log.message, log.has_message);
+	error = hiredis_refdb_backend__script_error(reply);
+	hiredis_refdb_cache__invalidate(backend->cache, name);
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_refdb_backend__rename(git_reference **out, git_refdb_backend *_backend, const char *old_name,
+	const char *new_name, int force, const git_signature *who, const char *message)
+{
+	hiredis_refdb_backend *backend;
+	int error = GIT_OK;
+	redisReply *reply;
+	hiredis_reflog_args log;
+
+	assert(old_name && new_name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	/* The script moves the log along with the ref and hands back the
+	 * renamed ref, sparing a lookup */
+	hiredis_refdb_backend__log_args(&log, new_name, who, message);
+
+	reply = hiredis_pool__script(backend->pool, &hiredis_refdb_script_rename,
+			"5 %s:refdb:%s %s:refdb:%s %s:refnames %s:reflog:%s %s:reflog:%s %s %s %d %u %s %s %s %s %s %s %s",
+			backend->key_prefix, old_name, backend->key_prefix, new_name, backend->key_prefix,
+			backend->key_prefix, old_name, backend->key_prefix, new_name,
+			old_name, new_name, force ? 1 : 0, backend->reflog_maxlen,
+			log.mode, log.name, log.email, log.time, log.offset, log.message, log.has_message);
+	error = hiredis_refdb_backend__script_error(reply);
+	hiredis_refdb_cache__invalidate(backend->cache, old_name);
+	hiredis_refdb_cache__invalidate(backend->cache, new_name);
+	if (error == GIT_OK)
+		error = hiredis_refdb_backend__parse_ref(out, new_name, reply);
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_refdb_backend__del(git_refdb_backend *_backend, const char *ref_name, const git_oid *old, const char *old_target)
+{
+	hiredis_refdb_backend *backend;
+	int error = GIT_OK;
+	redisReply *reply;
+
+	char old_str[GIT_OID_HEXSZ + 1];
+	const char *old_type = "", *old_value = "";
+
+	assert(ref_name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	if (old) {
+		git_oid_nfmt(old_str, sizeof(old_str), old);
+		old_type = "1";
+		old_value = old_str;
+	} else if (old_target) {
+		old_type = "2";
+		old_value = old_target;
+	}
+
+	reply = hiredis_pool__script(backend->pool, &hiredis_refdb_script_del, "3 %s:refdb:%s %s:refnames %s:reflog:%s %s %s %s",
+			backend->key_prefix, ref_name, backend->key_prefix, backend->key_prefix, ref_name,
+			ref_name, old_type, old_value);
+	error = hiredis_refdb_backend__script_error(reply);
+	hiredis_refdb_cache__invalidate(backend->cache, ref_name);
+
+	freeReplyObject(reply);
+	return error;
+}
+
+void hiredis_refdb_backend__free(git_refdb_backend *_backend)
+{
+	hiredis_refdb_backend *backend;
+
+	assert(_backend);
+	backend = (hiredis_refdb_backend *) _backend;
+
+	hiredis_refdb_cache__free(backend->cache);
+	free(backend->key_prefix);
+
+	git_hiredis_pool_free(backend->pool);
+
+	free(backend);
+}
+
+/* reflog methods */
+
+int hiredis_refdb_backend__has_log(git_refdb_backend *_backend, const char *refname)
+{
+	hiredis_refdb_backend *backend;
+	redisReply *reply;
+	int error;
+
+	assert(refname && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	reply = hiredis_pool__command(backend->pool, "EXISTS %s:reflog:%s", backend->key_prefix, refname);
+	if (reply && reply->type == REDIS_REPLY_INTEGER) {
+		error = reply->integer ? 1 : 0;
+	} else {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_refdb_backend__ensure_log(git_refdb_backend *_backend, const char *refname)
+{
+	hiredis_refdb_backend *backend;
+	redisReply *reply;
+	int error;
+
+	assert(refname && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	reply = hiredis_pool__script(backend->pool, &hiredis_refdb_script_ensure_log, "1 %s:reflog:%s",
+			backend->key_prefix, refname);
+	error = hiredis_refdb_backend__script_error(reply);
+
+	freeReplyObject(reply);
+	return error;
+}
+
+/* Make a reflog entry out of a stream entry's fields. The log's creation
+ * leaves a placeholder entry behind, which is skipped. */
+static int hiredis_refdb_backend__parse_log_entry(hiredis_reflog_entry **out, const redisReply *fields)
+{
+	hiredis_reflog_entry *entry;
+	const char *old = NULL, *new = NULL, *name = "", *email = "", *message = NULL;
+	git_time_t time = 0;
+	int offset = 0, error;
+	size_t i;
+
+	*out = NULL;
+
+	for (i = 0; i + 1 < fields->elements; i += 2) {
+		const char *field = fields->element[i]->str, *value = fields->element[i + 1]->str;
+
+		if (strcmp(field, "old") == 0)
+			old = value;
+		else if (strcmp(field, "new") == 0)
+			new = value;
+		else if (strcmp(field, "name") == 0)
+			name = value;
+		else if (strcmp(field, "email") == 0)
+			email = value;
+		else if (strcmp(field, "time") == 0)
+			time = (git_time_t) strtoll(value, NULL, 10);
+		else if (strcmp(field, "offset") == 0)
+			offset = atoi(value);
+		else if (strcmp(field, "message") == 0)
+			message = value;
+	}
+
+	if (old == NULL || new == NULL)
+		return GIT_OK;
+
+	entry = (hiredis_reflog_entry *) git_reflog_entry__alloc();
+	if (entry == NULL)
+		return GITERR_NOMEMORY;
+
+	if ((error = git_oid_fromstr(&entry->oid_old, old)) < 0 ||
+			(error = git_oid_fromstr(&entry->oid_cur, new)) < 0 ||
+			(error = git_signature_new(&entry->committer, name, email, time, offset)) < 0) {
+		git_reflog_entry__free((git_reflog_entry *) entry);
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage corrupted (bad reflog entry)");
+		return error;
+	}
+
+	if (message != NULL && (entry->msg = strdup(message)) == NULL) {
+		git_reflog_entry__free((git_reflog_entry *) entry);
+		return GITERR_NOMEMORY;
+	}
+
+	*out = entry;
+	return GIT_OK;
+}
+
+int hiredis_refdb_backend__reflog_read(git_reflog **out, git_refdb_backend *_backend, const char *name)
+{
+	hiredis_refdb_backend *backend;
+	hiredis_reflog *reflog;
+	hiredis_reflog_entry *entry;
+	redisReply *reply, *item;
+	size_t i;
+	int error = GIT_OK;
+
+	assert(out && name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	/* Streams are bounded, so the whole log is read at once, oldest entry
+	 * first as libgit2 keeps them */
+	reply = hiredis_pool__command(backend->pool, "XRANGE %s:reflog:%s - +", backend->key_prefix, name);
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+		freeReplyObject(reply);
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+		return GIT_ERROR;
+	}
+
+	reflog = calloc(1, sizeof(hiredis_reflog));
+	if (reflog == NULL || (reflog->ref_name = strdup(name)) == NULL ||
+			(reply->elements > 0 &&
+			 (reflog->entries.contents = calloc(reply->elements, sizeof(void *))) == NULL)) {
+		free(reflog ? reflog->ref_name : NULL);
+		free(reflog);
+		freeReplyObject(reply);
+		return GITERR_NOMEMORY;
+	}
+	reflog->entries.alloc_size = reply->elements;
+
+	for (i = 0; error == GIT_OK && i < reply->elements; i++) {
+		item = reply->element[i];
+		if (item->type != REDIS_REPLY_ARRAY || item->elements != 2 || item->element[1]->type != REDIS_REPLY_ARRAY)
+			continue;
+
+		error = hiredis_refdb_backend__parse_log_entry(&entry, item->element[1]);
+		if (error == GIT_OK && entry != NULL)
+			reflog->entries.contents[reflog->entries.length++] = entry;
+	}
+
+	freeReplyObject(reply);
+
+	if (error != GIT_OK) {
+		git_reflog_free((git_reflog *) reflog);
+		return error;
+	}
+
+	*out = (git_reflog *) reflog;
+	return GIT_OK;
+}
+
+int hiredis_refdb_backend__reflog_write(git_refdb_backend *_backend, git_reflog *_reflog)
+{
+	hiredis_refdb_backend *backend;
+	hiredis_reflog *reflog;
+	const git_reflog_entry *entry;
+	const git_signature *who;
+	redisReply *reply;
+	const char **argv;
+	size_t *argv_len;
+	char *strs, *str, *args;
+	size_t i, count, argc;
+	int len, error;
+
+	assert(_reflog && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+	reflog = (hiredis_reflog *) _reflog;
+	count = git_reflog_entrycount(_reflog);
+
+	/* numkeys, the log and maxlen, then eight arguments per entry: the two
+	 * ids, time and offset are formatted into strs */
+	argv = malloc((count * 8 + 3) * sizeof(const char *));
+	argv_len = malloc((count * 8 + 3) * sizeof(size_t));
+	strs = malloc(strlen(backend->key_prefix) + strlen(reflog->ref_name) + 64 +
+			count * (2 * (GIT_OID_HEXSZ + 1) + 48));
+	if (argv == NULL || argv_len == NULL || strs == NULL) {
+		free(argv);
+		free(argv_len);
+		free(strs);
+		return GITERR_NOMEMORY;
+	}
+
+	str = strs;
+	argv[0] = "1";
+	argv[1] = str;
+	str += sprintf(str, "%s:reflog:%s", backend->key_prefix, reflog->ref_name) + 1;
+	argv[2] = str;
+	str += sprintf(str, "%u", backend->reflog_maxlen) + 1;
+	argc = 3;
+
+	/* Oldest first, so the stream's ids keep their order */
+	for (i = count; i > 0; i--) {
+		entry = git_reflog_entry_byindex(_reflog, i - 1);
+		who = git_reflog_entry_committer(entry);
+
+		argv[argc++] = git_oid_tostr(str, GIT_OID_HEXSZ + 1, git_reflog_entry_id_old(entry));
+		str += GIT_OID_HEXSZ + 1;
+		argv[argc++] = git_oid_tostr(str, GIT_OID_HEXSZ + 1, git_reflog_entry_id_new(entry));
+		str += GIT_OID_HEXSZ + 1;
+		argv[argc++] = who->name;
+		argv[argc++] = who->email;
+		argv[argc++] = str;
+		str += sprintf(str, "%lld", (long long) who->when.time) + 1;
+		argv[argc++] = str;
+		str += sprintf(str, "%d", who->when.offset) + 1;
+		argv[argc++] = git_reflog_entry_message(entry) ? git_reflog_entry_message(entry) : "";
+		argv[argc++] = git_reflog_entry_message(entry) ? "1" : "0";
+	}
+
+	for (i = 0; i < argc; i++)
+		argv_len[i] = strlen(argv[i]);
+
+	len = redisFormatCommandArgv(&args, (int) argc, argv, argv_len);
+	free(argv);
+	free(argv_len);
+	free(strs);
+	if (len < 0)
+		return GITERR_NOMEMORY;
+
+	reply = hiredis_pool__script_formatted(backend->pool, &hiredis_refdb_script_reflog_write, args, (size_t) len);
+	redisFreeCommand(args);
+
+	error = hiredis_refdb_backend__script_error(reply);
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_refdb_backend__reflog_rename(git_refdb_backend *_backend, const char *old_name, const char *new_name)
+{
+	hiredis_refdb_backend *backend;
+	redisReply *reply;
+	int error = GIT_OK;
+
+	assert(old_name && new_name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	/* A ref without a log has nothing to rename */
+	reply = hiredis_pool__command(backend->pool, "RENAME %s:reflog:%s %s:reflog:%s",
+			backend->key_prefix, old_name, backend->key_prefix, new_name);
+	if (reply == NULL || (reply->type == REDIS_REPLY_ERROR && strstr(reply->str, "no such key") == NULL)) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+int hiredis_refdb_backend__reflog_delete(git_refdb_backend *_backend, const char *name)
+{
+	hiredis_refdb_backend *backend;
+	redisReply *reply;
+	int error = GIT_OK;
+
+	assert(name && _backend);
+
+	backend = (hiredis_refdb_backend *) _backend;
+
+	reply = hiredis_pool__command(backend->pool, "DEL %s:reflog:%s", backend->key_prefix, name);
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	return error;
+}
+
+/* Batch operations: the commands for a window of objects are sent
+ * together, then their replies are read back in order. This costs a round
+ * trip per window (per cluster node), rather than one per object. */
+
+static void hiredis_odb_backend__batch_free(char **cmds, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		redisFreeCommand(cmds[i]);
+}
+
+static int hiredis_odb_backend__batch_format(hiredis_odb_backend *backend, char **cmds, size_t *lens,
+		const git_oid *oids, size_t count, int what)
+{
+	char str_id[GIT_OID_HEXSZ + 1];
+	size_t i;
+	int len;
+
+	for (i = 0; i < count; i++) {
+		if (backend->compact) {
+			if (what == HIREDIS_ODB_BATCH_READ)
+				len = redisFormatCommand(&cmds[i], "GET %s:%s:obj:%b", backend->prefix,
+						backend->repo_path, oids[i].id, (size_t) GIT_OID_RAWSZ);
+			else if (what == HIREDIS_ODB_BATCH_HEADER)
+				len = redisFormatCommand(&cmds[i], "GETRANGE %s:%s:obj:%b 0 %d", backend->prefix,
+						backend->repo_path, oids[i].id, (size_t) GIT_OID_RAWSZ, HIREDIS_ODB_HEADER_LEN - 1);
+			else
+				len = redisFormatCommand(&cmds[i], "EXISTS %s:%s:obj:%b", backend->prefix,
+						backend->repo_path, oids[i].id, (size_t) GIT_OID_RAWSZ);
+		} else {
+			/* Same key as the single object methods produce */
+			git_oid_tostr(str_id, GIT_OID_HEXSZ, &oids[i]);
+
+			if (what == HIREDIS_ODB_BATCH_READ)
+				len = redisFormatCommand(&cmds[i], "HMGET %s:%s:odb:%s %s %s %s %s", backend->prefix,
+						backend->repo_path, str_id, "type", "size", "codec", "data");
+			else if (what == HIREDIS_ODB_BATCH_HEADER)
+				len = redisFormatCommand(&cmds[i], "HMGET %s:%s:odb:%s %s %s", backend->prefix,
+						backend->repo_path, str_id, "type", "size");
+			else
+				len = redisFormatCommand(&cmds[i], "EXISTS %s:%s:odb:%s", backend->prefix,
+						backend->repo_path, str_id);
+		}
+
+		if (len < 0) {
+			hiredis_odb_backend__batch_free(cmds, i);
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+		lens[i] = (size_t) len;
+	}
+
+	return GIT_OK;
+}
+
+/* Send a window of commands about oids and collect the replies */
+static int hiredis_odb_backend__batch_run(hiredis_odb_backend *backend, redisReply **replies,
+		const git_oid *oids, size_t count, int what)
+{
+	char *cmds[HIREDIS_ODB_PIPELINE_DEPTH];
+	size_t lens[HIREDIS_ODB_PIPELINE_DEPTH];
+	int error;
+
+	assert(count <= HIREDIS_ODB_PIPELINE_DEPTH);
+
+	error = hiredis_odb_backend__batch_format(backend, cmds, lens, oids, count, what);
+	if (error != GIT_OK)
+		return error;
+
+	error = hiredis_pool__pipeline(backend->pool, cmds, lens, count, replies);
+	hiredis_odb_backend__batch_free(cmds, count);
+	return error;
+}
+
+static int hiredis_odb_backend__batch_read(hiredis_odb_backend *backend,
+		const git_oid *oids, size_t count, void **data_out, size_t *len_out, git_otype *type_out, int *error_out)
+{
+	redisReply *replies[HIREDIS_ODB_PIPELINE_DEPTH];
+	redisReply *reply;
+	size_t start, end, i;
+	int error;
+
+	for (start = 0; start < count; start = end) {
+		end = start + HIREDIS_ODB_PIPELINE_DEPTH;
+		if (end > count)
+			end = count;
+
+		error = hiredis_odb_backend__batch_run(backend, replies, oids + start, end - start,
+				data_out ? HIREDIS_ODB_BATCH_READ : HIREDIS_ODB_BATCH_HEADER);
+		if (error != GIT_OK)
+			return error;
+
+		for (i = start; i < end; i++) {
+			reply = replies[i - start];
+
+			if (data_out != NULL)
+				data_out[i] = NULL;
+
+			if (backend->compact) {
+				error_out[i] = hiredis_odb_backend__parse_compact(data_out ? &data_out[i] : NULL,
+						&len_out[i], &type_out[i], backend, reply);
+			} else if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+				error_out[i] = GIT_ERROR;
+			} else if (reply->element[0]->type == REDIS_REPLY_NIL ||
+					reply->element[1]->type == REDIS_REPLY_NIL ||
+					(data_out != NULL && reply->element[3]->type == REDIS_REPLY_NIL)) {
+				error_out[i] = GIT_ENOTFOUND;
+			} else {
+				type_out[i] = (git_otype) atoi(reply->element[0]->str);
+				len_out[i] = (size_t) strtoull(reply->element[1]->str, NULL, 10);
+				error_out[i] = GIT_OK;
+
+				if (data_out != NULL)
+					error_out[i] = hiredis_odb_backend__unpack(&data_out[i], backend, len_out[i],
+							reply->element[2]->type == REDIS_REPLY_NIL ?
+								HIREDIS_ODB_CODEC_NONE : atoi(reply->element[2]->str),
+							reply->element[3]->str, reply->element[3]->len);
+			}
+
+			freeReplyObject(reply);
+		}
+	}
+
+	return GIT_OK;
+}
+
+static int hiredis_odb_backend__batch_exists(hiredis_odb_backend *backend,
+		const git_oid *oids, size_t count, int *found_out)
+{
+	redisReply *replies[HIREDIS_ODB_PIPELINE_DEPTH];
+	size_t start, end, i;
+	int error;
+
+	for (start = 0; start < count; start = end) {
+		end = start + HIREDIS_ODB_PIPELINE_DEPTH;
+		if (end > count)
+			end = count;
+
+		error = hiredis_odb_backend__batch_run(backend, replies, oids + start, end - start,
+				HIREDIS_ODB_BATCH_EXISTS);
+		if (error != GIT_OK)
+			return error;
+
+		for (i = start; i < end; i++) {
+			redisReply *reply = replies[i - start];
+
+			found_out[i] = (reply != NULL && reply->type == REDIS_REPLY_INTEGER && reply->integer > 0);
+			freeReplyObject(reply);
+		}
+	}
+
+	return GIT_OK;
+}
+
+/* Foreach: objects are listed from the index of object ids when there is
+ * one, or else by SCAN over the object keys, a cursor at a time, so the
+ * server is never held up for long. */
+
+static int hiredis_odb_backend__foreach_index(hiredis_odb_backend *backend, git_odb_foreach_cb cb, void *payload)
+{
+	redisReply *reply, *last;
+	char min[GIT_OID_HEXSZ + 2] = "-";
+	git_oid oid;
+	size_t i;
+	int error = GIT_OK, done = 0;
+
+	while (error == GIT_OK && !done) {
+		reply = hiredis_pool__command(backend->pool, "ZRANGEBYLEX %s:%s:oids %s + LIMIT 0 %d",
+				backend->prefix, backend->repo_path, min, HIREDIS_ODB_SCAN_COUNT);
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+			freeReplyObject(reply);
+			giterr_set_str(GITERR_ODB, "Redis odb storage error");
+			return GIT_ERROR;
+		}
+
+		for (i = 0; error == GIT_OK && i < reply->elements; i++) {
+			if (git_oid_fromstr(&oid, reply->element[i]->str) == 0)
+				error = cb(&oid, payload);
+		}
+
+		done = reply->elements < HIREDIS_ODB_SCAN_COUNT;
+		if (!done) {
+			last = reply->element[reply->elements - 1];
+			snprintf(min, sizeof(min), "(%s", last->str);
+		}
+
+		freeReplyObject(reply);
+	}
+
+	return error;
+}
+
+/* Run one command per key over a pipeline, HMGET with the given fields */
+static int hiredis_odb_backend__foreach_fetch(hiredis_odb_backend *backend, redisReply **keys, size_t count,
+		const char *fields, redisReply **replies)
+{
+	char *cmds[HIREDIS_ODB_PIPELINE_DEPTH];
+	size_t lens[HIREDIS_ODB_PIPELINE_DEPTH];
+	size_t i;
+	int len, error;
+
+	for (i = 0; i < count; i++) {
+		len = redisFormatCommand(&cmds[i], "HMGET %b %s", keys[i]->str, keys[i]->len, fields);
+		if (len < 0) {
+			hiredis_odb_backend__batch_free(cmds, i);
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+		lens[i] = (size_t) len;
+	}
+
+	error = hiredis_pool__pipeline(backend->pool, cmds, lens, count, replies);
+	hiredis_odb_backend__batch_free(cmds, count);
+	return error;
+}
+
+/* The hex layout's keys hold only the first 39 digits of an id; the whole
+ * id is read from the object's id field, leaving its data where it is.
+ * Objects stored before there was one are hashed again, which means
+ * fetching all their data, and only done when the caller opted in. */
+static int hiredis_odb_backend__foreach_hash(hiredis_odb_backend *backend, redisReply *keys,
+		git_odb_foreach_cb cb, void *payload)
+{
+	redisReply *stale[HIREDIS_ODB_PIPELINE_DEPTH];
+	redisReply *replies[HIREDIS_ODB_PIPELINE_DEPTH];
+	redisReply *reply;
+	git_oid oid;
+	void *data;
+	size_t start, end, i, size, stale_count;
+	int error = GIT_OK;
+
+	for (start = 0; error == GIT_OK && start < keys->elements; start = end) {
+		end = start + HIREDIS_ODB_PIPELINE_DEPTH;
+		if (end > keys->elements)
+			end = keys->elements;
+
+		error = hiredis_odb_backend__foreach_fetch(backend, &keys->element[start], end - start, "id", replies);
+		if (error != GIT_OK)
+			break;
+
+		/* Objects deleted since the SCAN are skipped */
+		for (i = 0, stale_count = 0; i < end - start; i++) {
+			reply = replies[i];
+
+			if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 1) {
+				if (reply->element[0]->type == REDIS_REPLY_NIL)
+					stale[stale_count++] = keys->element[start + i];
+				else if (error == GIT_OK && reply->element[0]->type == REDIS_REPLY_STRING &&
+						reply->element[0]->len == GIT_OID_HEXSZ &&
+						git_oid_fromstrn(&oid, reply->element[0]->str, GIT_OID_HEXSZ) == 0)
+					error = cb(&oid, payload);
+			}
+
+			freeReplyObject(reply);
+		}
+
+		if (error != GIT_OK || stale_count == 0)
+			continue;
+
+		if (!backend->foreach_rehash) {
+			giterr_set_str(GITERR_ODB, "Redis odb objects stored without their id can only be listed "
+					"by hashing them again; see git_odb_backend_hiredis_set_foreach_rehash");
+			error = GIT_ERROR;
+			break;
+		}
+
+		error = hiredis_odb_backend__foreach_fetch(backend, stale, stale_count, "type size codec data", replies);
+		if (error != GIT_OK)
+			break;
+
+		for (i = 0; i < stale_count; i++) {
+			reply = replies[i];
+
+			if (error == GIT_OK && reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 4 &&
+					reply->element[0]->type == REDIS_REPLY_STRING &&
+					reply->element[1]->type == REDIS_REPLY_STRING &&
+					reply->element[3]->type == REDIS_REPLY_STRING) {
+				size = (size_t) strtoull(reply->element[1]->str, NULL, 10);
+				error = hiredis_odb_backend__unpack(&data, backend, size,
+						reply->element[2]->type == REDIS_REPLY_NIL ?
+							HIREDIS_ODB_CODEC_NONE : atoi(reply->element[2]->str),
+						reply->element[3]->str, reply->element[3]->len);
+				if (error == GIT_OK) {
+					error = git_odb_hash(&oid, data, size, (git_otype) atoi(reply->element[0]->str));
+					free(data);
+				}
+				if (error == GIT_OK)
+					error = cb(&oid, payload);
+			}
+
+			freeReplyObject(reply);
+		}
+	}
+
+	return error;
+}
+
+/* SCAN one server for object keys */
+static int hiredis_odb_backend__foreach_node(hiredis_odb_backend *backend, git_hiredis_pool *node,
+		const char *match, size_t key_len, git_odb_foreach_cb cb, void *payload)
+{
+	redisReply *reply, *keys;
+	char cursor[32] = "0";
+	char *cmd;
+	git_oid oid;
+	size_t i;
+	int len, error = GIT_OK;
+
+	do {
+		len = redisFormatCommand(&cmd, "SCAN %s MATCH %s COUNT %d", cursor, match, HIREDIS_ODB_SCAN_COUNT);
+		if (len < 0) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+
+		reply = hiredis_pool__execute(node, cmd, (size_t) len, 0);
+		redisFreeCommand(cmd);
+
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+				reply->element[0]->type != REDIS_REPLY_STRING || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+			freeReplyObject(reply);
+			giterr_set_str(GITERR_ODB, "Redis odb storage error");
+			return GIT_ERROR;
+		}
+
+		snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+		keys = reply->element[1];
+
+		/* Compact keys end in the raw id, read in place */
+		if (backend->compact) {
+			for (i = 0; error == GIT_OK && i < keys->elements; i++) {
+				if (keys->element[i]->len != key_len + GIT_OID_RAWSZ)
+					continue;
+
+				git_oid_fromraw(&oid, (const unsigned char *) keys->element[i]->str + key_len);
+				error = cb(&oid, payload);
+			}
+		} else {
+			error = hiredis_odb_backend__foreach_hash(backend, keys, cb, payload);
+		}
+
+		freeReplyObject(reply);
+	} while (error == GIT_OK && strcmp(cursor, "0") != 0);
+
+	return error;
+}
+
+static int hiredis_odb_backend__foreach_scan(hiredis_odb_backend *backend, git_odb_foreach_cb cb, void *payload)
+{
+	git_hiredis_pool *pool = backend->pool, **nodes;
+	char *match, *end;
+	size_t i, node_count, key_len;
+	int error = GIT_OK;
+
+	match = malloc((strlen(backend->prefix) + strlen(backend->repo_path)) * 2 + sizeof("::odb:*"));
+	if (match == NULL)
+		return GITERR_NOMEMORY;
+
+	end = hiredis_scan__escape(match, backend->prefix);
+	*end++ = ':';
+	end = hiredis_scan__escape(end, backend->repo_path);
+	strcpy(end, backend->compact ? ":obj:*" : ":odb:*");
+	key_len = strlen(backend->prefix) + strlen(backend->repo_path) + strlen("::obj:");
+
+	if (!pool->cluster) {
+		error = hiredis_odb_backend__foreach_node(backend, pool, match, key_len, cb, payload);
+		free(match);
+		return error;
+	}
+
+	/* Objects are spread over every node of a cluster, and each has to be
+	 * scanned in turn */
+	pthread_rwlock_rdlock(&pool->slots_lock);
+	node_count = pool->node_count;
+	nodes = malloc(node_count * sizeof(git_hiredis_pool *));
+	if (nodes != NULL)
+		memcpy(nodes, pool->nodes, node_count * sizeof(git_hiredis_pool *));
+	pthread_rwlock_unlock(&pool->slots_lock);
+
+	if (nodes == NULL) {
+		free(match);
+		return GITERR_NOMEMORY;
+	}
+
+	for (i = 0; error == GIT_OK && i < node_count; i++)
+		error = hiredis_odb_backend__foreach_node(backend, nodes[i], match, key_len, cb, payload);
+
+	free(nodes);
+	free(match);
+	return error;
+}
+
+int hiredis_odb_backend__foreach(git_odb_backend *_backend, git_odb_foreach_cb cb, void *payload)
+{
+	hiredis_odb_backend *backend;
+
+	assert(_backend && cb);
+
+	backend = (hiredis_odb_backend *) _backend;
+
+	if (backend->oid_index)
+		return hiredis_odb_backend__foreach_index(backend, cb, payload);
+
+	return hiredis_odb_backend__foreach_scan(backend, cb, payload);
+}
+
+/* Collects ids for the index of object ids while it is rebuilt */
+typedef struct {
+	hiredis_odb_backend *backend;
+	git_oid oids[HIREDIS_ODB_PIPELINE_DEPTH];
+	size_t count;
+} hiredis_odb_reindex;
+
+static int hiredis_odb_reindex__flush(hiredis_odb_reindex *reindex)
+{
+	const git_oid *oids[HIREDIS_ODB_PIPELINE_DEPTH];
+	redisReply *reply;
+	char *cmd;
+	size_t i;
+	int len, error = GIT_OK;
+
+	if (reindex->count == 0)
+		return GIT_OK;
+
+	for (i = 0; i < reindex->count; i++)
+		oids[i] = &reindex->oids[i];
+
+	len = hiredis_odb_backend__format_index(reindex->backend, &cmd, oids, reindex->count);
+	if (len < 0) {
+		giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+		return GIT_ERROR;
+	}
+
+	reply = hiredis_pool__route(reindex->backend->pool, cmd, (size_t) len);
+	redisFreeCommand(cmd);
+
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+		giterr_set_str(GITERR_ODB, "Redis odb storage error");
+		error = GIT_ERROR;
+	}
+
+	freeReplyObject(reply);
+	reindex->count = 0;
+	return error;
+}
+
+static int hiredis_odb_reindex__add(const git_oid *oid, void *payload)
+{
+	hiredis_odb_reindex *reindex = (hiredis_odb_reindex *) payload;
+
+	git_oid_cpy(&reindex->oids[reindex->count++], oid);
+	if (reindex->count == HIREDIS_ODB_PIPELINE_DEPTH)
+		return hiredis_odb_reindex__flush(reindex);
+
+	return GIT_OK;
+}
+
+/* Writepack: the incoming pack is indexed into a temporary directory, then
+ * the objects Redis doesn't have yet are read out of it and sent in
+ * pipelined batches, each bounded in count and in bytes. */
+
+typedef struct {
+	git_oid *oids;
+	size_t count;
+	size_t alloc;
+} hiredis_odb_oid_list;
+
+static int hiredis_odb_writepack__collect(const git_oid *oid, void *payload)
+{
+	hiredis_odb_oid_list *list = (hiredis_odb_oid_list *) payload;
+	git_oid *oids;
+
+	if (list->count == list->alloc) {
+		list->alloc = list->alloc ? list->alloc * 2 : 1024;
+		oids = realloc(list->oids, list->alloc * sizeof(git_oid));
+		if (oids == NULL) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+		list->oids = oids;
+	}
+
+	git_oid_cpy(&list->oids[list->count++], oid);
+	return GIT_OK;
+}
+
+/* Send a batch of write commands; cmds has a free slot before them, for
+ * MULTI, and two after, for updating the index and EXEC */
+static int hiredis_odb_writepack__flush(hiredis_odb_backend *backend, char **cmds, size_t *lens, size_t count,
+		const git_oid **written)
+{
+	static char cmd_multi[] = "*1\r\n$5\r\nMULTI\r\n";
+	static char cmd_exec[] = "*1\r\n$4\r\nEXEC\r\n";
+	redisReply *replies[HIREDIS_ODB_PIPELINE_DEPTH + 3];
+	char *index_cmd = NULL;
+	size_t first = 1, total, i;
+	int multi, len, error;
+
+	if (count == 0)
+		return GIT_OK;
+
+	/* The whole batch goes into the index with a single command */
+	if (backend->oid_index) {
+		len = hiredis_odb_backend__format_index(backend, &index_cmd, written, count);
+		if (len < 0) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			return GIT_ERROR;
+		}
+		cmds[++count] = index_cmd;
+		lens[count] = (size_t) len;
+	}
+	total = count;
+
+	/* A cluster can't run a transaction over keys in different slots */
+	multi = backend->writepack_multi && !backend->pool->cluster;
+	if (multi) {
+		cmds[0] = cmd_multi;
+		lens[0] = sizeof(cmd_multi) - 1;
+		cmds[count + 1] = cmd_exec;
+		lens[count + 1] = sizeof(cmd_exec) - 1;
+		first = 0;
+		total = count + 2;
+	}
+
+	error = hiredis_pool__pipeline(backend->pool, cmds + first, lens + first, total, replies);
+	redisFreeCommand(index_cmd);
+	if (error != GIT_OK)
+		return error;
+
+	for (i = 0; i < total; i++) {
+		if (replies[i] == NULL || replies[i]->type == REDIS_REPLY_ERROR ||
+				(multi && i == total - 1 && replies[i]->type != REDIS_REPLY_ARRAY))
+			error = GIT_ERROR;
+
+		freeReplyObject(replies[i]);
+	}
+
+	if (error != GIT_OK)
+		giterr_set_str(GITERR_ODB, "Redis odb failed to store objects from a pack");
+
+	return error;
+}
+
+static int hiredis_odb_writepack__store(hiredis_odb_backend *backend, git_odb *pack_odb,
+		const hiredis_odb_oid_list *list)
+{
+	char *cmds[HIREDIS_ODB_PIPELINE_DEPTH + 3];
+	size_t lens[HIREDIS_ODB_PIPELINE_DEPTH + 3];
+	const git_oid *written[HIREDIS_ODB_PIPELINE_DEPTH];
+	int found[HIREDIS_ODB_PIPELINE_DEPTH];
+	git_odb_object *obj;
+	size_t start, end, i, count = 0, inflight = 0;
+	int len, error = GIT_OK;
+
+	for (start = 0; error == GIT_OK && start < list->count; start = end) {
+		end = start + HIREDIS_ODB_PIPELINE_DEPTH;
+		if (end > list->count)
+			end = list->count;
+
+		/* Objects that are already there needn't be read out of the pack */
+		error = hiredis_odb_backend__batch_exists(backend, list->oids + start, end - start, found);
+
+		for (i = start; error == GIT_OK && i < end; i++) {
+			if (found[i - start])
+				continue;
+
+			error = git_odb_read(&obj, pack_odb, &list->oids[i]);
+			if (error != GIT_OK)
+				break;
+
+			/* Too big to batch; it goes in chunks of its own */
+			if (backend->chunk_threshold && git_odb_object_size(obj) > backend->chunk_threshold) {
+				error = hiredis_odb_backend__write_chunked(backend, &list->oids[i], git_odb_object_data(obj),
+						git_odb_object_size(obj), git_odb_object_type(obj));
+				git_odb_object_free(obj);
+				continue;
+			}
+
+			len = hiredis_odb_backend__format_write(backend, &cmds[count + 1], &list->oids[i],
+					git_odb_object_data(obj), git_odb_object_size(obj), git_odb_object_type(obj));
+			inflight += git_odb_object_size(obj);
+			git_odb_object_free(obj);
+
+			if (len < 0) {
+				giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+				error = GIT_ERROR;
+				break;
+			}
+			written[count] = &list->oids[i];
+			lens[++count] = (size_t) len;
+
+			if (count == HIREDIS_ODB_PIPELINE_DEPTH || inflight >= backend->writepack_inflight) {
+				error = hiredis_odb_writepack__flush(backend, cmds, lens, count, written);
+				hiredis_odb_backend__batch_free(cmds + 1, count);
+				count = 0;
+				inflight = 0;
+			}
+		}
+	}
+
+	if (error == GIT_OK)
+		error = hiredis_odb_writepack__flush(backend, cmds, lens, count, written);
+	hiredis_odb_backend__batch_free(cmds + 1, count);
+
+	return error;
+}
+
+static int hiredis_odb_writepack__append(git_odb_writepack *_wp, const void *data, size_t size,
+		git_transfer_progress *stats)
+{
+	hiredis_odb_writepack *wp = (hiredis_odb_writepack *) _wp;
+
+	return git_indexer_append(wp->indexer, data, size, stats);
+}
+
+static int hiredis_odb_writepack__commit(git_odb_writepack *_wp, git_transfer_progress *stats)
+{
+	hiredis_odb_writepack *wp = (hiredis_odb_writepack *) _wp;
+	hiredis_odb_backend *backend = (hiredis_odb_backend *) _wp->backend;
+	hiredis_odb_oid_list list = { NULL, 0, 0 };
+	git_odb_backend *pack_backend;
+	git_odb *pack_odb = NULL;
+	char idx_path[PATH_MAX + GIT_OID_HEXSZ + 16];
+	char hash[GIT_OID_HEXSZ + 1];
+	int error;
+
+	error = git_indexer_commit(wp->indexer, stats);
+	if (error != GIT_OK)
+		return error;
+
+	git_oid_tostr(hash, sizeof(hash), git_indexer_hash(wp->indexer));
+	snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", wp->dir_path, hash);
+
+	if ((error = git_odb_new(&pack_odb)) < 0 ||
+			(error = git_odb_backend_one_pack(&pack_backend, idx_path)) < 0)
+		goto out;
+
+	if ((error = git_odb_add_backend(pack_odb, pack_backend, 1)) < 0) {
+		pack_backend->free(pack_backend);
+		goto out;
+	}
+
+	error = git_odb_foreach(pack_odb, &hiredis_odb_writepack__collect, &list);
+	if (error == GIT_OK)
+		error = hiredis_odb_writepack__store(backend, pack_odb, &list);
+
+out:
+	git_odb_free(pack_odb);
+	free(list.oids);
+	return error;
+}
+
+static void hiredis_odb_writepack__free(git_odb_writepack *_wp)
+{
+	hiredis_odb_writepack *wp = (hiredis_odb_writepack *) _wp;
+	char path[PATH_MAX + 256];
+	struct dirent *entry;
+	DIR *dir;
+
+	git_indexer_free(wp->indexer);
+
+	/* Whatever the indexer left, the pack and its index included */
+	dir = opendir(wp->dir_path);
+	if (dir != NULL) {
+		while ((entry = readdir(dir)) != NULL) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", wp->dir_path, entry->d_name);
+			unlink(path);
+		}
+		closedir(dir);
+	}
+	rmdir(wp->dir_path);
+
+	free(wp);
+}
+
+int hiredis_odb_backend__writepack(git_odb_writepack **out, git_odb_backend *_backend, git_odb *odb,
+		git_transfer_progress_callback progress_cb, void *progress_payload)
+{
+	hiredis_odb_writepack *wp;
+	int error;
+
+	assert(out && _backend);
+
+	wp = calloc(1, sizeof(hiredis_odb_writepack));
+	if (wp == NULL)
+		return GITERR_NOMEMORY;
+
+	strcpy(wp->dir_path, "/tmp/git2-redis-XXXXXX");
+	if (mkdtemp(wp->dir_path) == NULL) {
+		free(wp);
+		giterr_set_str(GITERR_OS, "Redis odb couldn't create a directory for the pack");
+		return GIT_ERROR;
+	}
+
+	/* odb resolves the bases of thin packs */
+	error = git_indexer_new(&wp->indexer, wp->dir_path, 0, odb, progress_cb, progress_payload);
+	if (error != GIT_OK) {
+		rmdir(wp->dir_path);
+		free(wp);
+		return error;
+	}
+
+	wp->parent.backend = _backend;
+	wp->parent.append = &hiredis_odb_writepack__append;
+	wp->parent.commit = &hiredis_odb_writepack__commit;
+	wp->parent.free = &hiredis_odb_writepack__free;
+
+	*out = (git_odb_writepack *) wp;
+	return GIT_OK;
+}
+
+int git_odb_backend_hiredis_set_writepack(git_odb_backend *_backend, int transactional, size_t max_inflight)
+{
+	/* Tune pack ingestion. With transactional set, each batch of objects is
+	 * stored within MULTI/EXEC (not in a cluster, where batches span
+	 * slots). max_inflight bounds the bytes of object data sent before
+	 * waiting for replies; 0 restores the default. */
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
+
+	backend = (hiredis_odb_backend *) _backend;
+	backend->writepack_multi = transactional;
+	backend->writepack_inflight = max_inflight ? max_inflight : HIREDIS_ODB_WRITEPACK_INFLIGHT;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_hiredis_set_oid_index(git_odb_backend *_backend, int enabled)
+{
+	/* Keep a sorted set of every object id written from now on, through
+	 * which abbreviated ids are resolved in one round trip, and which
+	 * foreach lists objects from. Objects written while it was off are only
+	 * added by git_odb_backend_hiredis_rebuild_oid_index. */
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
+
+	backend = (hiredis_odb_backend *) _backend;
+	backend->oid_index = enabled;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_hiredis_set_foreach_rehash(git_odb_backend *_backend, int enabled)
+{
+	/* Let foreach and git_odb_backend_hiredis_rebuild_oid_index list hex
+	 * layout objects stored without their whole id, by fetching and hashing
+	 * them again: a full transfer of every such object. Without this they
+	 * fail on meeting one. */
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
+
+	backend = (hiredis_odb_backend *) _backend;
+	backend->foreach_rehash = enabled;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_hiredis_rebuild_oid_index(git_odb_backend *_backend)
+{
+	/* Add every object stored to the index of object ids, found by SCAN
+	 * over the object keys, so the index covers objects written before it
+	 * was turned on. */
+	hiredis_odb_reindex *reindex;
+	int error;
+
+	assert(_backend);
+
+	reindex = calloc(1, sizeof(hiredis_odb_reindex));
+	if (reindex == NULL)
+		return GITERR_NOMEMORY;
+
+	reindex->backend = (hiredis_odb_backend *) _backend;
+
+	error = hiredis_odb_backend__foreach_scan(reindex->backend, &hiredis_odb_reindex__add, reindex);
+	if (error == GIT_OK)
+		error = hiredis_odb_reindex__flush(reindex);
+
+	free(reindex);
+	return error;
+}
+
+int git_odb_backend_hiredis_set_compression(git_odb_backend *_backend, size_t threshold)
+{
+	/* Deflate objects of at least threshold bytes as they're written, or
+	 * with 0, none. Objects are read back whichever way they were stored,
+	 * so this may be changed at any time. */
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
+
+	backend = (hiredis_odb_backend *) _backend;
+	backend->compress_threshold = threshold;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_hiredis_set_chunking(git_odb_backend *_backend, size_t threshold, size_t chunk_size)
+{
+	/* Split objects larger than threshold bytes, as they're written, into
+	 * chunks of chunk_size bytes, each a key of its own, sent and read a
+	 * few at a time; a threshold of 0 turns this off, and a chunk_size of 0
+	 * restores the default. Chunks aren't deflated. Objects are read back
+	 * whichever way they were stored, so this may be changed at any time. */
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
+
+	if ((unsigned long long) chunk_size > 0xffffffffULL) {
+		giterr_set_str(GITERR_INVALID, "Redis odb chunks can't be larger than 4 GiB");
+		return GIT_ERROR;
+	}
+
+	backend = (hiredis_odb_backend *) _backend;
+	backend->chunk_threshold = threshold;
+	backend->chunk_size = chunk_size ? chunk_size : HIREDIS_ODB_CHUNK_SIZE;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_hiredis_set_compact(git_odb_backend *_backend, int compact)
+{
+	/* Choose the object layout. The default stores each object as a hash
+	 * under its hex oid; the compact layout stores one binary string under
+	 * the raw oid, which takes less memory and a single lookup to read. The
+	 * two don't see each other's objects, so a repository must stick to one. */
+	hiredis_odb_backend *backend;
+
+	assert(_backend);
 
-	reply = redisCommand(backend->db, "EXISTS %s:%s:refdb:%s", backend->prefix, backend->repo_path, ref_name);
-	if (reply->type == REDIS_REPLY_INTEGER) {
-		*exists = reply->integer;
-	} else {
-		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
-		error = GIT_ERROR;
-	}
+	backend = (hiredis_odb_backend *) _backend;
+	backend->compact = compact;
 
-	freeReplyObject(reply);
-	return error;
+	return GIT_OK;
 }
 
-int hiredis_refdb_backend__lookup(git_reference **out, git_refdb_backend *_backend, const char *ref_name)
+int git_odb_backend_hiredis_read_batch(git_odb_backend *_backend, const git_oid *oids, size_t count,
+		void **data_out, size_t *len_out, git_otype *type_out, int *error_out)
 {
-	hiredis_refdb_backend *backend;
-	int error = GIT_OK;
-	redisReply *reply;
-	git_oid oid;
-
-	assert(ref_name && _backend);
+	/* Read count objects in pipelined round trips. For each object, error_out
+	 * gets GIT_OK, with its contents in data_out (to be freed by the caller),
+	 * len_out and type_out, or GIT_ENOTFOUND. Passing a NULL data_out reads
+	 * only the headers. A connection failure makes the whole batch fail. */
+	hiredis_odb_backend *backend;
+	size_t i;
+	int error;
 
-	backend = (hiredis_refdb_backend *) _backend;
+	assert(_backend && (oids || count == 0) && len_out && type_out && error_out);
 
-	reply = redisCommand(backend->db, "HMGET %s:%s:refdb:%s type target", backend->prefix, backend->repo_path, ref_name);
-	if(reply->type == REDIS_REPLY_ARRAY) {
-		if (reply->element[0]->type != REDIS_REPLY_NIL && reply->element[1]->type != REDIS_REPLY_NIL) {
-			git_ref_t type = (git_ref_t) atoi(reply->element[0]->str);
+	backend = (hiredis_odb_backend *) _backend;
 
-			if (type == GIT_REF_OID) {
-				git_oid_fromstr(&oid, reply->element[1]->str);
-				*out = git_reference__alloc(ref_name, &oid, NULL);
-			} else if (type == GIT_REF_SYMBOLIC) {
-				*out = git_reference__alloc_symbolic(ref_name, reply->element[1]->str);
-			} else {
-				giterr_set_str(GITERR_REFERENCE, "Redis refdb storage corrupted (unknown ref type returned)");
-				error = GIT_ERROR;
-			}
+	if (data_out != NULL)
+		memset(data_out, 0, count * sizeof(void *));
 
-		} else {
-			giterr_set_str(GITERR_REFERENCE, "Redis refdb couldn't find ref");
-			error = GIT_ENOTFOUND;
+	error = hiredis_odb_backend__batch_read(backend, oids, count, data_out, len_out, type_out, error_out);
+	if (error != GIT_OK && data_out != NULL) {
+		for (i = 0; i < count; i++) {
+			free(data_out[i]);
+			data_out[i] = NULL;
 		}
-	} else {
-		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
-		error = GIT_ERROR;
 	}
 
-	freeReplyObject(reply);
 	return error;
 }
 
-int hiredis_refdb_backend__iterator_next(git_reference **ref, git_reference_iterator *_iter) {
-	hiredis_refdb_iterator *iter;
-	hiredis_refdb_backend *backend;
-	char* ref_name;
-	int error;
+int git_odb_backend_hiredis_exists_batch(git_odb_backend *_backend, const git_oid *oids, size_t count,
+		int *found_out)
+{
+	/* Check count objects for existence in pipelined round trips; found_out
+	 * gets 1 for each object present and 0 for each one missing */
+	assert(_backend && (oids || count == 0) && found_out);
 
-	assert(_iter);
-	iter = (hiredis_refdb_iterator *) _iter;
+	return hiredis_odb_backend__batch_exists((hiredis_odb_backend *) _backend, oids, count, found_out);
+}
 
-	if(iter->current < iter->keys->elements) {
-		ref_name = strstr(iter->keys->element[iter->current++]->str, ":refdb:") + 7;
-		error = hiredis_refdb_backend__lookup(ref, (git_refdb_backend *) iter->backend, ref_name);
+/* Constructors */
 
-		return error;
-	} else {
-		return GIT_ITEROVER;
-	}
-}
+int git_hiredis_cluster_new(git_hiredis_pool **out, const char *host, int port, const char *password,
+	size_t size, int connect_timeout_ms, int command_timeout_ms)
+{
+	/* Create a pool for a Redis Cluster, given any one of its nodes. The
+	 * slot map is read from it, and each node gets a pool of up to size
+	 * connections. Backends made with the pool spread objects over the
+	 * cluster, and keep each repository's refs on one node. */
+	git_hiredis_pool *cluster, *seed;
+	int error;
 
-int hiredis_refdb_backend__iterator_next_name(const char **ref_name, git_reference_iterator *_iter) {
-	hiredis_refdb_iterator *iter;
+	assert(out && host && size > 0);
 
-	assert(_iter);
-	iter = (hiredis_refdb_iterator *) _iter;
+	error = git_hiredis_pool_new(&cluster, host, port, NULL, password, size, connect_timeout_ms,
+			command_timeout_ms);
+	if (error != GIT_OK)
+		return error;
 
-	if(iter->current < iter->keys->elements) {
-		*ref_name = strdup(strstr(iter->keys->element[iter->current++]->str, ":refdb:") + 7);
+	cluster->cluster = 1;
+	pthread_rwlock_init(&cluster->slots_lock, NULL);
 
-		return GIT_OK;
-	} else {
-		return GIT_ITEROVER;
+	cluster->slots = calloc(HIREDIS_CLUSTER_SLOTS, sizeof(git_hiredis_pool *));
+	cluster->nodes = malloc(sizeof(git_hiredis_pool *));
+	if (cluster->slots == NULL || cluster->nodes == NULL) {
+		git_hiredis_pool_free(cluster);
+		return GITERR_NOMEMORY;
 	}
-}
-
-void hiredis_refdb_backend__iterator_free(git_reference_iterator *_iter) {
-	hiredis_refdb_iterator *iter;
 
-	assert(_iter);
-	iter = (hiredis_refdb_iterator *) _iter;
+	error = git_hiredis_pool_new(&seed, host, port, NULL, password, size, connect_timeout_ms,
+			command_timeout_ms);
+	if (error != GIT_OK) {
+		git_hiredis_pool_free(cluster);
+		return error;
+	}
+	cluster->nodes[cluster->node_count++] = seed;
 
-	freeReplyObject(iter->keys);
+	error = hiredis_cluster__refresh(cluster);
+	if (error != GIT_OK) {
+		git_hiredis_pool_free(cluster);
+		return error;
+	}
 
-	free(iter);
+	*out = cluster;
+	return GIT_OK;
 }
 
-int hiredis_refdb_backend__iterator(git_reference_iterator **_iter, struct git_refdb_backend *_backend, const char *glob)
+int git_odb_backend_hiredis_pool(git_odb_backend **backend_out, const char* prefix, const char* path,
+	git_hiredis_pool *pool)
 {
-	hiredis_refdb_backend *backend;
-	hiredis_refdb_iterator *iterator;
-	int error = GIT_OK;
-	redisReply *reply;
+	/* Same as git_odb_backend_hiredis, but talking through the given pool */
+	hiredis_odb_backend *backend;
 
-	assert(_backend);
+	assert(backend_out && prefix && path && pool);
 
-	backend = (hiredis_refdb_backend *) _backend;
+	backend = calloc(1, sizeof (hiredis_odb_backend));
+	if (backend == NULL)
+		return GITERR_NOMEMORY;
 
-	reply = redisCommand(backend->db, "KEYS %s:%s:refdb:%s", backend->prefix, backend->repo_path, (glob != NULL ? glob : "refs/*"));
-	if(reply->type != REDIS_REPLY_ARRAY) {
-		freeReplyObject(reply);
-		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
-		return GIT_ERROR;
-	}
+	hiredis_pool__ref(pool);
+	backend->pool = pool;
 
-	iterator = calloc(1, sizeof(hiredis_refdb_iterator));
+	backend->prefix = strdup(prefix);
+	backend->repo_path = strdup(path);
 
-	iterator->backend = backend;
-	iterator->keys = reply;
+	backend->parent.version = 1;
 
-	iterator->parent.next = &hiredis_refdb_backend__iterator_next;
-	iterator->parent.next_name = &hiredis_refdb_backend__iterator_next_name;
-	iterator->parent.free = &hiredis_refdb_backend__iterator_free;
+	backend->parent.read = &hiredis_odb_backend__read;
+	backend->parent.write = &hiredis_odb_backend__write;
+	backend->parent.read_prefix = &hiredis_odb_backend__read_prefix;
+	backend->parent.read_header = &hiredis_odb_backend__read_header;
+	backend->parent.exists = &hiredis_odb_backend__exists;
+	backend->parent.exists_prefix = &hiredis_odb_backend__exists_prefix;
+	backend->parent.writepack = &hiredis_odb_backend__writepack;
+	backend->parent.free = &hiredis_odb_backend__free;
 
-	*_iter = (git_reference_iterator *) iterator;
+	backend->writepack_inflight = HIREDIS_ODB_WRITEPACK_INFLIGHT;
+	backend->chunk_threshold = HIREDIS_ODB_CHUNK_THRESHOLD;
+	backend->chunk_size = HIREDIS_ODB_CHUNK_SIZE;
+
+	backend->parent.readstream = &hiredis_odb_backend__readstream;
+	backend->parent.writestream = &hiredis_odb_backend__writestream;
+	backend->parent.foreach = &hiredis_odb_backend__foreach;
+
+	*backend_out = (git_odb_backend *) backend;
 
 	return GIT_OK;
 }
 
-int hiredis_refdb_backend__write(git_refdb_backend *_backend, const git_reference *ref, int force, const git_signature *who,
-	const char *message, const git_oid *old, const char *old_target)
+int git_odb_backend_hiredis(git_odb_backend **backend_out, const char* prefix, const char* path, const char *host, int port, char* password)
 {
-	hiredis_refdb_backend *backend;
-	int error = GIT_OK;
-	redisReply *reply;
-
-	const char *name = git_reference_name(ref);
-	const git_oid *target;
-	const char *symbolic_target;
-	char oid_str[GIT_OID_HEXSZ + 1];
-
-	assert(ref && _backend);
-
-	backend = (hiredis_refdb_backend *) _backend;
-
-	target = git_reference_target(ref);
-	symbolic_target = git_reference_symbolic_target(ref);
-
-	/* FIXME handle force correctly */
+	git_hiredis_pool *pool;
+	int error;
 
-	if (target) {
-		git_oid_nfmt(oid_str, sizeof(oid_str), target);
-		reply = redisCommand(backend->db, "HMSET %s:%s:refdb:%s type %d target %s", backend->prefix, backend->repo_path, name, GIT_REF_OID, oid_str);
-	} else {
-		symbolic_target = git_reference_symbolic_target(ref);
-		reply = redisCommand(backend->db, "HMSET %s:%s:refdb:%s type %d target %s", backend->prefix, backend->repo_path, name, GIT_REF_SYMBOLIC, symbolic_target);
-	}
+	pool = hiredis_pool__shared(host, port, password);
+	if (pool == NULL)
+		return GITERR_NOMEMORY;
 
-	if(reply->type == REDIS_REPLY_ERROR) {
-		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
-		error = GIT_ERROR;
-	}
+	error = hiredis_pool__check(pool);
+	if (error == GIT_OK)
+		error = git_odb_backend_hiredis_pool(backend_out, prefix, path, pool);
 
-	freeReplyObject(reply);
+	git_hiredis_pool_free(pool);
 	return error;
 }
 
-int hiredis_refdb_backend__rename(git_reference **out, git_refdb_backend *_backend, const char *old_name,
-	const char *new_name, int force, const git_signature *who, const char *message)
+int git_refdb_backend_hiredis_set_reflog(git_refdb_backend *_backend, unsigned int max_entries)
 {
+	/* Set about how many entries each reflog keeps; the oldest are trimmed
+	 * as new ones are added. Trimming is approximate, as it's cheapest
+	 * for Redis when done a whole node of the stream at a time. 0 restores
+	 * the default. */
 	hiredis_refdb_backend *backend;
-	int error = GIT_OK;
-	redisReply *reply;
 
-	assert(old_name && new_name && _backend);
+	assert(_backend);
 
 	backend = (hiredis_refdb_backend *) _backend;
+	backend->reflog_maxlen = max_entries ? max_entries : HIREDIS_REFDB_REFLOG_MAXLEN;
 
-	reply = redisCommand(backend->db, "RENAME %s:%s:refdb:%s %s:%s:refdb:%s",
-						backend->prefix, backend->repo_path, old_name, backend->prefix, backend->repo_path, new_name);
-	if(reply->type == REDIS_REPLY_ERROR) {
-		freeReplyObject(reply);
-
-		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
-		return GIT_ERROR;
-	}
-
-	freeReplyObject(reply);
-	return hiredis_refdb_backend__lookup(out, _backend, new_name);
+	return GIT_OK;
 }
 
-int hiredis_refdb_backend__del(git_refdb_backend *_backend, const char *ref_name, const git_oid *old, const char *old_target)
+int git_refdb_backend_hiredis_set_cache(git_refdb_backend *_backend, int enabled)
 {
+	/* Cache refs in process as they're looked up, serving lookups and
+	 * exists checks without a round trip. A connection of the cache's own
+	 * has the server (Redis 6 or later) report changes to any of the
+	 * repository's refs, by any client, and a thread drops the refs
+	 * changed; refs this backend changes are dropped straight away. */
 	hiredis_refdb_backend *backend;
-	int error = GIT_OK;
-	redisReply *reply;
 
-	assert(ref_name && _backend);
+	assert(_backend);
 
 	backend = (hiredis_refdb_backend *) _backend;
 
-	reply = redisCommand(backend->db, "DEL %s:%s:refdb:%s", backend->prefix, backend->repo_path, ref_name);
-	if(reply->type == REDIS_REPLY_ERROR) {
-		giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
-		error = GIT_ERROR;
+	if (!enabled) {
+		hiredis_refdb_cache__free(backend->cache);
+		backend->cache = NULL;
+		return GIT_OK;
 	}
 
-	freeReplyObject(reply);
-	return error;
+	if (backend->cache != NULL)
+		return GIT_OK;
+
+	return hiredis_refdb_cache__new(&backend->cache, backend->pool, backend->key_prefix);
 }
 
-void hiredis_refdb_backend__free(git_refdb_backend *_backend)
+int git_refdb_backend_hiredis_update_refs(git_refdb_backend *_backend, size_t count, const char **names,
+	const git_oid **new_ids, const git_oid **old_ids, const git_signature *who, const char *message)
 {
+	/* Update several refs at once, atomically: either every update is made
+	 * or, with GIT_EMODIFIED, none is. A NULL in new_ids deletes the ref.
+	 * old_ids, if given, holds each ref's expected oid: NULL for no check,
+	 * a zero oid for a ref that mustn't exist yet. Each ref updated gets a
+	 * reflog entry from who and message, as a single write would. */
 	hiredis_refdb_backend *backend;
+	redisReply *reply;
+	const char **argv;
+	size_t *argv_len;
+	char *keys, *ids, *args;
+	char maxlen[16];
+	hiredis_reflog_args log, ref_log;
+	size_t i, key_len, argc;
+	int len, error;
+
+	assert(_backend && names && new_ids);
 
-	assert(_backend);
 	backend = (hiredis_refdb_backend *) _backend;
+	if (count == 0)
+		return GIT_OK;
 
-	free(backend->repo_path);
-	free(backend->prefix);
+	key_len = strlen(backend->key_prefix);
+
+	/* numkeys, the index and two keys per ref, maxlen and six log entry
+	 * arguments, then four arguments per ref */
+	argv = malloc((count * 6 + 9) * sizeof(const char *));
+	argv_len = malloc((count * 6 + 9) * sizeof(size_t));
+	keys = malloc(key_len + sizeof(":refnames") + 20);
+	ids = malloc(count * 2 * (GIT_OID_HEXSZ + 1));
+	if (argv == NULL || argv_len == NULL || keys == NULL || ids == NULL) {
+		error = GITERR_NOMEMORY;
+		goto out;
+	}
 
-	redisFree(backend->db);
+	sprintf(keys, "%u", (unsigned int) (count * 2 + 1));
+	argv[0] = keys;
+	sprintf(keys + strlen(keys) + 1, "%s:refnames", backend->key_prefix);
+	argv[1] = keys + strlen(keys) + 1;
+	argc = 2;
+
+	for (i = 0; i < count; i++) {
+		argv[argc] = malloc(key_len + strlen(":refdb:") + strlen(names[i]) + 1);
+		if (argv[argc] == NULL) {
+			error = GITERR_NOMEMORY;
+			goto out_keys;
+		}
+		sprintf((char *) argv[argc++], "%s:refdb:%s", backend->key_prefix, names[i]);
 
-	free(backend);
-}
+		argv[argc] = malloc(key_len + strlen(":reflog:") + strlen(names[i]) + 1);
+		if (argv[argc] == NULL) {
+			error = GITERR_NOMEMORY;
+			goto out_keys;
+		}
+		sprintf((char *) argv[argc++], "%s:reflog:%s", backend->key_prefix, names[i]);
+	}
 
-/* reflog methods */
+	hiredis_refdb_backend__log_args(&log, names[0], who, message);
+	sprintf(maxlen, "%u", backend->reflog_maxlen);
+	argv[argc++] = maxlen;
+	argv[argc++] = log.name;
+	argv[argc++] = log.email;
+	argv[argc++] = log.time;
+	argv[argc++] = log.offset;
+	argv[argc++] = log.message;
+	argv[argc++] = log.has_message;
+
+	for (i = 0; i < count; i++) {
+		char *new_str = ids + i * 2 * (GIT_OID_HEXSZ + 1);
+		char *old_str = new_str + GIT_OID_HEXSZ + 1;
+
+		new_str[0] = old_str[0] = '\0';
+		if (new_ids[i])
+			git_oid_tostr(new_str, GIT_OID_HEXSZ + 1, new_ids[i]);
+		if (old_ids && old_ids[i])
+			git_oid_tostr(old_str, GIT_OID_HEXSZ + 1, old_ids[i]);
+
+		/* Whether the ref is logged depends on its name */
+		hiredis_refdb_backend__log_args(&ref_log, names[i], who, message);
+
+		argv[argc++] = names[i];
+		argv[argc++] = new_str;
+		argv[argc++] = old_str;
+		argv[argc++] = ref_log.mode;
+	}
 
-int hiredis_refdb_backend__has_log(git_refdb_backend *_backend, const char *refname)
-{
-	return 0;
-}
+	for (i = 0; i < argc; i++)
+		argv_len[i] = strlen(argv[i]);
 
-int hiredis_refdb_backend__ensure_log(git_refdb_backend *_backend, const char *refname)
-{
-	return GIT_ERROR;
-}
+	len = redisFormatCommandArgv(&args, (int) argc, argv, argv_len);
+	if (len < 0) {
+		error = GITERR_NOMEMORY;
+		goto out_keys;
+	}
 
-int hiredis_refdb_backend__reflog_read(git_reflog **out, git_refdb_backend *_backend, const char *name)
-{
-	return GIT_ERROR;
-}
+	reply = hiredis_pool__script_formatted(backend->pool, &hiredis_refdb_script_update, args, (size_t) len);
+	redisFreeCommand(args);
 
-int hiredis_refdb_backend__reflog_write(git_refdb_backend *_backend, git_reflog *reflog)
-{
-	return GIT_ERROR;
-}
+	error = hiredis_refdb_backend__script_error(reply);
+	freeReplyObject(reply);
 
-int hiredis_refdb_backend__reflog_rename(git_refdb_backend *_backend, const char *old_name, const char *new_name)
-{
-	return GIT_ERROR;
+	for (i = 0; i < count; i++)
+		hiredis_refdb_cache__invalidate(backend->cache, names[i]);
+
+out_keys:
+	for (i = 2; i < count * 2 + 2 && i < argc; i++)
+		free((char *) argv[i]);
+out:
+	free(argv);
+	free(argv_len);
+	free(keys);
+	free(ids);
+	return error;
 }
 
-int hiredis_refdb_backend__reflog_delete(git_refdb_backend *_backend, const char *name)
+int git_refdb_backend_hiredis_reindex(git_refdb_backend *_backend)
 {
-	return GIT_ERROR;
-}
-
-/* Constructors */
+	/* Rebuild the index of refnames the iterator lists refs from, out of the
+	 * refs themselves. Needed once for repositories written before there
+	 * was an index. Uses SCAN, which doesn't hold up the server the way
+	 * KEYS did, though it still walks every key on it. */
+	hiredis_refdb_backend *backend;
+	git_hiredis_pool *node;
+	redisReply *reply = NULL, *keys, *added;
+	char *cmd, *match, *index_key;
+	const char **argv = NULL;
+	size_t *argv_len = NULL;
+	char cursor[32] = "0";
+	size_t i, key_len, name_offset;
+	int argc, len, error = GIT_OK;
 
-int git_odb_backend_hiredis(git_odb_backend **backend_out, const char* prefix, const char* path, const char *host, int port, char* password)
-{
-	hiredis_odb_backend *backend;
-	redisReply *reply;
+	assert(_backend);
 
-	backend = calloc(1, sizeof (hiredis_odb_backend));
-	if (backend == NULL)
+	backend = (hiredis_refdb_backend *) _backend;
+	key_len = strlen(backend->key_prefix);
+
+	/* The prefix is matched literally, whatever glob characters it holds */
+	match = malloc(key_len * 2 + sizeof(":refdb:*"));
+	index_key = malloc(key_len + sizeof(":refnames"));
+	if (match == NULL || index_key == NULL) {
+		free(match);
+		free(index_key);
 		return GITERR_NOMEMORY;
+	}
+	sprintf(index_key, "%s:refnames", backend->key_prefix);
+	name_offset = key_len + strlen(":refdb:");
 
-	if (sharedConnection == NULL) {
-		sharedConnection = redisConnect(host, port);
-		if (sharedConnection->err) {
-			free(backend);
-			giterr_set_str(GITERR_REFERENCE, "Redis odb storage couldn't connect to redis server");
-			return GIT_ERROR;
+	strcpy(hiredis_scan__escape(match, backend->key_prefix), ":refdb:*");
+
+	/* In a cluster the refs are all on the node serving their hash tag */
+	node = backend->pool->cluster ?
+		hiredis_cluster__key_node(backend->pool, backend->key_prefix, key_len) : backend->pool;
+
+	do {
+		len = redisFormatCommand(&cmd, "SCAN %s MATCH %s COUNT %d", cursor, match, HIREDIS_REFDB_SCAN_COUNT);
+		if (len < 0) {
+			giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+			error = GIT_ERROR;
+			break;
 		}
 
-		if(password != NULL) {
-			reply = redisCommand(sharedConnection, "AUTH %s", password);
-			if (reply->type == REDIS_REPLY_ERROR) {
-				giterr_set_str(GITERR_REFERENCE, "Redis odb storage authentication with redis server failed");
-				return GIT_ERROR;
-			}
-			freeReplyObject(reply);
+		reply = hiredis_pool__execute(node, cmd, (size_t) len, 0);
+		redisFreeCommand(cmd);
+
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+				reply->element[0]->type != REDIS_REPLY_STRING || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+			giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+			error = GIT_ERROR;
+			break;
 		}
-	}
 
-	backend->db = sharedConnection;
+		snprintf(cursor, sizeof(cursor), "%s", reply->element[0]->str);
+		keys = reply->element[1];
 
-	backend->prefix = strdup(prefix);
-	backend->repo_path = strdup(path);
+		/* A single ZADD for every ref SCAN returned this time */
+		if (keys->elements > 0) {
+			argv = malloc((keys->elements * 2 + 2) * sizeof(const char *));
+			argv_len = malloc((keys->elements * 2 + 2) * sizeof(size_t));
+			if (argv == NULL || argv_len == NULL) {
+				giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+				error = GIT_ERROR;
+				break;
+			}
 
-	backend->parent.version = 1;
+			argv[0] = "ZADD";
+			argv_len[0] = 4;
+			argv[1] = index_key;
+			argv_len[1] = strlen(index_key);
+			for (i = 0, argc = 2; i < keys->elements; i++) {
+				argv[argc] = "0";
+				argv_len[argc++] = 1;
+				argv[argc] = keys->element[i]->str + name_offset;
+				argv_len[argc++] = keys->element[i]->len - name_offset;
+			}
 
-	backend->parent.read = &hiredis_odb_backend__read;
-	backend->parent.write = &hiredis_odb_backend__write;
-	backend->parent.read_prefix = &hiredis_odb_backend__read_prefix;
-	backend->parent.read_header = &hiredis_odb_backend__read_header;
-	backend->parent.exists = &hiredis_odb_backend__exists;
-	backend->parent.free = &hiredis_odb_backend__free;
+			len = redisFormatCommandArgv(&cmd, argc, argv, argv_len);
+			free(argv);
+			free(argv_len);
+			argv = NULL;
+			argv_len = NULL;
+			if (len < 0) {
+				giterr_set_str(GITERR_NOMEMORY, "Out of memory");
+				error = GIT_ERROR;
+				break;
+			}
 
-	backend->parent.writestream = NULL;
-	backend->parent.foreach = NULL;
+			added = hiredis_pool__route(backend->pool, cmd, (size_t) len);
+			redisFreeCommand(cmd);
+			if (added == NULL || added->type == REDIS_REPLY_ERROR) {
+				giterr_set_str(GITERR_REFERENCE, "Redis refdb storage error");
+				error = GIT_ERROR;
+			}
+			freeReplyObject(added);
+		}
 
-	*backend_out = (git_odb_backend *) backend;
+		freeReplyObject(reply);
+		reply = NULL;
+	} while (error == GIT_OK && strcmp(cursor, "0") != 0);
 
-	return GIT_OK;
+	freeReplyObject(reply);
+	free(argv);
+	free(argv_len);
+	free(index_key);
+	free(match);
+	return error;
 }
 
-int git_refdb_backend_hiredis(git_refdb_backend **backend_out, const char* prefix, const char* path, const char *host, int port, char* password)
+int git_refdb_backend_hiredis_pool(git_refdb_backend **backend_out, const char* prefix, const char* path,
+	git_hiredis_pool *pool)
 {
+	/* Same as git_refdb_backend_hiredis, but talking through the given pool */
 	hiredis_refdb_backend *backend;
-	redisReply *reply;
+
+	assert(backend_out && prefix && path && pool);
 
 	backend = calloc(1, sizeof(hiredis_refdb_backend));
 	if (backend == NULL)
 		return GITERR_NOMEMORY;
 
-	if (sharedConnection == NULL) {
-		sharedConnection = redisConnect(host, port);
-		if (sharedConnection->err) {
-			free(backend);
-			giterr_set_str(GITERR_REFERENCE, "Redis refdb storage couldn't connect to redis server");
-			return GIT_ERROR;
-		}
-
-		if(password != NULL) {
-			reply = redisCommand(sharedConnection, "AUTH %s", password);
-			if (reply->type == REDIS_REPLY_ERROR) {
-				giterr_set_str(GITERR_REFERENCE, "Redis refdb storage authentication with redis server failed");
-				return GIT_ERROR;
-			}
-			freeReplyObject(reply);
-		}
+	/* In a cluster, a hash tag keeps all of a repository's refs in one
+	 * slot, so commands may span several of them */
+	backend->key_prefix = malloc(strlen(prefix) + strlen(path) + 4);
+	if (backend->key_prefix == NULL) {
+		free(backend);
+		return GITERR_NOMEMORY;
 	}
+	sprintf(backend->key_prefix, pool->cluster ? "{%s:%s}" : "%s:%s", prefix, path);
 
-	backend->db = sharedConnection;
-
-	backend->prefix = strdup(prefix);
-	backend->repo_path = strdup(path);
+	hiredis_pool__ref(pool);
+	backend->pool = pool;
+	backend->reflog_maxlen = HIREDIS_REFDB_REFLOG_MAXLEN;
 
 	backend->parent.exists = &hiredis_refdb_backend__exists;
 	backend->parent.lookup = &hiredis_refdb_backend__lookup;
@@ -596,3 +4977,19 @@ int git_refdb_backend_hiredis(git_refdb_backend **backend_out, const char* prefi
 	return GIT_OK;
 }
 
+int git_refdb_backend_hiredis(git_refdb_backend **backend_out, const char* prefix, const char* path, const char *host, int port, char* password)
+{
+	git_hiredis_pool *pool;
+	int error;
+
+	pool = hiredis_pool__shared(host, port, password);
+	if (pool == NULL)
+		return GITERR_NOMEMORY;
+
+	error = hiredis_pool__check(pool);
+	if (error == GIT_OK)
+		error = git_refdb_backend_hiredis_pool(backend_out, prefix, path, pool);
+
+	git_hiredis_pool_free(pool);
+	return error;
+}
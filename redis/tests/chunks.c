@@ -0,0 +1,77 @@
+/*
+ * Objects over the chunking threshold are stored in chunks: write one, read
+ * it back whole, through its header and through a read stream, and write
+ * another through a write stream.
+ */
+
+#include "../hiredis.c"
+#include "test.h"
+
+#define TEST_CHUNK_SIZE 1000
+#define TEST_OBJECT_SIZE (10 * TEST_CHUNK_SIZE + 123)
+
+static void check_read(git_odb_backend *odb, const git_oid *oid, const unsigned char *data, size_t len)
+{
+	git_odb_stream *stream;
+	unsigned char streamed[TEST_OBJECT_SIZE];
+	void *read_data;
+	size_t read_len, done = 0;
+	git_otype type;
+	int n;
+
+	CHECK(odb->read_header(&read_len, &type, odb, oid) == GIT_OK);
+	CHECK(read_len == len && type == GIT_OBJ_BLOB);
+
+	CHECK(odb->read(&read_data, &read_len, &type, odb, oid) == GIT_OK);
+	CHECK(read_len == len && type == GIT_OBJ_BLOB);
+	CHECK(memcmp(read_data, data, len) == 0);
+	free(read_data);
+
+	CHECK(odb->readstream(&stream, odb, oid) == GIT_OK);
+	while ((n = stream->read(stream, (char *) streamed + done, len - done)) > 0)
+		done += n;
+	CHECK(n == 0 && done == len);
+	CHECK(memcmp(streamed, data, len) == 0);
+	stream->free(stream);
+}
+
+int main(void)
+{
+	git_odb_backend *odb;
+	git_odb_stream *stream;
+	const char *host;
+	int port;
+	unsigned char data[TEST_OBJECT_SIZE];
+	git_oid oid;
+	size_t done, n;
+
+	if (!test_server_get(&host, &port, "GIT2_REDIS_TEST_HOST", "GIT2_REDIS_TEST_PORT"))
+		return 0;
+
+	git_libgit2_init();
+	CHECK(git_odb_backend_hiredis(&odb, TEST_PREFIX, test_path(), host, port, NULL) == GIT_OK);
+	CHECK(git_odb_backend_hiredis_set_chunking(odb, 4 * TEST_CHUNK_SIZE, TEST_CHUNK_SIZE) == GIT_OK);
+
+	test_fill(data, sizeof(data), 1);
+	CHECK(git_odb_hash(&oid, data, sizeof(data), GIT_OBJ_BLOB) == GIT_OK);
+	CHECK(odb->write(odb, &oid, data, sizeof(data), GIT_OBJ_BLOB) == GIT_OK);
+	CHECK(odb->exists(odb, &oid) == 1);
+	check_read(odb, &oid, data, sizeof(data));
+
+	/* Stream writes needn't line up with the chunks */
+	test_fill(data, sizeof(data), 2);
+	CHECK(git_odb_hash(&oid, data, sizeof(data), GIT_OBJ_BLOB) == GIT_OK);
+	CHECK(odb->writestream(&stream, odb, sizeof(data), GIT_OBJ_BLOB) == GIT_OK);
+	for (done = 0; done < sizeof(data); done += n) {
+		n = sizeof(data) - done < 777 ? sizeof(data) - done : 777;
+		CHECK(stream->write(stream, (const char *) data + done, n) == GIT_OK);
+	}
+	CHECK(stream->finalize_write(stream, &oid) == GIT_OK);
+	stream->free(stream);
+	check_read(odb, &oid, data, sizeof(data));
+
+	odb->free(odb);
+
+	printf("ok\n");
+	return 0;
+}
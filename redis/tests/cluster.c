@@ -0,0 +1,102 @@
+/*
+ * Cluster routing: key slots and the keys found in commands, then, given a
+ * cluster, objects spread over it and read back through a slot map gone
+ * stale, so that commands are redirected.
+ */
+
+#include "../hiredis.c"
+#include "test.h"
+
+#define TEST_OBJECTS 64
+#define TEST_OBJECT_SIZE 100
+
+static unsigned int slot_of(const char *key)
+{
+	return hiredis_cluster__slot(key, strlen(key));
+}
+
+static int key_of(const char **key, size_t *key_len, const char *format, ...)
+{
+	static char *cmd;
+	va_list ap;
+	int len;
+
+	free(cmd);
+	va_start(ap, format);
+	len = redisvFormatCommand(&cmd, format, ap);
+	va_end(ap);
+	CHECK(len > 0);
+
+	return hiredis_cluster__command_key(key, key_len, cmd, len);
+}
+
+static void check_slots(void)
+{
+	const char *key;
+	size_t key_len;
+
+	/* The example from the cluster specification */
+	CHECK(slot_of("123456789") == 12739);
+
+	/* Only a non-empty hash tag counts */
+	CHECK(slot_of("{user1000}.following") == slot_of("{user1000}.followers"));
+	CHECK(slot_of("{user1000}.following") == slot_of("user1000"));
+	CHECK(slot_of("foo{}{bar}") != slot_of("bar"));
+	CHECK(slot_of("foo{{bar}}zap") == slot_of("{bar"));
+
+	CHECK(key_of(&key, &key_len, "HGET %s %s", "some:key", "field") == 1);
+	CHECK(key_len == 8 && memcmp(key, "some:key", 8) == 0);
+
+	CHECK(key_of(&key, &key_len, "EVALSHA %s 2 %s %s %s", "0123", "first", "second", "arg") == 1);
+	CHECK(key_len == 5 && memcmp(key, "first", 5) == 0);
+
+	CHECK(key_of(&key, &key_len, "EVAL %s 0 %s", "return 1", "arg") == 0);
+}
+
+int main(void)
+{
+	git_hiredis_pool *cluster;
+	git_odb_backend *odb;
+	const char *host;
+	int port;
+	unsigned char data[TEST_OBJECTS][TEST_OBJECT_SIZE];
+	git_oid oids[TEST_OBJECTS];
+	void *read_data;
+	size_t read_len, i;
+	git_otype type;
+
+	check_slots();
+
+	if (!test_server_get(&host, &port, "GIT2_REDIS_TEST_CLUSTER_HOST", "GIT2_REDIS_TEST_CLUSTER_PORT"))
+		return 0;
+
+	git_libgit2_init();
+	CHECK(git_hiredis_cluster_new(&cluster, host, port, NULL, 4, 1000, 5000) == GIT_OK);
+	CHECK(git_odb_backend_hiredis_pool(&odb, TEST_PREFIX, test_path(), cluster) == GIT_OK);
+
+	for (i = 0; i < TEST_OBJECTS; i++) {
+		test_fill(data[i], TEST_OBJECT_SIZE, i);
+		CHECK(git_odb_hash(&oids[i], data[i], TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+		CHECK(odb->write(odb, &oids[i], data[i], TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+	}
+
+	/* Point every slot at one node, as if the others' slots had just moved
+	 * there: commands for them get redirected back */
+	pthread_rwlock_wrlock(&cluster->slots_lock);
+	for (i = 0; i < HIREDIS_CLUSTER_SLOTS; i++)
+		cluster->slots[i] = cluster->nodes[0];
+	pthread_rwlock_unlock(&cluster->slots_lock);
+
+	for (i = 0; i < TEST_OBJECTS; i++) {
+		CHECK(odb->read(&read_data, &read_len, &type, odb, &oids[i]) == GIT_OK);
+		CHECK(read_len == TEST_OBJECT_SIZE && type == GIT_OBJ_BLOB);
+		CHECK(memcmp(read_data, data[i], TEST_OBJECT_SIZE) == 0);
+		free(read_data);
+	}
+
+	odb->free(odb);
+	git_hiredis_pool_free(cluster);
+
+	printf("ok\n");
+	return 0;
+}
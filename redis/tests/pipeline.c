@@ -0,0 +1,70 @@
+/*
+ * Batch reads and existence checks: more objects than fit in one pipeline,
+ * some of them missing, read whole and by header.
+ */
+
+#include "../hiredis.c"
+#include "test.h"
+
+#define TEST_OBJECTS (HIREDIS_ODB_PIPELINE_DEPTH + HIREDIS_ODB_PIPELINE_DEPTH / 2)
+#define TEST_OBJECT_SIZE 100
+
+int main(void)
+{
+	git_odb_backend *odb;
+	const char *host;
+	int port;
+	static unsigned char data[TEST_OBJECTS][TEST_OBJECT_SIZE];
+	static git_oid oids[TEST_OBJECTS];
+	static void *read_data[TEST_OBJECTS];
+	static size_t read_len[TEST_OBJECTS];
+	static git_otype read_type[TEST_OBJECTS];
+	static int errors[TEST_OBJECTS], found[TEST_OBJECTS];
+	size_t i;
+
+	if (!test_server_get(&host, &port, "GIT2_REDIS_TEST_HOST", "GIT2_REDIS_TEST_PORT"))
+		return 0;
+
+	git_libgit2_init();
+	CHECK(git_odb_backend_hiredis(&odb, TEST_PREFIX, test_path(), host, port, NULL) == GIT_OK);
+
+	/* Every third object is left out */
+	for (i = 0; i < TEST_OBJECTS; i++) {
+		test_fill(data[i], TEST_OBJECT_SIZE, i);
+		CHECK(git_odb_hash(&oids[i], data[i], TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+		if (i % 3 != 0)
+			CHECK(odb->write(odb, &oids[i], data[i], TEST_OBJECT_SIZE, GIT_OBJ_BLOB) == GIT_OK);
+	}
+
+	CHECK(git_odb_backend_hiredis_read_batch(odb, oids, TEST_OBJECTS, read_data, read_len,
+		read_type, errors) == GIT_OK);
+	for (i = 0; i < TEST_OBJECTS; i++) {
+		if (i % 3 == 0) {
+			CHECK(errors[i] == GIT_ENOTFOUND && read_data[i] == NULL);
+			continue;
+		}
+
+		CHECK(errors[i] == GIT_OK);
+		CHECK(read_len[i] == TEST_OBJECT_SIZE && read_type[i] == GIT_OBJ_BLOB);
+		CHECK(memcmp(read_data[i], data[i], TEST_OBJECT_SIZE) == 0);
+		free(read_data[i]);
+	}
+
+	memset(read_len, 0, sizeof(read_len));
+	CHECK(git_odb_backend_hiredis_read_batch(odb, oids, TEST_OBJECTS, NULL, read_len,
+		read_type, errors) == GIT_OK);
+	for (i = 0; i < TEST_OBJECTS; i++) {
+		CHECK(errors[i] == (i % 3 == 0 ? GIT_ENOTFOUND : GIT_OK));
+		if (i % 3 != 0)
+			CHECK(read_len[i] == TEST_OBJECT_SIZE && read_type[i] == GIT_OBJ_BLOB);
+	}
+
+	CHECK(git_odb_backend_hiredis_exists_batch(odb, oids, TEST_OBJECTS, found) == GIT_OK);
+	for (i = 0; i < TEST_OBJECTS; i++)
+		CHECK(found[i] == (i % 3 != 0));
+
+	odb->free(odb);
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * The ref cache: a backend's own changes show at once, another client's
+ * as soon as the server reports them. Needs Redis 6 or later.
+ */
+
+#include "../hiredis.c"
+#include "test.h"
+
+#define TEST_REF "refs/heads/refcache-test"
+
+static void write_ref(git_refdb_backend *refdb, const git_oid *oid)
+{
+	git_reference *ref;
+
+	ref = git_reference__alloc(TEST_REF, oid, NULL);
+	CHECK(ref != NULL);
+	CHECK(refdb->write(refdb, ref, 1, NULL, NULL, NULL, NULL) == GIT_OK);
+	git_reference_free(ref);
+}
+
+/* Look the ref up until it has the given target (none if NULL), for up to
+ * two seconds */
+static int wait_ref(git_refdb_backend *refdb, const git_oid *oid)
+{
+	git_reference *ref;
+	int tries, error, matched;
+
+	for (tries = 0; tries < 200; tries++) {
+		error = refdb->lookup(&ref, refdb, TEST_REF);
+		if (error == GIT_ENOTFOUND && oid == NULL)
+			return 1;
+
+		CHECK(error == GIT_OK || error == GIT_ENOTFOUND);
+		if (error == GIT_OK) {
+			matched = oid && git_oid_cmp(git_reference_target(ref), oid) == 0;
+			git_reference_free(ref);
+			if (matched)
+				return 1;
+		}
+
+		usleep(10000);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	git_refdb_backend *refdb, *other;
+	git_reference *ref;
+	const char *host, *path;
+	int port, exists;
+	git_oid oids[3];
+	int i;
+
+	if (!test_server_get(&host, &port, "GIT2_REDIS_TEST_HOST", "GIT2_REDIS_TEST_PORT"))
+		return 0;
+
+	git_libgit2_init();
+	path = test_path();
+	CHECK(git_refdb_backend_hiredis(&refdb, TEST_PREFIX, path, host, port, NULL) == GIT_OK);
+	CHECK(git_refdb_backend_hiredis(&other, TEST_PREFIX, path, host, port, NULL) == GIT_OK);
+
+	if (git_refdb_backend_hiredis_set_cache(refdb, 1) != GIT_OK) {
+		printf("skipped: the server can't track keys\n");
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++)
+		test_fill(oids[i].id, GIT_OID_RAWSZ, i);
+
+	write_ref(other, &oids[0]);
+	CHECK(refdb->lookup(&ref, refdb, TEST_REF) == GIT_OK);
+	CHECK(git_oid_cmp(git_reference_target(ref), &oids[0]) == 0);
+	git_reference_free(ref);
+
+	write_ref(refdb, &oids[1]);
+	CHECK(refdb->lookup(&ref, refdb, TEST_REF) == GIT_OK);
+	CHECK(git_oid_cmp(git_reference_target(ref), &oids[1]) == 0);
+	git_reference_free(ref);
+
+	write_ref(other, &oids[2]);
+	CHECK(wait_ref(refdb, &oids[2]));
+
+	CHECK(other->del(other, TEST_REF, NULL, NULL) == GIT_OK);
+	CHECK(wait_ref(refdb, NULL));
+	CHECK(refdb->exists(&exists, refdb, TEST_REF) == GIT_OK && exists == 0);
+
+	refdb->free(refdb);
+	other->free(other);
+
+	printf("ok\n");
+	return 0;
+}
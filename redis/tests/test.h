@@ -0,0 +1,70 @@
+/*
+ * Helpers for the Redis backends' smoke tests. Each test is built with the
+ * backends' source included, so it can reach their internals too.
+ *
+ * Tests that need a server take it from GIT2_REDIS_TEST_HOST and
+ * GIT2_REDIS_TEST_PORT, and a cluster from GIT2_REDIS_TEST_CLUSTER_HOST and
+ * GIT2_REDIS_TEST_CLUSTER_PORT; without a host they are skipped. They store
+ * their objects and refs under a repository path of their own, left behind.
+ */
+
+#ifndef GIT2_REDIS_TEST_H
+#define GIT2_REDIS_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <git2.h>
+
+#define CHECK(expr) do { \
+		if (!(expr)) { \
+			const git_error *e = giterr_last(); \
+			fprintf(stderr, "%s:%d: check failed: %s (%s)\n", __FILE__, __LINE__, \
+				#expr, (e) ? e->message : "no error"); \
+			exit(1); \
+		} \
+	} while (0)
+
+#define TEST_PREFIX "git2-test"
+
+/* Get the server named by `host_var` and `port_var`. Returns 0 if there is
+ * none, and the test (or that part of it) should be skipped. */
+static int test_server_get(const char **host, int *port, const char *host_var, const char *port_var)
+{
+	const char *value;
+
+	*host = getenv(host_var);
+	if (*host == NULL || **host == '\0') {
+		printf("skipped: %s is not set\n", host_var);
+		return 0;
+	}
+
+	value = getenv(port_var);
+	*port = (value && *value) ? atoi(value) : 6379;
+	return 1;
+}
+
+/* A repository path unique to this run, so each run starts out empty */
+static const char *test_path(void)
+{
+	static char path[64];
+
+	snprintf(path, sizeof(path), "/test-%ld-%d", (long) time(NULL), (int) getpid());
+	return path;
+}
+
+/* Fill a buffer with data unique to this run */
+static void test_fill(unsigned char *data, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	seed ^= (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (unsigned char) (seed >> 16);
+	}
+}
+
+#endif